@@ -0,0 +1,117 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#include "blocksearch.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+//******************************************************************************
+
+void MC_BlockQuery::SetBox(int32_t xa, int32_t ya, int32_t za, int32_t xb, int32_t yb, int32_t zb)
+{
+    x0 = min(xa, xb); x1 = max(xa, xb);
+    y0 = max(min(ya, yb), 0); y1 = min(max(ya, yb), 127);
+    z0 = min(za, zb); z1 = max(za, zb);
+}
+
+// Test a match against the data mask and record it
+static inline void AddMatch(const MC_BlockQuery & query, const uint8_t * data, int idx,
+                            int32_t wx, int32_t wz, vector<int32_t> & out)
+{
+    if(query.dataMask != 0xFFFF) {
+        uint8_t d = (idx & 1)? (data[idx >> 1] >> 4) : (data[idx >> 1] & 0x0F);
+        if(!((query.dataMask >> d) & 1))
+            return;
+    }
+    out.push_back(wx);
+    out.push_back(idx & 127);
+    out.push_back(wz);
+}
+
+size_t MC_FindBlocks(const MC_BlockQuery & query, int32_t cx, int32_t cz,
+                     const uint8_t * blocks, const uint8_t * data, vector<int32_t> & out)
+{
+    if(!query.ChunkInBox(cx, cz) || query.y0 > query.y1)
+        return 0;
+    if(query.dataMask != 0xFFFF && !data)
+        return 0;
+    size_t start = out.size();
+    
+    // Part of the box within this chunk, in chunk coordinates
+    int bx0 = max<int64_t>(query.x0 - (int64_t)cx*16, 0), bx1 = min<int64_t>(query.x1 - (int64_t)cx*16, 15);
+    int bz0 = max<int64_t>(query.z0 - (int64_t)cz*16, 0), bz1 = min<int64_t>(query.z1 - (int64_t)cz*16, 15);
+    int by0 = query.y0, by1 = query.y1;
+    
+    uint8_t types[8];
+    int numTypes = 0;
+    for(int t = 0; t < 256; ++t)
+        if(query.types.Contains(t) && numTypes++ < 8)
+            types[numTypes - 1] = t;
+    
+    for(int x = bx0; x <= bx1; ++x)
+    for(int z = bz0; z <= bz1; ++z)
+    {
+        int col = (x*16 + z)*128;
+        int32_t wx = cx*16 + x, wz = cz*16 + z;
+        int y = by0;
+#if defined(__SSE2__)
+        if(numTypes <= 8)
+        {
+            __m128i cmp[8];
+            for(int t = 0; t < numTypes; ++t)
+                cmp[t] = _mm_set1_epi8((char)types[t]);
+            for(int base = by0 & ~15; base <= by1; base += 16)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i *)(blocks + col + base));
+                __m128i eq = _mm_setzero_si128();
+                for(int t = 0; t < numTypes; ++t)
+                    eq = _mm_or_si128(eq, _mm_cmpeq_epi8(v, cmp[t]));
+                unsigned hits = _mm_movemask_epi8(eq);
+                // Trim to the box's y range
+                if(base < by0)
+                    hits &= 0xFFFFu << (by0 - base);
+                if(base + 15 > by1)
+                    hits &= 0xFFFFu >> (base + 15 - by1);
+                while(hits) {
+                    int bit = __builtin_ctz(hits);
+                    AddMatch(query, data, col + base + bit, wx, wz, out);
+                    hits &= hits - 1;
+                }
+            }
+            continue;
+        }
+#endif
+        for(; y <= by1; ++y)
+            if(query.types.Contains(blocks[col + y]))
+                AddMatch(query, data, col + y, wx, wz, out);
+    }
+    return (out.size() - start)/3;
+}
+
+//******************************************************************************
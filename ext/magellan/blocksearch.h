@@ -0,0 +1,62 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef BLOCKSEARCH_H
+#define BLOCKSEARCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include <vector>
+
+#include "heightmap.h"
+
+// Blocks to search for: any of a set of types, optionally restricted to some data
+// values and to a box.
+struct MC_BlockQuery {
+    MC_BlockSet types;
+    uint16_t dataMask;// bit d set to accept data value d, 0xFFFF accepts any
+    int32_t x0, y0, z0, x1, y1, z1;// box in world coordinates, inclusive
+    
+    MC_BlockQuery(): dataMask(0xFFFF),
+        x0(INT_MIN), y0(0), z0(INT_MIN), x1(INT_MAX), y1(127), z1(INT_MAX) {}
+    
+    void SetBox(int32_t xa, int32_t ya, int32_t za, int32_t xb, int32_t yb, int32_t zb);
+    // True if chunk cx, cz overlaps the box
+    bool ChunkInBox(int32_t cx, int32_t cz) const {
+        return (int64_t)cx*16 + 15 >= x0 && (int64_t)cx*16 <= x1 &&
+               (int64_t)cz*16 + 15 >= z0 && (int64_t)cz*16 <= z1;
+    }
+};
+
+// Search the blocks of chunk cx, cz (in chunk order, indexed (x*16 + z)*128 + y) and
+// append the world coordinates x, y, z of each match to out, in chunk order. data is
+// the chunk's packed Data array, only needed if the query restricts data values.
+// Columns are scanned 16 blocks at a time with vector compares against up to 8
+// types, and only the part of each column inside the box is read.
+// Returns the number of matches.
+size_t MC_FindBlocks(const MC_BlockQuery & query, int32_t cx, int32_t cz,
+                     const uint8_t * blocks, const uint8_t * data, std::vector<int32_t> & out);
+
+#endif // BLOCKSEARCH_H
@@ -41,16 +41,20 @@ using namespace std;
 BlockType blockTypes[256];
 
 static SimpleImage texturesImage;
+static bool texturesLoaded = false;
 
 //******************************************************************************
 ScaledTexture::ScaledTexture()
 {
     for(int j = 0; j < kNumTextureScales; ++j)
-        texture[kNumTextureScales] = NULL;
+        texture[j] = NULL;
 }
 
 void ScaledTexture::Compute(SimpleImage * base)
 {
+    // Textures loaded again replace those already there
+    for(int j = 0; j < kNumTextureScales; ++j)
+        delete texture[j];
     texture[0] = base;
     for(int j = 1; j < kNumTextureScales; ++j) {
         texture[j] = new SimpleImage(*texture[j - 1]);
@@ -91,12 +95,12 @@ void LoadTexture(int id, int x, int y, bool isOpaque = true, float tr = 1.0f, fl
 // Fancy block: Separate texture for each side (furnace, workbench, chest...)
 // Need to specify texture coordinates and orientation for each of 6 faces, and rotate to one of 4 positions.
 // Model: block entities that aren't blocks. Levers, torches, ladders, rails, etc.
-void LoadTextures()
+bool LoadTextures(const std::string & path)
 {
     PNG_FileInfo pngFileInfo;
-    if(!pngFileInfo.Read(MCPath() + "/magellan/terrain.png", texturesImage)) {
-        cerr << "Could not read terrain.png!" << endl;
-        exit(EXIT_FAILURE);
+    if(!pngFileInfo.Read(path, texturesImage)) {
+        cerr << "Could not read " << path << "!" << endl;
+        return false;
     }
     
     blockTypes[kBT_Air].color[0] = 255;
@@ -239,6 +243,13 @@ void LoadTextures()
     LoadTexture(kBT_SignPost, 0, 6, false);// Actually a lever
     
     // TODO: need to support multiple textures per block type, multiple cloth colors and log types
+    texturesLoaded = true;
+    return true;
+}
+
+bool TexturesLoaded()
+{
+    return texturesLoaded;
 }
 
 //******************************************************************************
@@ -79,6 +79,9 @@ struct BlockType {
 extern BlockType blockTypes[];
 
 
-void LoadTextures();
+// Load block textures from the terrain.png at path, replacing any loaded before.
+// Returns false if it can't be read.
+bool LoadTextures(const std::string & path);
+bool TexturesLoaded();
 
 #endif // BLOCKTYPES_H
@@ -0,0 +1,332 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#include "chunkcache.h"
+#include "nbtrb.h"
+#include "nbt.h"
+#include "mc.h"
+#include "magellan.h"
+
+#include <iostream>
+#include <algorithm>
+
+using namespace std;
+
+static VALUE class_MCChunkCache;
+
+static VALUE sym_dirty, sym_nbt, sym_region, sym_region_coords;
+static VALUE sym_Level, sym_LastUpdate, sym_Entities, sym_TileEntities;
+static VALUE sym_hits, sym_misses, sym_evictions, sym_writebacks;
+static VALUE sym_chunks, sym_bytes, sym_budget;
+
+static const size_t kChunkOverheadBytes = 4096;// NBT objects, hash, etc
+static const size_t kEntityBytes = 1024;
+
+
+// Approximate memory held by a Ruby chunk: byte arrays plus a rough allowance for
+// the Ruby objects making up the NBT tree and entity lists.
+static size_t ChunkBytes(VALUE chunk)
+{
+    size_t bytes = kChunkOverheadBytes;
+    VALUE rbnbt = rb_hash_aref(chunk, sym_nbt);
+    if(NIL_P(rbnbt))
+        return bytes;
+    VALUE rblevel = rb_hash_aref(NBT_Value(rbnbt), sym_Level);
+    if(NIL_P(rblevel))
+        return bytes;
+    VALUE tags = NBT_Value(rblevel);
+    VALUE tagvals = rb_funcall(tags, rb_intern("values"), 0);
+    for(long j = 0; j < RARRAY_LEN(tagvals); ++j)
+        bytes += NBT_ValueBytes(rb_ary_entry(tagvals, j));
+    VALUE ents = rb_hash_aref(tags, sym_Entities);
+    if(!NIL_P(ents))
+        bytes += RARRAY_LEN(NBT_Value(ents))*kEntityBytes;
+    ents = rb_hash_aref(tags, sym_TileEntities);
+    if(!NIL_P(ents))
+        bytes += RARRAY_LEN(NBT_Value(ents))*kEntityBytes;
+    return bytes;
+}
+
+static bool ChunkDirty(VALUE chunk) {return RTEST(rb_hash_aref(chunk, sym_dirty));}
+
+// Write a chunk back to its region and mark it clean
+static void WriteChunk(VALUE chunk)
+{
+    VALUE rbnbt = rb_hash_aref(chunk, sym_nbt);
+    VALUE region = rb_hash_aref(chunk, sym_region);
+    VALUE rcoords = rb_hash_aref(chunk, sym_region_coords);
+    
+    // LastUpdate gets the same millisecond timestamp as the session lock
+    VALUE rblevel = rb_hash_aref(NBT_Value(rbnbt), sym_Level);
+    VALUE lastUpdate = rb_hash_aref(NBT_Value(rblevel), sym_LastUpdate);
+    if(!NIL_P(lastUpdate))
+        NBT_SetValue(lastUpdate, LL2NUM(MC_Timestamp()));
+    
+    NBT_Region_IO * rgn = GetMCRegion(region);
+    if(WriteRegionChunk(*rgn, NUM2INT(rb_ary_entry(rcoords, 0)), NUM2INT(rb_ary_entry(rcoords, 1)), rbnbt) != 0)
+        rb_raise(rb_eIOError, "Could not write chunk");
+    rb_hash_aset(chunk, sym_dirty, Qfalse);
+}
+
+//******************************************************************************
+// MC_ChunkCache
+//******************************************************************************
+
+MC_ChunkCache::MC_ChunkCache(size_t bgt):
+    budget(bgt), bytesUsed(0),
+    hits(0), misses(0), evictions(0), writebacks(0)
+{}
+
+VALUE MC_ChunkCache::Fetch(const ChunkCoords & coords)
+{
+    std::map<ChunkCoords, EntryList::iterator>::iterator i = index.find(coords);
+    if(i == index.end()) {
+        ++misses;
+        return Qnil;
+    }
+    ++hits;
+    entries.splice(entries.begin(), entries, i->second);
+    return i->second->chunk;
+}
+
+void MC_ChunkCache::Store(const ChunkCoords & coords, VALUE chunk)
+{
+    Delete(coords);
+    Entry ent;
+    ent.coords = coords;
+    ent.chunk = chunk;
+    ent.bytes = ChunkBytes(chunk);
+    entries.push_front(ent);
+    index[coords] = entries.begin();
+    bytesUsed += ent.bytes;
+    Trim();
+}
+
+VALUE MC_ChunkCache::Delete(const ChunkCoords & coords)
+{
+    std::map<ChunkCoords, EntryList::iterator>::iterator i = index.find(coords);
+    if(i == index.end())
+        return Qnil;
+    VALUE chunk = i->second->chunk;
+    bytesUsed -= i->second->bytes;
+    entries.erase(i->second);
+    index.erase(i);
+    return chunk;
+}
+
+void MC_ChunkCache::Evict(EntryList::iterator ent)
+{
+    bytesUsed -= ent->bytes;
+    index.erase(ent->coords);
+    entries.erase(ent);
+    ++evictions;
+}
+
+size_t MC_ChunkCache::WriteRegionChunks(VALUE region)
+{
+    size_t n = 0;
+    for(EntryList::iterator ent = entries.begin(); ent != entries.end(); ++ent) {
+        if(rb_hash_aref(ent->chunk, sym_region) == region && ChunkDirty(ent->chunk)) {
+            WriteChunk(ent->chunk);
+            ++n;
+        }
+    }
+    writebacks += n;
+    return n;
+}
+
+size_t MC_ChunkCache::Flush()
+{
+    // Collect regions with dirty chunks, then write each region's chunks together
+    std::vector<VALUE> regions;
+    for(EntryList::iterator ent = entries.begin(); ent != entries.end(); ++ent) {
+        if(ChunkDirty(ent->chunk)) {
+            VALUE region = rb_hash_aref(ent->chunk, sym_region);
+            if(std::find(regions.begin(), regions.end(), region) == regions.end())
+                regions.push_back(region);
+        }
+    }
+    size_t n = 0;
+    for(size_t j = 0; j < regions.size(); ++j)
+        n += WriteRegionChunks(regions[j]);
+    return n;
+}
+
+void MC_ChunkCache::Trim()
+{
+    // The most recently used chunk (usually the one just loaded) is always kept
+    while(bytesUsed > budget && entries.size() > 1)
+    {
+        // Drop clean chunks, oldest first
+        EntryList::iterator ent = entries.end();
+        --ent;
+        while(bytesUsed > budget && ent != entries.begin()) {
+            EntryList::iterator prev = ent;
+            --prev;
+            if(!ChunkDirty(ent->chunk))
+                Evict(ent);
+            ent = prev;
+        }
+        if(bytesUsed <= budget || entries.size() <= 1)
+            break;
+        
+        // Only dirty chunks left to evict. Write back all dirty chunks in the region of
+        // the least recently used one, they are then clean and can be dropped.
+        ent = entries.end();
+        --ent;
+        if(WriteRegionChunks(rb_hash_aref(ent->chunk, sym_region)) == 0)
+            break;
+    }
+}
+
+void MC_ChunkCache::Mark() const
+{
+    for(EntryList::const_iterator ent = entries.begin(); ent != entries.end(); ++ent)
+        rb_gc_mark(ent->chunk);
+}
+
+//******************************************************************************
+// Ruby interface
+//******************************************************************************
+
+static const size_t kDefaultBudget = 256*1024*1024;
+
+MC_ChunkCache * GetChunkCache(VALUE value) {
+    MC_ChunkCache * val; Data_Get_Struct(value, MC_ChunkCache, val);
+    return val;
+}
+
+static MC_ChunkCache::ChunkCoords KeyToCoords(VALUE key) {
+    Check_Type(key, T_ARRAY);
+    return MC_ChunkCache::ChunkCoords(NUM2INT(rb_ary_entry(key, 0)), NUM2INT(rb_ary_entry(key, 1)));
+}
+
+static VALUE CoordsToKey(const MC_ChunkCache::ChunkCoords & coords) {
+    return rb_assoc_new(INT2NUM(coords.first), INT2NUM(coords.second));
+}
+
+static void MCChunkCache_Mark(void * cache) {static_cast<MC_ChunkCache *>(cache)->Mark();}
+static void MCChunkCache_Free(void * cache) {delete static_cast<MC_ChunkCache *>(cache);}
+
+static VALUE MCChunkCache_allocate(VALUE klass) {
+    MC_ChunkCache * cache = new MC_ChunkCache(kDefaultBudget);
+    return Data_Wrap_Struct(klass, MCChunkCache_Mark, MCChunkCache_Free, (void *)cache);
+}
+
+// MCChunkCache.new(budget_bytes = 256 MB)
+static VALUE MCChunkCache_init(int argc, VALUE * argv, VALUE self) {
+    VALUE rbbudget;
+    rb_scan_args(argc, argv, "01", &rbbudget);
+    if(!NIL_P(rbbudget))
+        GetChunkCache(self)->SetBudget(NUM2SIZET(rbbudget));
+    return self;
+}
+
+static VALUE MCChunkCache_aref(VALUE self, VALUE key) {
+    return GetChunkCache(self)->Fetch(KeyToCoords(key));
+}
+
+static VALUE MCChunkCache_aset(VALUE self, VALUE key, VALUE chunk) {
+    Check_Type(chunk, T_HASH);
+    GetChunkCache(self)->Store(KeyToCoords(key), chunk);
+    return chunk;
+}
+
+static VALUE MCChunkCache_delete(VALUE self, VALUE key) {
+    return GetChunkCache(self)->Delete(KeyToCoords(key));
+}
+
+static VALUE MCChunkCache_flush(VALUE self) {
+    return SIZET2NUM(GetChunkCache(self)->Flush());
+}
+
+static VALUE MCChunkCache_budget(VALUE self) {
+    return SIZET2NUM(GetChunkCache(self)->Budget());
+}
+
+static VALUE MCChunkCache_set_budget(VALUE self, VALUE rbbudget) {
+    GetChunkCache(self)->SetBudget(NUM2SIZET(rbbudget));
+    return rbbudget;
+}
+
+static VALUE MCChunkCache_size(VALUE self) {
+    return SIZET2NUM(GetChunkCache(self)->NumChunks());
+}
+
+static VALUE MCChunkCache_stats(VALUE self) {
+    MC_ChunkCache * cache = GetChunkCache(self);
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, sym_hits, SIZET2NUM(cache->hits));
+    rb_hash_aset(stats, sym_misses, SIZET2NUM(cache->misses));
+    rb_hash_aset(stats, sym_evictions, SIZET2NUM(cache->evictions));
+    rb_hash_aset(stats, sym_writebacks, SIZET2NUM(cache->writebacks));
+    rb_hash_aset(stats, sym_chunks, SIZET2NUM(cache->NumChunks()));
+    rb_hash_aset(stats, sym_bytes, SIZET2NUM(cache->BytesUsed()));
+    rb_hash_aset(stats, sym_budget, SIZET2NUM(cache->Budget()));
+    return stats;
+}
+
+// Yields coordinates and chunk for each cached chunk, most recently used first.
+// Entries are copied first, the block may load or unload chunks.
+static VALUE MCChunkCache_each(VALUE self) {
+    const MC_ChunkCache::EntryList & entries = GetChunkCache(self)->Entries();
+    VALUE pairs = rb_ary_new2(entries.size());
+    MC_ChunkCache::EntryList::const_iterator ent;
+    for(ent = entries.begin(); ent != entries.end(); ++ent)
+        rb_ary_push(pairs, rb_assoc_new(CoordsToKey(ent->coords), ent->chunk));
+    for(long j = 0; j < RARRAY_LEN(pairs); ++j)
+        rb_yield(rb_ary_entry(pairs, j));
+    return self;
+}
+
+void Init_chunkcache()
+{
+    sym_dirty = ID2SYM(rb_intern("dirty"));
+    sym_nbt = ID2SYM(rb_intern("nbt"));
+    sym_region = ID2SYM(rb_intern("region"));
+    sym_region_coords = ID2SYM(rb_intern("region_coords"));
+    sym_Level = ID2SYM(rb_intern("Level"));
+    sym_LastUpdate = ID2SYM(rb_intern("LastUpdate"));
+    sym_Entities = ID2SYM(rb_intern("Entities"));
+    sym_TileEntities = ID2SYM(rb_intern("TileEntities"));
+    sym_hits = ID2SYM(rb_intern("hits"));
+    sym_misses = ID2SYM(rb_intern("misses"));
+    sym_evictions = ID2SYM(rb_intern("evictions"));
+    sym_writebacks = ID2SYM(rb_intern("writebacks"));
+    sym_chunks = ID2SYM(rb_intern("chunks"));
+    sym_bytes = ID2SYM(rb_intern("bytes"));
+    sym_budget = ID2SYM(rb_intern("budget"));
+    
+    class_MCChunkCache = rb_define_class("MCChunkCache", rb_cObject);
+    rb_define_alloc_func(class_MCChunkCache, MCChunkCache_allocate);
+    rb_define_method(class_MCChunkCache, "initialize", RUBY_METHOD_FUNC(MCChunkCache_init), -1);
+    rb_define_method(class_MCChunkCache, "[]", RUBY_METHOD_FUNC(MCChunkCache_aref), 1);
+    rb_define_method(class_MCChunkCache, "[]=", RUBY_METHOD_FUNC(MCChunkCache_aset), 2);
+    rb_define_method(class_MCChunkCache, "delete", RUBY_METHOD_FUNC(MCChunkCache_delete), 1);
+    rb_define_method(class_MCChunkCache, "flush", RUBY_METHOD_FUNC(MCChunkCache_flush), 0);
+    rb_define_method(class_MCChunkCache, "budget", RUBY_METHOD_FUNC(MCChunkCache_budget), 0);
+    rb_define_method(class_MCChunkCache, "budget=", RUBY_METHOD_FUNC(MCChunkCache_set_budget), 1);
+    rb_define_method(class_MCChunkCache, "size", RUBY_METHOD_FUNC(MCChunkCache_size), 0);
+    rb_define_method(class_MCChunkCache, "stats", RUBY_METHOD_FUNC(MCChunkCache_stats), 0);
+    rb_define_method(class_MCChunkCache, "each", RUBY_METHOD_FUNC(MCChunkCache_each), 0);
+}
@@ -0,0 +1,94 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include <ruby.h>
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <vector>
+
+// LRU cache of the chunks loaded by a Ruby MC_World, within a memory budget.
+// Chunks are the Ruby chunk hashes built by MC_World#load_chunk(), keyed by world
+// chunk coordinates. When the budget is exceeded, clean chunks are dropped least
+// recently used first. If that isn't enough, dirty chunks are written back to their
+// regions, all dirty chunks of a region at once, and then dropped.
+// A chunk hash must not be kept and modified after further chunks are loaded, as it
+// may be evicted and the modifications lost.
+class MC_ChunkCache {
+  public:
+    typedef std::pair<int32_t, int32_t> ChunkCoords;
+    
+    struct Entry {
+        ChunkCoords coords;
+        VALUE chunk;
+        size_t bytes;
+    };
+    typedef std::list<Entry> EntryList;
+    
+  private:
+    EntryList entries;// most recently used first
+    std::map<ChunkCoords, EntryList::iterator> index;
+    size_t budget;
+    size_t bytesUsed;
+    
+  public:
+    size_t hits, misses, evictions, writebacks;
+    
+    MC_ChunkCache(size_t bgt);
+    
+    // Get chunk, or Qnil if not cached. Found chunk becomes most recently used.
+    VALUE Fetch(const ChunkCoords & coords);
+    // Whether chunk is cached, without counting a hit or miss or touching its recency.
+    bool Contains(const ChunkCoords & coords) const {return index.count(coords) != 0;}
+    // Insert or replace chunk, evicting others if over budget.
+    void Store(const ChunkCoords & coords, VALUE chunk);
+    // Remove chunk without writing it, returns chunk or Qnil
+    VALUE Delete(const ChunkCoords & coords);
+    
+    // Write all dirty chunks, grouped by region. Returns number written.
+    size_t Flush();
+    
+    size_t Budget() const {return budget;}
+    void SetBudget(size_t bgt) {budget = bgt; Trim();}
+    size_t BytesUsed() const {return bytesUsed;}
+    size_t NumChunks() const {return entries.size();}
+    const EntryList & Entries() const {return entries;}
+    
+    void Mark() const;
+    
+  private:
+    void Trim();
+    void Evict(EntryList::iterator ent);
+    size_t WriteRegionChunks(VALUE region);
+};
+
+// Cache wrapped by a MCChunkCache
+MC_ChunkCache * GetChunkCache(VALUE value);
+
+void Init_chunkcache();
+
+#endif // CHUNKCACHE_H
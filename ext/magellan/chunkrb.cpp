@@ -0,0 +1,428 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+
+#include "chunkrb.h"
+#include "nbtrb.h"
+#include "nbtio.h"
+#include "magellan.h"
+#include "lighting.h"
+
+#include <algorithm>
+
+using namespace std;
+
+static VALUE class_MCChunk;
+
+struct RbChunk {
+    MC_Chunk * chunk;
+    VALUE region;// MCRegion to write to, or nil
+    int rx, rz;// chunk coordinates within region
+    std::vector<MC_LightChange> * lightChanges;// edits to relight, NULL if not tracking
+};
+
+static void RbChunk_Mark(void * ptr) {rb_gc_mark(static_cast<RbChunk *>(ptr)->region);}
+
+static void RbChunk_Free(void * ptr)
+{
+    RbChunk * rbchunk = static_cast<RbChunk *>(ptr);
+    delete rbchunk->chunk;
+    delete rbchunk->lightChanges;
+    delete rbchunk;
+}
+
+static const rb_data_type_t RbChunk_type = {
+    "MCChunk",
+    {RbChunk_Mark, RbChunk_Free, NULL, NULL, {NULL}},
+    NULL, NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE MCChunk_allocate(VALUE klass)
+{
+    RbChunk * rbchunk = new RbChunk;
+    rbchunk->chunk = NULL;
+    rbchunk->region = Qnil;
+    rbchunk->rx = rbchunk->rz = 0;
+    rbchunk->lightChanges = NULL;
+    return TypedData_Wrap_Struct(klass, &RbChunk_type, rbchunk);
+}
+
+static RbChunk * GetRbChunk(VALUE self)
+{
+    RbChunk * rbchunk;
+    TypedData_Get_Struct(self, RbChunk, &RbChunk_type, rbchunk);
+    if(!rbchunk->chunk)
+        rb_raise(rb_eRuntimeError, "MCChunk has no chunk");
+    return rbchunk;
+}
+
+MC_Chunk * GetMCChunk(VALUE value) {return GetRbChunk(value)->chunk;}
+
+bool ValidChunkNBT(NBT_TagCompound * root)
+{
+    NBT_TagCompound * level = root->GetTag<NBT_TagCompound>("Level", NULL);
+    if(!level)
+        return false;
+    static const char * arrays[5] = {"Blocks", "Data", "SkyLight", "BlockLight", "HeightMap"};
+    static const size_t sizes[5] = {32768, 16384, 16384, 16384, 256};
+    for(int j = 0; j < 5; ++j) {
+        NBT_TagByteArray * arr = level->GetTag<NBT_TagByteArray>(arrays[j], NULL);
+        if(!arr || arr->value.size() != sizes[j])
+            return false;
+    }
+    return level->GetTag<NBT_TagList>("Entities", NULL) && level->GetTag<NBT_TagList>("TileEntities", NULL) &&
+           level->GetTag<NBT_TagLong>("LastUpdate", NULL) && level->GetTag<NBT_TagInt>("xPos", NULL) &&
+           level->GetTag<NBT_TagInt>("zPos", NULL) && level->GetTag<NBT_TagByte>("TerrainPopulated", NULL);
+}
+
+// Give a MCChunk the chunk in root, taking ownership of it
+static void SetChunk(VALUE self, NBT_TagCompound * root, VALUE region, int rx, int rz)
+{
+    RbChunk * rbchunk;
+    TypedData_Get_Struct(self, RbChunk, &RbChunk_type, rbchunk);
+    if(!ValidChunkNBT(root)) {
+        delete root;
+        rb_raise(rb_eArgError, "Not a valid chunk NBT");
+    }
+    delete rbchunk->chunk;
+    rbchunk->chunk = new MC_Chunk(root);
+    if(rbchunk->lightChanges)
+        rbchunk->lightChanges->clear();
+    rbchunk->region = region;
+    rbchunk->rx = rx;
+    rbchunk->rz = rz;
+}
+
+// Block index for chunk-relative or world x, z, raising if y is out of range
+static size_t BlockIdx(VALUE rbx, VALUE rby, VALUE rbz)
+{
+    int y = NUM2INT(rby);
+    if(y < 0 || y > 127)
+        rb_raise(rb_eIndexError, "y coordinate %d out of range", y);
+    return MC_Chunk::GetIdx(NUM2INT(rbx) & 15, y, NUM2INT(rbz) & 15);
+}
+
+// MCChunk.read(region, x, z)
+// Read chunk x, z (0-31) of a MCRegion, nil if it doesn't exist.
+static VALUE MCChunk_read(VALUE klass, VALUE region, VALUE rbx, VALUE rbz)
+{
+    int rx = NUM2INT(rbx), rz = NUM2INT(rbz);
+    NBT_Region_IO * rgn = GetMCRegion(region);
+    {
+        RegionLock lock(rgn);
+        if(!rgn->ChunkExists(rx, rz))
+            return Qnil;
+    }
+    NBT_TagCompound * root = ReadRegionChunkNBT(rgn, rx, rz);
+    if(!root)
+        return Qnil;
+    VALUE self = MCChunk_allocate(klass);
+    SetChunk(self, root, region, rx, rz);
+    return self;
+}
+
+// MCChunk.new(nbt, region = nil, x = 0, z = 0)
+// Chunk holding a copy of chunk NBT, to be written to chunk x, z of region.
+static VALUE MCChunk_initialize(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rbnbt, region, rbx, rbz;
+    rb_scan_args(argc, argv, "13", &rbnbt, &region, &rbx, &rbz);
+    if(!NIL_P(region))
+        GetMCRegion(region);// check type
+    int rx = NIL_P(rbx)? 0 : NUM2INT(rbx), rz = NIL_P(rbz)? 0 : NUM2INT(rbz);
+    // The converted tree borrows from the Ruby NBT, copy it before anything else runs
+    NBT_Tag * borrowed = ValueToNBT(rbnbt);
+    NBT_Tag * copy = borrowed->Clone();
+    delete borrowed;
+    NBT_TagCompound * root = dynamic_cast<NBT_TagCompound *>(copy);
+    if(!root) {
+        delete copy;
+        rb_raise(rb_eArgError, "Chunk NBT must be a compound");
+    }
+    SetChunk(self, root, region, rx, rz);
+    return self;
+}
+
+static VALUE MCChunk_initialize_copy(VALUE self, VALUE orig)
+{
+    if(self == orig)
+        return self;
+    RbChunk * src = GetRbChunk(orig);
+    const MC_Chunk * chunk = src->chunk;
+    SetChunk(self, static_cast<NBT_TagCompound *>(chunk->GetChunkNBT()->Clone()), src->region, src->rx, src->rz);
+    GetRbChunk(self)->chunk->SetDirty(chunk->IsDirty());
+    return self;
+}
+
+static VALUE MCChunk_coords(VALUE self) {
+    MC_Chunk * chunk = GetRbChunk(self)->chunk;
+    return rb_assoc_new(INT2NUM(chunk->xPos), INT2NUM(chunk->zPos));
+}
+
+static VALUE MCChunk_region(VALUE self) {return GetRbChunk(self)->region;}
+
+static VALUE MCChunk_region_coords(VALUE self) {
+    RbChunk * rbchunk = GetRbChunk(self);
+    return rb_assoc_new(INT2NUM(rbchunk->rx), INT2NUM(rbchunk->rz));
+}
+
+// get_block(x, y, z)
+// Block type and data as [type, data]. Only the low 4 bits of x and z are used, so
+// they may be world or chunk-relative coordinates.
+static VALUE MCChunk_get_block(VALUE self, VALUE rbx, VALUE rby, VALUE rbz)
+{
+    MC_Chunk * chunk = GetRbChunk(self)->chunk;
+    size_t idx = BlockIdx(rbx, rby, rbz);
+    return rb_assoc_new(INT2FIX(chunk->GetType(idx)), INT2FIX(chunk->GetData(idx)));
+}
+
+// set_block(x, y, z, type, data = 0)
+static VALUE MCChunk_set_block(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rbx, rby, rbz, rbtype, rbdata;
+    rb_scan_args(argc, argv, "41", &rbx, &rby, &rbz, &rbtype, &rbdata);
+    RbChunk * rbchunk = GetRbChunk(self);
+    MC_Chunk * chunk = rbchunk->chunk;
+    size_t idx = BlockIdx(rbx, rby, rbz);
+    if(rbchunk->lightChanges)
+        MC_RecordTypeChanges(*rbchunk->lightChanges, *chunk, idx, 1, NUM2UINT(rbtype) & 0xFF);
+    chunk->SetType(NUM2UINT(rbtype) & 0xFF, idx);
+    chunk->SetData(NIL_P(rbdata)? 0 : NUM2UINT(rbdata) & 0x0F, idx);
+    chunk->SetDirty();
+    return self;
+}
+
+// Calls op(idx, n) for each column run of a box in world coordinates (any order),
+// clipped to the chunk and height range.
+template<typename Op>
+static void ForEachColumnRun(MC_Chunk * chunk, VALUE * box, Op & op)
+{
+    int32_t x0 = NUM2INT(box[0]), y0 = NUM2INT(box[1]), z0 = NUM2INT(box[2]);
+    int32_t x1 = NUM2INT(box[3]), y1 = NUM2INT(box[4]), z1 = NUM2INT(box[5]);
+    if(x0 > x1) swap(x0, x1);
+    if(y0 > y1) swap(y0, y1);
+    if(z0 > z1) swap(z0, z1);
+    x0 = max(x0, chunk->xPos*16); x1 = min(x1, chunk->xPos*16 + 15);
+    z0 = max(z0, chunk->zPos*16); z1 = min(z1, chunk->zPos*16 + 15);
+    y0 = max(y0, 0); y1 = min(y1, 127);
+    if(x0 > x1 || y0 > y1 || z0 > z1)
+        return;
+    for(int32_t x = x0; x <= x1; ++x)
+    for(int32_t z = z0; z <= z1; ++z)
+        op(MC_Chunk::GetIdx(x & 15, y0, z & 15), y1 - y0 + 1);
+}
+
+struct FillTypeOp {
+    MC_Chunk * chunk;
+    std::vector<MC_LightChange> * changes;// if tracking light changes, NULL otherwise
+    uint8_t type, data;
+    size_t count;
+    void operator()(size_t idx, size_t n) {
+        if(changes)
+            MC_RecordTypeChanges(*changes, *chunk, idx, n, type);
+        chunk->FillTypeSpan(type, data, idx, n);
+        count += n;
+    }
+};
+
+struct ReplaceTypeOp {
+    MC_Chunk * chunk;
+    std::vector<MC_LightChange> * changes;
+    uint8_t fromType, type, data;
+    size_t count;
+    void operator()(size_t idx, size_t n) {
+        if(changes)
+            MC_RecordTypeChanges(*changes, *chunk, idx, n, type, fromType);
+        count += chunk->ReplaceTypeSpan(fromType, type, data, idx, n);
+    }
+};
+
+// fill(x0, y0, z0, x1, y1, z1, type, data = 0)
+// Set type and data of the part of a box (inclusive world coordinates) in the chunk,
+// leaving lighting to update_lights() or MC_World#compute_lights(). Returns the number
+// of blocks set.
+static VALUE MCChunk_fill(int argc, VALUE * argv, VALUE self)
+{
+    rb_check_arity(argc, 7, 8);
+    RbChunk * rbchunk = GetRbChunk(self);
+    FillTypeOp op;
+    op.chunk = rbchunk->chunk;
+    op.changes = rbchunk->lightChanges;
+    op.type = NUM2UINT(argv[6]) & 0xFF;
+    op.data = (argc > 7)? NUM2UINT(argv[7]) & 0x0F : 0;
+    op.count = 0;
+    ForEachColumnRun(op.chunk, argv, op);
+    if(op.count)
+        op.chunk->SetDirty();
+    return SIZET2NUM(op.count);
+}
+
+// replace(from_type, x0, y0, z0, x1, y1, z1, type, data = 0)
+// As fill(), but only setting blocks of from_type. Returns the number replaced.
+static VALUE MCChunk_replace(int argc, VALUE * argv, VALUE self)
+{
+    rb_check_arity(argc, 8, 9);
+    RbChunk * rbchunk = GetRbChunk(self);
+    ReplaceTypeOp op;
+    op.chunk = rbchunk->chunk;
+    op.changes = rbchunk->lightChanges;
+    op.fromType = NUM2UINT(argv[0]) & 0xFF;
+    op.type = NUM2UINT(argv[7]) & 0xFF;
+    op.data = (argc > 8)? NUM2UINT(argv[8]) & 0x0F : 0;
+    op.count = 0;
+    ForEachColumnRun(op.chunk, argv + 1, op);
+    if(op.count)
+        op.chunk->SetDirty();
+    return SIZET2NUM(op.count);
+}
+
+// Block types of a column, bottom to top, as a 128 byte string
+static VALUE ColumnTypes(MC_Chunk * chunk, int x, int z)
+{
+    VALUE types = rb_str_new(NULL, 128);
+    uint8_t * dst = (uint8_t *)RSTRING_PTR(types);
+    size_t idx = MC_Chunk::GetIdx(x, 0, z);
+    if(chunk->IsCompact())
+        for(int y = 0; y < 128; ++y)
+            dst[y] = chunk->GetType(idx + y);
+    else
+        memcpy(dst, chunk->Blocks() + idx, 128);
+    return types;
+}
+
+// column(x, z)
+// Block types of a column as a 128 byte string indexed by y. Only the low 4 bits of
+// x and z are used.
+static VALUE MCChunk_column(VALUE self, VALUE rbx, VALUE rbz) {
+    return ColumnTypes(GetRbChunk(self)->chunk, NUM2INT(rbx) & 15, NUM2INT(rbz) & 15);
+}
+
+// each_column {|x, z, types| ...}
+// Yields world x, z and the column's block types (as column()) for each column.
+static VALUE MCChunk_each_column(VALUE self)
+{
+    RETURN_ENUMERATOR(self, 0, 0);
+    for(int x = 0; x < 16; ++x)
+    for(int z = 0; z < 16; ++z)
+    {
+        // Look the chunk up each time, in case the block replaced it
+        MC_Chunk * chunk = GetRbChunk(self)->chunk;
+        rb_yield_values(3, INT2NUM(chunk->xPos*16 + x), INT2NUM(chunk->zPos*16 + z),
+                        ColumnTypes(chunk, x, z));
+    }
+    return self;
+}
+
+static VALUE MCChunk_dirty(VALUE self) {return GetRbChunk(self)->chunk->IsDirty()? Qtrue : Qfalse;}
+
+static VALUE MCChunk_set_dirty(VALUE self, VALUE dirty) {
+    GetRbChunk(self)->chunk->SetDirty(RTEST(dirty));
+    return dirty;
+}
+
+// With light tracking on, blocks changed by set_block(), fill() and replace() are
+// recorded for update_lights(). Turning it off discards edits not yet relit.
+static VALUE MCChunk_set_light_tracking(VALUE self, VALUE on)
+{
+    RbChunk * rbchunk = GetRbChunk(self);
+    if(!RTEST(on)) {
+        delete rbchunk->lightChanges;
+        rbchunk->lightChanges = NULL;
+    }
+    else if(!rbchunk->lightChanges) {
+        rbchunk->lightChanges = new std::vector<MC_LightChange>;
+    }
+    return on;
+}
+
+static VALUE MCChunk_light_tracking(VALUE self) {return GetRbChunk(self)->lightChanges? Qtrue : Qfalse;}
+
+// Relight around the edits recorded since light tracking was turned on or
+// update_lights() last ran, and update heightmaps of the edited columns. Light is only
+// updated within this chunk: edits whose light reaches a neighboring chunk should be
+// relit with MC_World#compute_lights() instead. Returns the number of light values set.
+static VALUE MCChunk_update_lights(VALUE self)
+{
+    RbChunk * rbchunk = GetRbChunk(self);
+    if(!rbchunk->lightChanges)
+        return INT2FIX(0);
+    MC_ChunkMap<MC_Chunk> chunks;
+    chunks.Add(rbchunk->chunk->xPos, rbchunk->chunk->zPos, rbchunk->chunk);
+    size_t numSet = MC_RelightChanges<MC_ChunkMap<MC_Chunk>, MC_Chunk>(chunks, *rbchunk->lightChanges);
+    rbchunk->lightChanges->clear();
+    return SIZET2NUM(numSet);
+}
+
+// Copy of the chunk's NBT
+static VALUE MCChunk_nbt(VALUE self) {
+    const MC_Chunk * chunk = GetRbChunk(self)->chunk;
+    return NBT_TreeToValue(static_cast<NBT_TagCompound *>(chunk->GetChunkNBT()->Clone()));
+}
+
+// write(last_update = nil)
+// Write chunk to its region, setting its LastUpdate tag first if last_update is given.
+// Clears the dirty flag.
+static VALUE MCChunk_write(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rblastupdate;
+    rb_scan_args(argc, argv, "01", &rblastupdate);
+    RbChunk * rbchunk = GetRbChunk(self);
+    if(NIL_P(rbchunk->region))
+        rb_raise(rb_eRuntimeError, "MCChunk has no region to write to");
+    
+    NBT_TagCompound * root = rbchunk->chunk->GetChunkNBT();
+    if(!NIL_P(rblastupdate))
+        root->GetTag<NBT_TagCompound>("Level")->GetTag<NBT_TagLong>("LastUpdate")->value = NUM2LL(rblastupdate);
+    NBT_Buffer_O bfr;
+    root->Write(bfr);
+    if(WriteRegionChunkData(GetMCRegion(rbchunk->region), rbchunk->rx, rbchunk->rz, bfr.data) != 0)
+        rb_raise(rb_eIOError, "Could not write chunk");
+    rbchunk->chunk->SetDirty(false);
+    return self;
+}
+
+void Init_mcchunk()
+{
+    class_MCChunk = rb_define_class("MCChunk", rb_cObject);
+    rb_define_alloc_func(class_MCChunk, MCChunk_allocate);
+    rb_define_singleton_method(class_MCChunk, "read", RUBY_METHOD_FUNC(MCChunk_read), 3);
+    rb_define_method(class_MCChunk, "initialize", RUBY_METHOD_FUNC(MCChunk_initialize), -1);
+    rb_define_method(class_MCChunk, "initialize_copy", RUBY_METHOD_FUNC(MCChunk_initialize_copy), 1);
+    rb_define_method(class_MCChunk, "coords", RUBY_METHOD_FUNC(MCChunk_coords), 0);
+    rb_define_method(class_MCChunk, "region", RUBY_METHOD_FUNC(MCChunk_region), 0);
+    rb_define_method(class_MCChunk, "region_coords", RUBY_METHOD_FUNC(MCChunk_region_coords), 0);
+    rb_define_method(class_MCChunk, "get_block", RUBY_METHOD_FUNC(MCChunk_get_block), 3);
+    rb_define_method(class_MCChunk, "set_block", RUBY_METHOD_FUNC(MCChunk_set_block), -1);
+    rb_define_method(class_MCChunk, "fill", RUBY_METHOD_FUNC(MCChunk_fill), -1);
+    rb_define_method(class_MCChunk, "replace", RUBY_METHOD_FUNC(MCChunk_replace), -1);
+    rb_define_method(class_MCChunk, "column", RUBY_METHOD_FUNC(MCChunk_column), 2);
+    rb_define_method(class_MCChunk, "each_column", RUBY_METHOD_FUNC(MCChunk_each_column), 0);
+    rb_define_method(class_MCChunk, "dirty?", RUBY_METHOD_FUNC(MCChunk_dirty), 0);
+    rb_define_method(class_MCChunk, "dirty=", RUBY_METHOD_FUNC(MCChunk_set_dirty), 1);
+    rb_define_method(class_MCChunk, "light_tracking=", RUBY_METHOD_FUNC(MCChunk_set_light_tracking), 1);
+    rb_define_method(class_MCChunk, "light_tracking?", RUBY_METHOD_FUNC(MCChunk_light_tracking), 0);
+    rb_define_method(class_MCChunk, "update_lights", RUBY_METHOD_FUNC(MCChunk_update_lights), 0);
+    rb_define_method(class_MCChunk, "nbt", RUBY_METHOD_FUNC(MCChunk_nbt), 0);
+    rb_define_method(class_MCChunk, "write", RUBY_METHOD_FUNC(MCChunk_write), -1);
+}
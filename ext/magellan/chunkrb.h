@@ -0,0 +1,46 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+
+#ifndef CHUNKRB_H
+#define CHUNKRB_H
+
+#include <ruby.h>
+
+class MC_Chunk;
+class NBT_TagCompound;
+
+// MCChunk is a Ruby class wrapping a MC_Chunk, for editing a chunk block by block, or
+// a box at a time, without per-block Ruby overhead. Unlike the chunk hashes of
+// MC_World, it keeps the chunk as a C++ NBT tree, only converting it to Ruby NBT on
+// request. It remembers the region it was read from, and is written back there.
+
+// Chunk wrapped by a MCChunk
+MC_Chunk * GetMCChunk(VALUE value);
+
+// Check for the tags MC_Chunk needs, which would otherwise end the process if missing.
+bool ValidChunkNBT(NBT_TagCompound * root);
+
+void Init_mcchunk();
+
+#endif // CHUNKRB_H
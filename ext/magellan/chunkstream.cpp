@@ -0,0 +1,225 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#include "chunkstream.h"
+#include "nbtio.h"
+
+#include <stdio.h>
+
+#include <iostream>
+
+using namespace std;
+
+//******************************************************************************
+
+MC_ChunkStream::MC_ChunkStream():
+    depth(1),
+    nextRead(0), nextParse(0), nextOut(0),
+    started(false), stopping(false)
+{
+}
+
+MC_ChunkStream::~MC_ChunkStream()
+{
+    Stop();
+}
+
+void MC_ChunkStream::AddRegion(NBT_Region_IO & rgn, int32_t rx, int32_t rz)
+{
+    // Anything buffered must reach the file before it's read through another handle
+    rgn.Flush();
+    Region region;
+    region.path = rgn.FilePath();
+    region.writeCount = rgn.WriteCount();
+    regions.push_back(region);
+    
+    Job job;
+    job.region = regions.size() - 1;
+    job.nbt = NULL;
+    job.state = kQueued;
+    for(int x = 0; x < 32; ++x)
+    for(int z = 0; z < 32; ++z)
+    {
+        if(!rgn.ChunkExists(x, z))
+            continue;
+        job.cx = rx*32 + x;
+        job.cz = rz*32 + z;
+        job.offset = rgn.ChunkStart(x, z);
+        job.numSectors = rgn.ChunkSize(x, z);
+        jobs.push_back(job);
+    }
+}
+
+void MC_ChunkStream::Start(size_t dpth, int numThreads)
+{
+    if(started)
+        return;
+    started = true;
+    depth = (dpth > 0)? dpth : 1;
+    if(numThreads <= 0)
+        numThreads = NumCPUs();
+    
+    pthread_t tid;
+    bool reading = (pthread_create(&tid, NULL, ReadEntry, this) == 0);
+    if(reading)
+        threads.push_back(tid);
+    for(int t = 0; reading && t < numThreads; ++t)
+        if(pthread_create(&tid, NULL, ParseEntry, this) == 0)
+            threads.push_back(tid);
+    
+    // Without both stages, Next() would wait forever
+    if(threads.size() < 2) {
+        cerr << "Could not start chunk stream threads" << endl;
+        Stop();
+    }
+}
+
+void * MC_ChunkStream::ReadEntry(void * stream)
+{
+    static_cast<MC_ChunkStream *>(stream)->ReadChunks();
+    return NULL;
+}
+
+void * MC_ChunkStream::ParseEntry(void * stream)
+{
+    static_cast<MC_ChunkStream *>(stream)->ParseChunks();
+    return NULL;
+}
+
+void MC_ChunkStream::ReadChunks()
+{
+    FILE * fin = NULL;
+    size_t finRegion = regions.size();
+    for(;;)
+    {
+        size_t j;
+        {
+            MutexLock lock(mutex);
+            while(!stopping && nextRead < jobs.size() && nextRead >= nextOut + depth)
+                readCond.Wait(mutex);
+            if(stopping || nextRead >= jobs.size())
+                break;
+            j = nextRead;
+        }
+        
+        // Until marked read, the job belongs to this thread
+        Job & job = jobs[j];
+        if(job.region != finRegion) {
+            if(fin)
+                fclose(fin);
+            finRegion = job.region;
+            fin = fopen(regions[finRegion].path.c_str(), "rb");
+            if(!fin)
+                cerr << "Could not open " << regions[finRegion].path << endl;
+        }
+        if(fin)
+            ReadRegionChunkCompressed(fin, job.offset, job.numSectors, job.compData);
+        
+        MutexLock lock(mutex);
+        job.state = kRead;
+        ++nextRead;
+        parseCond.Signal();
+    }
+    if(fin)
+        fclose(fin);
+}
+
+void MC_ChunkStream::ParseChunks()
+{
+    vector<uint8_t> nbtData;
+    for(;;)
+    {
+        size_t j;
+        {
+            MutexLock lock(mutex);
+            while(!stopping && nextParse < jobs.size() && nextParse >= nextRead)
+                parseCond.Wait(mutex);
+            if(stopping || nextParse >= jobs.size())
+                break;
+            j = nextParse++;
+        }
+        
+        Job & job = jobs[j];
+        NBT_TagCompound * nbt = NULL;
+        if(!job.compData.empty() && InflateRegionChunk(job.compData, nbtData) == 0) {
+            NBT_Buffer_I fin(&nbtData[0], nbtData.size());
+            nbt = LoadNBT_File(fin);
+            if(fin.overrun) {
+                delete nbt;
+                nbt = NULL;
+            }
+        }
+        vector<uint8_t>().swap(job.compData);
+        
+        MutexLock lock(mutex);
+        job.nbt = nbt;
+        job.state = kParsed;
+        if(j == nextOut)
+            doneCond.Signal();
+    }
+}
+
+bool MC_ChunkStream::Next(Chunk & chunk)
+{
+    MutexLock lock(mutex);
+    if(!started || stopping || nextOut >= jobs.size())
+        return false;
+    Job & job = jobs[nextOut];
+    while(job.state != kParsed && !stopping)
+        doneCond.Wait(mutex);
+    if(job.state != kParsed)
+        return false;
+    
+    chunk.cx = job.cx;
+    chunk.cz = job.cz;
+    chunk.region = job.region;
+    chunk.writeCount = regions[job.region].writeCount;
+    chunk.nbt = job.nbt;
+    job.nbt = NULL;
+    ++nextOut;
+    readCond.Signal();
+    return true;
+}
+
+void MC_ChunkStream::Stop()
+{
+    {
+        MutexLock lock(mutex);
+        stopping = true;
+        readCond.Broadcast();
+        parseCond.Broadcast();
+        doneCond.Broadcast();
+    }
+    for(size_t t = 0; t < threads.size(); ++t)
+        pthread_join(threads[t], NULL);
+    threads.clear();
+    
+    MutexLock lock(mutex);
+    for(size_t j = 0; j < jobs.size(); ++j) {
+        delete jobs[j].nbt;
+        jobs[j].nbt = NULL;
+    }
+    nextOut = jobs.size();
+}
+
+//******************************************************************************
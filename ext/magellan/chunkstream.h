@@ -0,0 +1,116 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef CHUNKSTREAM_H
+#define CHUNKSTREAM_H
+
+#include "nbt.h"
+#include "threadpool.h"
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+class NBT_Region_IO;
+
+//******************************************************************************
+// MC_ChunkStream
+// Reads every chunk of a set of regions, in order, as a pipeline: an I/O thread reads
+// compressed chunk data ahead of the consumer, worker threads inflate and parse it,
+// and Next() hands out the parsed chunks in order. At most depth chunks are read
+// ahead of the consumer, bounding the memory held in flight.
+// Regions are read through the stream's own file handles. Chunks written through a
+// region after it was added may be read in either state or not at all: compare
+// NBT_Region_IO::WriteCount() against Chunk::writeCount and reread if it differs.
+
+class MC_ChunkStream {
+  public:
+    struct Chunk {
+        int32_t cx, cz;// world chunk coordinates
+        size_t region;// index of region, in order added
+        uint32_t writeCount;// region WriteCount() when added
+        NBT_TagCompound * nbt;// parsed chunk owned by the caller, NULL if unreadable
+    };
+  
+  private:
+    enum JobState {kQueued, kRead, kParsed};
+    
+    struct Job {
+        int32_t cx, cz;
+        size_t region;
+        int offset, numSectors;
+        std::vector<uint8_t> compData;
+        NBT_TagCompound * nbt;
+        JobState state;
+    };
+    
+    struct Region {
+        std::string path;
+        uint32_t writeCount;
+    };
+    
+    std::vector<Region> regions;
+    std::vector<Job> jobs;
+    
+    Mutex mutex;
+    CondVar readCond;// I/O thread waits for room
+    CondVar parseCond;// workers wait for read chunks
+    CondVar doneCond;// Next() waits for parsed chunks
+    size_t depth;
+    size_t nextRead, nextParse, nextOut;
+    bool started, stopping;
+    std::vector<pthread_t> threads;
+    
+    MC_ChunkStream(const MC_ChunkStream &);
+    MC_ChunkStream & operator=(const MC_ChunkStream &);
+    
+    static void * ReadEntry(void * stream);
+    static void * ParseEntry(void * stream);
+    void ReadChunks();
+    void ParseChunks();
+  
+  public:
+    MC_ChunkStream();
+    ~MC_ChunkStream();
+    
+    // Queue the existing chunks of region rgn at region coordinates rx, rz, in x
+    // then z order. Must be called before Start(), with rgn's mutex held.
+    void AddRegion(NBT_Region_IO & rgn, int32_t rx, int32_t rz);
+    size_t NumChunks() const {return jobs.size();}
+    
+    // Start reading with depth chunks of read-ahead on numThreads parsing threads
+    // (one per processor if <= 0), plus the I/O thread.
+    void Start(size_t depth, int numThreads = 0);
+    
+    // Get the next chunk, waiting until it has been parsed. Returns false when all
+    // chunks have been taken, or the stream is stopped.
+    bool Next(Chunk & chunk);
+    
+    // Stop all threads and drop chunks not yet taken, waking a waiting Next(). May be
+    // called from another thread while Next() waits. Called by the destructor.
+    void Stop();
+};
+
+//******************************************************************************
+#endif // CHUNKSTREAM_H
@@ -0,0 +1,146 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef CHUNKTABLE_H
+#define CHUNKTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// Sparse 2D table for chunk-sized items, such as the chunks of a world. The table is
+// split into 32x32 pages, matching region files, which are allocated as needed and
+// found through an open addressing hash on the page coordinates. Lookup and
+// insertion are O(1), nothing is rebuilt as the table grows, and memory is only used
+// for the regions actually occupied, however far apart.
+// Code walking across a dense area can fetch a page with FindPage() and index it
+// directly, skipping the hash lookup.
+template<typename T>
+class ChunkTable {
+  public:
+    static const int kPageBits = 5;
+    static const int kPageSize = 1 << kPageBits;
+    static const int kPageMask = kPageSize - 1;
+    
+    struct Page {
+        int32_t px, pz;// page coordinates: item coordinates >> kPageBits
+        T items[kPageSize*kPageSize];// indexed (x & kPageMask) + (z & kPageMask)*kPageSize
+        
+        T & operator()(int32_t x, int32_t z) {return items[(x & kPageMask) + (z & kPageMask)*kPageSize];}
+        const T & operator()(int32_t x, int32_t z) const {return items[(x & kPageMask) + (z & kPageMask)*kPageSize];}
+    };
+  
+  private:
+    std::vector<Page *> slots;// size is a power of 2, NULL for empty slots
+    size_t numPages;
+    T defVal;
+    
+    ChunkTable(const ChunkTable &);
+    ChunkTable & operator=(const ChunkTable &);
+    
+    static size_t Hash(int32_t px, int32_t pz) {
+        uint32_t h = (uint32_t)px*0x9E3779B1u ^ (uint32_t)pz*0x85EBCA77u;
+        return h ^ (h >> 15);
+    }
+    
+    // Index of slot holding page, or of the empty slot where it would go
+    size_t FindSlot(int32_t px, int32_t pz) const {
+        size_t mask = slots.size() - 1;
+        size_t s = Hash(px, pz) & mask;
+        while(slots[s] && (slots[s]->px != px || slots[s]->pz != pz))
+            s = (s + 1) & mask;
+        return s;
+    }
+    
+    void Grow() {
+        std::vector<Page *> old(slots.size()*2, (Page *)NULL);
+        old.swap(slots);
+        for(size_t j = 0; j < old.size(); ++j)
+            if(old[j])
+                slots[FindSlot(old[j]->px, old[j]->pz)] = old[j];
+    }
+  
+  public:
+    ChunkTable(const T & def = T()): slots(16, (Page *)NULL), numPages(0), defVal(def) {}
+    ~ChunkTable() {Clear();}
+    
+    void Clear() {
+        for(size_t j = 0; j < slots.size(); ++j) {
+            delete slots[j];
+            slots[j] = NULL;
+        }
+        numPages = 0;
+    }
+    
+    size_t NumPages() const {return numPages;}
+    
+    // Page containing item coordinates x, z, or NULL if none allocated.
+    Page * FindPage(int32_t x, int32_t z) {
+        return slots[FindSlot(x >> kPageBits, z >> kPageBits)];
+    }
+    const Page * FindPage(int32_t x, int32_t z) const {
+        return slots[FindSlot(x >> kPageBits, z >> kPageBits)];
+    }
+    
+    // Page containing item coordinates x, z, allocated and filled with the default
+    // value if necessary.
+    Page * GetPage(int32_t x, int32_t z) {
+        int32_t px = x >> kPageBits, pz = z >> kPageBits;
+        size_t s = FindSlot(px, pz);
+        if(!slots[s])
+        {
+            // Keep load factor below 1/2 so probe sequences stay short
+            if((numPages + 1)*2 > slots.size()) {
+                Grow();
+                s = FindSlot(px, pz);
+            }
+            Page * page = new Page;
+            page->px = px;
+            page->pz = pz;
+            for(int j = 0; j < kPageSize*kPageSize; ++j)
+                page->items[j] = defVal;
+            slots[s] = page;
+            ++numPages;
+        }
+        return slots[s];
+    }
+    
+    // Item at x, z, or the default value if no page is allocated for it.
+    T Get(int32_t x, int32_t z) const {
+        const Page * page = FindPage(x, z);
+        return page? (*page)(x, z) : defVal;
+    }
+    
+    void Set(int32_t x, int32_t z, const T & val) {(*GetPage(x, z))(x, z) = val;}
+    
+    // Call fn(page) for each allocated page, in no particular order.
+    template<typename Fn>
+    void EachPage(Fn & fn) const {
+        for(size_t j = 0; j < slots.size(); ++j)
+            if(slots[j])
+                fn(*slots[j]);
+    }
+};
+
+#endif // CHUNKTABLE_H
@@ -0,0 +1,114 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#include "compactblocks.h"
+#include "nibbles.h"
+
+#include <string.h>
+
+//******************************************************************************
+
+static const size_t kChunkBlocks = 16*16*128;
+
+MC_CompactBlocks::MC_CompactBlocks()
+{
+    memset(colStart, 0, sizeof(colStart));
+}
+
+void MC_CompactBlocks::Encode(const uint8_t * types, const uint8_t * data,
+                              const uint8_t * skylight, const uint8_t * blocklight)
+{
+    // Expand nibbles first, the run scan is then a straight walk over four planes
+    std::vector<uint8_t> planes(3*kChunkBlocks);
+    uint8_t * d = &planes[0];
+    uint8_t * sl = &planes[kChunkBlocks];
+    uint8_t * bl = &planes[2*kChunkBlocks];
+    UnpackNibbles(d, data, kChunkBlocks);
+    UnpackNibbles(sl, skylight, kChunkBlocks);
+    UnpackNibbles(bl, blocklight, kChunkBlocks);
+    
+    std::vector<Run> newRuns;
+    newRuns.reserve(16*16*4);
+    for(size_t col = 0; col < 16*16; ++col)
+    {
+        colStart[col] = (uint16_t)newRuns.size();
+        size_t idx = col*128;
+        Run run;
+        run.type = types[idx];
+        run.data = d[idx];
+        run.light = (sl[idx] << 4) | bl[idx];
+        for(size_t y = 1; y < 128; ++y)
+        {
+            ++idx;
+            uint8_t light = (sl[idx] << 4) | bl[idx];
+            if(types[idx] != run.type || d[idx] != run.data || light != run.light) {
+                run.end = y;
+                newRuns.push_back(run);
+                run.type = types[idx];
+                run.data = d[idx];
+                run.light = light;
+            }
+        }
+        run.end = 128;
+        newRuns.push_back(run);
+    }
+    colStart[16*16] = (uint16_t)newRuns.size();
+    
+    // Copy to exactly sized storage, the scratch reserve is usually far too big or small
+    std::vector<Run>(newRuns).swap(runs);
+}
+
+void MC_CompactBlocks::DecodePlane(uint8_t * dst, int plane) const
+{
+    for(size_t col = 0; col < 16*16; ++col)
+    {
+        uint8_t y = 0;
+        for(size_t r = colStart[col]; r < colStart[col + 1]; ++r)
+        {
+            const Run & run = runs[r];
+            uint8_t val;
+            switch(plane) {
+              case kPlaneTypes: val = run.type; break;
+              case kPlaneData: val = run.data; break;
+              case kPlaneSkylight: val = run.light >> 4; break;
+              default: val = run.light & 0x0F; break;
+            }
+            memset(dst + col*128 + y, val, run.end - y);
+            y = run.end;
+        }
+    }
+}
+
+void MC_CompactBlocks::Decode(uint8_t * types, uint8_t * data, uint8_t * skylight, uint8_t * blocklight) const
+{
+    DecodePlane(types, kPlaneTypes);
+    std::vector<uint8_t> plane(kChunkBlocks);
+    DecodePlane(&plane[0], kPlaneData);
+    PackNibbles(data, &plane[0], kChunkBlocks);
+    DecodePlane(&plane[0], kPlaneSkylight);
+    PackNibbles(skylight, &plane[0], kChunkBlocks);
+    DecodePlane(&plane[0], kPlaneBlocklight);
+    PackNibbles(blocklight, &plane[0], kChunkBlocks);
+}
+
+//******************************************************************************
@@ -0,0 +1,85 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef COMPACTBLOCKS_H
+#define COMPACTBLOCKS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+// Run length encoded copy of a chunk's blocks, data and lighting, for keeping large
+// numbers of chunks in memory. Each of the 256 columns is stored as runs of identical
+// blocks (same type, data and both light levels) from the bottom up. Most columns are
+// a few long runs of stone, dirt and air, taking a few hundred bytes instead of the
+// 80 KB of the raw arrays.
+// Single blocks can be read in place, at the cost of a short scan of the column's
+// runs. For anything more, decode to scratch buffers with Decode() or DecodePlane(),
+// which write their output front to back.
+class MC_CompactBlocks {
+  public:
+    enum {kPlaneTypes, kPlaneData, kPlaneSkylight, kPlaneBlocklight};
+    
+    struct Run {
+        uint8_t end;// y of the block above the run: runs in a column end at 128
+        uint8_t type;
+        uint8_t data;
+        uint8_t light;// skylight << 4 | blocklight
+    };
+  
+  private:
+    std::vector<Run> runs;
+    uint16_t colStart[16*16 + 1];// runs of column c are colStart[c] to colStart[c + 1] - 1
+  
+  public:
+    MC_CompactBlocks();
+    
+    // Encode from chunk arrays: one byte per block for types, packed nibbles for the
+    // others, all indexed as in MC_Chunk.
+    void Encode(const uint8_t * types, const uint8_t * data,
+                const uint8_t * skylight, const uint8_t * blocklight);
+    // Decode to chunk arrays in the same layout.
+    void Decode(uint8_t * types, uint8_t * data, uint8_t * skylight, uint8_t * blocklight) const;
+    // Decode one plane to one byte per block.
+    void DecodePlane(uint8_t * dst, int plane) const;
+    
+    const Run & RunAt(size_t idx) const {
+        const Run * run = &runs[colStart[idx >> 7]];
+        uint8_t y = idx & 127;
+        while(run->end <= y)
+            ++run;
+        return *run;
+    }
+    
+    uint8_t GetType(size_t idx) const {return RunAt(idx).type;}
+    uint8_t GetData(size_t idx) const {return RunAt(idx).data;}
+    uint8_t GetSkylight(size_t idx) const {return RunAt(idx).light >> 4;}
+    uint8_t GetBlocklight(size_t idx) const {return RunAt(idx).light & 0x0F;}
+    
+    size_t NumRuns() const {return runs.size();}
+    // Approximate memory used
+    size_t Bytes() const {return sizeof(*this) + runs.capacity()*sizeof(Run);}
+};
+
+#endif // COMPACTBLOCKS_H
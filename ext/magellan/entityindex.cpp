@@ -0,0 +1,399 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#include "entityindex.h"
+#include "nbtio.h"
+#include "threadpool.h"
+#include "magellan.h"
+
+#include <math.h>
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+
+using namespace std;
+
+//******************************************************************************
+
+void MC_EntityIndex::ChunkEntries(NBT_TagCompound * level, int32_t cx, int32_t cz, vector<Entry> & out)
+{
+    Entry entry;
+    entry.chunk = ChunkCoords(cx, cz);
+    
+    NBT_TagList * entities = level->GetTag<NBT_TagList>("Entities", NULL);
+    for(size_t j = 0; entities && j < entities->values.size(); ++j)
+    {
+        NBT_TagCompound * ent = dynamic_cast<NBT_TagCompound *>(entities->values[j]);
+        NBT_TagString * id = ent? ent->GetTag<NBT_TagString>("id", NULL) : NULL;
+        NBT_TagList * pos = ent? ent->GetTag<NBT_TagList>("Pos", NULL) : NULL;
+        if(!id || !pos || pos->values.size() != 3)
+            continue;
+        NBT_TagDouble * coords[3];
+        for(int k = 0; k < 3; ++k)
+            coords[k] = dynamic_cast<NBT_TagDouble *>(pos->values[k]);
+        if(!coords[0] || !coords[1] || !coords[2])
+            continue;
+        entry.x = coords[0]->value;
+        entry.y = coords[1]->value;
+        entry.z = coords[2]->value;
+        entry.id = id->value;
+        entry.listIdx = j;
+        entry.tile = false;
+        out.push_back(entry);
+    }
+    
+    NBT_TagList * tileEntities = level->GetTag<NBT_TagList>("TileEntities", NULL);
+    for(size_t j = 0; tileEntities && j < tileEntities->values.size(); ++j)
+    {
+        NBT_TagCompound * ent = dynamic_cast<NBT_TagCompound *>(tileEntities->values[j]);
+        NBT_TagString * id = ent? ent->GetTag<NBT_TagString>("id", NULL) : NULL;
+        NBT_TagInt * x = ent? ent->GetTag<NBT_TagInt>("x", NULL) : NULL;
+        NBT_TagInt * y = ent? ent->GetTag<NBT_TagInt>("y", NULL) : NULL;
+        NBT_TagInt * z = ent? ent->GetTag<NBT_TagInt>("z", NULL) : NULL;
+        if(!id || !x || !y || !z)
+            continue;
+        entry.x = x->value;
+        entry.y = y->value;
+        entry.z = z->value;
+        entry.id = id->value;
+        entry.listIdx = j;
+        entry.tile = true;
+        out.push_back(entry);
+    }
+}
+
+void MC_EntityIndex::Unlink(const ChunkCoords & coords, const Cell & cell)
+{
+    numEntries -= cell.entries.size();
+    for(size_t j = 0; j < cell.entries.size(); ++j)
+    {
+        map<string, set<ChunkCoords> >::iterator byId = chunksById.find(cell.entries[j].id);
+        if(byId != chunksById.end()) {
+            byId->second.erase(coords);
+            if(byId->second.empty())
+                chunksById.erase(byId);
+        }
+    }
+}
+
+void MC_EntityIndex::SetChunk(int32_t cx, int32_t cz, uint32_t timestamp, int64_t readTime,
+                              vector<Entry> & entries)
+{
+    ChunkCoords coords(cx, cz);
+    Cell & cell = cells[coords];
+    Unlink(coords, cell);
+    cell.timestamp = timestamp;
+    cell.readTime = readTime;
+    cell.entries.swap(entries);
+    entries.clear();
+    numEntries += cell.entries.size();
+    for(size_t j = 0; j < cell.entries.size(); ++j)
+        chunksById[cell.entries[j].id].insert(coords);
+}
+
+void MC_EntityIndex::RemoveChunk(int32_t cx, int32_t cz)
+{
+    map<ChunkCoords, Cell>::iterator cell = cells.find(ChunkCoords(cx, cz));
+    if(cell != cells.end()) {
+        Unlink(cell->first, cell->second);
+        cells.erase(cell);
+    }
+}
+
+void MC_EntityIndex::RetainChunks(const set<ChunkCoords> & live)
+{
+    for(map<ChunkCoords, Cell>::iterator cell = cells.begin(); cell != cells.end();)
+    {
+        if(live.count(cell->first)) {
+            ++cell;
+        }
+        else {
+            Unlink(cell->first, cell->second);
+            cells.erase(cell++);
+        }
+    }
+}
+
+bool MC_EntityIndex::Fresh(int32_t cx, int32_t cz, uint32_t timestamp) const
+{
+    map<ChunkCoords, Cell>::const_iterator cell = cells.find(ChunkCoords(cx, cz));
+    return cell != cells.end() && cell->second.timestamp == timestamp && timestamp < cell->second.readTime;
+}
+
+// Chunk coordinate of a block coordinate, clamped to the int32 range
+static int32_t ChunkCoord(double c)
+{
+    double cc = floor(c/16);
+    return (int32_t)max(min(cc, (double)INT32_MAX), (double)INT32_MIN);
+}
+
+void MC_EntityIndex::InBox(double x0, double y0, double z0, double x1, double y1, double z1,
+                           const string * id, vector<const Entry *> & out) const
+{
+    if(x0 > x1) swap(x0, x1);
+    if(y0 > y1) swap(y0, y1);
+    if(z0 > z1) swap(z0, z1);
+    int32_t cx0 = ChunkCoord(x0), cx1 = ChunkCoord(x1);
+    int32_t cz0 = ChunkCoord(z0), cz1 = ChunkCoord(z1);
+    
+    // Cells are ordered by x then z: visit the run of each row within the box
+    map<ChunkCoords, Cell>::const_iterator cell = cells.lower_bound(ChunkCoords(cx0, cz0));
+    while(cell != cells.end() && cell->first.first <= cx1)
+    {
+        if(cell->first.second > cz1) {
+            if(cell->first.first == INT32_MAX)
+                break;
+            cell = cells.lower_bound(ChunkCoords(cell->first.first + 1, cz0));
+            continue;
+        }
+        if(cell->first.second < cz0) {
+            cell = cells.lower_bound(ChunkCoords(cell->first.first, cz0));
+            continue;
+        }
+        const vector<Entry> & entries = cell->second.entries;
+        for(size_t j = 0; j < entries.size(); ++j)
+        {
+            const Entry & e = entries[j];
+            if(e.x >= x0 && e.x <= x1 && e.y >= y0 && e.y <= y1 && e.z >= z0 && e.z <= z1 &&
+               (!id || e.id == *id))
+                out.push_back(&e);
+        }
+        ++cell;
+    }
+}
+
+void MC_EntityIndex::Within(double x, double y, double z, double radius, const string * id,
+                            vector<const Entry *> & out) const
+{
+    size_t start = out.size();
+    InBox(x - radius, y - radius, z - radius, x + radius, y + radius, z + radius, id, out);
+    size_t n = start;
+    for(size_t j = start; j < out.size(); ++j)
+    {
+        double dx = out[j]->x - x, dy = out[j]->y - y, dz = out[j]->z - z;
+        if(dx*dx + dy*dy + dz*dz <= radius*radius)
+            out[n++] = out[j];
+    }
+    out.resize(n);
+}
+
+void MC_EntityIndex::WithId(const string & id, vector<const Entry *> & out) const
+{
+    map<string, set<ChunkCoords> >::const_iterator byId = chunksById.find(id);
+    if(byId == chunksById.end())
+        return;
+    for(set<ChunkCoords>::const_iterator c = byId->second.begin(); c != byId->second.end(); ++c)
+    {
+        const vector<Entry> & entries = cells.find(*c)->second.entries;
+        for(size_t j = 0; j < entries.size(); ++j)
+            if(entries[j].id == id)
+                out.push_back(&entries[j]);
+    }
+}
+
+//******************************************************************************
+// Ruby interface
+//******************************************************************************
+
+static VALUE class_MCEntityIndex;
+
+static VALUE sym_id, sym_pos, sym_tile, sym_chunk, sym_region, sym_index;
+
+static void MCEntityIndex_Free(void * index) {delete static_cast<MC_EntityIndex *>(index);}
+
+static VALUE MCEntityIndex_allocate(VALUE klass) {
+    return Data_Wrap_Struct(klass, NULL, MCEntityIndex_Free, (void *)new MC_EntityIndex);
+}
+
+MC_EntityIndex * GetEntityIndex(VALUE value) {
+    MC_EntityIndex * index; Data_Get_Struct(value, MC_EntityIndex, index);
+    return index;
+}
+
+static VALUE EntriesToValue(const vector<const MC_EntityIndex::Entry *> & entries)
+{
+    VALUE rbentries = rb_ary_new2(entries.size());
+    for(size_t j = 0; j < entries.size(); ++j)
+    {
+        const MC_EntityIndex::Entry & e = *entries[j];
+        VALUE rbentry = rb_hash_new();
+        rb_hash_aset(rbentry, sym_id, rb_str_new(e.id.data(), e.id.size()));
+        rb_hash_aset(rbentry, sym_pos, rb_ary_new3(3, rb_float_new(e.x), rb_float_new(e.y), rb_float_new(e.z)));
+        rb_hash_aset(rbentry, sym_tile, e.tile? Qtrue : Qfalse);
+        rb_hash_aset(rbentry, sym_chunk, rb_assoc_new(INT2NUM(e.chunk.first), INT2NUM(e.chunk.second)));
+        rb_hash_aset(rbentry, sym_region, rb_assoc_new(INT2NUM(e.chunk.first >> 5), INT2NUM(e.chunk.second >> 5)));
+        rb_hash_aset(rbentry, sym_index, UINT2NUM(e.listIdx));
+        rb_ary_push(rbentries, rbentry);
+    }
+    return rbentries;
+}
+
+// Chunks of a region to be (re)indexed. Compressed data is read in order, then the
+// chunks are inflated, parsed and indexed in parallel.
+struct IndexChunksTask {
+    struct Job {
+        int32_t cx, cz;
+        uint32_t timestamp;
+        vector<uint8_t> compData;
+        vector<MC_EntityIndex::Entry> entries;
+        bool ok;
+    };
+    deque<Job> jobs;
+    
+    void operator()(size_t j, int /*thread*/) {
+        Job & job = jobs[j];
+        vector<uint8_t> nbtData;
+        job.ok = false;
+        if(InflateRegionChunk(job.compData, nbtData) != 0)
+            return;
+        vector<uint8_t>().swap(job.compData);
+        NBT_Buffer_I fin(&nbtData[0], nbtData.size());
+        NBT_TagCompound * nbt = LoadNBT_File(fin);
+        NBT_TagCompound * level = nbt? nbt->GetTag<NBT_TagCompound>("Level", NULL) : NULL;
+        if(level && !fin.overrun) {
+            MC_EntityIndex::ChunkEntries(level, job.cx, job.cz, job.entries);
+            job.ok = true;
+        }
+        delete nbt;
+    }
+};
+
+// update(regions, num_threads = 0)
+// Bring the index up to date with a hash of regions keyed by region coordinates, as
+// MC_World#all_regions. Only chunks written since they were last indexed are read,
+// and chunks or regions no longer present are dropped. Returns the number of chunks
+// indexed.
+static VALUE MCEntityIndex_update(int argc, VALUE * argv, VALUE self) {
+    VALUE rbregions, rbthreads;
+    rb_scan_args(argc, argv, "11", &rbregions, &rbthreads);
+    Check_Type(rbregions, T_HASH);
+    int numThreads = NIL_P(rbthreads)? 0 : NUM2INT(rbthreads);
+    MC_EntityIndex * index = GetEntityIndex(self);
+    
+    set<MC_EntityIndex::ChunkCoords> live;
+    size_t numIndexed = 0;
+    VALUE pairs = rb_funcall(rbregions, rb_intern("to_a"), 0);
+    for(long r = 0; r < RARRAY_LEN(pairs); ++r)
+    {
+        VALUE pair = rb_ary_entry(pairs, r);
+        VALUE rbcoords = rb_ary_entry(pair, 0);
+        int32_t rx = NUM2INT(rb_ary_entry(rbcoords, 0)), rz = NUM2INT(rb_ary_entry(rbcoords, 1));
+        NBT_Region_IO * rgn = GetMCRegion(rb_ary_entry(pair, 1));
+        
+        IndexChunksTask task;
+        int64_t readTime = time(NULL);
+        {
+            RegionLock lock(rgn);
+            for(int z = 0; z < 32; ++z)
+            for(int x = 0; x < 32; ++x)
+            {
+                if(!rgn->ChunkExists(x, z))
+                    continue;
+                int32_t cx = rx*32 + x, cz = rz*32 + z;
+                live.insert(MC_EntityIndex::ChunkCoords(cx, cz));
+                uint32_t timestamp = rgn->ChunkTimestamp(x, z);
+                if(index->Fresh(cx, cz, timestamp))
+                    continue;
+                task.jobs.push_back(IndexChunksTask::Job());
+                IndexChunksTask::Job & job = task.jobs.back();
+                job.cx = cx;
+                job.cz = cz;
+                job.timestamp = timestamp;
+                if(rgn->ReadChunkCompressed(x, z, job.compData) != 0)
+                    task.jobs.pop_back();
+            }
+        }
+        ParallelFor(task.jobs.size(), task, numThreads);
+        
+        for(size_t j = 0; j < task.jobs.size(); ++j)
+        {
+            IndexChunksTask::Job & job = task.jobs[j];
+            if(job.ok) {
+                index->SetChunk(job.cx, job.cz, job.timestamp, readTime, job.entries);
+                ++numIndexed;
+            }
+        }
+    }
+    index->RetainChunks(live);
+    return SIZET2NUM(numIndexed);
+}
+
+// in_box(x0, y0, z0, x1, y1, z1, id = nil)
+// Entries within the box, inclusive, as hashes with keys id, pos, tile (true for tile
+// entities), chunk and region (coordinates), and index (position in the chunk's
+// Entities or TileEntities list).
+static VALUE MCEntityIndex_in_box(int argc, VALUE * argv, VALUE self) {
+    VALUE x0, y0, z0, x1, y1, z1, rbid;
+    rb_scan_args(argc, argv, "61", &x0, &y0, &z0, &x1, &y1, &z1, &rbid);
+    string id = NIL_P(rbid)? string() : string(StringValueCStr(rbid));
+    vector<const MC_EntityIndex::Entry *> found;
+    GetEntityIndex(self)->InBox(NUM2DBL(x0), NUM2DBL(y0), NUM2DBL(z0), NUM2DBL(x1), NUM2DBL(y1), NUM2DBL(z1),
+                                NIL_P(rbid)? NULL : &id, found);
+    return EntriesToValue(found);
+}
+
+// within(x, y, z, radius, id = nil)
+static VALUE MCEntityIndex_within(int argc, VALUE * argv, VALUE self) {
+    VALUE x, y, z, radius, rbid;
+    rb_scan_args(argc, argv, "41", &x, &y, &z, &radius, &rbid);
+    string id = NIL_P(rbid)? string() : string(StringValueCStr(rbid));
+    vector<const MC_EntityIndex::Entry *> found;
+    GetEntityIndex(self)->Within(NUM2DBL(x), NUM2DBL(y), NUM2DBL(z), NUM2DBL(radius),
+                                 NIL_P(rbid)? NULL : &id, found);
+    return EntriesToValue(found);
+}
+
+// with_id(id)
+static VALUE MCEntityIndex_with_id(VALUE self, VALUE rbid) {
+    vector<const MC_EntityIndex::Entry *> found;
+    GetEntityIndex(self)->WithId(StringValueCStr(rbid), found);
+    return EntriesToValue(found);
+}
+
+static VALUE MCEntityIndex_size(VALUE self) {
+    return SIZET2NUM(GetEntityIndex(self)->NumEntries());
+}
+
+static VALUE MCEntityIndex_num_chunks(VALUE self) {
+    return SIZET2NUM(GetEntityIndex(self)->NumChunks());
+}
+
+void Init_entityindex()
+{
+    sym_id = ID2SYM(rb_intern("id"));
+    sym_pos = ID2SYM(rb_intern("pos"));
+    sym_tile = ID2SYM(rb_intern("tile"));
+    sym_chunk = ID2SYM(rb_intern("chunk"));
+    sym_region = ID2SYM(rb_intern("region"));
+    sym_index = ID2SYM(rb_intern("index"));
+    
+    class_MCEntityIndex = rb_define_class("MCEntityIndex", rb_cObject);
+    rb_define_alloc_func(class_MCEntityIndex, MCEntityIndex_allocate);
+    rb_define_method(class_MCEntityIndex, "update", RUBY_METHOD_FUNC(MCEntityIndex_update), -1);
+    rb_define_method(class_MCEntityIndex, "in_box", RUBY_METHOD_FUNC(MCEntityIndex_in_box), -1);
+    rb_define_method(class_MCEntityIndex, "within", RUBY_METHOD_FUNC(MCEntityIndex_within), -1);
+    rb_define_method(class_MCEntityIndex, "with_id", RUBY_METHOD_FUNC(MCEntityIndex_with_id), 1);
+    rb_define_method(class_MCEntityIndex, "size", RUBY_METHOD_FUNC(MCEntityIndex_size), 0);
+    rb_define_method(class_MCEntityIndex, "num_chunks", RUBY_METHOD_FUNC(MCEntityIndex_num_chunks), 0);
+}
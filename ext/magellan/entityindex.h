@@ -0,0 +1,106 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef ENTITYINDEX_H
+#define ENTITYINDEX_H
+
+#include <ruby.h>
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "nbt.h"
+
+// Spatial index of the entities and tile entities of a world, for finding them by
+// position or id without reading every chunk. Entries are grouped into cells by chunk,
+// held in a map ordered by chunk coordinates, so a box query only visits the chunks
+// it overlaps. A second map from id to the chunks holding entities of that id answers
+// queries like "all MobSpawners" directly.
+// Each chunk's entries are recorded along with the chunk's region timestamp, and
+// replaced as a whole when the chunk has been written since. Region timestamps have
+// a resolution of one second, and a chunk written again within the second its
+// timestamp was read keeps the same timestamp, so entries also record the time the
+// timestamp was read, and are never fresh if the chunk's timestamp isn't older.
+class MC_EntityIndex {
+  public:
+    typedef std::pair<int32_t, int32_t> ChunkCoords;
+    
+    struct Entry {
+        double x, y, z;// Pos of entities, x, y, z of tile entities
+        std::string id;
+        ChunkCoords chunk;
+        uint32_t listIdx;// position in the chunk's Entities or TileEntities list
+        bool tile;
+    };
+  
+  private:
+    struct Cell {
+        uint32_t timestamp;
+        int64_t readTime;// time (seconds) at or before which timestamp was read
+        std::vector<Entry> entries;
+    };
+    std::map<ChunkCoords, Cell> cells;
+    std::map<std::string, std::set<ChunkCoords> > chunksById;
+    size_t numEntries;
+    
+    void Unlink(const ChunkCoords & coords, const Cell & cell);
+  
+  public:
+    MC_EntityIndex(): numEntries(0) {}
+    
+    // Entries for the entities and tile entities in a chunk's Level compound.
+    // Entities without a valid position are skipped.
+    static void ChunkEntries(NBT_TagCompound * level, int32_t cx, int32_t cz, std::vector<Entry> & out);
+    
+    // Replace a chunk's entries, taking the contents of entries. readTime is the time
+    // (in seconds, as time()) at or before which timestamp was read from the TOC.
+    void SetChunk(int32_t cx, int32_t cz, uint32_t timestamp, int64_t readTime, std::vector<Entry> & entries);
+    void RemoveChunk(int32_t cx, int32_t cz);
+    // Remove chunks not in live
+    void RetainChunks(const std::set<ChunkCoords> & live);
+    // True if the chunk is indexed as of the given timestamp, and can't have been
+    // written again within the same second
+    bool Fresh(int32_t cx, int32_t cz, uint32_t timestamp) const;
+    
+    size_t NumEntries() const {return numEntries;}
+    size_t NumChunks() const {return cells.size();}
+    
+    // Queries append matching entries to out. id may be NULL to match any id.
+    // Entries in the box x0..x1, y0..y1, z0..z1 inclusive
+    void InBox(double x0, double y0, double z0, double x1, double y1, double z1,
+               const std::string * id, std::vector<const Entry *> & out) const;
+    // Entries within radius of x, y, z
+    void Within(double x, double y, double z, double radius, const std::string * id,
+                std::vector<const Entry *> & out) const;
+    void WithId(const std::string & id, std::vector<const Entry *> & out) const;
+};
+
+// Index wrapped by a MCEntityIndex
+MC_EntityIndex * GetEntityIndex(VALUE value);
+
+void Init_entityindex();
+
+#endif // ENTITYINDEX_H
@@ -16,7 +16,17 @@ $srcs.push('mc.cpp')
 $srcs.push('nbt.cpp')
 $srcs.push('nbtio.cpp')
 $srcs.push('nbtrb.cpp')
+$srcs.push('nibbles.cpp')
+$srcs.push('chunkcache.cpp')
+$srcs.push('chunkrb.cpp')
+$srcs.push('chunkstream.cpp')
+$srcs.push('compactblocks.cpp')
+$srcs.push('entityindex.cpp')
+$srcs.push('heightmap.cpp')
+$srcs.push('blocksearch.cpp')
+$srcs.push('lighting.cpp')
 $srcs.push('magellan.cpp')
+$srcs.push('worldrb.cpp')
 
 #$srcs = $srcs.map {|f| "ext/magellan/" + f}
 
@@ -25,6 +35,7 @@ $objs = $srcs.map {|f| File.basename(f, ".*") + ".o"}
 
 have_library("z", "gzopen")
 have_library("png", "png_init_io")
+have_func("rb_ext_ractor_safe", "ruby.h")
 
 create_makefile('magellan/magellan')
 
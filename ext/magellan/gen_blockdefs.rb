@@ -16,6 +16,7 @@ blockdefs_h.puts ''
 blockdefs_h.puts 'struct BlockInfo {'
 blockdefs_h.puts '    std::string name;'
 blockdefs_h.puts '    uint8_t opacity;'
+blockdefs_h.puts '    uint8_t light;'
 blockdefs_h.puts '};'
 blockdefs_h.puts ''
 blockdefs_h.puts 'extern BlockInfo blockdefs[];'
@@ -45,9 +46,9 @@ blockdefs_cpp.puts 'BlockInfo blockdefs[256] = {'
 blockdefs_cpp.puts (0..255).map {|bid|
     block = Magellan::BLOCKS_BY_ID[bid]
     if(block)
-        "    {\"#{block[:name]}\", #{block[:opacity]}}"
+        "    {\"#{block[:name]}\", #{block[:opacity]}, #{block[:light]}}"
     else
-        "    {\"\", 15}"
+        "    {\"\", 15, 0}"
     end
 }.join(",\n")
 blockdefs_cpp.puts '};'
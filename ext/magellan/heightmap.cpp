@@ -0,0 +1,111 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#include "heightmap.h"
+#include "blockdefs.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+//******************************************************************************
+
+static MC_BlockSet BuildOpaqueSet()
+{
+    MC_BlockSet set;
+    for(int j = 1; j < 256; ++j)
+        if(blockdefs[j].opacity != 0)
+            set.Insert(j);
+    return set;
+}
+
+const MC_BlockSet & MC_BlockSet::Opaque()
+{
+    static MC_BlockSet opaque = BuildOpaqueSet();
+    return opaque;
+}
+
+//******************************************************************************
+
+// Height of a single 128 block column: one above the highest opaque block.
+static inline int ColumnHeight(const uint8_t * col, const MC_BlockSet & opaque)
+{
+#if defined(__SSE2__)
+    // Most of a column's upper part is air: find non-air blocks 16 at a time with
+    // a vector compare, and only test those against the set, highest first.
+    const __m128i zero = _mm_setzero_si128();
+    for(int base = 128 - 16; base >= 0; base -= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(col + base));
+        unsigned solid = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & 0xFFFF;
+        while(solid) {
+            int bit = 31 - __builtin_clz(solid);
+            if(opaque.Contains(col[base + bit]))
+                return base + bit + 1;
+            solid &= ~(1u << bit);
+        }
+    }
+    return 0;
+#else
+    for(int y = 127; y >= 0; --y)
+        if(col[y] != 0 && opaque.Contains(col[y]))
+            return y + 1;
+    return 0;
+#endif
+}
+
+void MC_ComputeHeightmap(uint8_t * heightmap, const uint8_t * blocks, const MC_BlockSet & opaque)
+{
+    for(int x = 0; x < 16; ++x)
+    for(int z = 0; z < 16; ++z)
+        heightmap[z*16 + x] = ColumnHeight(blocks + (x*16 + z)*128, opaque);
+}
+
+//******************************************************************************
+
+MC_BlockSet MC_BlockTypesPresent(const uint8_t * blocks, size_t n)
+{
+    MC_BlockSet set;
+    size_t j = 0;
+#if defined(__SSE2__)
+    // Compare each group of 16 with its first block: uniform groups only need one
+    // insertion.
+    for(; j + 16 <= n; j += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(blocks + j));
+        __m128i first = _mm_set1_epi8((char)blocks[j]);
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, first)) == 0xFFFF) {
+            set.Insert(blocks[j]);
+        }
+        else {
+            for(size_t k = j; k < j + 16; ++k)
+                set.Insert(blocks[k]);
+        }
+    }
+#endif
+    for(; j < n; ++j)
+        set.Insert(blocks[j]);
+    return set;
+}
+
+//******************************************************************************
@@ -0,0 +1,68 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef HEIGHTMAP_H
+#define HEIGHTMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Set of block types, as a 256 bit bitset: small enough to stay in cache and cheap
+// to test in inner loops, unlike the blockdefs table.
+struct MC_BlockSet {
+    uint64_t bits[4];
+    
+    MC_BlockSet() {Clear();}
+    
+    void Clear() {bits[0] = bits[1] = bits[2] = bits[3] = 0;}
+    void Insert(uint8_t type) {bits[type >> 6] |= (uint64_t)1 << (type & 63);}
+    void Remove(uint8_t type) {bits[type >> 6] &= ~((uint64_t)1 << (type & 63));}
+    bool Contains(uint8_t type) const {return (bits[type >> 6] >> (type & 63)) & 1;}
+    bool Empty() const {return !(bits[0] | bits[1] | bits[2] | bits[3]);}
+    // True if the sets have any type in common
+    bool Intersects(const MC_BlockSet & other) const {
+        return ((bits[0] & other.bits[0]) | (bits[1] & other.bits[1]) |
+                (bits[2] & other.bits[2]) | (bits[3] & other.bits[3])) != 0;
+    }
+    void Union(const MC_BlockSet & other) {
+        for(int j = 0; j < 4; ++j)
+            bits[j] |= other.bits[j];
+    }
+    
+    // Block types with nonzero opacity in blockdefs, which stop skylight
+    static const MC_BlockSet & Opaque();
+};
+
+// Compute the heightmap of a chunk from its block types (in chunk order, indexed
+// (x*16 + z)*128 + y). heightmap is 16x16, indexed z*16 + x, and receives for each
+// column the height of the lowest block that gets full skylight: one above the
+// highest block in opaque, or 0 if there is none. Air is always taken as
+// transparent.
+void MC_ComputeHeightmap(uint8_t * heightmap, const uint8_t * blocks,
+                         const MC_BlockSet & opaque = MC_BlockSet::Opaque());
+
+// Set of the block types in n blocks. Runs of a single type, which make up most of
+// a chunk, are skipped 16 blocks at a time.
+MC_BlockSet MC_BlockTypesPresent(const uint8_t * blocks, size_t n);
+
+#endif // HEIGHTMAP_H
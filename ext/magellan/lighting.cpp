@@ -0,0 +1,513 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#include "lighting.h"
+#include "mc.h"
+#include "heightmap.h"
+#include "threadpool.h"
+#include "blockdefs.h"
+
+#include <string.h>
+
+using namespace std;
+
+//******************************************************************************
+
+static const int kChunkBlocks = 16*16*128;
+static const int kFaceBlocks = 16*128;
+static const int kXStride = 16*128;
+static const int kZStride = 128;
+
+// Light reduction entering each block type, and light emitted
+struct LightTables {
+    uint8_t cost[256];
+    uint8_t emit[256];
+    
+    LightTables() {
+        for(int j = 0; j < 256; ++j) {
+            cost[j] = (blockdefs[j].opacity > 1)? blockdefs[j].opacity : 1;
+            emit[j] = blockdefs[j].light;
+        }
+    }
+};
+
+static const LightTables & Tables()
+{
+    static LightTables tables;
+    return tables;
+}
+
+// Index of block on face f (0: x = 0, 1: x = 15, 2: z = 0, 3: z = 15) at position u
+// along the face (z for x faces, x for z faces) and height y.
+static inline int FaceIdx(int f, int u, int y)
+{
+    switch(f) {
+      case 0: return u*kZStride + y;
+      case 1: return 15*kXStride + u*kZStride + y;
+      case 2: return u*kXStride + y;
+      default: return u*kXStride + 15*kZStride + y;
+    }
+}
+
+// The face of a neighbor that touches face f of this chunk
+static const int kOppositeFace[4] = {1, 0, 3, 2};
+
+//******************************************************************************
+
+// Border layout: for each face, skylight then blocklight, kFaceBlocks each, indexed
+// u*128 + y.
+void MC_LightEngine::Chunk::Snapshot()
+{
+    border.resize(4*2*kFaceBlocks);
+    uint8_t * dst = &border[0];
+    for(int f = 0; f < 4; ++f)
+    {
+        for(int u = 0; u < 16; ++u) {
+            memcpy(dst + u*128, skylight + FaceIdx(f, u, 0), 128);
+            memcpy(dst + kFaceBlocks + u*128, blocklight + FaceIdx(f, u, 0), 128);
+        }
+        dst += 2*kFaceBlocks;
+    }
+}
+
+// Breadth-first spread of light from queued blocks, within one chunk.
+static bool FloodFill(uint8_t * light, const uint8_t * types, vector<uint16_t> & queue, const uint8_t * cost)
+{
+    bool changed = !queue.empty();
+    for(size_t head = 0; head < queue.size(); ++head)
+    {
+        int idx = queue[head];
+        int l = light[idx];
+        if(l <= 1)
+            continue;
+        int x = idx >> 11, z = (idx >> 7) & 15, y = idx & 127;
+        int nbrs[6];
+        int n = 0;
+        if(x > 0) nbrs[n++] = idx - kXStride;
+        if(x < 15) nbrs[n++] = idx + kXStride;
+        if(z > 0) nbrs[n++] = idx - kZStride;
+        if(z < 15) nbrs[n++] = idx + kZStride;
+        if(y > 0) nbrs[n++] = idx - 1;
+        if(y < 127) nbrs[n++] = idx + 1;
+        for(int j = 0; j < n; ++j) {
+            int nidx = nbrs[j];
+            int nl = l - cost[types[nidx]];
+            if(nl > light[nidx]) {
+                light[nidx] = nl;
+                queue.push_back(nidx);
+            }
+        }
+    }
+    queue.clear();
+    return changed;
+}
+
+// Light a chunk on its own, ignoring neighbors
+static void LightLocal(MC_LightEngine::Chunk & chunk, vector<uint16_t> & queue)
+{
+    const LightTables & tables = Tables();
+    const uint8_t * types = chunk.types;
+    
+    MC_ComputeHeightmap(chunk.heightmap, types);
+    const uint8_t * height = chunk.heightmap;
+    
+    // Skylight: full above the heightmap, dark below. The flood fill starts from
+    // sky blocks beside a taller column, the only places sunlight spreads sideways
+    // into shadow.
+    memset(chunk.skylight, 0, kChunkBlocks);
+    for(int x = 0; x < 16; ++x)
+    for(int z = 0; z < 16; ++z)
+    {
+        int h = height[z*16 + x];
+        int col = x*kXStride + z*kZStride;
+        if(h < 128)
+            memset(chunk.skylight + col + h, 15, 128 - h);
+        int hmax = h;
+        if(x > 0) hmax = max(hmax, (int)height[z*16 + x - 1]);
+        if(x < 15) hmax = max(hmax, (int)height[z*16 + x + 1]);
+        if(z > 0) hmax = max(hmax, (int)height[(z - 1)*16 + x]);
+        if(z < 15) hmax = max(hmax, (int)height[(z + 1)*16 + x]);
+        for(int y = h; y < hmax; ++y)
+            queue.push_back(col + y);
+        // Light also spreads down through partially transparent blocks under the top
+        if(h > 0 && h < 128 && tables.cost[types[col + h - 1]] < 15)
+            queue.push_back(col + h);
+    }
+    FloodFill(chunk.skylight, types, queue, tables.cost);
+    
+    // Block light from emitting blocks
+    memset(chunk.blocklight, 0, kChunkBlocks);
+    for(int idx = 0; idx < kChunkBlocks; ++idx)
+    {
+        uint8_t e = tables.emit[types[idx]];
+        if(e) {
+            chunk.blocklight[idx] = e;
+            queue.push_back(idx);
+        }
+    }
+    FloodFill(chunk.blocklight, types, queue, tables.cost);
+}
+
+// Pull light in from neighbors' border snapshots, returns true if anything changed
+static bool LightFromNeighbors(MC_LightEngine::Chunk & chunk, vector<uint16_t> & queue)
+{
+    const uint8_t * cost = Tables().cost;
+    bool changed = false;
+    for(int plane = 0; plane < 2; ++plane)
+    {
+        uint8_t * light = plane? chunk.blocklight : chunk.skylight;
+        for(int f = 0; f < 4; ++f)
+        {
+            MC_LightEngine::Chunk * nbr = chunk.neighbors[f];
+            if(!nbr)
+                continue;
+            const uint8_t * src = &nbr->border[(kOppositeFace[f]*2 + plane)*kFaceBlocks];
+            for(int u = 0; u < 16; ++u)
+            for(int y = 0; y < 128; ++y)
+            {
+                int idx = FaceIdx(f, u, y);
+                int nl = src[u*128 + y] - cost[chunk.types[idx]];
+                if(nl > light[idx]) {
+                    light[idx] = nl;
+                    queue.push_back(idx);
+                }
+            }
+        }
+        changed = FloodFill(light, chunk.types, queue, cost) || changed;
+    }
+    return changed;
+}
+
+//******************************************************************************
+
+MC_LightEngine::~MC_LightEngine()
+{
+    for(size_t j = 0; j < chunks.size(); ++j)
+        delete chunks[j];
+}
+
+void MC_LightEngine::AddChunk(int32_t cx, int32_t cz, const uint8_t * types, uint8_t * skylight,
+                              uint8_t * blocklight, uint8_t * heightmap, bool relight)
+{
+    Chunk * chunk = new Chunk;
+    chunk->cx = cx;
+    chunk->cz = cz;
+    chunk->types = types;
+    chunk->skylight = skylight;
+    chunk->blocklight = blocklight;
+    chunk->heightmap = heightmap;
+    chunk->relight = relight;
+    chunk->changed = false;
+    for(int f = 0; f < 4; ++f)
+        chunk->neighbors[f] = NULL;
+    chunks.push_back(chunk);
+    index[make_pair(cx, cz)] = chunk;
+}
+
+struct LightTask {
+    vector<MC_LightEngine::Chunk *> & chunks;
+    vector<vector<uint16_t> > queues;// per thread
+    bool local;// initial local pass, or border exchange round
+    
+    LightTask(vector<MC_LightEngine::Chunk *> & c, int numThreads): chunks(c), queues(numThreads), local(true) {}
+    
+    void operator()(size_t j, int thread) {
+        MC_LightEngine::Chunk & chunk = *chunks[j];
+        if(local)
+            LightLocal(chunk, queues[thread]);
+        else
+            chunk.changed = LightFromNeighbors(chunk, queues[thread]);
+    }
+};
+
+struct SnapshotTask {
+    vector<MC_LightEngine::Chunk *> & chunks;
+    SnapshotTask(vector<MC_LightEngine::Chunk *> & c): chunks(c) {}
+    void operator()(size_t j, int /*thread*/) {chunks[j]->Snapshot();}
+};
+
+size_t MC_LightEngine::Run(int numThreads)
+{
+    if(numThreads <= 0)
+        numThreads = NumCPUs();
+    
+    static const int32_t kOffsets[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+    vector<Chunk *> relit;
+    for(size_t j = 0; j < chunks.size(); ++j)
+    {
+        Chunk * chunk = chunks[j];
+        for(int f = 0; f < 4; ++f) {
+            map<pair<int32_t, int32_t>, Chunk *>::iterator nbr =
+                index.find(make_pair(chunk->cx + kOffsets[f][0], chunk->cz + kOffsets[f][1]));
+            chunk->neighbors[f] = (nbr != index.end())? nbr->second : NULL;
+        }
+        if(chunk->relight)
+            relit.push_back(chunk);
+    }
+    
+    Tables();
+    MC_BlockSet::Opaque();
+    
+    LightTask task(relit, numThreads);
+    ParallelFor(relit.size(), task, numThreads);
+    
+    // Border exchange. Fixed chunks only need one snapshot, relit chunks need a new
+    // one each round.
+    SnapshotTask snapAll(chunks);
+    ParallelFor(chunks.size(), snapAll, numThreads);
+    task.local = false;
+    for(rounds = 1; ; ++rounds)
+    {
+        ParallelFor(relit.size(), task, numThreads);
+        
+        vector<Chunk *> changed;
+        for(size_t j = 0; j < relit.size(); ++j)
+            if(relit[j]->changed)
+                changed.push_back(relit[j]);
+        if(changed.empty())
+            break;
+        SnapshotTask snapChanged(changed);
+        ParallelFor(changed.size(), snapChanged, numThreads);
+    }
+    
+    for(size_t j = 0; j < chunks.size(); ++j)
+        vector<uint8_t>().swap(chunks[j]->border);
+    return relit.size();
+}
+
+//******************************************************************************
+
+// Light values of a plane (0: sky, 1: block) accessed by world position, through a
+// cursor that keeps the last chunk looked up.
+template<typename World, typename Chunk>
+class LightUpdate {
+  public:
+    struct Node {
+        int32_t x, y, z;
+        uint8_t light;
+    };
+    typedef MC_BlockCursorOf<World, Chunk> Cursor;
+  
+  private:
+    const LightTables & tables;
+    Cursor cursor;
+  
+  public:
+    vector<Node> removals[2];
+    vector<Node> additions[2];
+    size_t numSet;
+    
+    LightUpdate(World & w): tables(Tables()), cursor(w), numSet(0) {}
+    
+    // Chunk holding block column x, z
+    Chunk * ChunkAt(int32_t x, int32_t z) {
+        cursor.MoveTo(x, 0, z);
+        return cursor.GetChunk();
+    }
+    
+    static uint8_t Get(int plane, const Chunk * c, size_t idx) {
+        return plane? c->GetBlocklight(idx) : c->GetSkylight(idx);
+    }
+    void Set(int plane, Chunk * c, size_t idx, uint8_t light) {
+        if(plane)
+            c->SetBlocklight(light, idx);
+        else
+            c->SetSkylight(light, idx);
+        c->SetDirty();
+        ++numSet;
+    }
+    
+    // Light the block produces itself: sky above the heightmap, or light emitted
+    uint8_t Source(int plane, const Chunk * c, size_t idx, int32_t x, int32_t y, int32_t z) const {
+        if(plane)
+            return tables.emit[c->GetType(idx)];
+        return (y >= c->GetHeightmap(x & 15, z & 15))? 15 : 0;
+    }
+    
+    void Remove(int plane);
+    void Add(int plane);
+    void Change(const MC_LightChange & change);
+};
+
+template<typename World, typename Chunk>
+void LightUpdate<World, Chunk>::Remove(int plane)
+{
+    vector<Node> & queue = removals[plane];
+    for(size_t head = 0; head < queue.size(); ++head)
+    {
+        Node node = queue[head];
+        cursor.MoveTo(node.x, node.y, node.z);
+        for(int j = 0; j < 6; ++j)
+        {
+            // Neighbors in the same chunk are found without a lookup
+            Cursor at = cursor;
+            at.Step(j);
+            Chunk * c = at.GetChunk();
+            if(!c)
+                continue;
+            size_t idx = at.Index();
+            Node n = {at.X(), at.Y(), at.Z(), Get(plane, c, idx)};
+            if(n.light == 0)
+                continue;
+            if(n.light < node.light) {
+                Set(plane, c, idx, 0);
+                queue.push_back(n);
+                uint8_t source = Source(plane, c, idx, n.x, n.y, n.z);
+                if(source) {
+                    Set(plane, c, idx, source);
+                    additions[plane].push_back(n);
+                }
+            }
+            else {
+                additions[plane].push_back(n);
+            }
+        }
+    }
+    queue.clear();
+}
+
+template<typename World, typename Chunk>
+void LightUpdate<World, Chunk>::Add(int plane)
+{
+    vector<Node> & queue = additions[plane];
+    for(size_t head = 0; head < queue.size(); ++head)
+    {
+        Node node = queue[head];
+        cursor.MoveTo(node.x, node.y, node.z);
+        int l = Get(plane, cursor.GetChunk(), cursor.Index());
+        if(l <= 1)
+            continue;
+        for(int j = 0; j < 6; ++j)
+        {
+            Cursor at = cursor;
+            at.Step(j);
+            Chunk * c = at.GetChunk();
+            if(!c)
+                continue;
+            size_t idx = at.Index();
+            int nl = l - tables.cost[c->GetType(idx)];
+            if(nl > Get(plane, c, idx)) {
+                Set(plane, c, idx, nl);
+                Node n = {at.X(), at.Y(), at.Z(), 0};
+                queue.push_back(n);
+            }
+        }
+    }
+    queue.clear();
+}
+
+// Update the heightmap of the edited column and queue removal of light around the
+// edit. New light sources are queued after removal, by the caller.
+template<typename World, typename Chunk>
+void LightUpdate<World, Chunk>::Change(const MC_LightChange & change)
+{
+    int32_t x = change.x, y = change.y, z = change.z;
+    Chunk * c = (y >= 0 && y < 128)? ChunkAt(x, z) : NULL;
+    if(!c)
+        return;
+    size_t col = MC_Chunk::GetIdx(x & 15, 0, z & 15);
+    const MC_BlockSet & opaque = MC_BlockSet::Opaque();
+    
+    int h0 = c->GetHeightmap(x & 15, z & 15), h1 = h0;
+    if(opaque.Contains(c->GetType(col + y))) {
+        if(y >= h0)
+            h1 = y + 1;
+    }
+    else if(y == h0 - 1) {
+        h1 = y;
+        while(h1 > 0 && !opaque.Contains(c->GetType(col + h1 - 1)))
+            --h1;
+    }
+    if(h1 != h0) {
+        c->SetHeightmap(x & 15, z & 15, h1);
+        c->SetDirty();
+    }
+    // Blocks newly in shadow lose their sunlight, newly exposed blocks are handled
+    // with the other sources once removal is done.
+    for(int yy = h0; yy < h1; ++yy)
+    {
+        Node n = {x, yy, z, 15};
+        Set(0, c, col + yy, 0);
+        removals[0].push_back(n);
+    }
+    
+    Node n = {x, y, z, change.skylight};
+    Set(0, c, col + y, 0);
+    removals[0].push_back(n);
+    n.light = change.blocklight;
+    Set(1, c, col + y, 0);
+    removals[1].push_back(n);
+}
+
+template<typename World, typename Chunk>
+size_t MC_RelightChanges(World & world, const vector<MC_LightChange> & changes)
+{
+    typedef LightUpdate<World, Chunk> Update;
+    Update update(world);
+    // Heightmaps before and after, to find newly exposed sky
+    vector<uint8_t> oldHeights(changes.size());
+    for(size_t j = 0; j < changes.size(); ++j)
+    {
+        const MC_LightChange & change = changes[j];
+        Chunk * c = update.ChunkAt(change.x, change.z);
+        oldHeights[j] = c? c->GetHeightmap(change.x & 15, change.z & 15) : 0;
+        update.Change(change);
+    }
+    update.Remove(0);
+    update.Remove(1);
+    
+    for(size_t j = 0; j < changes.size(); ++j)
+    {
+        const MC_LightChange & change = changes[j];
+        Chunk * c = (change.y >= 0 && change.y < 128)? update.ChunkAt(change.x, change.z) : NULL;
+        if(!c)
+            continue;
+        size_t col = MC_Chunk::GetIdx(change.x & 15, 0, change.z & 15);
+        int h = c->GetHeightmap(change.x & 15, change.z & 15);
+        for(int y = h; y < oldHeights[j]; ++y) {
+            typename Update::Node n = {change.x, y, change.z, 15};
+            update.Set(0, c, col + y, 15);
+            update.additions[0].push_back(n);
+        }
+        for(int plane = 0; plane < 2; ++plane)
+        {
+            uint8_t source = update.Source(plane, c, col + change.y, change.x, change.y, change.z);
+            if(source > Update::Get(plane, c, col + change.y)) {
+                typename Update::Node n = {change.x, change.y, change.z, source};
+                update.Set(plane, c, col + change.y, source);
+                update.additions[plane].push_back(n);
+            }
+        }
+    }
+    update.Add(0);
+    update.Add(1);
+    return update.numSet;
+}
+
+template size_t MC_RelightChanges<MC_World, MC_Chunk>(MC_World &, const vector<MC_LightChange> &);
+template size_t MC_RelightChanges<MC_ChunkMap<MC_Chunk>, MC_Chunk>(MC_ChunkMap<MC_Chunk> &,
+                                                                 const vector<MC_LightChange> &);
+template size_t MC_RelightChanges<MC_ChunkMap<MC_LightChunk>, MC_LightChunk>(MC_ChunkMap<MC_LightChunk> &,
+                                                                           const vector<MC_LightChange> &);
+
+//******************************************************************************
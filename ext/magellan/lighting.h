@@ -0,0 +1,156 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef LIGHTING_H
+#define LIGHTING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+#include <map>
+
+class MC_World;
+struct MC_LightChange;
+
+// Sky and block light computation for a set of chunks.
+// Chunks to be relit are added along with any neighbors that should contribute
+// light across the borders but keep their current values. Each relit chunk is first
+// lit on its own: skylight is seeded from the heightmap (recomputed as part of
+// this), block light from light emitting blocks, and both spread with a
+// breadth-first flood fill. Light is then exchanged across chunk borders in rounds:
+// a snapshot is taken of every chunk's border faces, then each relit chunk seeds a
+// flood fill from its neighbors' snapshots, until a round changes nothing. Chunks
+// only read snapshots of their neighbors, so each round runs in parallel without
+// locking. Light goes at most 15 blocks, so a few rounds are usually enough.
+//
+// Light passing into a block is reduced by the block's opacity from blockdefs, and
+// by at least 1.
+// Arrays are in chunk order, indexed (x*16 + z)*128 + y, with one byte per value:
+// unpack and repack the chunk's nibble arrays around the computation.
+class MC_LightEngine {
+  public:
+    struct Chunk {
+        int32_t cx, cz;
+        const uint8_t * types;
+        uint8_t * skylight;
+        uint8_t * blocklight;
+        uint8_t * heightmap;// 16x16, indexed z*16 + x
+        bool relight;
+        Chunk * neighbors[4];// -x, +x, -z, +z, NULL if not present
+        std::vector<uint8_t> border;// snapshot of border faces, see Snapshot()
+        bool changed;
+        
+        void Snapshot();
+    };
+  
+  private:
+    std::vector<Chunk *> chunks;
+    std::map<std::pair<int32_t, int32_t>, Chunk *> index;
+    
+    MC_LightEngine(const MC_LightEngine &);
+    MC_LightEngine & operator=(const MC_LightEngine &);
+  
+  public:
+    size_t rounds;// border exchange rounds taken by the last Run()
+    
+    MC_LightEngine(): rounds(0) {}
+    ~MC_LightEngine();
+    
+    // Add a chunk. If relight is false, the chunk's light is only read, and types,
+    // heightmap and the light arrays are not modified.
+    void AddChunk(int32_t cx, int32_t cz, const uint8_t * types, uint8_t * skylight,
+                  uint8_t * blocklight, uint8_t * heightmap, bool relight);
+    bool HasChunk(int32_t cx, int32_t cz) const {return index.count(std::make_pair(cx, cz)) != 0;}
+    size_t NumChunks() const {return chunks.size();}
+    
+    // Relight chunks on numThreads threads, one per processor if <= 0. Returns the
+    // number of chunks relit.
+    size_t Run(int numThreads = 0);
+};
+
+// A chunk's block types, packed light arrays and heightmap as stored in chunk NBT,
+// for incremental relighting of chunks not held as MC_Chunks. Doesn't own the arrays.
+class MC_LightChunk {
+    const uint8_t * types;
+    uint8_t * skylight;
+    uint8_t * blocklight;
+    uint8_t * heightmap;// 16x16, indexed z*16 + x
+    bool dirty;
+    
+    static uint8_t GetNibble(const uint8_t * arr, size_t idx) {
+        return (idx & 0x01)? (arr[idx >> 1] >> 4) : (arr[idx >> 1] & 0x0F);
+    }
+    static void SetNibble(uint8_t * arr, uint8_t val, size_t idx) {
+        if(idx & 0x01)
+            arr[idx >> 1] = (val << 4) | (arr[idx >> 1] & 0x0F);
+        else
+            arr[idx >> 1] = (arr[idx >> 1] & 0xF0) | (val & 0x0F);
+    }
+    
+  public:
+    MC_LightChunk(const uint8_t * t, uint8_t * sl, uint8_t * bl, uint8_t * hm):
+        types(t), skylight(sl), blocklight(bl), heightmap(hm), dirty(false) {}
+    
+    uint8_t GetType(size_t idx) const {return types[idx];}
+    uint8_t GetSkylight(size_t idx) const {return GetNibble(skylight, idx);}
+    uint8_t GetBlocklight(size_t idx) const {return GetNibble(blocklight, idx);}
+    void SetSkylight(uint8_t sl, size_t idx) {SetNibble(skylight, sl, idx);}
+    void SetBlocklight(uint8_t bl, size_t idx) {SetNibble(blocklight, bl, idx);}
+    uint8_t GetHeightmap(int32_t x, int32_t z) const {return heightmap[z*16 + x];}
+    void SetHeightmap(int32_t x, int32_t z, uint8_t val) {heightmap[z*16 + x] = val;}
+    
+    bool IsDirty() const {return dirty;}
+    void SetDirty(bool d = true) {dirty = d;}
+};
+
+// Chunks by chunk coordinates, for relighting a set of chunks not held in a MC_World.
+// Doesn't own the chunks.
+template<typename Chunk>
+class MC_ChunkMap {
+    std::map<std::pair<int32_t, int32_t>, Chunk *> chunks;
+    
+  public:
+    void Add(int32_t cx, int32_t cz, Chunk * chunk) {chunks[std::make_pair(cx, cz)] = chunk;}
+    Chunk * ChunkAt(int32_t cx, int32_t cz) const {
+        typename std::map<std::pair<int32_t, int32_t>, Chunk *>::const_iterator c;
+        c = chunks.find(std::make_pair(cx, cz));
+        return (c != chunks.end())? c->second : NULL;
+    }
+};
+
+// Incremental relighting after block edits, for edits too small to be worth a full
+// relight of their chunks. Heightmaps of edited columns are updated first. Light that
+// may have come through an edited block (or a column newly shadowed) is removed by
+// a flood fill outward from it, which stops at blocks lit more brightly than the
+// light being removed: those may be lit from elsewhere, and seed a second flood fill
+// that spreads light back into the cleared blocks, along with new light sources and
+// newly exposed sky. Work is proportional to the volume the edits affect.
+// Light spreads only through chunks the world holds, so it should hold those beside
+// the edited ones. Chunks with changed light are marked dirty. Returns the number of
+// light values set.
+// World is a MC_World or MC_ChunkMap, Chunk a MC_Chunk or MC_LightChunk.
+template<typename World, typename Chunk>
+size_t MC_RelightChanges(World & world, const std::vector<MC_LightChange> & changes);
+
+#endif // LIGHTING_H
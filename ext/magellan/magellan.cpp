@@ -38,38 +38,42 @@
 #include <vector>
 #include <stack>
 #include <list>
+#include <deque>
 #include <map>
 #include <set>
 #include <algorithm>
 
 #include "nbtrb.h"
 #include "nbtio.h"
+#include "chunkcache.h"
+#include "chunkrb.h"
+#include "worldrb.h"
+#include "chunkstream.h"
+#include "entityindex.h"
+#include "heightmap.h"
+#include "lighting.h"
+#include "blocksearch.h"
+#include "nibbles.h"
+#include "threadpool.h"
 
 #include "blockdefs.h"
 #include "magellan.h"
 
+#include <ruby/thread.h>
+
 
 using namespace std;
 
 void ParseArgs(int argc, char * argv[]);
 void PrintUsage();
 
-//******************************************************************************
-// Globals
-//******************************************************************************
-
-MC_Stats stats;
-MC_World world;
-
-
 //******************************************************************************
 
-void WriteImage(SimpleImage & outputImage, const string & path);
+bool WriteImage(SimpleImage & outputImage, const string & path);
 
 VALUE class_MCRegion;
 VALUE class_MCWorld;
 
-static VALUE id_value;
 static VALUE sym_dirty;
 static VALUE sym_nbt;
 static VALUE sym_Level;
@@ -78,9 +82,14 @@ static VALUE sym_Data;
 static VALUE sym_SkyLight;
 static VALUE sym_BlockLight;
 static VALUE sym_HeightMap;
+static VALUE sym_coords;
+static VALUE sym_type;
+static VALUE sym_data;
+static VALUE sym_skylight;
+static VALUE sym_blocklight;
 
 
-inline NBT_Region_IO * GetMCRegion(VALUE value) {
+NBT_Region_IO * GetMCRegion(VALUE value) {
     NBT_Region_IO * val; Data_Get_Struct(value, NBT_Region_IO, val);
     return val;
 }
@@ -97,20 +106,82 @@ static VALUE MCRegion_init(int argc, VALUE *argv, VALUE self)
     return self;
 }
 
+struct RegionLockCall {
+    Mutex * mutex;
+    bool locked;
+};
+
+static void * RegionLock_NoGVL(void * data) {
+    RegionLockCall * call = static_cast<RegionLockCall *>(data);
+    call->mutex->Lock();
+    call->locked = true;
+    return NULL;
+}
+
+RegionLock::RegionLock(NBT_Region_IO * rgn): mutex(rgn->GetMutex())
+{
+    if(mutex.TryLock())
+        return;
+    // Without RB_NOGVL_INTR_FAIL, a pending interrupt could raise with the mutex
+    // locked. With it, the call is skipped if one is already pending.
+    RegionLockCall call = {&mutex, false};
+    rb_nogvl(RegionLock_NoGVL, &call, NULL, NULL, RB_NOGVL_INTR_FAIL);
+    if(!call.locked)
+        mutex.Lock();
+}
+
 static VALUE MCRegion_open(VALUE self, VALUE rbfpath) {
-    int err = GetMCRegion(self)->Open(StringValueCStr(rbfpath));
-    return INT2FIX(err);
+    NBT_Region_IO * rgn = GetMCRegion(self);
+    string fpath = StringValueCStr(rbfpath);
+    int status;
+    {
+        RegionLock lock(rgn);
+        status = rgn->Open(fpath);
+    }
+    return INT2FIX(status);
+}
+
+// Close region file. It will be reopened on the next chunk read or write.
+static VALUE MCRegion_close(VALUE self) {
+    NBT_Region_IO * rgn = GetMCRegion(self);
+    RegionLock lock(rgn);
+    rgn->CloseFile();
+    return self;
+}
+
+static VALUE MCRegion_file_open(VALUE self) {
+    NBT_Region_IO * rgn = GetMCRegion(self);
+    RegionLock lock(rgn);
+    return rgn->FileOpen()? Qtrue : Qfalse;
+}
+
+// Maximum number of region files held open at once, across all regions.
+static VALUE MCRegion_max_open_files(VALUE /*klass*/) {
+    return SIZET2NUM(NBT_RegionFilePool::MaxOpen());
+}
+
+static VALUE MCRegion_set_max_open_files(VALUE /*klass*/, VALUE rb_n) {
+    NBT_RegionFilePool::SetMaxOpen(NUM2SIZET(rb_n));
+    return rb_n;
+}
+
+static VALUE MCRegion_open_files(VALUE /*klass*/) {
+    return SIZET2NUM(NBT_RegionFilePool::NumOpen());
 }
 
 // TODO: compute and return stats, instead of printing to cout
 static VALUE MCRegion_stats(VALUE self) {
-    GetMCRegion(self)->PrintStats(cout);
+    NBT_Region_IO * rgn = GetMCRegion(self);
+    RegionLock lock(rgn);
+    rgn->PrintStats(cout);
     return self;
 }
 
 static VALUE MCRegion_chunk_exists(VALUE self, VALUE rb_x, VALUE rb_z) {
     NBT_Region_IO * rgn = GetMCRegion(self);
-    if(rgn->ChunkExists(NUM2INT(rb_x), NUM2INT(rb_z)))
+    int x = NUM2INT(rb_x), z = NUM2INT(rb_z);
+    RegionLock lock(rgn);
+    if(rgn->ChunkExists(x, z))
         return Qtrue;
     else
         return Qfalse;
@@ -119,96 +190,1018 @@ static VALUE MCRegion_chunk_exists(VALUE self, VALUE rb_x, VALUE rb_z) {
 static VALUE MCRegion_chunk_start(VALUE self, VALUE rb_x, VALUE rb_z) {
     NBT_Region_IO * rgn = GetMCRegion(self);
     int x = NUM2INT(rb_x), z = NUM2INT(rb_z);
-    if(rgn->ChunkExists(x, z))
-        return INT2NUM(rgn->ChunkStart(x, z));
-    else
-        return Qnil;
+    int start = -1;
+    {
+        RegionLock lock(rgn);
+        if(rgn->ChunkExists(x, z))
+            start = rgn->ChunkStart(x, z);
+    }
+    return (start >= 0)? INT2NUM(start) : Qnil;
 }
 
 static VALUE MCRegion_chunk_size(VALUE self, VALUE rb_x, VALUE rb_z) {
     NBT_Region_IO * rgn = GetMCRegion(self);
     int x = NUM2INT(rb_x), z = NUM2INT(rb_z);
-    if(rgn->ChunkExists(x, z))
-        return INT2NUM(rgn->ChunkSize(x, z));
-    else
-        return Qnil;
+    int size = -1;
+    {
+        RegionLock lock(rgn);
+        if(rgn->ChunkExists(x, z))
+            size = rgn->ChunkSize(x, z);
+    }
+    return (size >= 0)? INT2NUM(size) : Qnil;
 }
 
-static VALUE MCRegion_read_chunk_nbt(VALUE self, VALUE rb_x, VALUE rb_z) {
+static VALUE MCRegion_chunk_timestamp(VALUE self, VALUE rb_x, VALUE rb_z) {
     NBT_Region_IO * rgn = GetMCRegion(self);
-    if(rgn->ReadChunk(NUM2INT(rb_x), NUM2INT(rb_z)) != 0)
+    int x = NUM2INT(rb_x), z = NUM2INT(rb_z);
+    bool exists;
+    uint32_t timestamp = 0;
+    {
+        RegionLock lock(rgn);
+        if((exists = rgn->ChunkExists(x, z)))
+            timestamp = rgn->ChunkTimestamp(x, z);
+    }
+    return exists? UINT2NUM(timestamp) : Qnil;
+}
+
+// Returns timestamps of all chunks in the region, in TOC order (x + z*32), with nil
+// for chunks that don't exist. Cheaper than 1024 calls to chunk_timestamp().
+static VALUE MCRegion_chunk_timestamps(VALUE self) {
+    NBT_Region_IO * rgn = GetMCRegion(self);
+    uint32_t stamps[1024];
+    bool exists[1024];
+    {
+        RegionLock lock(rgn);
+        for(int j = 0; j < 1024; ++j)
+            if((exists[j] = rgn->ChunkExists(j%32, j/32)))
+                stamps[j] = rgn->ChunkTimestamp(j%32, j/32);
+    }
+    VALUE timestamps = rb_ary_new2(1024);
+    for(int j = 0; j < 1024; ++j)
+        rb_ary_push(timestamps, exists[j]? UINT2NUM(stamps[j]) : Qnil);
+    return timestamps;
+}
+
+// Chunk reads and writes do their file I/O, compression, and parsing with the
+// interpreter lock released, so other Ruby threads can run meanwhile. Only the
+// region's mutex is held while it's in use.
+struct RegionChunkCall {
+    NBT_Region_IO * rgn;
+    int cx, cz;
+    NBT_TagCompound * nbt;
+    std::vector<uint8_t> * data;
+    int status;
+};
+
+static void * ReadChunk_NoGVL(void * data) {
+    RegionChunkCall * call = static_cast<RegionChunkCall *>(data);
+    MutexLock lock(call->rgn->GetMutex());
+    if(call->rgn->ReadChunk(call->cx, call->cz) == 0)
+        call->nbt = LoadNBT_File(*call->rgn);
+    return NULL;
+}
+
+static void * WriteChunk_NoGVL(void * data) {
+    RegionChunkCall * call = static_cast<RegionChunkCall *>(data);
+    std::vector<uint8_t> compData;
+    call->status = CompressRegionChunk(&(*call->data)[0], call->data->size(), compData);
+    if(call->status == 0) {
+        MutexLock lock(call->rgn->GetMutex());
+        call->status = call->rgn->WriteChunkCompressed(call->cx, call->cz, compData);
+    }
+    return NULL;
+}
+
+NBT_TagCompound * ReadRegionChunkNBT(NBT_Region_IO * rgn, int cx, int cz)
+{
+    RegionChunkCall call;
+    call.rgn = rgn;
+    call.cx = cx;
+    call.cz = cz;
+    call.nbt = NULL;
+    rb_thread_call_without_gvl(ReadChunk_NoGVL, &call, NULL, NULL);
+    return call.nbt;
+}
+
+int WriteRegionChunkData(NBT_Region_IO * rgn, int cx, int cz, std::vector<uint8_t> & data)
+{
+    RegionChunkCall call;
+    call.rgn = rgn;
+    call.cx = cx;
+    call.cz = cz;
+    call.data = &data;
+    rb_thread_call_without_gvl(WriteChunk_NoGVL, &call, NULL, NULL);
+    return call.status;
+}
+
+static VALUE MCRegion_read_chunk_nbt(VALUE self, VALUE rb_x, VALUE rb_z) {
+    NBT_TagCompound * nbt = ReadRegionChunkNBT(GetMCRegion(self), NUM2INT(rb_x), NUM2INT(rb_z));
+    if(!nbt)
         return Qnil;
-    
-    // cout << "GetChunkSize(): " << rgn->GetChunkSize() << endl;
-    // cout << "RW_Ptr(): " << rgn->RW_Ptr() << endl;
-    NBT_TagCompound * nbt = LoadNBT_File(*rgn);
-    // cout << "RW_Ptr(): " << rgn->RW_Ptr() << endl;
-    // nbt->Print(cout);
-    VALUE rbnbt = NBT_CompoundToValue(nbt);
-    delete nbt;
-    return rbnbt;
+    return NBT_TreeToValue(nbt);
 }
 
 static VALUE MCRegion_write_chunk_nbt(VALUE self, VALUE rb_x, VALUE rb_z, VALUE rb_nbt) {
-    NBT_Region_IO * rgn = GetMCRegion(self);
-    NBT_Tag * nbt = ValueToNBT(rb_nbt);
-    nbt->Write(*rgn);
-    delete nbt;
-    rgn->WriteChunk(NUM2INT(rb_x), NUM2INT(rb_z));
+    if(WriteRegionChunk(*GetMCRegion(self), NUM2INT(rb_x), NUM2INT(rb_z), rb_nbt) != 0)
+        rb_raise(rb_eIOError, "Could not write chunk");
     return self;
 }
 
 
-static int ComputeLights_CB(VALUE key, VALUE value, VALUE rbchunks) {
-    return ST_CONTINUE;
+// Conversion runs with the interpreter lock released. An interrupt stops it after
+// the regions being converted, then is raised.
+struct ConvertAlphaCall {
+    std::string worldPath;
+    int numThreads;
+    bool overwrite;
+    StopFlag stop;
+    int converted;
+};
+
+static void * ConvertAlpha_NoGVL(void * data) {
+    ConvertAlphaCall * call = static_cast<ConvertAlphaCall *>(data);
+    call->converted = MC_ConvertAlphaWorld(call->worldPath, call->numThreads, call->overwrite, &call->stop);
+    return NULL;
 }
-static VALUE MCWorld_compute_lights(VALUE self) {
-    // Need to iterate over all dirty chunks and recompute lighting values
-    // Lighting changes in a chunk can affect adjacent chunks as well
-    VALUE rbchunks = rb_iv_get(self, "@chunks");
-    rb_hash_foreach(rbchunks, (int (*)(...))ComputeLights_CB, rbchunks);
-    return Qnil;
+
+static void ConvertAlpha_Stop(void * data) {static_cast<ConvertAlphaCall *>(data)->stop.Stop();}
+
+// Magellan.convert_alpha_world(world_dir, num_threads = 0, overwrite = false)
+// Convert an Alpha format world to region files, returns number of chunks converted.
+// Raises if any of the region files already exist, unless overwrite is true.
+static VALUE Magellan_convert_alpha_world(int argc, VALUE * argv, VALUE /*module*/) {
+    VALUE rbpath, rbthreads, rboverwrite;
+    rb_scan_args(argc, argv, "12", &rbpath, &rbthreads, &rboverwrite);
+    ConvertAlphaCall call;
+    call.worldPath = StringValueCStr(rbpath);
+    call.numThreads = NIL_P(rbthreads)? 0 : NUM2INT(rbthreads);
+    call.overwrite = RTEST(rboverwrite);
+    rb_thread_call_without_gvl(ConvertAlpha_NoGVL, &call, ConvertAlpha_Stop, &call);
+    rb_thread_check_ints();
+    if(call.converted < 0)
+        rb_raise(rb_eIOError, "Region files already exist in %s/region", call.worldPath.c_str());
+    return INT2NUM(call.converted);
 }
 
-static int ComputeHeights_CB(VALUE key, VALUE value, VALUE rbchunks)
+
+// String holding the value of a byte array tag in the Level compound of a chunk hash,
+// or Qnil if missing or not of the expected size.
+static VALUE ChunkByteArray(VALUE chunk, VALUE sym, long size)
 {
-    if(rb_hash_aref(value, sym_dirty) == Qfalse)
-        return ST_CONTINUE;
+    VALUE rbnbt = rb_hash_aref(chunk, sym_nbt);
+    if(NIL_P(rbnbt))
+        return Qnil;
+    VALUE rblevel = rb_hash_aref(NBT_Value(rbnbt), sym_Level);
+    if(NIL_P(rblevel))
+        return Qnil;
+    VALUE rbtag = rb_hash_aref(NBT_Value(rblevel), sym);
+    if(NIL_P(rbtag))
+        return Qnil;
+    VALUE rbstr = NBT_Value(rbtag);
+    if(TYPE(rbstr) != T_STRING || RSTRING_LEN(rbstr) != size)
+        return Qnil;
+    return rbstr;
+}
+
+// Heightmap computation for a set of Ruby chunks. The block and heightmap strings are
+// collected while holding the interpreter, and the heightmaps computed in parallel
+// directly on the string contents without touching Ruby.
+struct HeightmapJobs {
+    std::vector<std::pair<const uint8_t *, uint8_t *> > jobs;
     
-    VALUE rbnbt = rb_hash_aref(value, sym_nbt);
-    VALUE rblevel = rb_hash_aref(rb_ivar_get(rbnbt, id_value), sym_Level);
-    VALUE rbblocks = rb_hash_aref(rb_ivar_get(rblevel, id_value), sym_Blocks);
-    VALUE rbheights = rb_hash_aref(rb_ivar_get(rblevel, id_value), sym_HeightMap);
-    VALUE rbblockvals = rb_ivar_get(rbblocks, id_value);
-    VALUE rbheightvals = rb_ivar_get(rbheights, id_value);
+    bool Add(VALUE chunk) {
+        VALUE rbblocks = ChunkByteArray(chunk, sym_Blocks, 16*16*128);
+        VALUE rbheights = ChunkByteArray(chunk, sym_HeightMap, 16*16);
+        if(NIL_P(rbblocks) || NIL_P(rbheights))
+            return false;
+        rb_str_modify(rbheights);
+        jobs.push_back(std::make_pair((const uint8_t *)RSTRING_PTR(rbblocks), (uint8_t *)RSTRING_PTR(rbheights)));
+        return true;
+    }
+    void operator()(size_t j, int /*thread*/) {
+        MC_ComputeHeightmap(jobs[j].second, jobs[j].first);
+    }
+    void Run(int numThreads) {
+        MC_BlockSet::Opaque();
+        ParallelFor(jobs.size(), *this, numThreads);
+    }
+};
+
+// compute_heights_intern(num_threads = 0)
+// Recompute heightmaps of all loaded dirty chunks. Returns number of chunks updated.
+static VALUE MCWorld_compute_heights(int argc, VALUE * argv, VALUE self) {
+    VALUE rbthreads;
+    rb_scan_args(argc, argv, "01", &rbthreads);
     
-    char * blocks = RSTRING_PTR(rbblockvals);
-    char * heightmap = RSTRING_PTR(rbheightvals);
+    HeightmapJobs heightmaps;
+    const MC_ChunkCache::EntryList & entries = GetChunkCache(rb_iv_get(self, "@chunks"))->Entries();
+    for(MC_ChunkCache::EntryList::const_iterator ent = entries.begin(); ent != entries.end(); ++ent)
+        if(RTEST(rb_hash_aref(ent->chunk, sym_dirty)))
+            heightmaps.Add(ent->chunk);
+    heightmaps.Run(NIL_P(rbthreads)? 0 : NUM2INT(rbthreads));
+    return SIZET2NUM(heightmaps.jobs.size());
+}
+
+static void GetChunkCoords(VALUE chunk, int32_t & cx, int32_t & cz)
+{
+    VALUE rbcoords = rb_hash_aref(chunk, sym_coords);
+    cx = NUM2INT(rb_ary_entry(rbcoords, 0));
+    cz = NUM2INT(rb_ary_entry(rbcoords, 1));
+}
+
+// Lighting for a set of Ruby chunks, see MC_LightEngine. Light arrays are unpacked
+// to scratch planes, and relit chunks packed back into their strings afterwards.
+struct LightJobs {
+    struct Job {
+        VALUE chunk;
+        VALUE rbsky, rbblock;
+        std::vector<uint8_t> planes;// skylight, blocklight
+    };
+    std::deque<Job> jobs;// engine holds pointers to planes, so elements can't move
+    MC_LightEngine engine;
     
-    for(int x = 0; x < 16; ++x)
-    for(int z = 0; z < 16; ++z)
+    bool Add(int32_t cx, int32_t cz, VALUE chunk, bool relight) {
+        VALUE rbblocks = ChunkByteArray(chunk, sym_Blocks, 16*16*128);
+        VALUE rbsky = ChunkByteArray(chunk, sym_SkyLight, 16*16*128/2);
+        VALUE rbblock = ChunkByteArray(chunk, sym_BlockLight, 16*16*128/2);
+        VALUE rbheights = ChunkByteArray(chunk, sym_HeightMap, 16*16);
+        if(NIL_P(rbblocks) || NIL_P(rbsky) || NIL_P(rbblock) || NIL_P(rbheights))
+            return false;
+        if(relight) {
+            rb_str_modify(rbsky);
+            rb_str_modify(rbblock);
+            rb_str_modify(rbheights);
+        }
+        jobs.push_back(Job());
+        Job & job = jobs.back();
+        job.chunk = relight? chunk : Qnil;
+        job.rbsky = rbsky;
+        job.rbblock = rbblock;
+        job.planes.resize(2*MC_Chunk::kPlaneSize);
+        uint8_t * sky = &job.planes[0], * block = sky + MC_Chunk::kPlaneSize;
+        UnpackNibbles(sky, (const uint8_t *)RSTRING_PTR(rbsky), MC_Chunk::kPlaneSize);
+        UnpackNibbles(block, (const uint8_t *)RSTRING_PTR(rbblock), MC_Chunk::kPlaneSize);
+        engine.AddChunk(cx, cz, (const uint8_t *)RSTRING_PTR(rbblocks), sky, block,
+                        (uint8_t *)RSTRING_PTR(rbheights), relight);
+        return true;
+    }
+    size_t Run(int numThreads) {
+        size_t numRelit = engine.Run(numThreads);
+        for(size_t j = 0; j < jobs.size(); ++j)
+        {
+            Job & job = jobs[j];
+            if(NIL_P(job.chunk))
+                continue;
+            PackNibbles((uint8_t *)RSTRING_PTR(job.rbsky), &job.planes[0], MC_Chunk::kPlaneSize);
+            PackNibbles((uint8_t *)RSTRING_PTR(job.rbblock), &job.planes[MC_Chunk::kPlaneSize], MC_Chunk::kPlaneSize);
+            rb_hash_aset(job.chunk, sym_dirty, Qtrue);
+        }
+        return numRelit;
+    }
+};
+
+// compute_lights_intern(num_threads = 0, unloaded = nil)
+// Recompute lighting and heightmaps of loaded dirty chunks and the chunks beside
+// them, with chunks one further out contributing light across borders. Chunks beside
+// and around dirty chunks are taken from the chunk cache, or from the array of chunk
+// hashes unloaded, read for the purpose without caching them. Returns number of
+// chunks relit.
+static VALUE MCWorld_compute_lights(int argc, VALUE * argv, VALUE self) {
+    VALUE rbthreads, rbunloaded;
+    rb_scan_args(argc, argv, "02", &rbthreads, &rbunloaded);
+    
+    typedef MC_ChunkCache::ChunkCoords ChunkCoords;
+    std::map<ChunkCoords, VALUE> loaded;
+    std::set<ChunkCoords> relight;
+    const MC_ChunkCache::EntryList & entries = GetChunkCache(rb_iv_get(self, "@chunks"))->Entries();
+    for(MC_ChunkCache::EntryList::const_iterator ent = entries.begin(); ent != entries.end(); ++ent)
+        loaded[ent->coords] = ent->chunk;
+    if(!NIL_P(rbunloaded)) {
+        Check_Type(rbunloaded, T_ARRAY);
+        for(long j = 0; j < RARRAY_LEN(rbunloaded); ++j) {
+            VALUE chunk = rb_ary_entry(rbunloaded, j);
+            ChunkCoords c;
+            GetChunkCoords(chunk, c.first, c.second);
+            loaded.insert(std::make_pair(c, chunk));
+        }
+    }
+    for(MC_ChunkCache::EntryList::const_iterator ent = entries.begin(); ent != entries.end(); ++ent)
     {
-        int y = 127;
-        while(y > 0 && blockdefs[blocks[(x*16 + z)*128 + y]].opacity == 0)
-            --y;
-        
-        heightmap[z*16 + x] = y;
+        if(!RTEST(rb_hash_aref(ent->chunk, sym_dirty)))
+            continue;
+        for(int dx = -1; dx <= 1; ++dx)
+        for(int dz = -1; dz <= 1; ++dz) {
+            ChunkCoords c(ent->coords.first + dx, ent->coords.second + dz);
+            if(loaded.count(c))
+                relight.insert(c);
+        }
+    }
+    
+    LightJobs lights;
+    for(std::set<ChunkCoords>::iterator c = relight.begin(); c != relight.end(); ++c)
+        lights.Add(c->first, c->second, loaded[*c], true);
+    for(std::set<ChunkCoords>::iterator c = relight.begin(); c != relight.end(); ++c)
+    {
+        for(int dx = -1; dx <= 1; ++dx)
+        for(int dz = -1; dz <= 1; ++dz) {
+            ChunkCoords n(c->first + dx, c->second + dz);
+            std::map<ChunkCoords, VALUE>::iterator nbr = loaded.find(n);
+            if(nbr != loaded.end() && !relight.count(n) && !lights.engine.HasChunk(n.first, n.second))
+                lights.Add(n.first, n.second, nbr->second, false);
+        }
+    }
+    return SIZET2NUM(lights.Run(NIL_P(rbthreads)? 0 : NUM2INT(rbthreads)));
+}
+
+// Block edits awaiting update_lights_intern() are kept in a string of records, as
+// Array#pack("l3C2") lays out x, y, z, skylight and blocklight before the edit.
+static const size_t kLightChangeRecordSize = 3*sizeof(int32_t) + 2;
+
+static void AppendLightChange(VALUE rbchanges, const MC_LightChange & change)
+{
+    char rec[kLightChangeRecordSize];
+    memcpy(rec, &change.x, sizeof(int32_t));
+    memcpy(rec + sizeof(int32_t), &change.y, sizeof(int32_t));
+    memcpy(rec + 2*sizeof(int32_t), &change.z, sizeof(int32_t));
+    rec[3*sizeof(int32_t)] = change.skylight;
+    rec[3*sizeof(int32_t) + 1] = change.blocklight;
+    rb_str_cat(rbchanges, rec, kLightChangeRecordSize);
+}
+
+static void ParseLightChanges(VALUE rbchanges, std::vector<MC_LightChange> & changes)
+{
+    const char * recs = RSTRING_PTR(StringValue(rbchanges));
+    size_t numRecs = RSTRING_LEN(rbchanges)/kLightChangeRecordSize;
+    changes.resize(numRecs);
+    for(size_t j = 0; j < numRecs; ++j)
+    {
+        const char * rec = recs + j*kLightChangeRecordSize;
+        MC_LightChange & change = changes[j];
+        memcpy(&change.x, rec, sizeof(int32_t));
+        memcpy(&change.y, rec + sizeof(int32_t), sizeof(int32_t));
+        memcpy(&change.z, rec + 2*sizeof(int32_t), sizeof(int32_t));
+        change.skylight = rec[3*sizeof(int32_t)];
+        change.blocklight = rec[3*sizeof(int32_t) + 1];
+    }
+}
+
+// update_lights_intern(changes, unloaded)
+// Incrementally relight around the block edits recorded in the string changes (see
+// MC_RelightChanges()), in the loaded chunks and the array of chunk hashes unloaded,
+// read for the purpose without caching them. Chunks with changed light are marked
+// dirty. Returns the number of light values set.
+static VALUE MCWorld_update_lights(VALUE self, VALUE rbchanges, VALUE rbunloaded)
+{
+    std::vector<MC_LightChange> changes;
+    ParseLightChanges(rbchanges, changes);
+    Check_Type(rbunloaded, T_ARRAY);
+    
+    typedef MC_ChunkCache::ChunkCoords ChunkCoords;
+    std::map<ChunkCoords, VALUE> loaded;
+    const MC_ChunkCache::EntryList & entries = GetChunkCache(rb_iv_get(self, "@chunks"))->Entries();
+    for(MC_ChunkCache::EntryList::const_iterator ent = entries.begin(); ent != entries.end(); ++ent)
+        loaded[ent->coords] = ent->chunk;
+    for(long j = 0; j < RARRAY_LEN(rbunloaded); ++j) {
+        VALUE chunk = rb_ary_entry(rbunloaded, j);
+        ChunkCoords c;
+        GetChunkCoords(chunk, c.first, c.second);
+        loaded.insert(std::make_pair(c, chunk));
+    }
+    // Light from an edit reaches at most 15 blocks, so no further than the chunks
+    // beside the edited one
+    std::set<ChunkCoords> around;
+    for(size_t j = 0; j < changes.size(); ++j)
+        for(int dx = -1; dx <= 1; ++dx)
+        for(int dz = -1; dz <= 1; ++dz)
+            around.insert(ChunkCoords((changes[j].x >> 4) + dx, (changes[j].z >> 4) + dz));
+    
+    std::deque<MC_LightChunk> lightChunks;
+    std::vector<VALUE> rbchunks;
+    MC_ChunkMap<MC_LightChunk> chunkMap;
+    for(std::set<ChunkCoords>::iterator c = around.begin(); c != around.end(); ++c)
+    {
+        std::map<ChunkCoords, VALUE>::iterator chunk = loaded.find(*c);
+        if(chunk == loaded.end())
+            continue;
+        VALUE rbblocks = ChunkByteArray(chunk->second, sym_Blocks, 16*16*128);
+        VALUE rbsky = ChunkByteArray(chunk->second, sym_SkyLight, 16*16*128/2);
+        VALUE rbblock = ChunkByteArray(chunk->second, sym_BlockLight, 16*16*128/2);
+        VALUE rbheights = ChunkByteArray(chunk->second, sym_HeightMap, 16*16);
+        if(NIL_P(rbblocks) || NIL_P(rbsky) || NIL_P(rbblock) || NIL_P(rbheights))
+            continue;
+        rb_str_modify(rbsky);
+        rb_str_modify(rbblock);
+        rb_str_modify(rbheights);
+        lightChunks.push_back(MC_LightChunk((const uint8_t *)RSTRING_PTR(rbblocks), (uint8_t *)RSTRING_PTR(rbsky),
+                                           (uint8_t *)RSTRING_PTR(rbblock), (uint8_t *)RSTRING_PTR(rbheights)));
+        rbchunks.push_back(chunk->second);
+        chunkMap.Add(c->first, c->second, &lightChunks.back());
+    }
+    size_t numSet = MC_RelightChanges<MC_ChunkMap<MC_LightChunk>, MC_LightChunk>(chunkMap, changes);
+    for(size_t j = 0; j < lightChunks.size(); ++j)
+        if(lightChunks[j].IsDirty())
+            rb_hash_aset(rbchunks[j], sym_dirty, Qtrue);
+    return SIZET2NUM(numSet);
+}
+
+// Block search over a mix of loaded chunks, searched in place, and chunks read from
+// region files. Compressed data is read up front, then chunks are inflated, parsed
+// and searched in parallel without touching Ruby.
+struct FindBlocksJobs {
+    struct Job {
+        int32_t cx, cz;
+        const uint8_t * blocks;
+        const uint8_t * data;
+        std::vector<uint8_t> compData;// if read from a region
+        std::vector<int32_t> found;
+    };
+    MC_BlockQuery query;
+    bool withTypes;// output x, y, z, type
+    std::deque<Job> jobs;
+    
+    FindBlocksJobs(): withTypes(false) {}
+    
+    void AddLoaded(VALUE chunk) {
+        VALUE rbblocks = ChunkByteArray(chunk, sym_Blocks, 16*16*128);
+        VALUE rbdata = ChunkByteArray(chunk, sym_Data, 16*16*128/2);
+        VALUE rbcoords = rb_hash_aref(chunk, sym_coords);
+        if(NIL_P(rbblocks) || NIL_P(rbdata) || NIL_P(rbcoords))
+            rb_raise(rb_eArgError, "Chunk has no valid Blocks and Data");
+        jobs.push_back(Job());
+        Job & job = jobs.back();
+        job.cx = NUM2INT(rb_ary_entry(rbcoords, 0));
+        job.cz = NUM2INT(rb_ary_entry(rbcoords, 1));
+        job.blocks = (const uint8_t *)RSTRING_PTR(rbblocks);
+        job.data = (const uint8_t *)RSTRING_PTR(rbdata);
+    }
+    void AddStored(NBT_Region_IO * rgn, int rx, int rz) {
+        jobs.push_back(Job());
+        Job & job = jobs.back();
+        job.blocks = job.data = NULL;
+        RegionLock lock(rgn);
+        if(rgn->ReadChunkCompressed(rx, rz, job.compData) != 0)
+            jobs.pop_back();
+    }
+    
+    void Search(Job & job, int32_t cx, int32_t cz, const uint8_t * blocks, const uint8_t * data) {
+        MC_FindBlocks(query, cx, cz, blocks, data, job.found);
+        if(!withTypes)
+            return;
+        std::vector<int32_t> triples;
+        triples.swap(job.found);
+        job.found.reserve(triples.size()/3*4);
+        for(size_t k = 0; k < triples.size(); k += 3) {
+            job.found.insert(job.found.end(), &triples[k], &triples[k] + 3);
+            job.found.push_back(blocks[MC_Chunk::GetIdx(triples[k] & 15, triples[k + 1], triples[k + 2] & 15)]);
+        }
+    }
+    
+    void operator()(size_t j, int /*thread*/) {
+        Job & job = jobs[j];
+        if(job.blocks) {
+            Search(job, job.cx, job.cz, job.blocks, job.data);
+            return;
+        }
+        std::vector<uint8_t> nbtData;
+        if(InflateRegionChunk(job.compData, nbtData) != 0)
+            return;
+        std::vector<uint8_t>().swap(job.compData);
+        NBT_Buffer_I fin(&nbtData[0], nbtData.size());
+        NBT_TagCompound * nbt = LoadNBT_File(fin);
+        NBT_TagCompound * level = nbt? nbt->GetTag<NBT_TagCompound>("Level", NULL) : NULL;
+        NBT_TagByteArray * blocks = level? level->GetTag<NBT_TagByteArray>("Blocks", NULL) : NULL;
+        NBT_TagByteArray * data = level? level->GetTag<NBT_TagByteArray>("Data", NULL) : NULL;
+        NBT_TagInt * xPos = level? level->GetTag<NBT_TagInt>("xPos", NULL) : NULL;
+        NBT_TagInt * zPos = level? level->GetTag<NBT_TagInt>("zPos", NULL) : NULL;
+        if(!fin.overrun && blocks && data && xPos && zPos &&
+           blocks->value.size() == 16*16*128 && data->value.size() == 16*16*128/2)
+            Search(job, xPos->value, zPos->value, &blocks->value[0], &data->value[0]);
+        delete nbt;
+    }
+};
+
+// find_blocks_intern(types, data_mask, box, chunks, num_threads, with_types = false)
+// types is a 32 byte block type set as from Magellan.block_types_present(), data_mask
+// an integer with bit d set for each data value d accepted, box nil or
+// [x0, y0, z0, x1, y1, z1], and chunks an array of loaded chunk hashes and
+// [region, region_chunk_x, region_chunk_z] arrays for chunks to read. Returns a string
+// of native int32 x, y, z triples, or x, y, z, type if with_types, chunks in the order
+// given.
+static VALUE MCWorld_find_blocks(int argc, VALUE * argv, VALUE /*self*/) {
+    VALUE rbtypes, rbmask, rbbox, rbchunks, rbthreads, rbwithtypes;
+    rb_scan_args(argc, argv, "51", &rbtypes, &rbmask, &rbbox, &rbchunks, &rbthreads, &rbwithtypes);
+    FindBlocksJobs search;
+    search.withTypes = RTEST(rbwithtypes);
+    StringValue(rbtypes);
+    if(RSTRING_LEN(rbtypes) != 32)
+        rb_raise(rb_eArgError, "Block type set must be 32 bytes");
+    for(int t = 0; t < 256; ++t)
+        if((RSTRING_PTR(rbtypes)[t >> 3] >> (t & 7)) & 1)
+            search.query.types.Insert(t);
+    search.query.dataMask = NUM2UINT(rbmask) & 0xFFFF;
+    if(!NIL_P(rbbox)) {
+        Check_Type(rbbox, T_ARRAY);
+        if(RARRAY_LEN(rbbox) != 6)
+            rb_raise(rb_eArgError, "Box must be [x0, y0, z0, x1, y1, z1]");
+        search.query.SetBox(NUM2INT(rb_ary_entry(rbbox, 0)), NUM2INT(rb_ary_entry(rbbox, 1)),
+                            NUM2INT(rb_ary_entry(rbbox, 2)), NUM2INT(rb_ary_entry(rbbox, 3)),
+                            NUM2INT(rb_ary_entry(rbbox, 4)), NUM2INT(rb_ary_entry(rbbox, 5)));
+    }
+    
+    Check_Type(rbchunks, T_ARRAY);
+    for(long j = 0; j < RARRAY_LEN(rbchunks); ++j)
+    {
+        VALUE entry = rb_ary_entry(rbchunks, j);
+        if(TYPE(entry) == T_HASH)
+            search.AddLoaded(entry);
+        else
+            search.AddStored(GetMCRegion(rb_ary_entry(entry, 0)),
+                             NUM2INT(rb_ary_entry(entry, 1)), NUM2INT(rb_ary_entry(entry, 2)));
+    }
+    
+    ParallelFor(search.jobs.size(), search, NUM2INT(rbthreads));
+    
+    size_t numFound = 0;
+    for(size_t j = 0; j < search.jobs.size(); ++j)
+        numFound += search.jobs[j].found.size();
+    VALUE rbfound = rb_str_new(NULL, numFound*sizeof(int32_t));
+    char * dst = RSTRING_PTR(rbfound);
+    for(size_t j = 0; j < search.jobs.size(); ++j)
+    {
+        const std::vector<int32_t> & found = search.jobs[j].found;
+        if(!found.empty())
+            memcpy(dst, &found[0], found.size()*sizeof(int32_t));
+        dst += found.size()*sizeof(int32_t);
+    }
+    return rbfound;
+}
+
+struct EachChunkState {
+    MC_ChunkStream stream;
+    std::vector<VALUE> regions;
+    VALUE loaded;
+};
+
+struct ChunkStreamNextCall {
+    MC_ChunkStream * stream;
+    MC_ChunkStream::Chunk * chunk;
+    bool more;
+};
+
+static void * ChunkStreamNext_NoGVL(void * data) {
+    ChunkStreamNextCall * call = static_cast<ChunkStreamNextCall *>(data);
+    call->more = call->stream->Next(*call->chunk);
+    return NULL;
+}
+
+// Interrupts a wait in Next(), so the thread can be signalled or killed
+static void ChunkStreamNext_Unblock(void * stream) {
+    static_cast<MC_ChunkStream *>(stream)->Stop();
+}
+
+// Next chunk from the stream, waiting for it without holding the interpreter
+static bool ChunkStreamNext(MC_ChunkStream & stream, MC_ChunkStream::Chunk & chunk) {
+    ChunkStreamNextCall call;
+    call.stream = &stream;
+    call.chunk = &chunk;
+    call.more = false;
+    rb_thread_call_without_gvl(ChunkStreamNext_NoGVL, &call, ChunkStreamNext_Unblock, &stream);
+    return call.more;
+}
+
+static VALUE EachChunk_Yield(VALUE arg) {
+    EachChunkState & state = *(EachChunkState *)arg;
+    MC_ChunkCache * loaded = NIL_P(state.loaded)? NULL : GetChunkCache(state.loaded);
+    MC_ChunkStream::Chunk chunk;
+    while(ChunkStreamNext(state.stream, chunk))
+    {
+        VALUE region = state.regions[chunk.region];
+        VALUE rbnbt = Qnil;
+        // Loaded chunks, and chunks that may have been written since being read, are
+        // left to the caller to get from where they are current.
+        if(chunk.nbt && GetMCRegion(region)->WriteCount() == chunk.writeCount &&
+           !(loaded && loaded->Contains(MC_ChunkCache::ChunkCoords(chunk.cx, chunk.cz))))
+            rbnbt = NBT_TreeToValue(chunk.nbt);
+        else
+            delete chunk.nbt;
+        rb_yield_values(3, rb_assoc_new(INT2NUM(chunk.cx), INT2NUM(chunk.cz)), region, rbnbt);
     }
+    return Qnil;
+}
+
+// Frees the state, its stream stopping its threads and dropping chunks not taken
+static VALUE EachChunk_Stop(VALUE arg) {
+    delete (EachChunkState *)arg;
+    return Qnil;
+}
+
+// each_chunk_intern(regions, loaded, depth, num_threads)
+// Yields coords, region, nbt for each chunk of regions, an array of [coords, region]
+// pairs as from MC_World#all_regions.to_a, in region order and x then z order within
+// each. Chunks are read ahead, up to depth at once, and parsed on num_threads threads.
+// nbt is nil for chunks held in loaded (a MCChunkCache or nil), chunks that may have
+// been written since the stream started, and unreadable chunks: get those with
+// get_chunk().
+static VALUE MCWorld_each_chunk(VALUE self, VALUE rbregions, VALUE rbloaded, VALUE rbdepth, VALUE rbthreads) {
+    // Check arguments before allocating anything a raise would leak
+    Check_Type(rbregions, T_ARRAY);
+    for(long r = 0; r < RARRAY_LEN(rbregions); ++r)
+    {
+        VALUE pair = rb_ary_entry(rbregions, r);
+        VALUE coords = rb_ary_entry(pair, 0);
+        GetMCRegion(rb_ary_entry(pair, 1));
+        NUM2INT(rb_ary_entry(coords, 0));
+        NUM2INT(rb_ary_entry(coords, 1));
+    }
+    if(!NIL_P(rbloaded))
+        GetChunkCache(rbloaded);
+    size_t depth = NUM2SIZET(rbdepth);
+    int numThreads = NUM2INT(rbthreads);
     
-    return ST_CONTINUE;
+    EachChunkState * state = new EachChunkState;
+    state->loaded = rbloaded;
+    for(long r = 0; r < RARRAY_LEN(rbregions); ++r)
+    {
+        VALUE pair = rb_ary_entry(rbregions, r);
+        VALUE coords = rb_ary_entry(pair, 0);
+        state->regions.push_back(rb_ary_entry(pair, 1));
+        NBT_Region_IO * rgn = GetMCRegion(state->regions.back());
+        int32_t rx = NUM2INT(rb_ary_entry(coords, 0)), rz = NUM2INT(rb_ary_entry(coords, 1));
+        RegionLock lock(rgn);
+        state->stream.AddRegion(*rgn, rx, rz);
+    }
+    state->stream.Start(depth, numThreads);
+    // Free the state and stop the stream's threads however the block exits
+    rb_ensure(EachChunk_Yield, (VALUE)state, EachChunk_Stop, (VALUE)state);
+    return self;
 }
-static VALUE MCWorld_compute_heights(VALUE self) {
-    // Need to iterate over all dirty chunks and recompute heightmap values
-    // This can be done on a chunk-by-chunk basis and only affects dirty chunks
-    VALUE rbchunks = rb_iv_get(self, "@chunks");
-    rb_hash_foreach(rbchunks, (int (*)(...))ComputeHeights_CB, rbchunks);
+
+// Box of blocks in world coordinates, with buffers covering it indexed
+// ((x - x0)*zSize + (z - z0))*ySize + (y - y0), the same order as chunk data, so each
+// column of the box is a contiguous run in both.
+struct BlockBox {
+    int32_t x0, y0, z0, x1, y1, z1;
+    size_t xSize, ySize, zSize;
+    
+    BlockBox(VALUE rbbox) {
+        Check_Type(rbbox, T_ARRAY);
+        if(RARRAY_LEN(rbbox) != 6)
+            rb_raise(rb_eArgError, "Box must be [x0, y0, z0, x1, y1, z1]");
+        x0 = NUM2INT(rb_ary_entry(rbbox, 0)); y0 = NUM2INT(rb_ary_entry(rbbox, 1)); z0 = NUM2INT(rb_ary_entry(rbbox, 2));
+        x1 = NUM2INT(rb_ary_entry(rbbox, 3)); y1 = NUM2INT(rb_ary_entry(rbbox, 4)); z1 = NUM2INT(rb_ary_entry(rbbox, 5));
+        if(x0 > x1) std::swap(x0, x1);
+        if(y0 > y1) std::swap(y0, y1);
+        if(z0 > z1) std::swap(z0, z1);
+        xSize = x1 - x0 + 1; ySize = y1 - y0 + 1; zSize = z1 - z0 + 1;
+    }
+    size_t Volume() const {return xSize*ySize*zSize;}
+    
+    // Calls op(idx, n, bufIdx) for each column run of the box within chunk cx, cz and
+    // the chunk height range.
+    template<typename Op>
+    void ForEachRun(int32_t cx, int32_t cz, Op & op) const {
+        int32_t yFirst = max(y0, 0), yLast = min(y1, 127);
+        int32_t xStart = max(x0, cx*16), xEnd = min(x1, cx*16 + 15);
+        int32_t zStart = max(z0, cz*16), zEnd = min(z1, cz*16 + 15);
+        if(yFirst > yLast)
+            return;
+        for(int32_t x = xStart; x <= xEnd; ++x)
+        for(int32_t z = zStart; z <= zEnd; ++z)
+            op((size_t)MC_Chunk::GetIdx(x & 15, yFirst, z & 15), (size_t)(yLast - yFirst + 1),
+               ((x - x0)*zSize + (z - z0))*ySize + (yFirst - y0));
+    }
+};
+
+// Planes of a box read or written by read_box_intern() and write_box_intern(): the
+// chunk strings they come from and one byte per block buffers
+struct BoxPlanes {
+    std::vector<VALUE> tags;// Level tag symbols
+    std::vector<uint8_t *> bufs;
+    
+    BoxPlanes(VALUE rbplanes) {
+        Check_Type(rbplanes, T_ARRAY);
+        for(long j = 0; j < RARRAY_LEN(rbplanes); ++j)
+        {
+            VALUE plane = rb_ary_entry(rbplanes, j);
+            if(plane == sym_type) tags.push_back(sym_Blocks);
+            else if(plane == sym_data) tags.push_back(sym_Data);
+            else if(plane == sym_skylight) tags.push_back(sym_SkyLight);
+            else if(plane == sym_blocklight) tags.push_back(sym_BlockLight);
+            else
+                rb_raise(rb_eArgError, "Unknown plane %s", RSTRING_PTR(rb_inspect(plane)));
+        }
+    }
+    static bool IsNibbles(VALUE tag) {return tag != sym_Blocks;}
+    // Chunk string holding plane j, Qnil if the chunk doesn't have it
+    VALUE ChunkPlane(VALUE chunk, size_t j) const {
+        return ChunkByteArray(chunk, tags[j], IsNibbles(tags[j])? 16*16*128/2 : 16*16*128);
+    }
+};
+
+struct ReadRunOp {
+    const uint8_t * src;
+    uint8_t * dst;
+    bool nibbles;
+    void operator()(size_t idx, size_t n, size_t bufIdx) {
+        uint8_t * out = dst + bufIdx;
+        if(!nibbles) {
+            memcpy(out, src + idx, n);
+            return;
+        }
+        // Runs can start or end halfway through a byte
+        if(idx & 0x01) {
+            *out++ = src[idx >> 1] >> 4;
+            ++idx; --n;
+        }
+        UnpackNibbles(out, src + (idx >> 1), n & ~(size_t)1);
+        if(n & 0x01)
+            out[n - 1] = src[(idx + n - 1) >> 1] & 0x0F;
+    }
+};
+
+// Records the blocks of a run whose type src changes, for update_lights_intern()
+struct RecordRunOp {
+    const uint8_t * src;
+    const uint8_t * types;
+    const uint8_t * skylight;
+    const uint8_t * blocklight;
+    int32_t cx, cz;
+    VALUE rbchanges;
+    void operator()(size_t idx, size_t n, size_t bufIdx) {
+        for(size_t j = 0; j < n; ++j)
+        {
+            size_t b = idx + j;
+            if(src[bufIdx + j] == types[b])
+                continue;
+            MC_LightChange change = {cx*16 + (int32_t)(b >> 11), (int32_t)(b & 127), cz*16 + (int32_t)((b >> 7) & 15),
+                                     (uint8_t)((skylight[b >> 1] >> 4*(b & 1)) & 0x0F),
+                                     (uint8_t)((blocklight[b >> 1] >> 4*(b & 1)) & 0x0F)};
+            AppendLightChange(rbchanges, change);
+        }
+    }
+};
+
+struct WriteRunOp {
+    const uint8_t * src;
+    uint8_t * dst;
+    bool nibbles;
+    size_t count;
+    void operator()(size_t idx, size_t n, size_t bufIdx) {
+        const uint8_t * in = src + bufIdx;
+        count += n;
+        if(!nibbles) {
+            memcpy(dst + idx, in, n);
+            return;
+        }
+        if(idx & 0x01) {
+            dst[idx >> 1] = (*in++ << 4) | (dst[idx >> 1] & 0x0F);
+            ++idx; --n;
+        }
+        PackNibbles(dst + (idx >> 1), in, n & ~(size_t)1);
+        if(n & 0x01) {
+            size_t last = idx + n - 1;
+            dst[last >> 1] = (dst[last >> 1] & 0xF0) | (in[n - 1] & 0x0F);
+        }
+    }
+};
+
+// read_box_intern(box, chunks, planes)
+// Read planes of box [x0, y0, z0, x1, y1, z1] from the given chunk hashes, returning
+// a string of one byte per block for each plane. Blocks outside the chunks read as 0.
+static VALUE MCWorld_read_box(VALUE /*self*/, VALUE rbbox, VALUE rbchunks, VALUE rbplanes)
+{
+    BlockBox box(rbbox);
+    BoxPlanes planes(rbplanes);
+    Check_Type(rbchunks, T_ARRAY);
+    VALUE rbbufs = rb_ary_new2(planes.tags.size());
+    for(size_t j = 0; j < planes.tags.size(); ++j) {
+        VALUE rbbuf = rb_str_new(NULL, box.Volume());
+        memset(RSTRING_PTR(rbbuf), 0, box.Volume());
+        rb_ary_push(rbbufs, rbbuf);
+    }
+    for(long c = 0; c < RARRAY_LEN(rbchunks); ++c)
+    {
+        VALUE chunk = rb_ary_entry(rbchunks, c);
+        int32_t cx, cz;
+        GetChunkCoords(chunk, cx, cz);
+        for(size_t j = 0; j < planes.tags.size(); ++j)
+        {
+            VALUE rbsrc = planes.ChunkPlane(chunk, j);
+            if(NIL_P(rbsrc))
+                continue;
+            ReadRunOp op;
+            op.src = (const uint8_t *)RSTRING_PTR(rbsrc);
+            op.dst = (uint8_t *)RSTRING_PTR(rb_ary_entry(rbbufs, j));
+            op.nibbles = BoxPlanes::IsNibbles(planes.tags[j]);
+            box.ForEachRun(cx, cz, op);
+        }
+    }
+    return rbbufs;
+}
+
+// write_box_intern(box, chunks, planes, bufs, changes = nil)
+// Scatter strings laid out as returned by read_box_intern() back into the given chunk
+// hashes, marking them dirty. Blocks whose type changes are appended to the string
+// changes if given, for update_lights_intern(). Returns the number of blocks written
+// in the first plane.
+static VALUE MCWorld_write_box(int argc, VALUE * argv, VALUE /*self*/)
+{
+    VALUE rbbox, rbchunks, rbplanes, rbbufs, rbchanges;
+    rb_scan_args(argc, argv, "41", &rbbox, &rbchunks, &rbplanes, &rbbufs, &rbchanges);
+    if(!NIL_P(rbchanges))
+        StringValue(rbchanges);
+    BlockBox box(rbbox);
+    BoxPlanes planes(rbplanes);
+    Check_Type(rbchunks, T_ARRAY);
+    Check_Type(rbbufs, T_ARRAY);
+    if((size_t)RARRAY_LEN(rbbufs) != planes.tags.size())
+        rb_raise(rb_eArgError, "Expected one buffer for each plane");
+    for(size_t j = 0; j < planes.tags.size(); ++j) {
+        VALUE rbbuf = rb_ary_entry(rbbufs, j);
+        if((size_t)RSTRING_LEN(StringValue(rbbuf)) != box.Volume())
+            rb_raise(rb_eArgError, "Buffer size doesn't match box");
+    }
+    size_t count = 0;
+    for(long c = 0; c < RARRAY_LEN(rbchunks); ++c)
+    {
+        VALUE chunk = rb_ary_entry(rbchunks, c);
+        int32_t cx, cz;
+        GetChunkCoords(chunk, cx, cz);
+        bool written = false;
+        for(size_t j = 0; j < planes.tags.size(); ++j)
+        {
+            VALUE rbdst = planes.ChunkPlane(chunk, j);
+            if(NIL_P(rbdst))
+                continue;
+            rb_str_modify(rbdst);
+            if(!NIL_P(rbchanges) && planes.tags[j] == sym_Blocks) {
+                VALUE rbsky = ChunkByteArray(chunk, sym_SkyLight, 16*16*128/2);
+                VALUE rbblock = ChunkByteArray(chunk, sym_BlockLight, 16*16*128/2);
+                if(!NIL_P(rbsky) && !NIL_P(rbblock)) {
+                    RecordRunOp rec;
+                    rec.src = (const uint8_t *)RSTRING_PTR(rb_ary_entry(rbbufs, j));
+                    rec.types = (const uint8_t *)RSTRING_PTR(rbdst);
+                    rec.skylight = (const uint8_t *)RSTRING_PTR(rbsky);
+                    rec.blocklight = (const uint8_t *)RSTRING_PTR(rbblock);
+                    rec.cx = cx;
+                    rec.cz = cz;
+                    rec.rbchanges = rbchanges;
+                    box.ForEachRun(cx, cz, rec);
+                }
+            }
+            WriteRunOp op;
+            op.src = (const uint8_t *)RSTRING_PTR(rb_ary_entry(rbbufs, j));
+            op.dst = (uint8_t *)RSTRING_PTR(rbdst);
+            op.nibbles = BoxPlanes::IsNibbles(planes.tags[j]);
+            op.count = 0;
+            box.ForEachRun(cx, cz, op);
+            if(j == 0)
+                count += op.count;
+            written = written || op.count;
+        }
+        if(written)
+            rb_hash_aset(chunk, sym_dirty, Qtrue);
+    }
+    return SIZET2NUM(count);
+}
+
+// Magellan.compute_heightmap(chunk)
+// Recompute heightmap of a single chunk hash.
+static VALUE Magellan_compute_heightmap(VALUE /*module*/, VALUE chunk) {
+    HeightmapJobs heightmaps;
+    if(!heightmaps.Add(chunk))
+        rb_raise(rb_eArgError, "Chunk has no valid Blocks and HeightMap");
+    heightmaps.Run(1);
+    return chunk;
+}
+
+// Magellan.block_types_present(blocks)
+// Set of block types in a string of block IDs, as a 32 byte string with bit
+// (type & 7) of byte (type >> 3) set for each type present.
+static VALUE Magellan_block_types_present(VALUE /*module*/, VALUE rbblocks) {
+    StringValue(rbblocks);
+    MC_BlockSet types = MC_BlockTypesPresent((const uint8_t *)RSTRING_PTR(rbblocks), RSTRING_LEN(rbblocks));
+    char bytes[32];
+    for(int j = 0; j < 32; ++j)
+        bytes[j] = (types.bits[j >> 3] >> ((j & 7)*8)) & 0xFF;
+    return rb_str_new(bytes, 32);
+}
+
+static const char * kNibblesImplNames[3] = {"scalar", "sse2", "avx2"};
+
+// Implementation named by a symbol, or the default if nil
+static int NibblesImplArg(VALUE rbimpl)
+{
+    if(NIL_P(rbimpl))
+        return -1;
+    for(int j = 0; j < 3; ++j)
+        if(SYM2ID(rbimpl) == rb_intern(kNibblesImplNames[j])) {
+            if(!NibblesImplAvailable(j))
+                rb_raise(rb_eArgError, "Nibbles implementation %s not available", kNibblesImplNames[j]);
+            return j;
+        }
+    rb_raise(rb_eArgError, "Unknown nibbles implementation %s", RSTRING_PTR(rb_inspect(rbimpl)));
+    return -1;
+}
+
+// Magellan.nibbles_impls
+// Implementations of the nibble kernels (see nibbles.h) usable here, of :scalar, :sse2
+// and :avx2, for testing them against each other.
+static VALUE Magellan_nibbles_impls(VALUE /*module*/) {
+    VALUE impls = rb_ary_new();
+    for(int j = 0; j < 3; ++j)
+        if(NibblesImplAvailable(j))
+            rb_ary_push(impls, ID2SYM(rb_intern(kNibblesImplNames[j])));
+    return impls;
+}
+
+// Magellan.unpack_nibbles(packed, n, impl = nil)
+// First n nibbles of a string, a byte each.
+static VALUE Magellan_unpack_nibbles(int argc, VALUE * argv, VALUE /*module*/)
+{
+    VALUE rbsrc, rbn, rbimpl;
+    rb_scan_args(argc, argv, "21", &rbsrc, &rbn, &rbimpl);
+    StringValue(rbsrc);
+    size_t n = NUM2SIZET(rbn);
+    int impl = NibblesImplArg(rbimpl);
+    if((n + 1)/2 > (size_t)RSTRING_LEN(rbsrc))
+        rb_raise(rb_eArgError, "String too short for %lu nibbles", (unsigned long)n);
+    VALUE rbdst = rb_str_new(NULL, n);
+    uint8_t * dst = (uint8_t *)RSTRING_PTR(rbdst);
+    const uint8_t * src = (const uint8_t *)RSTRING_PTR(rbsrc);
+    if(impl < 0)
+        UnpackNibbles(dst, src, n);
+    else
+        UnpackNibbles(dst, src, n, impl);
+    return rbdst;
+}
+
+// Magellan.pack_nibbles(bytes, impl = nil)
+// Low 4 bits of each byte of a string of even length, packed two to a byte.
+static VALUE Magellan_pack_nibbles(int argc, VALUE * argv, VALUE /*module*/)
+{
+    VALUE rbsrc, rbimpl;
+    rb_scan_args(argc, argv, "11", &rbsrc, &rbimpl);
+    StringValue(rbsrc);
+    size_t n = RSTRING_LEN(rbsrc);
+    int impl = NibblesImplArg(rbimpl);
+    if(n & 1)
+        rb_raise(rb_eArgError, "Odd number of nibbles");
+    VALUE rbdst = rb_str_new(NULL, n/2);
+    uint8_t * dst = (uint8_t *)RSTRING_PTR(rbdst);
+    const uint8_t * src = (const uint8_t *)RSTRING_PTR(rbsrc);
+    if(impl < 0)
+        PackNibbles(dst, src, n);
+    else
+        PackNibbles(dst, src, n, impl);
+    return rbdst;
+}
+
+// Magellan.copy_where_nonzero(dst, src, key, impl = nil)
+// Copy of dst with the bytes of src where key is nonzero. Strings must be the same length.
+static VALUE Magellan_copy_where_nonzero(int argc, VALUE * argv, VALUE /*module*/)
+{
+    VALUE rbdst, rbsrc, rbkey, rbimpl;
+    rb_scan_args(argc, argv, "31", &rbdst, &rbsrc, &rbkey, &rbimpl);
+    StringValue(rbdst);
+    StringValue(rbsrc);
+    StringValue(rbkey);
+    size_t n = RSTRING_LEN(rbdst);
+    int impl = NibblesImplArg(rbimpl);
+    if((size_t)RSTRING_LEN(rbsrc) != n || (size_t)RSTRING_LEN(rbkey) != n)
+        rb_raise(rb_eArgError, "Strings differ in length");
+    VALUE rbout = rb_str_new(RSTRING_PTR(rbdst), n);
+    uint8_t * dst = (uint8_t *)RSTRING_PTR(rbout);
+    const uint8_t * src = (const uint8_t *)RSTRING_PTR(rbsrc), * key = (const uint8_t *)RSTRING_PTR(rbkey);
+    if(impl < 0)
+        CopyWhereNonzero(dst, src, key, n);
+    else
+        CopyWhereNonzero(dst, src, key, n, impl);
+    return rbout;
+}
+
+// Magellan.load_textures(path = MCPATH + "/magellan/terrain.png")
+// Load the block textures maps are rendered with at scales above 1. Textures are shared
+// by every world, thread and Ractor, so load them before rendering starts.
+static VALUE Magellan_load_textures(int argc, VALUE * argv, VALUE /*module*/)
+{
+    VALUE rbpath;
+    rb_scan_args(argc, argv, "01", &rbpath);
+    string path = NIL_P(rbpath)? MCPath() + "/magellan/terrain.png" : StringValueCStr(rbpath);
+    if(!LoadTextures(path))
+        rb_raise(rb_eIOError, "Could not read textures from %s", path.c_str());
     return Qnil;
 }
 
 
 extern "C" void Init_magellan()
 {
-    id_value = rb_intern("value");
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    // No mutable globals are shared between Ractors: world state lives in instances,
+    // cached symbols and classes are immutable, and the region file pool is locked.
+    rb_ext_ractor_safe(true);
+#endif // HAVE_RB_EXT_RACTOR_SAFE
+
     sym_dirty = ID2SYM(rb_intern("dirty"));
     sym_nbt = ID2SYM(rb_intern("nbt"));
     sym_Level = ID2SYM(rb_intern("Level"));
@@ -217,52 +1210,119 @@ extern "C" void Init_magellan()
     sym_SkyLight = ID2SYM(rb_intern("SkyLight"));
     sym_BlockLight = ID2SYM(rb_intern("BlockLight"));
     sym_HeightMap = ID2SYM(rb_intern("HeightMap"));
+    sym_coords = ID2SYM(rb_intern("coords"));
+    sym_type = ID2SYM(rb_intern("type"));
+    sym_data = ID2SYM(rb_intern("data"));
+    sym_skylight = ID2SYM(rb_intern("skylight"));
+    sym_blocklight = ID2SYM(rb_intern("blocklight"));
     
     VALUE mMGLN = rb_define_module("Magellan");
     Init_nbt();
-    rb_define_const(mMGLN, "MCPATH", rb_str_new2(MCPath().c_str()));
+    Init_chunkcache();
+    Init_entityindex();
+    Init_mcchunk();
+    Init_mcblockworld();
+    rb_define_const(mMGLN, "MCPATH", rb_obj_freeze(rb_str_new2(MCPath().c_str())));
+    rb_define_module_function(mMGLN, "convert_alpha_world", RUBY_METHOD_FUNC(Magellan_convert_alpha_world), -1);
+    rb_define_module_function(mMGLN, "compute_heightmap", RUBY_METHOD_FUNC(Magellan_compute_heightmap), 1);
+    rb_define_module_function(mMGLN, "block_types_present", RUBY_METHOD_FUNC(Magellan_block_types_present), 1);
+    rb_define_module_function(mMGLN, "nibbles_impls", RUBY_METHOD_FUNC(Magellan_nibbles_impls), 0);
+    rb_define_module_function(mMGLN, "unpack_nibbles", RUBY_METHOD_FUNC(Magellan_unpack_nibbles), -1);
+    rb_define_module_function(mMGLN, "pack_nibbles", RUBY_METHOD_FUNC(Magellan_pack_nibbles), -1);
+    rb_define_module_function(mMGLN, "copy_where_nonzero", RUBY_METHOD_FUNC(Magellan_copy_where_nonzero), -1);
+    rb_define_module_function(mMGLN, "load_textures", RUBY_METHOD_FUNC(Magellan_load_textures), -1);
     
     class_MCRegion = rb_define_class("MCRegion", rb_cObject);
     
     rb_define_alloc_func(class_MCRegion, MCRegion_allocate);
     rb_define_method(class_MCRegion, "initialize", RUBY_METHOD_FUNC(MCRegion_init), -1);
     rb_define_method(class_MCRegion, "open", RUBY_METHOD_FUNC(MCRegion_open), 1);
+    rb_define_method(class_MCRegion, "close", RUBY_METHOD_FUNC(MCRegion_close), 0);
+    rb_define_method(class_MCRegion, "file_open?", RUBY_METHOD_FUNC(MCRegion_file_open), 0);
+    rb_define_singleton_method(class_MCRegion, "max_open_files", RUBY_METHOD_FUNC(MCRegion_max_open_files), 0);
+    rb_define_singleton_method(class_MCRegion, "max_open_files=", RUBY_METHOD_FUNC(MCRegion_set_max_open_files), 1);
+    rb_define_singleton_method(class_MCRegion, "open_files", RUBY_METHOD_FUNC(MCRegion_open_files), 0);
     rb_define_method(class_MCRegion, "printstats", RUBY_METHOD_FUNC(MCRegion_stats), 0);
     
     rb_define_method(class_MCRegion, "chunk_exists", RUBY_METHOD_FUNC(MCRegion_chunk_exists), 2);
     rb_define_method(class_MCRegion, "chunk_start", RUBY_METHOD_FUNC(MCRegion_chunk_exists), 2);
     rb_define_method(class_MCRegion, "chunk_size", RUBY_METHOD_FUNC(MCRegion_chunk_exists), 2);
+    rb_define_method(class_MCRegion, "chunk_timestamp", RUBY_METHOD_FUNC(MCRegion_chunk_timestamp), 2);
+    rb_define_method(class_MCRegion, "chunk_timestamps", RUBY_METHOD_FUNC(MCRegion_chunk_timestamps), 0);
     rb_define_method(class_MCRegion, "read_chunk_nbt", RUBY_METHOD_FUNC(MCRegion_read_chunk_nbt), 2);
-    rb_define_method(class_MCRegion, "write_chunk_nbt", RUBY_METHOD_FUNC(MCRegion_write_chunk_nbt), 2);
+    rb_define_method(class_MCRegion, "write_chunk_nbt", RUBY_METHOD_FUNC(MCRegion_write_chunk_nbt), 3);
     
     class_MCWorld = rb_define_class("MCWorld", rb_cObject);
-    rb_define_method(class_MCWorld, "compute_lights_intern", RUBY_METHOD_FUNC(MCWorld_compute_lights), 0);
-    rb_define_method(class_MCWorld, "compute_heights_intern", RUBY_METHOD_FUNC(MCWorld_compute_heights), 0);
+    rb_define_method(class_MCWorld, "compute_lights_intern", RUBY_METHOD_FUNC(MCWorld_compute_lights), -1);
+    rb_define_method(class_MCWorld, "compute_heights_intern", RUBY_METHOD_FUNC(MCWorld_compute_heights), -1);
+    rb_define_method(class_MCWorld, "find_blocks_intern", RUBY_METHOD_FUNC(MCWorld_find_blocks), -1);
+    rb_define_method(class_MCWorld, "each_chunk_intern", RUBY_METHOD_FUNC(MCWorld_each_chunk), 4);
+    rb_define_method(class_MCWorld, "read_box_intern", RUBY_METHOD_FUNC(MCWorld_read_box), 3);
+    rb_define_method(class_MCWorld, "write_box_intern", RUBY_METHOD_FUNC(MCWorld_write_box), -1);
+    rb_define_method(class_MCWorld, "update_lights_intern", RUBY_METHOD_FUNC(MCWorld_update_lights), 2);
 }
 
-void WriteImage(SimpleImage & outputImage, const string & path)
+bool WriteImage(SimpleImage & outputImage, const string & path)
 {
     cout << "Writing output image" << endl;
     PNG_FileInfo outputFI;
     if(!outputFI.Write(path, outputImage)) {
         cerr << "Could not write PNG image!" << endl;
-        exit(EXIT_FAILURE);
+        return false;
     }
+    return true;
 }
 
 
-void RenderMap(const MagellanOptions & opts)
+// Bands run from the top of the image down, which is from xMin up. DrawTop() draws
+// what overhangs each band from the rows below it, so the result is the same as a
+// single image.
+static bool RenderMapBands(MC_World & world, const MagellanOptions & opts)
 {
+    PNG_StreamWriter png;
+    if(!png.Open(opts.outputFile, 16*opts.zSize*opts.scale, 16*opts.xSize*opts.scale)) {
+        cerr << "Could not write PNG image!" << endl;
+        return false;
+    }
+    
+    SimpleImage bandImage;
+    size_t blocksDrawn = 0;
+    for(int x0 = opts.xMin; x0 <= opts.xMax; x0 += opts.bandRows)
+    {
+        int x1 = min(x0 + opts.bandRows - 1, opts.xMax);
+        if(bandImage.height != 16*(x1 - x0 + 1)*opts.scale)
+            bandImage.Realloc(16*opts.zSize*opts.scale, 16*(x1 - x0 + 1)*opts.scale, 4);
+        bandImage.Clear(0, 0, 0, 255);
+        blocksDrawn += DrawTop(bandImage, world, opts, x0, x1);
+        if(!png.WriteRows(bandImage)) {
+            cerr << "Could not write PNG image!" << endl;
+            return false;
+        }
+    }
+    if(!png.Close()) {
+        cerr << "Could not write PNG image!" << endl;
+        return false;
+    }
+    cout << "Done. Blocks drawn: " << blocksDrawn << endl;
+    return true;
+}
+
+bool RenderMap(MC_World & world, const MagellanOptions & opts)
+{
+    if(opts.bandRows > 0)
+        return RenderMapBands(world, opts);
     SimpleImage outputImage(16*opts.zSize*opts.scale, 16*opts.xSize*opts.scale, 4);
     outputImage.Clear(0, 0, 0, 255);
-    DrawTop(outputImage, opts);
-    WriteImage(outputImage, opts.outputFile.c_str());
-    cout << "Done." << endl;
+    size_t blocksDrawn = DrawTop(outputImage, world, opts);
+    if(!WriteImage(outputImage, opts.outputFile.c_str()))
+        return false;
+    cout << "Done. Blocks drawn: " << blocksDrawn << endl;
+    return true;
 }
 
 
 
-void ComputeStats(const MagellanOptions & opts)
+void ComputeStats(MC_World & world, MC_Stats & stats, const MagellanOptions & opts)
 {
     stats.numBlocks = 0;
     for(int j = 0; j < kNumBlockTypes; ++j)
@@ -270,6 +1330,7 @@ void ComputeStats(const MagellanOptions & opts)
     
     stats.yMax = 0;
     stats.yMin = 128;
+    MC_BlockCursor at(world);
     for(int x = opts.xMin; x <= opts.xMax; ++x)
     for(int z = opts.zMin; z <= opts.zMax; ++z)
     {
@@ -281,12 +1342,13 @@ void ComputeStats(const MagellanOptions & opts)
         for(int bx = 0; bx < 16; ++bx)
         for(int bz = 0; bz < 16; ++bz)
         {
-            MC_Block block;
-            for(int by = opts.yMin; by <= opts.yMax; ++by)
+            // Heights outside the chunk read as air
+            at.MoveTo(x*16 + bx, opts.yMin, z*16 + bz);
+            for(int by = opts.yMin; by <= opts.yMax; ++by, at.YInc())
             {
-                chunk->GetBlock(block, bx, by, bz);
-                ++stats.blockCounts[block.type];
-                if(block.type != kBT_Air)
+                uint8_t type = at.GetType();
+                ++stats.blockCounts[type];
+                if(type != kBT_Air)
                 {
                     if(by < 0) continue;
                     if(by > stats.yMax) stats.yMax = by;
@@ -328,7 +1390,7 @@ void ComputeStats(const MagellanOptions & opts)
 }
 
 
-void RenderBlock(SimpleImage & outputImage, int scale, uint8_t type, int x, int y, int z, float light)
+bool RenderBlock(SimpleImage & outputImage, int scale, uint8_t type, int x, int y, int z, float light)
 {
 /*    if(x < opts.xMinBlock || x > opts.xMaxBlock ||
         z < opts.zMinBlock || z > opts.zMaxBlock)
@@ -353,107 +1415,230 @@ void RenderBlock(SimpleImage & outputImage, int scale, uint8_t type, int x, int
         if(blockTex == NULL) {
             if(type != kBT_Air)
                 cerr << "No texture for block type " << (int)type << " (" << blockdefs[type].name << ")" << endl;
-            return;
+            return false;
         }
         // Chunk coordinates are in world space chunk units, convert to block units
         // Blit texture at location
         outputImage.Blit(*blockTex, z*scale, x*scale, light);
     }
-    ++stats.blocksDrawn;
+    return true;
 }
 
-void DrawTop(SimpleImage & outputImage, const MagellanOptions & opts)
+// Scratch space for drawing chunks, one per drawing thread. Lighting is expanded to
+// byte planes once per chunk rather than decoded per block. One extra byte for the
+// topmost block (see FIXME below).
+struct DrawTopScratch {
+    std::vector<uint8_t> skyPlane, blockPlane, typePlane;
+    SimpleImage tile;
+    size_t blocksDrawn;
+    
+    DrawTopScratch():
+        skyPlane(MC_Chunk::kPlaneSize + 1), blockPlane(MC_Chunk::kPlaneSize + 1),
+        typePlane(MC_Chunk::kPlaneSize), blocksDrawn(0)
+    {}
+};
+
+// Draw the top of the columns bx < bxEnd, bz < bzEnd of chunk x, z into image, block
+// xOrg, zOrg landing on its origin. Returns number of blocks drawn.
+static size_t DrawTopChunk(SimpleImage & image, const MC_Chunk * chunk, int x, int z,
+                           int bxEnd, int bzEnd, int32_t xOrg, int32_t zOrg,
+                           DrawTopScratch & scratch, const MagellanOptions & opts)
 {
-    stats.blocksDrawn = 0;
-    for(int x = opts.xMin; x <= opts.xMax; ++x)
-    for(int z = opts.zMin; z <= opts.zMax; ++z)
+    size_t blocksDrawn = 0;
+    bool useLight = (opts.lightingMode == kLightingDay || opts.lightingMode == kLightingNight ||
+                     opts.lightingMode == kLightingMorning || opts.lightingMode == kLightingEvening);
+    std::vector<uint8_t> & skyPlane = scratch.skyPlane;
+    std::vector<uint8_t> & blockPlane = scratch.blockPlane;
+    
+    // Compact chunks are decoded once, rather than searched for every block
+    const uint8_t * types;
+    if(chunk->IsCompact()) {
+        chunk->ReadTypes(&scratch.typePlane[0]);
+        types = &scratch.typePlane[0];
+    }
+    else
+        types = chunk->Blocks();
+    if(useLight) {
+        chunk->ReadPlane(&skyPlane[0], MC_Chunk::kPlaneSkylight);
+        chunk->ReadPlane(&blockPlane[0], MC_Chunk::kPlaneBlocklight);
+    }
+    
+    for(int bx = 0; bx < bxEnd; ++bx)
+    for(int bz = 0; bz < bzEnd; ++bz)
     {
-        MC_Chunk * chunk = world.ChunkAt(x, z);
-        if(!chunk) continue;
-        
-        for(int bx = 0; bx < 16; ++bx)
-        for(int bz = 0; bz < 16; ++bz)
+        stack<int32_t> drawStack;
+        int32_t block = MC_Chunk::GetIdx(bx, opts.yMax + 1, bz);
+        int32_t low = MC_Chunk::GetIdx(bx, opts.yMin, bz);
+        if(opts.peel)
         {
-            stack<int32_t> drawStack;
-            int32_t block = MC_Chunk::GetIdx(bx, opts.yMax + 1, bz);
-            int32_t low = MC_Chunk::GetIdx(bx, opts.yMin, bz);
-            if(opts.peel)
+            int peelcount = opts.peel;
+            while(block >= low && peelcount)
             {
-                int peelcount = opts.peel;
-                while(block >= low && peelcount)
-                {
-                    // Search for non-air block
-                    while(--block >= low) {
-                        if(chunk->GetType(block) != kBT_Air)
-                            break;
-                    }
-                    // Bump count and search for air block
-                    while(--block >= opts.yMin) {
-                        if(chunk->GetType(block) == kBT_Air)
-                            break;
-                    }
-                    --peelcount;
+                // Search for non-air block
+                while(--block >= low) {
+                    if(types[block] != kBT_Air)
+                        break;
                 }
-                // Didn't hit anything, reset and take first hit
-//                if(block < low)
-//                    block = MC_Chunk::GetIdx(bx, opts.yMax + 1, bz);
-            }
-            
-            // find highest non-air block
-            while(--block >= low) {
-                if(chunk->GetType(block) != kBT_Air) {
-                    drawStack.push(block);
-                    break;
+                // Bump count and search for air block
+                while(--block >= opts.yMin) {
+                    if(types[block] == kBT_Air)
+                        break;
                 }
+                --peelcount;
             }
-            if(block < low) continue;// fell through the bottom
-            
-            // find highest *opaque* block
-            while(!blockTypes[chunk->GetType(drawStack.top())].isOpaque) {
-                if(--block < low)
-                    break;
+            // Didn't hit anything, reset and take first hit
+//                if(block < low)
+//                    block = MC_Chunk::GetIdx(bx, opts.yMax + 1, bz);
+        }
+        
+        // find highest non-air block
+        while(--block >= low) {
+            if(types[block] != kBT_Air) {
                 drawStack.push(block);
+                break;
             }
-            if(block < low) continue;// hit transparent stuff, then fell through the bottom
-            
-            while(!drawStack.empty()) {
-                block = drawStack.top(); drawStack.pop();
-                int32_t by = block - low + opts.yMin;
-                // FIXME: can go out of range at topmost layer
-                float light = 1;
-                switch(opts.lightingMode) {
-                  case kLightingAltitude:
-                  case kLightingAltitudeGray:// TODO: implement gray
-                    light = (float)(by - opts.yMin)/(opts.yMax - opts.yMin);
-                  break;
-                  case kLightingDay: {
-                    float blocklight = (float)chunk->GetBlocklight(block + 1)/15.0f;
-                    float skylight = (float)chunk->GetSkylight(block + 1)/15.0f;
-                    light = fminf(1.0f, blocklight + skylight);
-                  } break;
-                  case kLightingNight:
-                    light = (float)chunk->GetBlocklight(block + 1)/15.0f;
-                  break;
-                  case kLightingMorning:// halflight with fog
-                  case kLightingEvening: {// halflight without fog TODO
-                    float blocklight = (float)chunk->GetBlocklight(block + 1)/15.0f;
-                    float skylight = (float)chunk->GetSkylight(block + 1)/15.0f;
-                    light = fminf(1.0f, blocklight + skylight*0.5f);
-                  } break;
-                }
-                RenderBlock(outputImage, opts.scale, chunk->GetType(block),
-                    opts.xMaxBlock - (x*16 + bx), by, opts.zMaxBlock - (z*16 + bz),
-                    light);
+        }
+        if(block < low) continue;// fell through the bottom
+        
+        // find highest *opaque* block
+        while(!blockTypes[types[drawStack.top()]].isOpaque) {
+            if(--block < low)
+                break;
+            drawStack.push(block);
+        }
+        if(block < low) continue;// hit transparent stuff, then fell through the bottom
+        
+        while(!drawStack.empty()) {
+            block = drawStack.top(); drawStack.pop();
+            int32_t by = block - low + opts.yMin;
+            // FIXME: can go out of range at topmost layer
+            float light = 1;
+            switch(opts.lightingMode) {
+              case kLightingAltitude:
+              case kLightingAltitudeGray:// TODO: implement gray
+                light = (float)(by - opts.yMin)/(opts.yMax - opts.yMin);
+              break;
+              case kLightingDay: {
+                float blocklight = (float)blockPlane[block + 1]/15.0f;
+                float skylight = (float)skyPlane[block + 1]/15.0f;
+                light = fminf(1.0f, blocklight + skylight);
+              } break;
+              case kLightingNight:
+                light = (float)blockPlane[block + 1]/15.0f;
+              break;
+              case kLightingMorning:// halflight with fog
+              case kLightingEvening: {// halflight without fog TODO
+                float blocklight = (float)blockPlane[block + 1]/15.0f;
+                float skylight = (float)skyPlane[block + 1]/15.0f;
+                light = fminf(1.0f, blocklight + skylight*0.5f);
+              } break;
             }
+            if(RenderBlock(image, opts.scale, types[block],
+                           xOrg - (x*16 + bx), by, zOrg - (z*16 + bz),
+                           light))
+                ++blocksDrawn;
         }
     }
-    cout << "Done. Blocks drawn: " << stats.blocksDrawn << endl;
+    return blocksDrawn;
+}
+
+// Number of blocks a texture drawn at scale overhangs the blocks at lower coordinates.
+// Textures are 16 pixels square, halved for smaller scales.
+static int TextureOverhang(int scale)
+{
+    if(scale == 1)
+        return 0;
+    int overhang = (16 >> kTextureScaleMap[scale]) - scale;
+    return (overhang > 0)? (overhang + scale - 1)/scale : 0;
+}
+
+// DrawTop() splits rows xMin to xMax of the map into tiles of opts.tileChunks chunks
+// square, drawn in parallel. Each tile is drawn into its thread's own image, and only
+// the tile's rectangle copied back to the output, so no two threads ever touch the
+// same pixels. Textures larger than the map scale overhang the blocks at lower
+// coordinates, so the tile image has a halo of the blocks beyond its high edges that
+// overhang it. Blocks are drawn in the same order as if the map were a single tile,
+// and the output doesn't depend on the tiling.
+struct DrawTopTiles {
+    SimpleImage & outputImage;
+    MC_World & world;
+    const MagellanOptions & opts;
+    int xMin, xMax;
+    int zTiles;
+    int halo;
+    std::vector<DrawTopScratch> scratch;
+    
+    DrawTopTiles(SimpleImage & img, MC_World & w, const MagellanOptions & o, int x0, int x1, int numThreads):
+        outputImage(img), world(w), opts(o), xMin(x0), xMax(x1),
+        zTiles((o.zMax - o.zMin)/o.tileChunks + 1),
+        halo(TextureOverhang(o.scale)),
+        scratch(numThreads)
+    {}
+    
+    void operator()(size_t j, int thread) {
+        int x0 = xMin + (int)(j/zTiles)*opts.tileChunks;
+        int z0 = opts.zMin + (int)(j%zTiles)*opts.tileChunks;
+        int x1 = min(x0 + opts.tileChunks - 1, xMax);
+        int z1 = min(z0 + opts.tileChunks - 1, opts.zMax);
+        // Chunks overhanging the tile, within the map
+        int xh = (halo > 0)? min(x1 + 1, opts.xMax) : x1;
+        int zh = (halo > 0)? min(z1 + 1, opts.zMax) : z1;
+        bool empty = true;
+        for(int x = x0; x <= xh && empty; ++x)
+        for(int z = z0; z <= zh && empty; ++z)
+            empty = (world.ChunkAt(x, z) == NULL);
+        if(empty)
+            return;
+        
+        // Tile rectangle in the output, and its place in the tile image past the halo.
+        // Blocks are drawn at decreasing coordinates from the far corner of the halo.
+        int32_t xOrg = x1*16 + 15 + halo, zOrg = z1*16 + 15 + halo;
+        int32_t left = (opts.zMax - z1)*16*opts.scale, bottom = (xMax - x1)*16*opts.scale;
+        int32_t w = (z1 - z0 + 1)*16*opts.scale, h = (x1 - x0 + 1)*16*opts.scale;
+        int32_t border = halo*opts.scale;
+        
+        DrawTopScratch & s = scratch[thread];
+        if(s.tile.width != w + border || s.tile.height != h + border)
+            s.tile.Realloc(w + border, h + border, outputImage.pixelBytes);
+        s.tile.Copy(outputImage, left, bottom, border, border, w, h);
+        for(int x = x0; x <= xh; ++x)
+        for(int z = z0; z <= zh; ++z)
+        {
+            MC_Chunk * chunk = world.ChunkAt(x, z);
+            if(!chunk)
+                continue;
+            size_t drawn = DrawTopChunk(s.tile, chunk, x, z, (x > x1)? halo : 16, (z > z1)? halo : 16,
+                                        xOrg, zOrg, s, opts);
+            if(x <= x1 && z <= z1)
+                s.blocksDrawn += drawn;
+        }
+        outputImage.Copy(s.tile, border, border, left, bottom, w, h);
+    }
+};
+
+size_t DrawTop(SimpleImage & outputImage, MC_World & world, const MagellanOptions & opts, int xMin, int xMax)
+{
+    int numThreads = (opts.numThreads > 0)? opts.numThreads : NumCPUs();
+    DrawTopTiles tiles(outputImage, world, opts, xMin, xMax, numThreads);
+    size_t xTiles = (xMax - xMin)/opts.tileChunks + 1;
+    ParallelFor(xTiles*tiles.zTiles, tiles, numThreads);
+    
+    // Per-thread counts are only merged once all tiles are done
+    size_t blocksDrawn = 0;
+    for(size_t t = 0; t < tiles.scratch.size(); ++t)
+        blocksDrawn += tiles.scratch[t].blocksDrawn;
+    return blocksDrawn;
+}
+
+size_t DrawTop(SimpleImage & outputImage, MC_World & world, const MagellanOptions & opts)
+{
+    return DrawTop(outputImage, world, opts, opts.xMin, opts.xMax);
 }
 
 
-/*void DrawLayer(SimpleImage & outputImage, const MagellanOptions & opts, int by)
+/*size_t DrawLayer(SimpleImage & outputImage, MC_World & world, const MagellanOptions & opts, int by)
 {
-    stats.blocksDrawn = 0;
+    size_t blocksDrawn = 0;
     for(int x = opts.xMin; x <= opts.xMax; ++x)
     for(int z = opts.zMin; z <= opts.zMax; ++z)
     {
@@ -464,10 +1649,12 @@ void DrawTop(SimpleImage & outputImage, const MagellanOptions & opts)
         for(int bz = 0; bz < 16; ++bz) {
             MC_Block block;
             chunk->GetBlock(block, bx, by, bz);
-            RenderBlock(outputImage, opts.scale, block.type, x*16 + bx, by, z*16 + bz, 1.0f);
+            if(RenderBlock(outputImage, opts.scale, block.type, x*16 + bx, by, z*16 + bz, 1.0f))
+                ++blocksDrawn;
         }
     }
-    cout << "Done. Blocks drawn: " << stats.blocksDrawn << endl;
+    cout << "Done. Blocks drawn: " << blocksDrawn << endl;
+    return blocksDrawn;
 }*/
 
 
@@ -28,9 +28,34 @@
 
 #include "nbt.h"
 #include "mc.h"
-#include "array2d.h"
+#include "threadpool.h"
 
 #include <string>
+#include <vector>
+
+class NBT_Region_IO;
+
+// Region wrapped by a MCRegion
+NBT_Region_IO * GetMCRegion(VALUE value);
+
+// Holds a region's mutex for its lifetime, taken by a thread holding the interpreter
+// lock. If the mutex is busy (chunk I/O runs with the interpreter lock released),
+// waits for it with the interpreter lock released too, so other Ruby threads run
+// meanwhile. Interrupts arriving while waiting are left pending. Don't raise while
+// holding one: the mutex would stay locked.
+class RegionLock {
+    Mutex & mutex;
+    RegionLock(const RegionLock &);
+    RegionLock & operator=(const RegionLock &);
+  public:
+    RegionLock(NBT_Region_IO * rgn);
+    ~RegionLock() {mutex.Unlock();}
+};
+
+// Read and parse chunk cx, cz of a region, or write serialized chunk NBT to it, with
+// the interpreter lock released. Return NULL or nonzero on failure.
+NBT_TagCompound * ReadRegionChunkNBT(NBT_Region_IO * rgn, int cx, int cz);
+int WriteRegionChunkData(NBT_Region_IO * rgn, int cx, int cz, std::vector<uint8_t> & data);
 
 inline std::string MCPath()
 {
@@ -69,6 +94,9 @@ struct MagellanOptions {
     int xMaxBlock, zMaxBlock;
     int scale;
     int peel;
+    int numThreads;// threads to render on, one per processor if <= 0
+    int bandRows;// chunk rows rendered and written at a time, whole map at once if 0
+    int tileChunks;// DrawTop() draws tiles of this many chunks square in parallel
     
     int xSize, zSize;
     
@@ -78,7 +106,7 @@ struct MagellanOptions {
         yMin(1), yMax(127),
         xMin(INT_MIN), xMax(INT_MAX),
         zMin(INT_MIN), zMax(INT_MAX),
-        scale(2), peel(0)
+        scale(2), peel(0), numThreads(0), bandRows(16), tileChunks(4)
     {}
 };
 
@@ -86,27 +114,32 @@ struct MC_Stats {
     int yMin, yMax;
     size_t numBlocks;
     size_t blockCounts[kNumBlockTypes];
-    size_t blocksDrawn;
 };
 
 //******************************************************************************
+// The world and statistics are passed in rather than kept in globals, so several
+// can be in use at once, from different threads or Ractors.
 
-extern MC_Stats stats;
-extern MC_World world;
-
-//******************************************************************************
-
-void RenderMap(const MagellanOptions & opts);
+// Render the map to opts.outputFile. With opts.bandRows set, renders a band of that
+// many chunk rows at a time, writing each to the PNG before starting the next, so
+// memory use is proportional to the width of the map rather than its area. Returns
+// false if the image can't be written.
+bool RenderMap(MC_World & world, const MagellanOptions & opts);
 
 
-void WriteImage(SimpleImage & outputImage, const std::string & path);
+bool WriteImage(SimpleImage & outputImage, const std::string & path);
 
-void ComputeStats(const MagellanOptions & opts);
+void ComputeStats(MC_World & world, MC_Stats & stats, const MagellanOptions & opts);
 
-void RenderBlock(SimpleImage & outputImage, int scale, uint8_t type, int x, int y, int z, float light);
+// Returns false if the block has no texture to draw
+bool RenderBlock(SimpleImage & outputImage, int scale, uint8_t type, int x, int y, int z, float light);
 
-void DrawTop(SimpleImage & outputImage, const MagellanOptions & opts);
-//void DrawLayer(SimpleImage & outputImage, const MagellanOptions & opts, int by);
+// Returns number of blocks drawn. The output is the same whatever the tile size and
+// number of threads.
+size_t DrawTop(SimpleImage & outputImage, MC_World & world, const MagellanOptions & opts);
+// Draw chunk rows xMin to xMax of the map, into an image of just those rows
+size_t DrawTop(SimpleImage & outputImage, MC_World & world, const MagellanOptions & opts, int xMin, int xMax);
+//size_t DrawLayer(SimpleImage & outputImage, MC_World & world, const MagellanOptions & opts, int by);
 
 //******************************************************************************
 #endif // MAGELLAN_H
@@ -22,8 +22,21 @@
 //******************************************************************************
 
 #include "mc.h"
+#include "threadpool.h"
+#include "nibbles.h"
+#include "heightmap.h"
+#include "lighting.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
 
 #include <string>
+#include <sstream>
+#include <iomanip>
 #include <vector>
 #include <stack>
 #include <list>
@@ -71,17 +84,255 @@ static inline std::string ToBase36(int32_t val) {
 }
 
 
+//******************************************************************************
+// Alpha to region conversion
+//******************************************************************************
+
+struct AlphaChunkFile {
+    int32_t x, z;
+    std::string path;
+};
+
+struct AlphaRegion {
+    int32_t rx, rz;
+    std::vector<AlphaChunkFile> files;
+    
+    std::string Path(const std::string & regionPath) const {
+        std::ostringstream fname;
+        fname << regionPath << "/r." << rx << "." << rz << ".mcr";
+        return fname.str();
+    }
+};
+
+// Parse chunk coordinates from a "c.X.Z.dat" file name, coordinates in base36.
+static bool ParseAlphaChunkName(const char * name, int32_t & x, int32_t & z)
+{
+    if(name[0] != 'c' || name[1] != '.')
+        return false;
+    char * end;
+    x = strtol(name + 2, &end, 36);
+    if(end == name + 2 || *end != '.')
+        return false;
+    const char * zstr = end + 1;
+    z = strtol(zstr, &end, 36);
+    if(end == zstr || strcmp(end, ".dat") != 0)
+        return false;
+    return true;
+}
+
+// Read and inflate a gzipped file in one pass.
+static bool ReadGzFile(const std::string & path, std::vector<uint8_t> & data)
+{
+    gzFile fin = gzopen(path.c_str(), "rb");
+    if(!fin)
+        return false;
+    gzbuffer(fin, 64*1024);
+    data.resize(128*1024);
+    size_t size = 0;
+    int n;
+    while((n = gzread(fin, &data[size], (unsigned)(data.size() - size))) > 0) {
+        size += n;
+        if(size == data.size())
+            data.resize(data.size()*2);
+    }
+    gzclose(fin);
+    data.resize(size);
+    return n == 0 && size > 0;
+}
+
+// Scans one top level (x % 64) directory. Files are listed with readdir() only, the
+// chunk coordinates come from the file names, so nothing is stat()ed.
+struct AlphaScanTask {
+    std::string worldPath;
+    std::vector<std::vector<AlphaChunkFile> > found;// per thread
+    
+    void operator()(size_t xdir, int thread) {
+        for(int zdir = 0; zdir < 64; ++zdir)
+        {
+            std::string dirPath = worldPath + "/" + chunkDirs[xdir] + "/" + chunkDirs[zdir];
+            DIR * dir = opendir(dirPath.c_str());
+            if(!dir)
+                continue;
+            struct dirent * ent;
+            while((ent = readdir(dir)) != NULL)
+            {
+                AlphaChunkFile file;
+                if(ParseAlphaChunkName(ent->d_name, file.x, file.z)) {
+                    file.path = dirPath + "/" + ent->d_name;
+                    found[thread].push_back(file);
+                }
+            }
+            closedir(dir);
+        }
+    }
+};
+
+// Converts one region: each chunk file is inflated once and deflated into a region
+// chunk, and the region file is then written in one pass.
+struct AlphaConvertTask {
+    std::string regionPath;
+    std::vector<AlphaRegion> * regions;
+    std::vector<std::vector<uint8_t> > scratch;// per thread
+    uint32_t timestamp;
+    StopFlag * stop;
+    
+    // Progress, guarded by reportMutex
+    size_t chunksDone, regionsDone, bytesIn, bytesOut, errors;
+    size_t totalChunks;
+    int64_t startTime, lastReport;
+    Mutex reportMutex;
+    
+    void operator()(size_t r, int thread) {
+        if(stop && stop->Stopped())
+            return;
+        AlphaRegion & region = (*regions)[r];
+        std::vector<RegionChunkData> chunks;
+        chunks.reserve(region.files.size());
+        size_t in = 0, out = 0, errs = 0;
+        for(size_t j = 0; j < region.files.size(); ++j)
+        {
+            const AlphaChunkFile & file = region.files[j];
+            std::vector<uint8_t> & data = scratch[thread];
+            if(!ReadGzFile(file.path, data)) {
+                std::cerr << "Could not read chunk file \"" << file.path << "\"" << std::endl;
+                ++errs;
+                continue;
+            }
+            chunks.push_back(RegionChunkData());
+            RegionChunkData & chunk = chunks.back();
+            chunk.cx = file.x;
+            chunk.cz = file.z;
+            chunk.timestamp = timestamp;
+            if(CompressRegionChunk(&data[0], data.size(), chunk.compData) != 0) {
+                chunks.pop_back();
+                ++errs;
+                continue;
+            }
+            if(chunk.compData.size() > kMaxRegionChunkBytes) {
+                std::cerr << "Chunk " << file.x << ", " << file.z << " too large for region file, skipped" << std::endl;
+                chunks.pop_back();
+                ++errs;
+                continue;
+            }
+            in += data.size();
+            out += chunk.compData.size();
+        }
+        
+        if(WriteRegionFile(region.Path(regionPath), chunks) != 0)
+            errs += chunks.size();
+        
+        MutexLock lock(reportMutex);
+        chunksDone += region.files.size();
+        ++regionsDone;
+        bytesIn += in;
+        bytesOut += out;
+        errors += errs;
+        Report(false);
+    }
+    
+    // Call with reportMutex locked
+    void Report(bool final) {
+        int64_t now = MC_Timestamp();
+        if(!final && now - lastReport < 1000)
+            return;
+        lastReport = now;
+        double secs = std::max((now - startTime)/1000.0, 0.001);
+        std::cout << (final? "Converted " : "Converting: ")
+                  << chunksDone << "/" << totalChunks << " chunks, "
+                  << regionsDone << "/" << regions->size() << " regions, "
+                  << (int)(chunksDone/secs) << " chunks/s, "
+                  << std::fixed << std::setprecision(1) << bytesIn/secs/(1024.0*1024.0) << " MB/s inflated";
+        if(final)
+            std::cout << ", " << errors << " errors, " << secs << " s";
+        std::cout << std::endl;
+    }
+};
+
+int MC_ConvertAlphaWorld(const std::string & worldPath, int numThreads, bool overwrite, StopFlag * stop)
+{
+    if(numThreads <= 0)
+        numThreads = NumCPUs();
+    int64_t startTime = MC_Timestamp();
+    
+    // Find chunk files, in parallel over the 64 top level directories
+    AlphaScanTask scan;
+    scan.worldPath = worldPath;
+    scan.found.resize(numThreads);
+    ParallelFor(64, scan, numThreads);
+    
+    // Group chunks by region
+    std::map<std::pair<int32_t, int32_t>, size_t> regionIdx;
+    std::vector<AlphaRegion> regions;
+    size_t totalChunks = 0;
+    for(size_t t = 0; t < scan.found.size(); ++t)
+    for(size_t j = 0; j < scan.found[t].size(); ++j)
+    {
+        AlphaChunkFile & file = scan.found[t][j];
+        std::pair<int32_t, int32_t> rcoords(file.x >> 5, file.z >> 5);
+        std::map<std::pair<int32_t, int32_t>, size_t>::iterator r = regionIdx.find(rcoords);
+        if(r == regionIdx.end()) {
+            r = regionIdx.insert(std::make_pair(rcoords, regions.size())).first;
+            regions.push_back(AlphaRegion());
+            regions.back().rx = rcoords.first;
+            regions.back().rz = rcoords.second;
+        }
+        regions[r->second].files.push_back(file);
+        ++totalChunks;
+    }
+    scan.found.clear();
+    
+    std::cout << "Found " << totalChunks << " chunks in " << regions.size() << " regions ("
+              << (MC_Timestamp() - startTime) << " ms)" << std::endl;
+    if(totalChunks == 0)
+        return 0;
+    
+    std::string regionPath = worldPath + "/region";
+    mkdir(regionPath.c_str(), 0755);
+    
+    // Region files may hold chunks written since the Alpha files were
+    if(!overwrite) {
+        size_t numExisting = 0;
+        for(size_t r = 0; r < regions.size(); ++r)
+            if(access(regions[r].Path(regionPath).c_str(), F_OK) == 0)
+                ++numExisting;
+        if(numExisting > 0) {
+            std::cerr << numExisting << " of " << regions.size() << " region files already exist in \""
+                      << regionPath << "\", not converting" << std::endl;
+            return -1;
+        }
+    }
+    
+    AlphaConvertTask convert;
+    convert.regionPath = regionPath;
+    convert.regions = &regions;
+    convert.scratch.resize(numThreads);
+    convert.timestamp = (uint32_t)time(NULL);
+    convert.stop = stop;
+    convert.chunksDone = convert.regionsDone = 0;
+    convert.bytesIn = convert.bytesOut = convert.errors = 0;
+    convert.totalChunks = totalChunks;
+    convert.startTime = convert.lastReport = startTime;
+    ParallelFor(regions.size(), convert, numThreads);
+    MutexLock lock(convert.reportMutex);
+    convert.Report(true);
+    
+    return (int)(convert.chunksDone - convert.errors);
+}
+
+
 //******************************************************************************
 // MC_Chunk
 //******************************************************************************
 
-MC_Chunk::MC_Chunk(NBT_TagCompound * cNBT): dirty(false)
+MC_Chunk::MC_Chunk(NBT_TagCompound * cNBT):
+    dirty(false), typesKnown(false), unpacked(false), planesModified(false), compact(NULL)
 {
     chunkNBT = cNBT;
     SetupFromNBT();
 }
 
-MC_Chunk::MC_Chunk(int32_t x, int32_t z): dirty(false)
+MC_Chunk::MC_Chunk(int32_t x, int32_t z):
+    dirty(false), typesKnown(false), unpacked(false), planesModified(false), compact(NULL)
 {
     // Create a NBT structure for this chunk, rather than use an existing one.
     chunkNBT = new NBT_TagCompound();
@@ -148,14 +399,271 @@ void MC_Chunk::SetupFromNBT()
 }
 
 
+// Set nibbles idx to idx + n - 1 of a packed nibble array to val. Even indices are
+// in the low nibble.
+static void FillNibbles(std::vector<uint8_t> & arr, size_t idx, size_t n, uint8_t val)
+{
+    size_t end = idx + n;
+    val &= 0x0F;
+    if((idx & 0x01) && idx < end) {
+        arr[idx >> 1] = (val << 4) | (arr[idx >> 1] & 0x0F);
+        ++idx;
+    }
+    if((end & 0x01) && idx < end) {
+        --end;
+        arr[end >> 1] = (arr[end >> 1] & 0xF0) | val;
+    }
+    if(idx < end)
+        memset(&arr[idx >> 1], (val << 4) | val, (end - idx) >> 1);
+}
+
+void MC_Chunk::FillSpan(const MC_Block & block, size_t idx, size_t n)
+{
+    Expand();
+    typesKnown = false;
+    memset(&(*blocks)[idx], block.type, n);
+    if(unpacked) {
+        memset(&planes[kPlaneData*kPlaneSize + idx], block.data & 0x0F, n);
+        memset(&planes[kPlaneSkylight*kPlaneSize + idx], block.skylight & 0x0F, n);
+        memset(&planes[kPlaneBlocklight*kPlaneSize + idx], block.blocklight & 0x0F, n);
+        planesModified = true;
+    }
+    else {
+        FillNibbles(*data, idx, n, block.data);
+        FillNibbles(*skylight, idx, n, block.skylight);
+        FillNibbles(*blocklight, idx, n, block.blocklight);
+    }
+}
+
+size_t MC_Chunk::ReplaceSpan(uint8_t fromType, const MC_Block & block, size_t idx, size_t n)
+{
+    Expand();
+    size_t count = 0;
+    for(size_t j = idx; j < idx + n; ++j)
+    {
+        if((*blocks)[j] == fromType) {
+            SetBlock(block, j);
+            ++count;
+        }
+    }
+    return count;
+}
+
+void MC_Chunk::FillTypeSpan(uint8_t bt, uint8_t bd, size_t idx, size_t n)
+{
+    Expand();
+    typesKnown = false;
+    memset(&(*blocks)[idx], bt, n);
+    if(unpacked) {
+        memset(&planes[kPlaneData*kPlaneSize + idx], bd & 0x0F, n);
+        planesModified = true;
+    }
+    else
+        FillNibbles(*data, idx, n, bd);
+}
+
+size_t MC_Chunk::ReplaceTypeSpan(uint8_t fromType, uint8_t bt, uint8_t bd, size_t idx, size_t n)
+{
+    Expand();
+    size_t count = 0;
+    for(size_t j = idx; j < idx + n; ++j)
+    {
+        if((*blocks)[j] == fromType) {
+            SetType(bt, j);
+            SetData(bd, j);
+            ++count;
+        }
+    }
+    return count;
+}
+
+void MC_Chunk::Unpack()
+{
+    if(unpacked)
+        return;
+    Expand();
+    planes.resize(3*kPlaneSize);
+    ReadPlane(&planes[kPlaneData*kPlaneSize], kPlaneData);
+    ReadPlane(&planes[kPlaneSkylight*kPlaneSize], kPlaneSkylight);
+    ReadPlane(&planes[kPlaneBlocklight*kPlaneSize], kPlaneBlocklight);
+    unpacked = true;
+    planesModified = false;
+}
+
+void MC_Chunk::Pack()
+{
+    if(!unpacked)
+        return;
+    SyncNBT();
+    unpacked = false;
+    std::vector<uint8_t>().swap(planes);
+}
+
+void MC_Chunk::SyncNBT() const
+{
+    if(!unpacked || !planesModified)
+        return;
+    PackNibbles(&(*data)[0], &planes[kPlaneData*kPlaneSize], kPlaneSize);
+    PackNibbles(&(*skylight)[0], &planes[kPlaneSkylight*kPlaneSize], kPlaneSize);
+    PackNibbles(&(*blocklight)[0], &planes[kPlaneBlocklight*kPlaneSize], kPlaneSize);
+    planesModified = false;
+}
+
+void MC_Chunk::Compact()
+{
+    if(compact)
+        return;
+    Pack();
+    // Summarize types while they're cheap to read
+    TypesPresent();
+    compact = new MC_CompactBlocks;
+    compact->Encode(&(*blocks)[0], &(*data)[0], &(*skylight)[0], &(*blocklight)[0]);
+    // Release the arrays, leaving the tags in place for Expand()
+    std::vector<uint8_t>().swap(*blocks);
+    std::vector<uint8_t>().swap(*data);
+    std::vector<uint8_t>().swap(*skylight);
+    std::vector<uint8_t>().swap(*blocklight);
+}
+
+void MC_Chunk::Expand() const
+{
+    if(!compact)
+        return;
+    blocks->resize(kPlaneSize);
+    data->resize(kPlaneSize/2);
+    skylight->resize(kPlaneSize/2);
+    blocklight->resize(kPlaneSize/2);
+    compact->Decode(&(*blocks)[0], &(*data)[0], &(*skylight)[0], &(*blocklight)[0]);
+    delete compact;
+    compact = NULL;
+}
+
+size_t MC_Chunk::StorageBytes() const
+{
+    if(compact)
+        return compact->Bytes();
+    return blocks->capacity() + data->capacity() + skylight->capacity() +
+           blocklight->capacity() + planes.capacity();
+}
+
+const MC_BlockSet & MC_Chunk::TypesPresent() const
+{
+    if(!typesKnown) {
+        if(compact) {
+            std::vector<uint8_t> types(kPlaneSize);
+            compact->DecodePlane(&types[0], MC_CompactBlocks::kPlaneTypes);
+            typesPresent = MC_BlockTypesPresent(&types[0], kPlaneSize);
+        }
+        else {
+            typesPresent = MC_BlockTypesPresent(&(*blocks)[0], kPlaneSize);
+        }
+        typesKnown = true;
+    }
+    return typesPresent;
+}
+
+void MC_Chunk::ReadTypes(uint8_t * dst) const
+{
+    if(compact)
+        compact->DecodePlane(dst, MC_CompactBlocks::kPlaneTypes);
+    else
+        memcpy(dst, &(*blocks)[0], kPlaneSize);
+}
+
+void MC_Chunk::ReadPlane(uint8_t * dst, int plane) const
+{
+    if(compact) {
+        // Planes are in the same order, after types
+        compact->DecodePlane(dst, plane + MC_CompactBlocks::kPlaneData);
+        return;
+    }
+    if(unpacked) {
+        memcpy(dst, &planes[plane*kPlaneSize], kPlaneSize);
+        return;
+    }
+    const std::vector<uint8_t> * src = (plane == kPlaneData)? data :
+                                       (plane == kPlaneSkylight)? skylight : blocklight;
+    UnpackNibbles(dst, &(*src)[0], kPlaneSize);
+}
+
+// Expand nibbles idx to idx + n - 1 of a packed nibble array to dst
+static void ReadNibbles(uint8_t * dst, const std::vector<uint8_t> & arr, size_t idx, size_t n)
+{
+    if((idx & 0x01) && n > 0) {
+        *dst++ = arr[idx >> 1] >> 4;
+        ++idx;
+        --n;
+    }
+    UnpackNibbles(dst, &arr[idx >> 1], n);
+}
+
+void MC_Chunk::ReadSpan(MC_Block * out, size_t idx, size_t n) const
+{
+    if(compact) {
+        // Runs are decoded in place, there's no raw array to copy from
+        for(size_t j = 0; j < n; ++j)
+            GetBlock(out[j], idx + j);
+        return;
+    }
+    
+    // Expand each array a column at most at a time, then interleave into out
+    const size_t kRun = 128;
+    uint8_t types[kRun], values[3][kRun];
+    while(n > 0)
+    {
+        size_t m = min(n, kRun);
+        memcpy(types, &(*blocks)[idx], m);
+        if(unpacked) {
+            for(int p = 0; p < 3; ++p)
+                memcpy(values[p], &planes[p*kPlaneSize + idx], m);
+        }
+        else {
+            ReadNibbles(values[kPlaneData], *data, idx, m);
+            ReadNibbles(values[kPlaneSkylight], *skylight, idx, m);
+            ReadNibbles(values[kPlaneBlocklight], *blocklight, idx, m);
+        }
+        for(size_t j = 0; j < m; ++j) {
+            out[j].type = types[j];
+            out[j].data = values[kPlaneData][j];
+            out[j].skylight = values[kPlaneSkylight][j];
+            out[j].blocklight = values[kPlaneBlocklight][j];
+        }
+        out += m;
+        idx += m;
+        n -= m;
+    }
+}
+
+
+void MC_RecordTypeChanges(std::vector<MC_LightChange> & changes, const MC_Chunk & chunk,
+                          size_t idx, size_t n, uint8_t type, int fromType)
+{
+    for(size_t j = idx; j < idx + n; ++j)
+    {
+        uint8_t bt = chunk.GetType(j);
+        if(bt == type || (fromType >= 0 && bt != fromType))
+            continue;
+        // Inverse of MC_Chunk::GetIdx()
+        MC_LightChange change = {chunk.xPos*16 + (int32_t)(j >> 11), (int32_t)(j & 127),
+                                 chunk.zPos*16 + (int32_t)((j >> 7) & 15),
+                                 chunk.GetSkylight(j), chunk.GetBlocklight(j)};
+        changes.push_back(change);
+    }
+}
+
+
 //******************************************************************************
 // MC_World
 //******************************************************************************
 
 
 MC_World::MC_World():
+    chunks(NULL),
+    compactStorage(false),
+    lightTracking(false),
     xChunkMin(INT_MAX), xChunkMax(INT_MIN),
-    zChunkMin(INT_MAX), zChunkMax(INT_MIN)
+    zChunkMin(INT_MAX), zChunkMax(INT_MIN),
+    xSize(0), zSize(0)
 {}
 
 MC_World::~MC_World() {
@@ -195,6 +703,9 @@ void GenerateLevelDat(const std::string & ldPath, int spawnX, int spawnY, int sp
 void MC_World::AddChunk(MC_Chunk * chunk)
 {
     allChunks.push_back(chunk);
+    chunks.Set(chunk->xPos, chunk->zPos, chunk);
+    if(compactStorage)
+        chunk->Compact();
     
     xChunkMin = min(xChunkMin, chunk->xPos);
     xChunkMax = max(xChunkMax, chunk->xPos);
@@ -204,19 +715,34 @@ void MC_World::AddChunk(MC_Chunk * chunk)
     zSize = zChunkMax - zChunkMin + 1;
 }
 
-void MC_World::RebuildGrid()
+
+void MC_World::SetCompactStorage(bool on)
 {
-    // Place chunks in terrain grid
-    chunks.Resize(xSize, zSize, NULL);
-    for(size_t j = 0; j < allChunks.size(); ++j)
-    {
-        // Chunk grid is indexed from 0, must offset by lowest coordinates
-        int x = allChunks[j]->xPos - xChunkMin;
-        int z = allChunks[j]->zPos - zChunkMin;
-        chunks[x][z] = allChunks[j];
+    compactStorage = on;
+    for(size_t j = 0; j < allChunks.size(); ++j) {
+        if(on)
+            allChunks[j]->Compact();
+        else
+            allChunks[j]->Expand();
     }
 }
 
+void MC_World::CompactChunks()
+{
+    if(!compactStorage)
+        return;
+    for(size_t j = 0; j < allChunks.size(); ++j)
+        allChunks[j]->Compact();
+}
+
+size_t MC_World::StorageBytes() const
+{
+    size_t bytes = 0;
+    for(size_t j = 0; j < allChunks.size(); ++j)
+        bytes += allChunks[j]->StorageBytes();
+    return bytes;
+}
+
 
 // Get a block, returns "air" block if chunk doesn't exist for location
 MC_Block MC_World::GetBlock(int32_t x, int32_t y, int32_t z) const
@@ -225,27 +751,25 @@ MC_Block MC_World::GetBlock(int32_t x, int32_t y, int32_t z) const
     if(y < 0 || y > 127)
         return block;
     
-    // need to round negative numbers down, not toward zero
-    int cx = x & 15;//(x < 0)? ((x/16) - 1) : x/16;
-    int cz = z & 15;//(z < 0)? ((z/16) - 1) : z/16;
-    
-    const MC_Chunk * chunk = ChunkAt(cx, cz);
+    // Arithmetic shift rounds negative numbers down, not toward zero
+    const MC_Chunk * chunk = ChunkAt(x >> 4, z >> 4);
     if(chunk) {
-        chunk->GetBlock(block, x - cx*16, y, z - cz*16);
+        chunk->GetBlock(block, x & 15, y, z & 15);
     }
     return block;
 }
 
 // Set a block, creating chunk if necessary.
-// TODO: versions of SetBlock()/GetBlock() that don't pack/unpack lighting and data
+// For many blocks, use MC_BlockCursor or the box operations, which avoid repeating the
+// chunk lookup for each block.
 void MC_World::SetBlock(const MC_Block & block, int32_t x, int32_t y, int32_t z)
 {
     if(y < 0 || y > 127)
         return;
     
-    // need to round negative numbers down, not toward zero
-    int cx = (x < 0)? ((x/16) - 1) : x/16;
-    int cz = (z < 0)? ((z/16) - 1) : z/16;
+    // Arithmetic shift rounds negative numbers down, not toward zero
+    int cx = x >> 4;
+    int cz = z >> 4;
     
     MC_Chunk * chunk = ChunkAt(cx, cz);
     if(chunk == NULL) {
@@ -254,14 +778,298 @@ void MC_World::SetBlock(const MC_Block & block, int32_t x, int32_t y, int32_t z)
 //        cout << "Chunk for block does not exist, creating one..." << endl;
 //        chunk = new MC_Chunk(cx, cz);
 //        AddChunk(chunk);
-//        RebuildGrid();
     }
-    chunk->SetBlock(block, x - cx*16, y, z - cz*16);
+    RecordLightChange(chunk, MC_Chunk::GetIdx(x & 15, y, z & 15), x, y, z);
+    chunk->SetBlock(block, x & 15, y, z & 15);
+    chunk->SetDirty();
+}
+
+
+// Calls op(chunk, idx, n, outIdx) for each column run of the box that lies in an
+// existing chunk, where outIdx is the index of the run's first block in a buffer
+// covering the box, ordered like chunk data. Box is normalized and clipped to the
+// height range first.
+template<typename World, typename Chunk, typename Op>
+static void ForEachBoxRun(World & world, Op & op, int32_t x0, int32_t y0, int32_t z0,
+                          int32_t x1, int32_t y1, int32_t z1)
+{
+    if(x0 > x1) std::swap(x0, x1);
+    if(y0 > y1) std::swap(y0, y1);
+    if(z0 > z1) std::swap(z0, z1);
+    int32_t yFirst = max(y0, 0), yLast = min(y1, 127);
+    if(yFirst > yLast)
+        return;
+    size_t n = yLast - yFirst + 1;
+    size_t ySize = y1 - y0 + 1, zSize = z1 - z0 + 1;
+    
+    // Moves within a chunk don't look it up again
+    MC_BlockCursorOf<World, Chunk> at(world, x0, yFirst, z0);
+    for(int32_t cx = x0 >> 4; cx <= (x1 >> 4); ++cx)
+    for(int32_t cz = z0 >> 4; cz <= (z1 >> 4); ++cz)
+    {
+        int32_t xStart = max(x0, cx*16), xEnd = min(x1, cx*16 + 15);
+        int32_t zStart = max(z0, cz*16), zEnd = min(z1, cz*16 + 15);
+        at.MoveTo(xStart, yFirst, zStart);
+        if(!at.Valid())
+            continue;
+        for(int32_t x = xStart; x <= xEnd; ++x)
+        for(int32_t z = zStart; z <= zEnd; ++z)
+        {
+            at.MoveTo(x, yFirst, z);
+            size_t outIdx = ((x - x0)*zSize + (z - z0))*ySize + (yFirst - y0);
+            op(at.GetChunk(), at.Index(), n, outIdx);
+        }
+    }
+}
+
+// Fill and replace set the whole block if withLight, type and data otherwise
+struct FillBoxOp {
+    std::vector<MC_LightChange> * changes;// if tracking light changes, NULL otherwise
+    MC_Block block;
+    bool withLight;
+    size_t count;
+    FillBoxOp(std::vector<MC_LightChange> * lc, const MC_Block & b, bool wl):
+        changes(lc), block(b), withLight(wl), count(0) {}
+    void operator()(MC_Chunk * chunk, size_t idx, size_t n, size_t /*outIdx*/) {
+        if(changes)
+            MC_RecordTypeChanges(*changes, *chunk, idx, n, block.type);
+        if(withLight)
+            chunk->FillSpan(block, idx, n);
+        else
+            chunk->FillTypeSpan(block.type, block.data, idx, n);
+        chunk->SetDirty();
+        count += n;
+    }
+};
+
+struct ReplaceBoxOp {
+    std::vector<MC_LightChange> * changes;
+    uint8_t fromType;
+    MC_Block block;
+    bool withLight;
+    size_t count;
+    ReplaceBoxOp(std::vector<MC_LightChange> * lc, uint8_t from, const MC_Block & b, bool wl):
+        changes(lc), fromType(from), block(b), withLight(wl), count(0) {}
+    void operator()(MC_Chunk * chunk, size_t idx, size_t n, size_t /*outIdx*/) {
+        if(changes)
+            MC_RecordTypeChanges(*changes, *chunk, idx, n, block.type, fromType);
+        size_t replaced = withLight? chunk->ReplaceSpan(fromType, block, idx, n) :
+                                     chunk->ReplaceTypeSpan(fromType, block.type, block.data, idx, n);
+        if(replaced)
+            chunk->SetDirty();
+        count += replaced;
+    }
+};
+
+struct ReadBoxOp {
+    std::vector<MC_Block> & out;
+    ReadBoxOp(std::vector<MC_Block> & o): out(o) {}
+    void operator()(const MC_Chunk * chunk, size_t idx, size_t n, size_t outIdx) {
+        chunk->ReadSpan(&out[outIdx], idx, n);
+    }
+};
+
+size_t MC_World::FillBox(uint8_t type, uint8_t data, int32_t x0, int32_t y0, int32_t z0,
+                         int32_t x1, int32_t y1, int32_t z1)
+{
+    MC_Block block = {type, data, 0x0, 0x0};
+    FillBoxOp op(lightTracking? &lightChanges : NULL, block, false);
+    ForEachBoxRun<MC_World, MC_Chunk>(*this, op, x0, y0, z0, x1, y1, z1);
+    return op.count;
+}
+
+size_t MC_World::FillBox(const MC_Block & block, int32_t x0, int32_t y0, int32_t z0,
+                         int32_t x1, int32_t y1, int32_t z1)
+{
+    FillBoxOp op(lightTracking? &lightChanges : NULL, block, true);
+    ForEachBoxRun<MC_World, MC_Chunk>(*this, op, x0, y0, z0, x1, y1, z1);
+    return op.count;
+}
+
+size_t MC_World::ReplaceBox(uint8_t fromType, uint8_t type, uint8_t data,
+                            int32_t x0, int32_t y0, int32_t z0, int32_t x1, int32_t y1, int32_t z1)
+{
+    MC_Block block = {type, data, 0x0, 0x0};
+    ReplaceBoxOp op(lightTracking? &lightChanges : NULL, fromType, block, false);
+    ForEachBoxRun<MC_World, MC_Chunk>(*this, op, x0, y0, z0, x1, y1, z1);
+    return op.count;
+}
+
+size_t MC_World::ReplaceBox(uint8_t fromType, const MC_Block & block,
+                            int32_t x0, int32_t y0, int32_t z0, int32_t x1, int32_t y1, int32_t z1)
+{
+    ReplaceBoxOp op(lightTracking? &lightChanges : NULL, fromType, block, true);
+    ForEachBoxRun<MC_World, MC_Chunk>(*this, op, x0, y0, z0, x1, y1, z1);
+    return op.count;
+}
+
+void MC_World::ReadBox(std::vector<MC_Block> & out, int32_t x0, int32_t y0, int32_t z0,
+                       int32_t x1, int32_t y1, int32_t z1) const
+{
+    MC_Block air = {kBT_Air, 0x0, 0x0, 0x0};
+    out.assign((size_t)(abs(x1 - x0) + 1)*(abs(y1 - y0) + 1)*(abs(z1 - z0) + 1), air);
+    ReadBoxOp op(out);
+    ForEachBoxRun<const MC_World, const MC_Chunk>(*this, op, x0, y0, z0, x1, y1, z1);
+}
+
+struct CalcHeightmapTask {
+    std::vector<MC_Chunk *> chunks;
+    std::vector<std::vector<uint8_t> > scratch;// per thread, for compact chunks
+    
+    void operator()(size_t j, int thread) {
+        MC_Chunk * chunk = chunks[j];
+        if(chunk->IsCompact()) {
+            std::vector<uint8_t> & types = scratch[thread];
+            types.resize(MC_Chunk::kPlaneSize);
+            chunk->ReadTypes(&types[0]);
+            MC_ComputeHeightmap(chunk->EditHeightmap(), &types[0]);
+        }
+        else {
+            MC_ComputeHeightmap(chunk->EditHeightmap(), chunk->Blocks());
+        }
+    }
+};
+
+void MC_World::CalcHeightmap(bool dirtyOnly, int numThreads)
+{
+    CalcHeightmapTask task;
+    for(size_t j = 0; j < allChunks.size(); ++j)
+        if(!dirtyOnly || allChunks[j]->IsDirty())
+            task.chunks.push_back(allChunks[j]);
+    
+    if(numThreads <= 0)
+        numThreads = NumCPUs();
+    task.scratch.resize(numThreads);
+    // Make sure the opacity set is built before threads start using it
+    MC_BlockSet::Opaque();
+    ParallelFor(task.chunks.size(), task, numThreads);
+}
+
+size_t MC_World::CalcLighting(int numThreads)
+{
+    // Light from a change reaches at most 15 blocks, so relighting the neighbors of
+    // dirty chunks covers it. The ring of chunks beyond that supplies light across
+    // the borders unchanged.
+    std::set<std::pair<int, int> > relight, fixed;
+    for(size_t j = 0; j < allChunks.size(); ++j)
+    {
+        MC_Chunk * chunk = allChunks[j];
+        if(!chunk->IsDirty())
+            continue;
+        for(int dx = -1; dx <= 1; ++dx)
+        for(int dz = -1; dz <= 1; ++dz)
+            if(ChunkAt(chunk->xPos + dx, chunk->zPos + dz))
+                relight.insert(std::make_pair(chunk->xPos + dx, chunk->zPos + dz));
+    }
+    std::set<std::pair<int, int> >::iterator ci;
+    for(ci = relight.begin(); ci != relight.end(); ++ci)
+    {
+        for(int dx = -1; dx <= 1; ++dx)
+        for(int dz = -1; dz <= 1; ++dz) {
+            std::pair<int, int> c(ci->first + dx, ci->second + dz);
+            if(!relight.count(c) && ChunkAt(c.first, c.second))
+                fixed.insert(c);
+        }
+    }
+    
+    MC_LightEngine engine;
+    std::vector<MC_Chunk *> packed, compacted;
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        std::set<std::pair<int, int> > & coords = pass? fixed : relight;
+        for(ci = coords.begin(); ci != coords.end(); ++ci)
+        {
+            MC_Chunk * chunk = ChunkAt(ci->first, ci->second);
+            if(chunk->IsCompact())
+                compacted.push_back(chunk);
+            if(!chunk->IsUnpacked())
+                packed.push_back(chunk);
+            chunk->Unpack();
+            if(pass == 0) {
+                engine.AddChunk(chunk->xPos, chunk->zPos, chunk->Blocks(),
+                                chunk->EditPlane(MC_Chunk::kPlaneSkylight),
+                                chunk->EditPlane(MC_Chunk::kPlaneBlocklight),
+                                chunk->EditHeightmap(), true);
+                chunk->SetDirty();
+            }
+            else {
+                // Only read by the engine
+                engine.AddChunk(chunk->xPos, chunk->zPos, chunk->Blocks(),
+                                const_cast<uint8_t *>(chunk->Plane(MC_Chunk::kPlaneSkylight)),
+                                const_cast<uint8_t *>(chunk->Plane(MC_Chunk::kPlaneBlocklight)),
+                                chunk->EditHeightmap(), false);
+            }
+        }
+    }
+    
+    size_t numRelit = engine.Run(numThreads);
+    // Recorded edits all made their chunks dirty, so are covered
+    lightChanges.clear();
+    
+    for(size_t j = 0; j < packed.size(); ++j)
+        packed[j]->Pack();
+    for(size_t j = 0; j < compacted.size(); ++j)
+        compacted[j]->Compact();
+    return numRelit;
+}
+
+void MC_World::ChunksContaining(const MC_BlockSet & types, std::vector<MC_Chunk *> & out) const
+{
+    out.clear();
+    for(size_t j = 0; j < allChunks.size(); ++j)
+        if(allChunks[j]->TypesPresent().Intersects(types))
+            out.push_back(allChunks[j]);
 }
 
-void MC_World::CalcHeightmap()
+struct FindBlocksTask {
+    const MC_BlockQuery & query;
+    std::vector<const MC_Chunk *> chunks;
+    std::vector<std::vector<int32_t> > results;// per chunk
+    std::vector<std::vector<uint8_t> > scratch;// per thread, types then packed data
+    
+    FindBlocksTask(const MC_BlockQuery & q): query(q) {}
+    
+    void operator()(size_t j, int thread) {
+        const MC_Chunk * chunk = chunks[j];
+        std::vector<uint8_t> & buf = scratch[thread];
+        buf.resize(MC_Chunk::kPlaneSize*2 + MC_Chunk::kPlaneSize/2);
+        const uint8_t * types = &buf[0], * data = NULL;
+        chunk->ReadTypes(&buf[0]);
+        if(query.dataMask != 0xFFFF) {
+            chunk->ReadPlane(&buf[MC_Chunk::kPlaneSize], MC_Chunk::kPlaneData);
+            PackNibbles(&buf[MC_Chunk::kPlaneSize*2], &buf[MC_Chunk::kPlaneSize], MC_Chunk::kPlaneSize);
+            data = &buf[MC_Chunk::kPlaneSize*2];
+        }
+        MC_FindBlocks(query, chunk->xPos, chunk->zPos, types, data, results[j]);
+    }
+};
+
+size_t MC_World::FindBlocks(const MC_BlockQuery & query, std::vector<int32_t> & out, int numThreads) const
 {
+    FindBlocksTask task(query);
+    for(size_t j = 0; j < allChunks.size(); ++j)
+    {
+        const MC_Chunk * chunk = allChunks[j];
+        if(query.ChunkInBox(chunk->xPos, chunk->zPos) && chunk->TypesPresent().Intersects(query.types))
+            task.chunks.push_back(chunk);
+    }
+    if(numThreads <= 0)
+        numThreads = NumCPUs();
+    task.results.resize(task.chunks.size());
+    task.scratch.resize(numThreads);
+    ParallelFor(task.chunks.size(), task, numThreads);
     
+    size_t start = out.size();
+    for(size_t j = 0; j < task.results.size(); ++j)
+        out.insert(out.end(), task.results[j].begin(), task.results[j].end());
+    return (out.size() - start)/3;
+}
+
+size_t MC_World::UpdateLighting()
+{
+    size_t numSet = MC_RelightChanges<MC_World, MC_Chunk>(*this, lightChanges);
+    lightChanges.clear();
+    return numSet;
 }
 
 
@@ -270,9 +1078,9 @@ void MC_World::SetHeightmap(int x, int z, int height)
     if(height < 0 || height > 127)
         return;
     
-    // need to round negative numbers down, not toward zero
-    int cx = (x < 0)? ((x/16) - 1) : x/16;
-    int cz = (z < 0)? ((z/16) - 1) : z/16;
+    // Arithmetic shift rounds negative numbers down, not toward zero
+    int cx = x >> 4;
+    int cz = z >> 4;
     
     MC_Chunk * chunk = ChunkAt(cx, cz);
     if(chunk == NULL) {
@@ -280,9 +1088,8 @@ void MC_World::SetHeightmap(int x, int z, int height)
         return;
 //        chunk = new MC_Chunk(cx, cz);
 //        AddChunk(chunk);
-//        RebuildGrid();
     }
-    chunk->SetHeightmap(x - cx*16, z - cz*16, height);
+    chunk->SetHeightmap(x & 15, z & 15, height);
 }
 
 
@@ -291,8 +1098,285 @@ void MC_World::SetHeightmap(int x, int z, int height)
 //******************************************************************************
 
 MC_BlockBuffer::MC_BlockBuffer(int xS, int yS, int zS):
+    entities("Entities", kNBT_TAG_Compound),
+    tileEntities("TileEntities", kNBT_TAG_Compound),
     xSize(xS), ySize(yS), zSize(zS)
 {
+    size_t n = (size_t)xSize*ySize*zSize;
+    blocks.resize(n, kBT_Air);
+    data.resize(n, 0);
+    skylight.resize(n, 0);
+    blocklight.resize(n, 0);
+}
+
+// Entity positions are a Pos list of 3 doubles, tile entities have integer x, y, z.
+// Paintings also have the integer TileX, TileY, TileZ of the block they hang on.
+static bool GetEntityPos(NBT_Tag * tag, double pos[3])
+{
+    NBT_TagCompound * ent = dynamic_cast<NBT_TagCompound *>(tag);
+    NBT_TagList * posTag = ent? ent->GetTag<NBT_TagList>("Pos", (NBT_TagList *)NULL) : NULL;
+    if(!posTag || posTag->values.size() != 3)
+        return false;
+    for(int j = 0; j < 3; ++j) {
+        NBT_TagDouble * coord = dynamic_cast<NBT_TagDouble *>(posTag->values[j]);
+        if(!coord)
+            return false;
+        pos[j] = coord->value;
+    }
+    return true;
+}
+
+static bool GetIntPos(NBT_Tag * tag, const char * xName, const char * yName, const char * zName, int32_t pos[3])
+{
+    NBT_TagCompound * ent = dynamic_cast<NBT_TagCompound *>(tag);
+    if(!ent)
+        return false;
+    NBT_TagInt * x = ent->GetTag<NBT_TagInt>(xName, (NBT_TagInt *)NULL);
+    NBT_TagInt * y = ent->GetTag<NBT_TagInt>(yName, (NBT_TagInt *)NULL);
+    NBT_TagInt * z = ent->GetTag<NBT_TagInt>(zName, (NBT_TagInt *)NULL);
+    if(!x || !y || !z)
+        return false;
+    pos[0] = x->value; pos[1] = y->value; pos[2] = z->value;
+    return true;
+}
+
+static void MoveIntPos(NBT_Tag * tag, const char * xName, const char * yName, const char * zName,
+                       int32_t dx, int32_t dy, int32_t dz)
+{
+    NBT_TagCompound * ent = static_cast<NBT_TagCompound *>(tag);
+    NBT_TagInt * x = ent->GetTag<NBT_TagInt>(xName, (NBT_TagInt *)NULL);
+    NBT_TagInt * y = ent->GetTag<NBT_TagInt>(yName, (NBT_TagInt *)NULL);
+    NBT_TagInt * z = ent->GetTag<NBT_TagInt>(zName, (NBT_TagInt *)NULL);
+    if(x && y && z) {
+        x->value += dx; y->value += dy; z->value += dz;
+    }
+}
+
+static void MoveEntity(NBT_Tag * tag, int32_t dx, int32_t dy, int32_t dz)
+{
+    NBT_TagList * posTag = static_cast<NBT_TagCompound *>(tag)->GetTag<NBT_TagList>("Pos");
+    static_cast<NBT_TagDouble *>(posTag->values[0])->value += dx;
+    static_cast<NBT_TagDouble *>(posTag->values[1])->value += dy;
+    static_cast<NBT_TagDouble *>(posTag->values[2])->value += dz;
+    MoveIntPos(tag, "TileX", "TileY", "TileZ", dx, dy, dz);
+}
+
+static bool InBox(const int32_t pos[3], const int32_t boxMin[3], const int32_t boxSize[3])
+{
+    for(int j = 0; j < 3; ++j)
+        if(pos[j] < boxMin[j] || pos[j] >= boxMin[j] + boxSize[j])
+            return false;
+    return true;
+}
+
+static void ClearList(NBT_TagList & list)
+{
+    for(size_t j = 0; j < list.values.size(); ++j)
+        delete list.values[j];
+    list.values.clear();
+}
+
+// Copy column runs from chunks to buffer. Each chunk is decoded to scratch planes
+// once, on its first run.
+struct CopyFromOp {
+    uint8_t * dst[4];
+    const MC_Chunk * chunk;
+    std::vector<uint8_t> planes;
+    
+    CopyFromOp(): chunk(NULL), planes(4*MC_Chunk::kPlaneSize) {}
+    void operator()(const MC_Chunk * c, size_t idx, size_t n, size_t outIdx) {
+        if(c != chunk) {
+            chunk = c;
+            chunk->ReadTypes(&planes[0]);
+            for(int p = 0; p < 3; ++p)
+                chunk->ReadPlane(&planes[(p + 1)*MC_Chunk::kPlaneSize], p);
+        }
+        for(int p = 0; p < 4; ++p)
+            memcpy(dst[p] + outIdx, &planes[p*MC_Chunk::kPlaneSize + idx], n);
+    }
+};
+
+// Copy or merge column runs from buffer to chunks. Each chunk is switched to unpacked
+// mode while being written, so runs are plain byte copies, and returned to its
+// previous mode when done.
+struct PasteOp {
+    const uint8_t * src[4];
+    bool merge;
+    MC_Chunk * chunk;
+    bool wasUnpacked;
+    uint8_t * dst[4];
+    
+    PasteOp(bool m): merge(m), chunk(NULL), wasUnpacked(false) {}
+    ~PasteOp() {Finish();}
+    
+    void Finish() {
+        if(chunk && !wasUnpacked)
+            chunk->Pack();
+        chunk = NULL;
+    }
+    void operator()(MC_Chunk * c, size_t idx, size_t n, size_t outIdx) {
+        if(c != chunk) {
+            Finish();
+            chunk = c;
+            wasUnpacked = chunk->IsUnpacked();
+            chunk->Unpack();
+            chunk->SetDirty();
+            dst[0] = chunk->EditBlocks();
+            for(int p = 0; p < 3; ++p)
+                dst[p + 1] = chunk->EditPlane(p);
+        }
+        if(merge) {
+            // Keyed on the buffer's block types, so air in the buffer leaves all planes alone
+            for(int p = 0; p < 4; ++p)
+                CopyWhereNonzero(dst[p] + idx, src[p] + outIdx, src[0] + outIdx, n);
+        }
+        else {
+            for(int p = 0; p < 4; ++p)
+                memcpy(dst[p] + idx, src[p] + outIdx, n);
+        }
+    }
+};
+
+void MC_BlockBuffer::CopyFrom(MC_World & world, int xPos, int yPos, int zPos)
+{
+    std::fill(blocks.begin(), blocks.end(), (uint8_t)kBT_Air);
+    std::fill(data.begin(), data.end(), 0);
+    std::fill(skylight.begin(), skylight.end(), 0);
+    std::fill(blocklight.begin(), blocklight.end(), 0);
+    if(blocks.empty())
+        return;
+    
+    CopyFromOp op;
+    op.dst[0] = &blocks[0];
+    op.dst[1] = &data[0];
+    op.dst[2] = &skylight[0];
+    op.dst[3] = &blocklight[0];
+    ForEachBoxRun<MC_World, const MC_Chunk>(world, op, xPos, yPos, zPos,
+                                            xPos + xSize - 1, yPos + ySize - 1, zPos + zSize - 1);
+    
+    ClearList(entities);
+    ClearList(tileEntities);
+    int32_t boxMin[3] = {xPos, yPos, zPos};
+    int32_t boxSize[3] = {xSize, ySize, zSize};
+    for(int32_t cx = xPos >> 4; cx <= ((xPos + xSize - 1) >> 4); ++cx)
+    for(int32_t cz = zPos >> 4; cz <= ((zPos + zSize - 1) >> 4); ++cz)
+    {
+        MC_Chunk * chunk = world.ChunkAt(cx, cz);
+        if(!chunk)
+            continue;
+        
+        std::vector<NBT_Tag *> & ents = chunk->GetEntities()->values;
+        for(size_t j = 0; j < ents.size(); ++j)
+        {
+            double p[3];
+            int32_t ip[3];
+            if(!GetEntityPos(ents[j], p))
+                continue;
+            for(int k = 0; k < 3; ++k)
+                ip[k] = (int32_t)floor(p[k]);
+            if(InBox(ip, boxMin, boxSize)) {
+                NBT_Tag * ent = ents[j]->Clone();
+                MoveEntity(ent, -xPos, -yPos, -zPos);
+                entities.values.push_back(ent);
+            }
+        }
+        
+        std::vector<NBT_Tag *> & tiles = chunk->GetTileEntities()->values;
+        for(size_t j = 0; j < tiles.size(); ++j)
+        {
+            int32_t ip[3];
+            if(GetIntPos(tiles[j], "x", "y", "z", ip) && InBox(ip, boxMin, boxSize)) {
+                NBT_Tag * te = tiles[j]->Clone();
+                MoveIntPos(te, "x", "y", "z", -xPos, -yPos, -zPos);
+                tileEntities.values.push_back(te);
+            }
+        }
+    }
+}
+
+void MC_BlockBuffer::PasteTo(MC_World & world, int xPos, int yPos, int zPos, bool merge)
+{
+    if(blocks.empty())
+        return;
+    
+    {
+        PasteOp op(merge);
+        op.src[0] = &blocks[0];
+        op.src[1] = &data[0];
+        op.src[2] = &skylight[0];
+        op.src[3] = &blocklight[0];
+        ForEachBoxRun<MC_World, MC_Chunk>(world, op, xPos, yPos, zPos,
+                                          xPos + xSize - 1, yPos + ySize - 1, zPos + zSize - 1);
+    }
+    
+    // Remove entities displaced by the paste: everything in the box for a copy, only
+    // tile entities whose block has been replaced for a merge.
+    int32_t boxMin[3] = {xPos, yPos, zPos};
+    int32_t boxSize[3] = {xSize, ySize, zSize};
+    for(int32_t cx = xPos >> 4; cx <= ((xPos + xSize - 1) >> 4); ++cx)
+    for(int32_t cz = zPos >> 4; cz <= ((zPos + zSize - 1) >> 4); ++cz)
+    {
+        MC_Chunk * chunk = world.ChunkAt(cx, cz);
+        if(!chunk)
+            continue;
+        
+        if(!merge) {
+            std::vector<NBT_Tag *> & ents = chunk->GetEntities()->values;
+            size_t kept = 0;
+            for(size_t j = 0; j < ents.size(); ++j)
+            {
+                double p[3];
+                int32_t ip[3] = {INT_MIN, INT_MIN, INT_MIN};
+                if(GetEntityPos(ents[j], p))
+                    for(int k = 0; k < 3; ++k)
+                        ip[k] = (int32_t)floor(p[k]);
+                if(InBox(ip, boxMin, boxSize))
+                    delete ents[j];
+                else
+                    ents[kept++] = ents[j];
+            }
+            ents.resize(kept);
+        }
+        
+        std::vector<NBT_Tag *> & tiles = chunk->GetTileEntities()->values;
+        size_t kept = 0;
+        for(size_t j = 0; j < tiles.size(); ++j)
+        {
+            int32_t ip[3];
+            bool replaced = GetIntPos(tiles[j], "x", "y", "z", ip) && InBox(ip, boxMin, boxSize) &&
+                (!merge || blocks[GetIdx(ip[0] - xPos, ip[1] - yPos, ip[2] - zPos)] != kBT_Air);
+            if(replaced)
+                delete tiles[j];
+            else
+                tiles[kept++] = tiles[j];
+        }
+        tiles.resize(kept);
+    }
     
+    // Add buffer's entities to the chunks they land in
+    for(size_t j = 0; j < entities.values.size(); ++j)
+    {
+        double p[3];
+        if(!GetEntityPos(entities.values[j], p))
+            continue;
+        MC_Chunk * chunk = world.ChunkAt(((int32_t)floor(p[0]) + xPos) >> 4, ((int32_t)floor(p[2]) + zPos) >> 4);
+        if(chunk) {
+            NBT_Tag * ent = entities.values[j]->Clone();
+            MoveEntity(ent, xPos, yPos, zPos);
+            chunk->GetEntities()->values.push_back(ent);
+        }
+    }
+    for(size_t j = 0; j < tileEntities.values.size(); ++j)
+    {
+        int32_t ip[3];
+        if(!GetIntPos(tileEntities.values[j], "x", "y", "z", ip))
+            continue;
+        MC_Chunk * chunk = world.ChunkAt((ip[0] + xPos) >> 4, (ip[2] + zPos) >> 4);
+        if(chunk) {
+            NBT_Tag * te = tileEntities.values[j]->Clone();
+            MoveIntPos(te, "x", "y", "z", xPos, yPos, zPos);
+            chunk->GetTileEntities()->values.push_back(te);
+        }
+    }
 }
 //******************************************************************************
@@ -33,8 +33,12 @@
 
 #include "nbt.h"
 #include "pngimage.h"
-#include "array2d.h"
+#include "chunktable.h"
+#include "compactblocks.h"
+#include "heightmap.h"
+#include "blocksearch.h"
 #include "blocktypes.h"
+#include "threadpool.h"
 
 #include <sys/time.h>
 
@@ -45,6 +49,14 @@ struct MC_Block {
     uint8_t blocklight;
 };
 
+// A block edit recorded for incremental relighting, with the light the block had
+// before the edit.
+struct MC_LightChange {
+    int32_t x, y, z;
+    uint8_t skylight;
+    uint8_t blocklight;
+};
+
 
 static inline int64_t MC_Timestamp() {
     timeval tp;
@@ -68,6 +80,16 @@ class MC_Chunk {
     int64_t lastupdate;
     int8_t populated;
     bool dirty;
+    // Block types present, computed when first needed after the blocks change
+    mutable MC_BlockSet typesPresent;
+    mutable bool typesKnown;
+    
+    std::vector<uint8_t> planes;// data, skylight, blocklight planes in unpacked mode
+    bool unpacked;
+    mutable bool planesModified;
+    
+    // Run length encoded blocks in compact mode, NULL otherwise
+    mutable MC_CompactBlocks * compact;
     
   public:// public members
     int32_t xPos;
@@ -76,16 +98,33 @@ class MC_Chunk {
   private:
     void SetupFromNBT();
     
+    static uint8_t GetNibble(const std::vector<uint8_t> & arr, size_t idx) {
+        return (idx & 0x01)? (arr[idx >> 1] >> 4) : (arr[idx >> 1] & 0x0F);
+    }
+    void SetValue(int plane, std::vector<uint8_t> & arr, uint8_t val, size_t idx) {
+        if(compact)
+            Expand();
+        if(unpacked) {
+            planes[plane*kPlaneSize + idx] = val & 0x0F;
+            planesModified = true;
+        }
+        else if(idx & 0x01)
+            arr[idx >> 1] = (val << 4) | (arr[idx >> 1] & 0x0F);
+        else
+            arr[idx >> 1] = (arr[idx >> 1] & 0xF0) | (val & 0x0F);
+    }
+    
   public:
     MC_Chunk(NBT_TagCompound * cNBT);
     MC_Chunk(int32_t x, int32_t z);
-    ~MC_Chunk() {delete chunkNBT;}
+    ~MC_Chunk() {delete chunkNBT; delete compact;}
     
-    NBT_TagCompound * GetChunkNBT() {return chunkNBT;}
-    const NBT_TagCompound * GetChunkNBT() const {return chunkNBT;}
+    NBT_TagCompound * GetChunkNBT() {Expand(); SyncNBT(); typesKnown = false; return chunkNBT;}
+    const NBT_TagCompound * GetChunkNBT() const {Expand(); SyncNBT(); return chunkNBT;}
     
     void SetHeightmap(int32_t x, int32_t z, uint8_t val) {(*heightmap)[z*16 + x] = val;}
     uint8_t GetHeightmap(int32_t x, int32_t z) const {return (*heightmap)[z*16 + x];}
+    uint8_t * EditHeightmap() {return &(*heightmap)[0];}
 
 static int32_t GetIdx(int32_t x, int32_t y, int32_t z) {return (x*16 + z)*128 + y;}
 // Compute indices of neighboring blocks
@@ -97,64 +136,124 @@ static int32_t GetIdxU(int32_t idx) {return idx + 1;}
 //static int32_t GetIdxW(int32_t idx) {return idx + ;}
 static bool IdxGood(int32_t idx) {return idx > 0 && idx < (16*16*128);}
     
-    void GetBlock(MC_Block & block, int32_t x, int32_t y, int32_t z) const {
-        size_t idx = GetIdx(x, y, z);
-        size_t halfidx = idx >> 1;
-        block.type = (*blocks)[idx];
-        if(idx & 0x01) {
-            block.data = ((*data)[halfidx] >> 4);
-            block.skylight = ((*skylight)[halfidx] >> 4);
-            block.blocklight = ((*blocklight)[halfidx] >> 4);
-        }
-        else {
-            block.data = ((*data)[halfidx] & 0x0F);
-            block.skylight = ((*skylight)[halfidx] & 0x0F);
-            block.blocklight = ((*blocklight)[halfidx] & 0x0F);
-        }
+    void GetBlock(MC_Block & block, int32_t x, int32_t y, int32_t z) const {GetBlock(block, GetIdx(x, y, z));}
+    void GetBlock(MC_Block & block, size_t idx) const {
+        block.type = GetType(idx);
+        block.data = GetData(idx);
+        block.skylight = GetSkylight(idx);
+        block.blocklight = GetBlocklight(idx);
     }
     
-    void SetBlock(const MC_Block & block, int32_t x, int32_t y, int32_t z) const {
-        size_t idx = GetIdx(x, y, z);
-        size_t halfidx = idx >> 1;
-        (*blocks)[idx] = block.type;
-        if(idx & 0x01) {
-            (*data)[halfidx] = ((block.data << 4) & 0xF0) | ((*data)[halfidx] & 0x0F);
-            (*skylight)[halfidx] = ((block.skylight << 4) & 0xF0) | ((*skylight)[halfidx] & 0x0F);
-            (*blocklight)[halfidx] = ((block.blocklight << 4) & 0xF0) | ((*blocklight)[halfidx] & 0x0F);
-        }
-        else {
-            (*data)[halfidx] = ((*data)[halfidx] & 0xF0) | (block.data & 0x0F);
-            (*skylight)[halfidx] = ((*skylight)[halfidx] & 0xF0) | (block.skylight & 0x0F);
-            (*blocklight)[halfidx] = ((*blocklight)[halfidx] & 0xF0) | (block.blocklight & 0x0F);
-        }
+    void SetBlock(const MC_Block & block, int32_t x, int32_t y, int32_t z) {SetBlock(block, GetIdx(x, y, z));}
+    void SetBlock(const MC_Block & block, size_t idx) {
+        SetType(block.type, idx);
+        SetData(block.data, idx);
+        SetSkylight(block.skylight, idx);
+        SetBlocklight(block.blocklight, idx);
     }
     
     
-    uint8_t GetType(size_t idx) const {return (*blocks)[idx];}
+    uint8_t GetType(size_t idx) const {return compact? compact->GetType(idx) : (*blocks)[idx];}
     uint8_t GetData(size_t idx) const {
-        size_t halfidx = idx >> 1;
-        return (idx & 0x01)? ((*data)[halfidx] >> 4) : ((*data)[halfidx] & 0x0F);
+        if(compact) return compact->GetData(idx);
+        return unpacked? planes[idx] : GetNibble(*data, idx);
     }
     uint8_t GetSkylight(size_t idx) const {
-        size_t halfidx = idx >> 1;
-        return (idx & 0x01)? ((*skylight)[halfidx] >> 4) : ((*skylight)[halfidx] & 0x0F);
+        if(compact) return compact->GetSkylight(idx);
+        return unpacked? planes[kPlaneSize + idx] : GetNibble(*skylight, idx);
     }
     uint8_t GetBlocklight(size_t idx) const {
-        size_t halfidx = idx >> 1;
-        return (idx & 0x01)? ((*blocklight)[halfidx] >> 4) : ((*blocklight)[halfidx] & 0x0F);
+        if(compact) return compact->GetBlocklight(idx);
+        return unpacked? planes[2*kPlaneSize + idx] : GetNibble(*blocklight, idx);
     }
     
-    void SetType(uint8_t bt, size_t idx) const {(*blocks)[idx] = bt;}
-    void SetData(uint8_t bd, size_t idx) const {
-        size_t halfidx = idx >> 1;
-        if(idx & 0x01)
-            (*data)[halfidx] = (bd << 4) | ((*data)[halfidx] & 0x0F);
-        else
-            (*data)[halfidx] = ((*data)[halfidx] & 0xF0) | (bd & 0x0F);
+    void SetType(uint8_t bt, size_t idx) {
+        if(compact)
+            Expand();
+        typesKnown = false;
+        (*blocks)[idx] = bt;
+    }
+    void SetData(uint8_t bd, size_t idx) {SetValue(kPlaneData, *data, bd, idx);}
+    void SetSkylight(uint8_t sl, size_t idx) {SetValue(kPlaneSkylight, *skylight, sl, idx);}
+    void SetBlocklight(uint8_t bl, size_t idx) {SetValue(kPlaneBlocklight, *blocklight, bl, idx);}
+    
+    // Unpacked mode keeps data and lighting as byte-per-block planes, so that full
+    // chunk passes and heavy editing avoid decoding nibbles at each access. Costs an
+    // extra 96 KB per chunk. The packed arrays in the chunk NBT are updated from the
+    // planes when the NBT is next requested, so saving works as usual.
+    enum {kPlaneData, kPlaneSkylight, kPlaneBlocklight};
+    static const size_t kPlaneSize = 16*16*128;
+    
+    void Unpack();
+    // Return to packed mode, writing back any changes made while unpacked.
+    void Pack();
+    bool IsUnpacked() const {return unpacked;}
+    // Update packed arrays from planes if they have been modified.
+    void SyncNBT() const;
+    
+    // Compact mode replaces the block, data and lighting arrays with a run length
+    // encoded copy (see MC_CompactBlocks), usually a small fraction of the size, for
+    // holding large areas in memory. Reads work in place, if more slowly. Anything
+    // that writes to the chunk or needs the raw arrays, including GetChunkNBT(),
+    // expands it back to normal mode first. Hot loops over compact chunks should
+    // decode to scratch buffers with ReadTypes() and ReadPlane().
+    void Compact();
+    // Return to normal mode. Only changes representation, so logically const, but
+    // must not be called while other threads are reading the chunk.
+    void Expand() const;
+    bool IsCompact() const {return compact != NULL;}
+    // Approximate memory used by blocks, data and lighting
+    size_t StorageBytes() const;
+    
+    // Direct access to block types and, in unpacked mode, to the planes. Indexed like
+    // GetType(). EditPlane() marks the plane as modified. Blocks() is NULL in compact
+    // mode rather than expanding the chunk, so const access never changes it and is
+    // safe from several threads at once: use ReadTypes() for compact chunks.
+    const uint8_t * Blocks() const {return compact? NULL : &(*blocks)[0];}
+    uint8_t * EditBlocks() {Expand(); typesKnown = false; return &(*blocks)[0];}
+    const uint8_t * Plane(int plane) const {return unpacked? &planes[plane*kPlaneSize] : NULL;}
+    uint8_t * EditPlane(int plane) {
+        if(!unpacked)
+            return NULL;
+        planesModified = true;
+        return &planes[plane*kPlaneSize];
     }
+    // Set of block types in the chunk, for skipping chunks that can't match a search.
+    // Kept until the blocks are changed, then recomputed on the next call.
+    const MC_BlockSet & TypesPresent() const;
+    bool MayContain(uint8_t type) const {return TypesPresent().Contains(type);}
+    
+    // Expand block types or a plane into dst (kPlaneSize bytes) without changing modes.
+    void ReadTypes(uint8_t * dst) const;
+    void ReadPlane(uint8_t * dst, int plane) const;
+    
+    // Operations on the run of n blocks starting at idx. Runs along y within a column
+    // are contiguous, so whole columns of the box are handled at once: types are
+    // filled with memset(), nibble arrays a byte at a time except at the ends.
+    void FillSpan(const MC_Block & block, size_t idx, size_t n);
+    // Replace blocks of type fromType, returns number replaced
+    size_t ReplaceSpan(uint8_t fromType, const MC_Block & block, size_t idx, size_t n);
+    // As above, but setting only type and data, leaving lighting alone
+    void FillTypeSpan(uint8_t bt, uint8_t bd, size_t idx, size_t n);
+    size_t ReplaceTypeSpan(uint8_t fromType, uint8_t bt, uint8_t bd, size_t idx, size_t n);
+    // Types are copied and nibble arrays expanded a run at a time, not per block
+    void ReadSpan(MC_Block * out, size_t idx, size_t n) const;
+    
+    bool IsDirty() const {return dirty;}
+    void SetDirty(bool d = true) {dirty = d;}
+    
+    NBT_TagList * GetEntities() {return entities;}
+    NBT_TagList * GetTileEntities() {return tileEntities;}
 };
 
 
+// Append to changes the blocks of the run of n blocks at idx whose type is about to be
+// set to type, with their current light, for MC_RelightChanges(). If fromType is
+// given (>= 0), only blocks of that type are recorded.
+void MC_RecordTypeChanges(std::vector<MC_LightChange> & changes, const MC_Chunk & chunk,
+                          size_t idx, size_t n, uint8_t type, int fromType = -1);
+
+
 // TODO:
 // Either remove this, replace with an interface wrapping a Ruby MC_World, or
 // turn the Ruby API into a wrapper for it.
@@ -162,7 +261,10 @@ class MC_World {
   protected:
     std::string worldPath;
     std::vector<MC_Chunk *> allChunks;
-    Array2D<MC_Chunk *> chunks;
+    ChunkTable<MC_Chunk *> chunks;
+    bool compactStorage;
+    bool lightTracking;
+    std::vector<MC_LightChange> lightChanges;
     
   public:// public members
     // Map info:
@@ -188,13 +290,44 @@ class MC_World {
     // returns 0 on success, -1 on failure
     // int Write(const std::string & wPath);
     
-    // AddChunk() only adds a chunk to allChunks and recomputes the map dimensions.
-    // If chunks are added to the map, RebuildGrid() must be called to recompute
-    // the chunk grid and do other tasks..
+    // AddChunk() adds a chunk to allChunks and the chunk table, and recomputes the
+    // map dimensions. The chunk is immediately available through ChunkAt().
     void AddChunk(MC_Chunk * chunk);
-    void RebuildGrid();
     
-    void CalcHeightmap();
+    // Keep chunks in compact mode (see MC_Chunk::Compact()), for analysis of worlds
+    // too large to hold uncompressed. Turning it on compacts all current chunks and
+    // any added later. Chunks that are written to are expanded: call CompactChunks()
+    // after a batch of edits to compact them again.
+    void SetCompactStorage(bool on);
+    bool CompactStorage() const {return compactStorage;}
+    void CompactChunks();
+    // Approximate memory used by blocks, data and lighting of all chunks
+    size_t StorageBytes() const;
+    
+    // Recompute heightmaps of all chunks, or only dirty ones, on numThreads threads
+    // (one per processor if <= 0). See MC_ComputeHeightmap().
+    void CalcHeightmap(bool dirtyOnly = true, int numThreads = 0);
+    // Recompute sky and block light of dirty chunks and the chunks beside them, on
+    // numThreads threads, along with their heightmaps. See MC_LightEngine. Returns
+    // the number of chunks relit, which are marked dirty.
+    size_t CalcLighting(int numThreads = 0);
+    
+    // Record block edits made with SetBlock(), MC_BlockCursor, FillBox() and
+    // ReplaceBox(), for UpdateLighting(). Box operations record only the blocks whose type changes.
+    // Pasted buffers aren't recorded: follow them with CalcLighting().
+    void SetLightTracking(bool on) {lightTracking = on; if(!on) lightChanges.clear();}
+    bool LightTracking() const {return lightTracking;}
+    size_t PendingLightChanges() const {return lightChanges.size();}
+    void RecordLightChange(const MC_Chunk * chunk, size_t idx, int32_t x, int32_t y, int32_t z) {
+        if(lightTracking) {
+            MC_LightChange change = {x, y, z, chunk->GetSkylight(idx), chunk->GetBlocklight(idx)};
+            lightChanges.push_back(change);
+        }
+    }
+    // Relight around the recorded edits, only as far as their effects reach, and
+    // update heightmaps of the edited columns. See MC_RelightChanges(). Returns the
+    // number of light values set.
+    size_t UpdateLighting();
     void SetHeightmap(int x, int z, int height);
     
     
@@ -202,55 +335,218 @@ class MC_World {
     const std::vector<MC_Chunk *> & GetAllChunks() const {return allChunks;}
     
     
-    // Get chunk at given chunk location. Return NULL if location is out of bounds
-    // or has no chunk. Location is in chunk coordinates, which are block coordinates/16.
-    MC_Chunk * ChunkAt(int x, int z) {
-        if(x < xChunkMin || x > xChunkMax ||
-           z < zChunkMin || z > zChunkMax)
-            return NULL;
-        else
-            return chunks[x - xChunkMin][z - zChunkMin];
-    }
-    const MC_Chunk * ChunkAt(int x, int z) const {
-        if(x < xChunkMin || x > xChunkMax ||
-           z < zChunkMin || z > zChunkMax)
-            return NULL;
-        else
-            return chunks[x - xChunkMin][z - zChunkMin];
-    }
+    // Get chunk at given chunk location. Return NULL if location has no chunk.
+    // Location is in chunk coordinates, which are block coordinates/16.
+    MC_Chunk * ChunkAt(int x, int z) {return chunks.Get(x, z);}
+    const MC_Chunk * ChunkAt(int x, int z) const {return chunks.Get(x, z);}
+    
+    // The page of the chunk table holding the 32x32 chunk region containing chunk
+    // x, z, or NULL if no chunks have been added there. For loops over many
+    // neighboring chunks.
+    const ChunkTable<MC_Chunk *>::Page * RegionAt(int x, int z) const {return chunks.FindPage(x, z);}
     
     // Get a block, returns "air" block if chunk doesn't exist for location
     MC_Block GetBlock(int32_t x, int32_t y, int32_t z) const;
     
     // Set a block, creating chunk if necessary.
+    // For many blocks, use MC_BlockCursor or the box operations, which avoid repeating
+    // the chunk lookup for each block.
     void SetBlock(const MC_Block & block, int32_t x, int32_t y, int32_t z);
+    
+    // Bulk operations on the box from x0, y0, z0 to x1, y1, z1 inclusive (corners may
+    // be given in any order). The box is processed a chunk at a time, one column run
+    // at a time, with no per-block chunk lookups. Blocks in chunks that don't exist are
+    // skipped, as are those outside 0 <= y < 128.
+    // FillBox() and ReplaceBox() return the number of blocks set. Given a type and
+    // data, they leave lighting to CalcLighting() or UpdateLighting(); given a block,
+    // they set its light as well.
+    size_t FillBox(uint8_t type, uint8_t data, int32_t x0, int32_t y0, int32_t z0,
+                   int32_t x1, int32_t y1, int32_t z1);
+    size_t FillBox(const MC_Block & block, int32_t x0, int32_t y0, int32_t z0,
+                   int32_t x1, int32_t y1, int32_t z1);
+    size_t ReplaceBox(uint8_t fromType, uint8_t type, uint8_t data,
+                      int32_t x0, int32_t y0, int32_t z0, int32_t x1, int32_t y1, int32_t z1);
+    size_t ReplaceBox(uint8_t fromType, const MC_Block & block,
+                      int32_t x0, int32_t y0, int32_t z0, int32_t x1, int32_t y1, int32_t z1);
+    // Read box into out, resized to hold it and indexed ((x - x0)*zSize + (z - z0))*ySize + (y - y0),
+    // the same order as chunk data. Missing blocks read as air.
+    void ReadBox(std::vector<MC_Block> & out, int32_t x0, int32_t y0, int32_t z0,
+                 int32_t x1, int32_t y1, int32_t z1) const;
+    
+    // Chunks holding any of the given block types, found with MC_Chunk::TypesPresent()
+    // without searching their blocks.
+    void ChunksContaining(const MC_BlockSet & types, std::vector<MC_Chunk *> & out) const;
+    // Find blocks matching query, appending their coordinates to out as x, y, z
+    // triples. Only chunks that may hold the types are searched, on numThreads
+    // threads (one per processor if <= 0). See MC_FindBlocks(). Returns the number
+    // of blocks found.
+    size_t FindBlocks(const MC_BlockQuery & query, std::vector<int32_t> & out, int numThreads = 0) const;
+};
+
+
+// Cursor for walking through the blocks of a world. The current chunk and block index
+// are cached, so stepping to a neighboring block only does a chunk lookup when
+// crossing into another chunk, and moving within the current chunk none at all.
+// Stepping along y is the cheapest, followed by z then x, matching the order of the
+// chunk data.
+// The cursor may be moved outside of existing chunks or the 0-127 height range, in
+// which case Valid() is false, reads return air and writes are ignored. Chunks must
+// not be removed from the world while a cursor is in use.
+// World is a MC_World, or anything else with ChunkAt() returning Chunk pointers, such
+// as the MC_ChunkMap used for lighting. Get() and Set() need a MC_World and MC_Chunk.
+template<typename World, typename Chunk>
+class MC_BlockCursorOf {
+    World * world;
+    Chunk * column;// chunk at x, z whatever y is
+    Chunk * chunk;// column if y is in range, NULL otherwise
+    int32_t x, y, z;
+    int32_t cx, cz;
+    size_t idx;
+    
+    void Relocate() {
+        // Missing chunks are looked up again, as they may have been added since
+        if(!column || (x >> 4) != cx || (z >> 4) != cz) {
+            cx = x >> 4;
+            cz = z >> 4;
+            column = world->ChunkAt(cx, cz);
+        }
+        chunk = (y >= 0 && y < 128)? column : NULL;
+        idx = chunk? MC_Chunk::GetIdx(x & 15, y, z & 15) : 0;
+    }
+    
+  public:
+    MC_BlockCursorOf(World & w, int32_t xx = 0, int32_t yy = 0, int32_t zz = 0):
+        world(&w), column(NULL), chunk(NULL), x(xx), y(yy), z(zz), cx(0), cz(0), idx(0)
+    {Relocate();}
+    
+    void MoveTo(int32_t xx, int32_t yy, int32_t zz) {x = xx; y = yy; z = zz; Relocate();}
+    
+    int32_t X() const {return x;}
+    int32_t Y() const {return y;}
+    int32_t Z() const {return z;}
+    bool Valid() const {return chunk != NULL;}
+    Chunk * GetChunk() const {return chunk;}
+    size_t Index() const {return idx;}
+    
+    void XInc() {if((++x & 15) == 0 || !chunk) Relocate(); else idx += 16*128;}
+    void XDec() {if((x-- & 15) == 0 || !chunk) Relocate(); else idx -= 16*128;}
+    void ZInc() {if((++z & 15) == 0 || !chunk) Relocate(); else idx += 128;}
+    void ZDec() {if((z-- & 15) == 0 || !chunk) Relocate(); else idx -= 128;}
+    void YInc() {if(++y >= 128 || !chunk) Relocate(); else ++idx;}
+    void YDec() {if(--y < 0 || !chunk) Relocate(); else --idx;}
+    // Step to a face neighbor, dir 0 to 5 for -x, +x, -y, +y, -z, +z. Step(dir ^ 1)
+    // steps back.
+    void Step(int dir) {
+        switch(dir) {
+          case 0: XDec(); break;
+          case 1: XInc(); break;
+          case 2: YDec(); break;
+          case 3: YInc(); break;
+          case 4: ZDec(); break;
+          case 5: ZInc(); break;
+        }
+    }
+    
+    MC_Block Get() const {
+        MC_Block block = {kBT_Air, 0x0, 0x0, 0x0};
+        if(chunk)
+            chunk->GetBlock(block, idx);
+        return block;
+    }
+    uint8_t GetType() const {return chunk? chunk->GetType(idx) : (uint8_t)kBT_Air;}
+    
+    void Set(const MC_Block & block) {
+        if(chunk) {
+            world->RecordLightChange(chunk, idx, x, y, z);
+            chunk->SetBlock(block, idx);
+            chunk->SetDirty();
+        }
+    }
+    void SetType(uint8_t bt) {
+        if(chunk) {
+            world->RecordLightChange(chunk, idx, x, y, z);
+            chunk->SetType(bt, idx);
+            chunk->SetDirty();
+        }
+    }
 };
 
+typedef MC_BlockCursorOf<MC_World, MC_Chunk> MC_BlockCursor;
+
+
+// Convert a world in the old Alpha format (one gzipped file per chunk, in directories
+// named for the chunk coordinates mod 64) to region files in worldPath/region. Chunk
+// files are read, inflated and recompressed in parallel on numThreads threads, one
+// region at a time per thread, and each region file is written in a single pass.
+// Progress is reported on stdout. Chunks that can't be read or are too large for a
+// region file are skipped and counted as errors.
+// numThreads <= 0 uses one thread per processor.
+// Nothing is converted if any of the region files already exist, unless overwrite
+// is set. If stop is given and set while converting, regions not yet started are
+// left unconverted.
+// Returns the number of chunks converted, or -1 if region files exist.
+int MC_ConvertAlphaWorld(const std::string & worldPath, int numThreads = 0, bool overwrite = false,
+                         StopFlag * stop = NULL);
+
 
 // An arbitarily-sized chunk of blocks, to be operated on as a mass and broken into standard
 // chunks at a later point.
+// Blocks are stored a byte per value and in the same order as chunk data, indexed
+// (x*zSize + z)*ySize + y, so copies to and from chunks are runs of whole columns.
+// Entities and tile entities are held with positions relative to the buffer.
 class MC_BlockBuffer {
     std::vector<uint8_t> blocks;
     std::vector<uint8_t> data;
     std::vector<uint8_t> skylight;
     std::vector<uint8_t> blocklight;
-    NBT_TagCompound * entities;
-    NBT_TagCompound * tileEntities;
+    NBT_TagList entities;
+    NBT_TagList tileEntities;
     int xSize, ySize, zSize;
+    
+    MC_BlockBuffer(const MC_BlockBuffer &);
+    MC_BlockBuffer & operator=(const MC_BlockBuffer &);
+    
+    void PasteTo(MC_World & world, int xPos, int yPos, int zPos, bool merge);
+    
   public:
     MC_BlockBuffer(int xS, int yS, int zS);
     
-//    MC_Block GetBlock(int x, int y, int z) {}
-//    void SetBlock(int x, int y, int z, const MC_Block & blk) {}
+    int XSize() const {return xSize;}
+    int YSize() const {return ySize;}
+    int ZSize() const {return zSize;}
+    size_t GetIdx(int x, int y, int z) const {return ((size_t)x*zSize + z)*ySize + y;}
+    
+    MC_Block GetBlock(int x, int y, int z) const {
+        size_t idx = GetIdx(x, y, z);
+        MC_Block blk = {blocks[idx], data[idx], skylight[idx], blocklight[idx]};
+        return blk;
+    }
+    void SetBlock(int x, int y, int z, const MC_Block & blk) {
+        size_t idx = GetIdx(x, y, z);
+        blocks[idx] = blk.type;
+        data[idx] = blk.data & 0x0F;
+        skylight[idx] = blk.skylight & 0x0F;
+        blocklight[idx] = blk.blocklight & 0x0F;
+    }
+    
+    NBT_TagList & GetEntities() {return entities;}
+    NBT_TagList & GetTileEntities() {return tileEntities;}
+    
+    // Buffer position xPos, yPos, zPos is the lowest corner of the box in the world.
+    // Parts of the box outside existing chunks or the 0-127 height range are skipped
+    // (read as air). Lighting is copied with the blocks, heightmaps are not updated.
     
     // Copy block and item data to buffer from a world
     void CopyFrom(MC_World & world, int xPos, int yPos, int zPos);
     
-    // Copy block and item data from buffer to a world
-    void CopyTo(MC_World & world, int xPos, int yPos, int zPos);
+    // Copy block and item data from buffer to a world. Existing entities and tile
+    // entities in the box are removed.
+    void CopyTo(MC_World & world, int xPos, int yPos, int zPos) {PasteTo(world, xPos, yPos, zPos, false);}
     
     // Copy block and item data from buffer to a world, except do not replace blocks with air.
-    void MergeTo(MC_World & world, int xPos, int yPos, int zPos);
+    // Existing tile entities are removed only where a block is replaced, and existing
+    // entities are kept.
+    void MergeTo(MC_World & world, int xPos, int yPos, int zPos) {PasteTo(world, xPos, yPos, zPos, true);}
 };
 //******************************************************************************
 #endif // MINECRAFT_H
@@ -27,8 +27,6 @@
 
 using namespace std;
 
-int tagIndentLevel = 0;
-
 const std::string kTypeNames[] = {
     "TAG_End",
     "TAG_Byte",
@@ -52,8 +50,8 @@ NBT_Tag * Parse_TAG_List(const std::string & name, NBT_I & fin);
 
 NBT_Tag * Parse_TagData(nbt_tag_t type, const std::string & name, NBT_I & fin);
 
-//std::string TagTab() {return std::string(tagIndentLevel, '\t');}
-std::string TagTab() {return std::string(tagIndentLevel*2, ' ');}
+//std::string TagTab(int indent) {return std::string(indent, '\t');}
+std::string TagTab(int indent) {return std::string(indent*2, ' ');}
 
 //******************************************************************************
 NBT_TagCompound * LoadNBT_File(NBT_I & fin)
@@ -67,13 +65,16 @@ NBT_TagCompound * LoadNBT_File(NBT_I & fin)
     
     if(type != kNBT_TAG_Compound) {
         cerr << "Bad file format" << endl;
-        //return NULL;
-        exit(EXIT_FAILURE);
+        return NULL;
     }
     
     string name;
     fin.Parse_String(name);
     NBT_TagCompound * tag = Parse_TAG_Compound(name, fin);
+    if(fin.badData) {
+        delete tag;
+        return NULL;
+    }
     
 //    cerr << "File \"" << path << "\" loaded" << endl;
     return tag;
@@ -101,7 +102,7 @@ NBT_Tag * Parse_TAG_List(const std::string & name, NBT_I & fin)
 //    cerr << "Loading list \"" << name << "\", elements: " << size << endl;
     
     // Now, parse tag data entries without name or type
-    for(size_t j = 0; j < size; ++j)
+    for(size_t j = 0; j < size && !fin.badData; ++j)
         lst->values[j] = Parse_TagData(valueType, "", fin);
     
 //    cerr << "List \"" << name << "\" loaded" << endl;
@@ -115,7 +116,7 @@ NBT_TagCompound * Parse_TAG_Compound(const std::string & name, NBT_I & fin)
     NBT_TagCompound * compTag = new NBT_TagCompound;
     compTag->name = name;
 //    cerr << "Compound tag: \"" << name << "\"" << endl;
-    while(!fin.Eof()) {
+    while(!fin.Eof() && !fin.badData) {
 //        cerr << "Loading member of \"" << name << "\"" << endl;
         NBT_Tag * tag = Parse_Tag(fin);
         if(tag) {
@@ -138,7 +139,8 @@ NBT_Tag * Parse_Tag(NBT_I & fin)
     
     if(type >= kNBT_NumTagTypes) {
         cerr << "Invalid tag type: " << (int)type << endl;
-        abort();
+        fin.badData = true;
+        return NULL;
     }
 //    cerr << "Tag type " << (int)type << ", typename: " << kTypeNames[type] << endl;
     
@@ -194,21 +196,27 @@ NBT_Tag * Parse_TagData(nbt_tag_t type, const std::string & name, NBT_I & fin)
       break;
       default:
         cerr << "Unknown tag type" << endl;
-        exit(EXIT_FAILURE);
+        fin.badData = true;
     }
     return NULL;
 }
 
 //******************************************************************************
-void NBT_TagCompound::Print(std::ostream & ostrm)
+NBT_Tag * NBT_TagCompound::Clone() const
 {
-    ostrm << TagTab() << "TAG_Compound(\"" << name << "\"): " << tags.size() << " entries" << std::endl;
-    ostrm << TagTab() << '{' << std::endl;
-    ++tagIndentLevel;
+    NBT_TagCompound * copy = new NBT_TagCompound(name);
+    for(std::vector<NBT_Tag *>::const_iterator t = tags.begin(); t != tags.end(); ++t)
+        copy->AddTag((*t)->Clone());
+    return copy;
+}
+
+void NBT_TagCompound::Print(std::ostream & ostrm, int indent)
+{
+    ostrm << TagTab(indent) << "TAG_Compound(\"" << name << "\"): " << tags.size() << " entries" << std::endl;
+    ostrm << TagTab(indent) << '{' << std::endl;
     for(std::vector<NBT_Tag *>::iterator t = tags.begin(); t != tags.end(); ++t)
-        (*t)->Print(ostrm);
-    --tagIndentLevel;
-    ostrm << TagTab() << '}' << std::endl;
+        (*t)->Print(ostrm, indent + 1);
+    ostrm << TagTab(indent) << '}' << std::endl;
 }
 
 void NBT_TagCompound::Write(NBT_O & fout) const
@@ -227,16 +235,23 @@ void NBT_TagCompound::WriteData(NBT_O & fout) const
 
 //******************************************************************************
 
-void NBT_TagList::Print(std::ostream & ostrm)
+NBT_Tag * NBT_TagList::Clone() const
+{
+    NBT_TagList * copy = new NBT_TagList(name, valueType);
+    copy->values.reserve(values.size());
+    for(std::vector<NBT_Tag *>::const_iterator t = values.begin(); t != values.end(); ++t)
+        copy->values.push_back((*t)->Clone());
+    return copy;
+}
+
+void NBT_TagList::Print(std::ostream & ostrm, int indent)
 {
-    ostrm << TagTab() << "TAG_List(\"" << name << "\"): " << values.size()
+    ostrm << TagTab(indent) << "TAG_List(\"" << name << "\"): " << values.size()
           << " entries of type " << kTypeNames[valueType] << std::endl;
-    ostrm << TagTab() << '{' << std::endl;
-    ++tagIndentLevel;
+    ostrm << TagTab(indent) << '{' << std::endl;
     for(std::vector<NBT_Tag *>::iterator t = values.begin(); t != values.end(); ++t)
-        (*t)->Print(ostrm);
-    --tagIndentLevel;
-    ostrm << TagTab() << '}' << std::endl;
+        (*t)->Print(ostrm, indent + 1);
+    ostrm << TagTab(indent) << '}' << std::endl;
 }
 
 void NBT_TagList::Write(NBT_O & fout) const
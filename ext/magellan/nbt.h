@@ -66,9 +66,8 @@ enum nbt_tag_t {
 
 extern const std::string kTypeNames[];
 
-extern int tagIndentLevel;
 
-std::string TagTab();
+std::string TagTab(int indent);
 
 //******************************************************************************
 
@@ -79,11 +78,12 @@ struct NBT_Tag {
     NBT_Tag(const std::string nm): name(nm) {}
     virtual ~NBT_Tag() {}
     
-//    virtual NBT_Tag * Clone() const = 0;
+    // Deep copy of tag and any children
+    virtual NBT_Tag * Clone() const = 0;
     
     virtual nbt_tag_t Type() const = 0;
     
-    virtual void Print(std::ostream & ostrm) = 0;
+    virtual void Print(std::ostream & ostrm, int indent = 0) = 0;
     
     virtual void Write(NBT_O & fout) const {}
     virtual void WriteData(NBT_O & fout) const = 0;
@@ -170,9 +170,11 @@ struct NBT_TagCompound: public NBT_Tag {
         return (tag == tagsByName.end())? defVal : dynamic_cast<T *>(tag->second);
     }
     
+    virtual NBT_Tag * Clone() const;
+    
     virtual nbt_tag_t Type() const {return kNBT_TAG_Compound;}
     
-    virtual void Print(std::ostream & ostrm);
+    virtual void Print(std::ostream & ostrm, int indent = 0);
     virtual void Write(NBT_O & fout) const;
     virtual void WriteData(NBT_O & fout) const;
 };
@@ -190,11 +192,13 @@ struct NBT_TagList: public NBT_Tag {
         for(std::vector<NBT_Tag *>::iterator t = values.begin(); t != values.end(); ++t)
             delete *t;
     }
-  
+    
+    virtual NBT_Tag * Clone() const;
+    
     virtual nbt_tag_t Type() const {return kNBT_TAG_List;}
     virtual nbt_tag_t ValueType() const {return valueType;}
     
-    virtual void Print(std::ostream & ostrm);
+    virtual void Print(std::ostream & ostrm, int indent = 0);
     virtual void Write(NBT_O & fout) const;
     virtual void WriteData(NBT_O & fout) const;
 };
@@ -210,10 +214,12 @@ struct NBT_TagValue: public NBT_Tag {
     NBT_TagValue(const std::string & nm, T val = T()): NBT_Tag(nm), value(val) {}
     ~NBT_TagValue() {}
     
+    virtual NBT_Tag * Clone() const {return new NBT_TagValue(name, value);}
+    
     virtual nbt_tag_t Type() const {return -1;}
     
-    virtual void Print(std::ostream & ostrm) {
-        ostrm << TagTab() << kTypeNames[Type()] << "(\"" << name << "\"): " << value << std::endl;
+    virtual void Print(std::ostream & ostrm, int indent = 0) {
+        ostrm << TagTab(indent) << kTypeNames[Type()] << "(\"" << name << "\"): " << value << std::endl;
     }
     virtual void Write(NBT_O & fout) const {
         fout.NBT_Write((int8_t)Type());
@@ -229,8 +235,8 @@ template<>
 inline nbt_tag_t NBT_TagValue<int8_t>::Type() const {return kNBT_TAG_Byte;}
 
 template<>
-inline void NBT_TagValue<int8_t>::Print(std::ostream & ostrm) {
-    ostrm << TagTab() << kTypeNames[Type()] << "(\"" << name << "\"): " << (int)value << std::endl;
+inline void NBT_TagValue<int8_t>::Print(std::ostream & ostrm, int indent) {
+    ostrm << TagTab(indent) << kTypeNames[Type()] << "(\"" << name << "\"): " << (int)value << std::endl;
 }
 
 template<>
@@ -252,15 +258,13 @@ template<>
 inline nbt_tag_t NBT_TagValue<std::vector<uint8_t> >::Type() const {return kNBT_TAG_Byte_Array;}
 
 template<>
-inline void NBT_TagValue<std::vector<uint8_t> >::Print(std::ostream & ostrm) {
-    ostrm << TagTab() << "TAG_Byte_Array(\"" << name << "\"): " << value.size() << " bytes" << std::endl;
-    ostrm << TagTab() << '{' << std::endl;
-    ++tagIndentLevel;
+inline void NBT_TagValue<std::vector<uint8_t> >::Print(std::ostream & ostrm, int indent) {
+    ostrm << TagTab(indent) << "TAG_Byte_Array(\"" << name << "\"): " << value.size() << " bytes" << std::endl;
+    ostrm << TagTab(indent) << '{' << std::endl;
     for(std::vector<uint8_t>::iterator t = value.begin(); t != value.end(); ++t) {
         ostrm << (int)*t << ' ';
     }
-    --tagIndentLevel;
-    ostrm << TagTab() << "\n}" << std::endl;
+    ostrm << TagTab(indent) << "\n}" << std::endl;
 }
 
 template<>
@@ -278,6 +282,8 @@ typedef NBT_TagValue<std::string> NBT_TagString;
 
 //******************************************************************************
 
+// Parse a file's root TAG_Compound. Returns NULL if the file doesn't start with one or
+// holds an unknown tag type.
 NBT_TagCompound * LoadNBT_File(NBT_I & fin);
 int WriteNBT_File(const NBT_TagCompound * nbt, const std::string & path);
 
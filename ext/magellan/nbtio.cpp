@@ -41,20 +41,80 @@ bool sortbysize(const RegionBlock & a, const RegionBlock & b) {return a.size < b
 
 
 
+//******************************************************************************
+// NBT_RegionFilePool
+//******************************************************************************
+
+std::list<NBT_Region_IO *> NBT_RegionFilePool::openRegions;
+size_t NBT_RegionFilePool::maxOpen = 64;
+Mutex NBT_RegionFilePool::mutex;
+
+void NBT_RegionFilePool::SetMaxOpen(size_t n)
+{
+    MutexLock lock(mutex);
+    maxOpen = max(n, (size_t)1);
+    Trim();
+}
+
+void NBT_RegionFilePool::Touch(NBT_Region_IO * rgn)
+{
+    MutexLock lock(mutex);
+    if(rgn->inPool)
+        openRegions.splice(openRegions.begin(), openRegions, rgn->poolPos);
+    else
+        openRegions.push_front(rgn);
+    rgn->inPool = true;
+    rgn->poolPos = openRegions.begin();
+    Trim();
+}
+
+void NBT_RegionFilePool::Remove(NBT_Region_IO * rgn)
+{
+    MutexLock lock(mutex);
+    if(!rgn->inPool)
+        return;
+    openRegions.erase(rgn->poolPos);
+    rgn->inPool = false;
+}
+
+// Called with the pool mutex held
+void NBT_RegionFilePool::Trim()
+{
+    // Front entry is the region currently in use, never close it
+    std::list<NBT_Region_IO *>::iterator r = openRegions.end();
+    while(openRegions.size() > maxOpen && --r != openRegions.begin())
+    {
+        NBT_Region_IO * rgn = *r;
+        if(!rgn->mutex.TryLock())
+            continue;
+        r = openRegions.erase(r);
+        rgn->inPool = false;
+        rgn->CloseUnpooled();
+        rgn->mutex.Unlock();
+    }
+}
+
+//******************************************************************************
+// NBT_Region_IO
+//******************************************************************************
+
 NBT_Region_IO::NBT_Region_IO():
     regFile(NULL),
     fileSize(0),
+    inPool(false),
     chunkX(-1), chunkZ(-1),
-    decompBfr(NULL)
+    chunkBytes(0), rwPtr(0),
+    decompBfr(NULL),
+    writeCount(0)
 {
 }
 
 
 int NBT_Region_IO::Open(const std::string & fpath)
 {
-    if(regFile)
-        fclose(regFile);
+    CloseFile();
     
+    filePath = fpath;
     fileSize = 0;
     endUsedSectors = 0;
     regFile = fopen(fpath.c_str(), "r+b");
@@ -62,15 +122,57 @@ int NBT_Region_IO::Open(const std::string & fpath)
         std::cerr << "Could not open \"" << fpath << "\"" << std::endl;
         return -1;
     }
-    return ReadRegionTOC();
+    if(ReadRegionTOC() != 0)
+        return -1;
+    
+    NBT_RegionFilePool::Touch(this);
+    return 0;
 }
 
+int NBT_Region_IO::OpenFile()
+{
+    if(!regFile)
+    {
+        if(filePath.empty()) {
+            std::cerr << "No region file open" << std::endl;
+            return -1;
+        }
+        regFile = fopen(filePath.c_str(), "r+b");
+        if(!regFile) {
+            std::cerr << "Could not reopen \"" << filePath << "\"" << std::endl;
+            return -1;
+        }
+    }
+    NBT_RegionFilePool::Touch(this);
+    return 0;
+}
 
-NBT_Region_IO::~NBT_Region_IO() {
+void NBT_Region_IO::CloseFile()
+{
+    // Leave the pool first, so a Trim() on another thread can't close the file too
+    NBT_RegionFilePool::Remove(this);
+    CloseUnpooled();
+}
+
+void NBT_Region_IO::CloseUnpooled()
+{
     if(regFile)
         fclose(regFile);
+    regFile = NULL;
     if(decompBfr)
         delete[] decompBfr;
+    decompBfr = NULL;
+}
+
+void NBT_Region_IO::AllocChunkBuffer()
+{
+    if(!decompBfr)
+        decompBfr = new uint8_t[DECOMP_CHUNK_SIZE];
+}
+
+
+NBT_Region_IO::~NBT_Region_IO() {
+    CloseFile();
 }
 
 
@@ -125,6 +227,7 @@ int NBT_Region_IO::ReadRegionTOC()
     if(fileSize <= 8192) {
         std::cerr << "Input file too short" << std::endl;
         fclose(regFile);
+        regFile = NULL;
         return -1;
     }
     
@@ -145,8 +248,8 @@ int NBT_Region_IO::ReadRegionTOC()
     }
 //    cout << empty << " chunks are empty" << endl;
     fread(buf, 4096, 1, regFile);
-    for(int j = 0; j < 1024; ++j)
-        chunkTimestamps[j] = (buf[j] << 24) | (buf[j + 1] << 16) | (buf[j + 2] << 8) | buf[j + 3];
+    for(int j = 0, i = 0; j < 1024; ++j, i += 4)
+        chunkTimestamps[j] = (buf[i] << 24) | (buf[i + 1] << 16) | (buf[i + 2] << 8) | buf[i + 3];
     
     // build list of contiguous blocks of free sectors
     // There will be at most 1024 used blocks, and at most 1024 free blocks...
@@ -180,7 +283,7 @@ int NBT_Region_IO::ReadRegionTOC()
         crsr = j->start + j->size;
     }
     
-    endUsedSectors = chunkBlocksInOrder.back().start + chunkBlocksInOrder.back().size;
+    endUsedSectors = max(2, chunkBlocksInOrder.back().start + chunkBlocksInOrder.back().size);
     
     return 0;
 }
@@ -194,33 +297,41 @@ void NBT_Region_IO::UpdateTOC(size_t chunkIdx, const RegionBlock & chunkBlock)
     
     // Old block of sectors used by chunk is now free for reuse
     // Check for contiguous free blocks and combine them
-    freeBlocks.push_back(oldBlock);
-    for(size_t j = 0; j < freeBlocks.size(); ++j)
+    if(oldBlock.start > 0 && oldBlock.size > 0)
     {
-        if((freeBlocks[j].start + freeBlocks[j].size) == oldBlock.start)
-        {
-            freeBlocks[j].size += oldBlock.size;
-            make_heap(freeBlocks.begin(), freeBlocks.end(), sortbysize);
-            oldBlock.start = 0;
-            break;
-        }
-        else if((oldBlock.start + oldBlock.size) == freeBlocks[j].start)
+        for(size_t j = 0; j < freeBlocks.size();)
         {
-            freeBlocks[j].start = oldBlock.start;
-            make_heap(freeBlocks.begin(), freeBlocks.end(), sortbysize);
-            oldBlock.start = 0;
-            break;
+            if((freeBlocks[j].start + freeBlocks[j].size) == oldBlock.start) {
+                oldBlock.start = freeBlocks[j].start;
+                oldBlock.size += freeBlocks[j].size;
+                freeBlocks.erase(freeBlocks.begin() + j);
+            }
+            else if((oldBlock.start + oldBlock.size) == freeBlocks[j].start) {
+                oldBlock.size += freeBlocks[j].size;
+                freeBlocks.erase(freeBlocks.begin() + j);
+            }
+            else {
+                ++j;
+            }
         }
+        freeBlocks.push_back(oldBlock);
     }
-    if(oldBlock.start)// did not merge with existing block, insert
-        push_heap(freeBlocks.begin(), freeBlocks.end(), sortbysize);
     
     // Recompute endUsedSectors
-    endUsedSectors = 0;
+    endUsedSectors = 2;
     for(int j = 0; j < 1024; ++j) {
         if((chunkBlocks[j].start + chunkBlocks[j].size) > endUsedSectors)
             endUsedSectors = chunkBlocks[j].start + chunkBlocks[j].size;
     }
+    // Free space after the last used block is handled by appending, drop it from the
+    // free list so it can't be allocated twice.
+    for(size_t j = 0; j < freeBlocks.size();) {
+        if(freeBlocks[j].start >= endUsedSectors)
+            freeBlocks.erase(freeBlocks.begin() + j);
+        else
+            ++j;
+    }
+    make_heap(freeBlocks.begin(), freeBlocks.end(), sortbysize);
     
     buf[0] = ((chunkBlock.start >> 16) & 0xFF);
     buf[1] = ((chunkBlock.start >> 8) & 0xFF);
@@ -237,7 +348,7 @@ void NBT_Region_IO::UpdateTOC(size_t chunkIdx, const RegionBlock & chunkBlock)
     buf[1] = ((timestamp >> 16) & 0xFF);
     buf[2] = ((timestamp >> 8) & 0xFF);
     buf[3] = (timestamp & 0xFF);
-    fseek(regFile, 8*chunkIdx, SEEK_SET);
+    fseek(regFile, 4096 + 4*chunkIdx, SEEK_SET);
     fwrite(buf, 4, 1, regFile);
 }
 
@@ -245,7 +356,25 @@ void NBT_Region_IO::UpdateTOC(size_t chunkIdx, const RegionBlock & chunkBlock)
 int NBT_Region_IO::WriteChunk(int cx, int cz)
 {
     chunkX = cx; chunkZ = cz;
-    // Compress the data and determine the compressed size.
+    if(!decompBfr)
+    {
+        std::cerr << "No chunk to write!" << std::endl;
+        return -1;
+    }
+    
+    std::vector<uint8_t> compData;
+    int status = CompressRegionChunk(decompBfr, chunkBytes, compData);
+    rwPtr = 0;
+    chunkBytes = 0;
+    if(status != 0)
+        return -1;
+    return WriteChunkCompressed(cx, cz, compData);
+}
+
+
+int NBT_Region_IO::WriteChunkCompressed(int cx, int cz, const std::vector<uint8_t> & compData)
+{
+    ++writeCount;
     // Find an appropriate location for chunk...possible algorithms:
     // A: First contiguous free area of sufficient size, else append
     // B: Largest contiguous free area, if of sufficient size, else append
@@ -256,38 +385,13 @@ int NBT_Region_IO::WriteChunk(int cx, int cz)
     //    which requires overwriting old chunk, slightly less safe.)
     // Perhaps perform free space defragmenting/optmization tasks as well.
     
-    if(!decompBfr)
-    {
-        std::cerr << "No chunk to write!" << std::endl;
+    if(compData.empty())
         return -1;
-    }
-    
-    uint8_t compBfr[COMP_CHUNK_SIZE];
-    
-    // decompress chunk into decompBfr
-    int status;
-    z_stream strm;
-    strm.zalloc = (alloc_func)NULL;
-    strm.zfree = (free_func)NULL;
-    strm.opaque = NULL;
-    
-    strm.next_in = decompBfr;
-    strm.next_out = compBfr;
-    strm.avail_out = COMP_CHUNK_SIZE;
-    strm.avail_in = (int)chunkBytes;
-    
-    int compressionLevel = 6;
-    deflateInit(&strm, compressionLevel);
-    status = deflate(&strm, Z_FINISH);
-    deflateEnd(&strm);
-    
-    if(status != Z_STREAM_END) {
-        std::cerr << "Error while compressing" << std::endl;
+    if(OpenFile() != 0)
         return -1;
-    }
     
-    int compChunkBytes = strm.avail_out;
-    int compChunkSectors = (compChunkBytes + 5)/4096;// (compressed data + 5 byte header)/sector size
+    int compChunkBytes = (int)compData.size();
+    int compChunkSectors = (compChunkBytes + 5 + 4095)/4096;// (compressed data + 5 byte header)/sector size, rounded up
     
     // If there's a free block with sufficient size, use it.
     // Else write at end of file.
@@ -336,12 +440,9 @@ int NBT_Region_IO::WriteChunk(int cx, int cz)
     // Write chunk and update TOC, in that order. If chunk write fails, old
     // chunk is still intact.
     fwrite(buf, 5, 1, regFile);
-    fwrite(compBfr, compChunkBytes, 1, regFile);
+    fwrite(&compData[0], compChunkBytes, 1, regFile);
     
-    UpdateTOC(ChunkIdx(chunkX, chunkZ), freeBlock);
-    
-    rwPtr = 0;
-    chunkBytes = 0;
+    UpdateTOC(ChunkIdx(cx, cz), freeBlock);
     
     return 0;
 }
@@ -358,6 +459,8 @@ int NBT_Region_IO::ReadChunk(int cx, int cz)
         std::cerr << "Chunk " << cx << ", " << cz << " is empty." << std::endl;
         return -1;
     }
+    if(OpenFile() != 0)
+        return -1;
     
     fseek(regFile, 4096*offset, SEEK_SET);
     uint8_t buf[5];
@@ -379,8 +482,7 @@ int NBT_Region_IO::ReadChunk(int cx, int cz)
         return -1;
     }
     
-    if(!decompBfr)
-        decompBfr = new uint8_t[DECOMP_CHUNK_SIZE];
+    AllocChunkBuffer();
     
     uint8_t compBfr[COMP_CHUNK_SIZE];
     fread(compBfr, compChunkBytes - 1, 1, regFile);
@@ -415,4 +517,166 @@ int NBT_Region_IO::ReadChunk(int cx, int cz)
 }
 
 
+int NBT_Region_IO::ReadChunkCompressed(int cx, int cz, std::vector<uint8_t> & compData)
+{
+    size_t chunkIdx = ChunkIdx(cx, cz);
+    int offset = chunkBlocks[chunkIdx].start;
+    size_t numSectors = chunkBlocks[chunkIdx].size;
+    
+    if(offset == 0 || numSectors == 0) {
+        std::cerr << "Chunk " << cx << ", " << cz << " is empty." << std::endl;
+        return -1;
+    }
+    if(OpenFile() != 0)
+        return -1;
+    
+    if(ReadRegionChunkCompressed(regFile, offset, numSectors, compData) != 0) {
+        std::cerr << "Could not read chunk " << cx << ", " << cz << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+//******************************************************************************
+
+int ReadRegionChunkCompressed(FILE * regFile, int offset, size_t numSectors, std::vector<uint8_t> & compData)
+{
+    compData.clear();
+    fseek(regFile, 4096*(long)offset, SEEK_SET);
+    uint8_t buf[5];
+    if(fread(buf, 5, 1, regFile) != 1)
+        return -1;
+    
+    // The size includes the compression method byte (buf[4]), but not the size field itself.
+    size_t compChunkBytes = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    if(compChunkBytes < 1 || compChunkBytes > numSectors*4096) {
+        std::cerr << "Bad chunk size: " << compChunkBytes << std::endl;
+        return -1;
+    }
+    if(buf[4] != 2) {
+        std::cerr << "Only compression method 2 supported at this time" << std::endl;
+        return -1;
+    }
+    
+    compData.resize(compChunkBytes - 1);
+    if(compData.empty() || fread(&compData[0], compData.size(), 1, regFile) != 1) {
+        compData.clear();
+        return -1;
+    }
+    return 0;
+}
+
+//******************************************************************************
+
+int InflateRegionChunk(const std::vector<uint8_t> & compData, std::vector<uint8_t> & data)
+{
+    z_stream strm;
+    strm.zalloc = (alloc_func)NULL;
+    strm.zfree = (free_func)NULL;
+    strm.opaque = NULL;
+    strm.next_in = (Bytef *)&compData[0];
+    strm.avail_in = (uInt)compData.size();
+    if(compData.empty() || inflateInit(&strm) != Z_OK) {
+        std::cerr << "Error while decompressing" << std::endl;
+        return -1;
+    }
+    
+    // Chunks are usually well under DECOMP_CHUNK_SIZE, but grow the buffer if needed
+    data.resize(DECOMP_CHUNK_SIZE);
+    int status;
+    for(;;)
+    {
+        strm.next_out = &data[strm.total_out];
+        strm.avail_out = (uInt)(data.size() - strm.total_out);
+        status = inflate(&strm, Z_FINISH);
+        if(status != Z_BUF_ERROR || strm.avail_out != 0)
+            break;
+        data.resize(data.size()*2);
+    }
+    data.resize(strm.total_out);
+    inflateEnd(&strm);
+    
+    if(status != Z_STREAM_END) {
+        std::cerr << "Error while decompressing" << std::endl;
+        data.clear();
+        return -1;
+    }
+    return 0;
+}
+
+int CompressRegionChunk(const uint8_t * data, size_t size, std::vector<uint8_t> & compData)
+{
+    uLongf compSize = compressBound(size);
+    compData.resize(compSize);
+    if(compress2(&compData[0], &compSize, data, size, 6) != Z_OK) {
+        std::cerr << "Error while compressing" << std::endl;
+        compData.clear();
+        return -1;
+    }
+    compData.resize(compSize);
+    return 0;
+}
+
+
+int WriteRegionFile(const std::string & fpath, const std::vector<RegionChunkData> & chunks)
+{
+    // Lay out chunks back to back, starting after the two TOC sectors.
+    uint8_t toc[8192];
+    memset(toc, 0, sizeof(toc));
+    int sector = 2;
+    for(size_t j = 0; j < chunks.size(); ++j)
+    {
+        // 5 byte header: size including the compression method byte, method
+        int numSectors = (int)(chunks[j].compData.size() + 5 + 4095)/4096;
+        if(chunks[j].compData.size() > kMaxRegionChunkBytes) {
+            std::cerr << "Chunk " << chunks[j].cx << ", " << chunks[j].cz << " too large for region file" << std::endl;
+            return -1;
+        }
+        size_t i = 4*((chunks[j].cx & 31) + (chunks[j].cz & 31)*32);
+        toc[i] = ((sector >> 16) & 0xFF);
+        toc[i + 1] = ((sector >> 8) & 0xFF);
+        toc[i + 2] = (sector & 0xFF);
+        toc[i + 3] = numSectors;
+        
+        uint32_t timestamp = chunks[j].timestamp;
+        toc[4096 + i] = ((timestamp >> 24) & 0xFF);
+        toc[4096 + i + 1] = ((timestamp >> 16) & 0xFF);
+        toc[4096 + i + 2] = ((timestamp >> 8) & 0xFF);
+        toc[4096 + i + 3] = (timestamp & 0xFF);
+        sector += numSectors;
+    }
+    
+    FILE * fout = fopen(fpath.c_str(), "wb");
+    if(!fout) {
+        std::cerr << "Could not open \"" << fpath << "\"" << std::endl;
+        return -1;
+    }
+    bool ok = (fwrite(toc, sizeof(toc), 1, fout) == 1);
+    
+    static const uint8_t padding[4096] = {0};
+    for(size_t j = 0; ok && j < chunks.size(); ++j)
+    {
+        size_t compBytes = chunks[j].compData.size();
+        size_t chunkSize = compBytes + 1;
+        uint8_t buf[5];
+        buf[0] = ((chunkSize >> 24) & 0xFF);
+        buf[1] = ((chunkSize >> 16) & 0xFF);
+        buf[2] = ((chunkSize >> 8) & 0xFF);
+        buf[3] = (chunkSize & 0xFF);
+        buf[4] = 2;// compression method 2
+        size_t padBytes = (4096 - (compBytes + 5)%4096)%4096;
+        ok = fwrite(buf, 5, 1, fout) == 1 &&
+             fwrite(&chunks[j].compData[0], compBytes, 1, fout) == 1 &&
+             (padBytes == 0 || fwrite(padding, padBytes, 1, fout) == 1);
+    }
+    if(fclose(fout) != 0)
+        ok = false;
+    if(!ok) {
+        std::cerr << "Could not write \"" << fpath << "\"" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
 //******************************************************************************
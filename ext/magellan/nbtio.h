@@ -26,15 +26,22 @@
 
 #include <zlib.h>
 #include <stdint.h>
+#include <string.h>
+
+#include "threadpool.h"
 
 #include <vector>
+#include <list>
+#include <string>
 #include <iostream>
 
 //******************************************************************************
 
 class NBT_I {
   public:
-    NBT_I() {}
+    bool badData;// set on an unknown tag type, which stops parsing
+    
+    NBT_I(): badData(false) {}
     
     virtual void Read(uint8_t * bfr, size_t size) = 0;
     
@@ -129,27 +136,22 @@ class NBT_O {
     
     void NBT_Write(int8_t val) {Write(&val, 1);}
     
+    // Big-endian values are assembled first and written with a single call
     void NBT_Write(int16_t val) {
-        NBT_Write((int8_t)((val >> 8) & 0xFF));
-        NBT_Write((int8_t)(val & 0xFF));
+        uint8_t bytes[2] = {(uint8_t)(val >> 8), (uint8_t)val};
+        Write(bytes, 2);
     }
     
     void NBT_Write(int32_t val) {
-        NBT_Write((int8_t)((val >> 24) & 0xFF));
-        NBT_Write((int8_t)((val >> 16) & 0xFF));
-        NBT_Write((int8_t)((val >> 8) & 0xFF));
-        NBT_Write((int8_t)(val & 0xFF));
+        uint8_t bytes[4] = {(uint8_t)(val >> 24), (uint8_t)(val >> 16), (uint8_t)(val >> 8), (uint8_t)val};
+        Write(bytes, 4);
     }
     
     void NBT_Write(int64_t val) {
-        NBT_Write((int8_t)((val >> 56) & 0xFF));
-        NBT_Write((int8_t)((val >> 48) & 0xFF));
-        NBT_Write((int8_t)((val >> 40) & 0xFF));
-        NBT_Write((int8_t)((val >> 32) & 0xFF));
-        NBT_Write((int8_t)((val >> 24) & 0xFF));
-        NBT_Write((int8_t)((val >> 16) & 0xFF));
-        NBT_Write((int8_t)((val >> 8) & 0xFF));
-        NBT_Write((int8_t)(val & 0xFF));
+        uint8_t bytes[8];
+        for(int j = 0; j < 8; ++j)
+            bytes[j] = (uint8_t)(val >> (56 - j*8));
+        Write(bytes, 8);
     }
     
     void NBT_Write(float val) {
@@ -186,7 +188,7 @@ class NBT_O {
 class NBT_gzFile_I: public NBT_I {
   private:
     gzFile fin;
-    
+  
   public:
     NBT_gzFile_I(const std::string & fpath) {
         fin = gzopen(fpath.c_str(), "rb");
@@ -214,7 +216,7 @@ class NBT_gzFile_I: public NBT_I {
 class NBT_gzFile_O: public NBT_O {
   private:
     gzFile fout;
-    
+  
   public:
     NBT_gzFile_O(const std::string & fpath) {
         fout = gzopen(fpath.c_str(), "wb");
@@ -237,6 +239,45 @@ class NBT_gzFile_O: public NBT_O {
     virtual bool Eof() {return gzeof(fout);}
 };
 
+// Reads NBT from a buffer in memory, such as an inflated region chunk. Reads past the
+// end of the buffer return zeros and set overrun, rather than exiting.
+class NBT_Buffer_I: public NBT_I {
+  private:
+    const uint8_t * bfr;
+    size_t size;
+    size_t pos;
+  
+  public:
+    bool overrun;
+    
+    NBT_Buffer_I(const uint8_t * b, size_t sz): bfr(b), size(sz), pos(0), overrun(false) {}
+    
+    virtual void Read(uint8_t * dst, size_t n) {
+        if(n > size - pos) {
+            memset(dst, 0, n);
+            pos = size;
+            overrun = true;
+            return;
+        }
+        memcpy(dst, bfr + pos, n);
+        pos += n;
+    }
+    
+    virtual bool Eof() {return pos >= size;}
+};
+
+// Writes NBT to a buffer in memory, for compressing or writing elsewhere.
+class NBT_Buffer_O: public NBT_O {
+  public:
+    std::vector<uint8_t> data;
+    
+    virtual void Write(void * bfr, size_t size) {
+        data.insert(data.end(), (const uint8_t *)bfr, (const uint8_t *)bfr + size);
+    }
+    
+    virtual bool Eof() {return false;}
+};
+
 struct RegionBlock {
     int start, size;
     RegionBlock() {}
@@ -244,10 +285,41 @@ struct RegionBlock {
     RegionBlock(int st, int sz): start(st), size(sz) {}
 };
 
+class NBT_Region_IO;
+
+// Limits the number of region files held open at once. A region keeps its TOC in
+// memory and reopens its file on demand, so only file handles (and their stdio and
+// chunk buffers) are limited: when more than MaxOpen() regions have open files, the
+// least recently used region's file is closed. Regions whose mutex is held are in use
+// on another thread, and are passed over.
+class NBT_RegionFilePool {
+    static std::list<NBT_Region_IO *> openRegions;// most recently used first
+    static size_t maxOpen;
+    static Mutex mutex;
+    
+    static void Trim();
+  
+  public:
+    static size_t MaxOpen() {return maxOpen;}
+    static void SetMaxOpen(size_t n);
+    static size_t NumOpen() {MutexLock lock(mutex); return openRegions.size();}
+    
+    // Mark region as most recently used, closing least recently used files if the
+    // limit has been exceeded. The given region's file is never closed by this.
+    static void Touch(NBT_Region_IO * rgn);
+    // Region's file has been closed, or region is being deleted.
+    static void Remove(NBT_Region_IO * rgn);
+};
+
 class NBT_Region_IO: public NBT_I, public NBT_O {
+    friend class NBT_RegionFilePool;
   private:
     FILE * regFile;
     long fileSize;
+    std::string filePath;
+    
+    bool inPool;
+    std::list<NBT_Region_IO *>::iterator poolPos;
     
     int chunkX, chunkZ;// coordinates of loaded chunk
     size_t chunkBytes;
@@ -258,18 +330,38 @@ class NBT_Region_IO: public NBT_I, public NBT_O {
     RegionBlock chunkBlocks[1024];// chunk blocks in index order
     std::vector<RegionBlock> freeBlocks;// heap of blocks of unused sectors
     int endUsedSectors;// index of sector after last used sector
+    uint32_t writeCount;// chunk writes since opened
+    Mutex mutex;
     
     static size_t ChunkIdx(int cx, int cz) {return ((cx & 31) + (cz & 31)*32);}
     
     int ReadRegionTOC();
     void UpdateTOC(size_t chunkIdx, const RegionBlock & newBlock);
     
+    // Reopen file if it was closed by the file pool, and mark region as recently used.
+    int OpenFile();
+    // Close file without updating the file pool
+    void CloseUnpooled();
+    void AllocChunkBuffer();
+  
   public:
     NBT_Region_IO();
     ~NBT_Region_IO();
     
     int Open(const std::string & fpath);
     
+    // Close file handle and release chunk buffer. TOC is kept, and the file will
+    // be reopened when next needed.
+    void CloseFile();
+    bool FileOpen() const {return regFile != NULL;}
+    // Push buffered writes out to the file, so that it can be read through another handle.
+    void Flush() {if(regFile) fflush(regFile);}
+    const std::string & FilePath() const {return filePath;}
+    
+    // Region methods aren't thread safe. Code that may use a region while the Ruby
+    // interpreter lock is released must hold this for as long as it does.
+    Mutex & GetMutex() {return mutex;}
+    
     void PrintStats(std::ostream & ostrm);
     
     // Sets up chunk buffer for read/write operations
@@ -304,14 +396,31 @@ class NBT_Region_IO: public NBT_I, public NBT_O {
     // Performs write of buffered chunk
     int WriteChunk(int cx, int cz);
     int WriteChunk() {return WriteChunk(chunkX, chunkZ);}
+    // Write chunk data already compressed with CompressRegionChunk(), leaving the chunk
+    // buffer alone.
+    int WriteChunkCompressed(int cx, int cz, const std::vector<uint8_t> & compData);
     
     // Reads a chunk into the chunk buffer
     int ReadChunk(int cx, int cz);
+    // Read a chunk's zlib compressed data without inflating it, so that inflating and
+    // parsing can be done elsewhere, for example on another thread with
+    // InflateRegionChunk(). Returns 0 on success, -1 on failure.
+    int ReadChunkCompressed(int cx, int cz, std::vector<uint8_t> & compData);
     
     // Get timestamp for currently buffered chunk. Only valid for chunks loaded from file.
     // Timestamp is automatically updated on chunk write.
     int32_t GetTimestamp() const {return chunkTimestamps[ChunkIdx(chunkX, chunkZ)];}
     
+    // Get timestamp of any chunk in the region, as recorded in the region TOC. This
+    // does not read the chunk, so it is cheap enough to scan a whole region with to
+    // find chunks that have changed since some earlier run.
+    uint32_t ChunkTimestamp(int cx, int cz) const {return chunkTimestamps[ChunkIdx(cx, cz)];}
+    
+    // Number of chunk writes made through this region. Data read through another file
+    // handle is only known to be current if this hasn't changed since the handle was
+    // opened after a Flush().
+    uint32_t WriteCount() const {return writeCount;}
+    
     // Get size in bytes of currently buffered chunk.
     size_t GetChunkSize() const {return chunkBytes;}
     
@@ -323,6 +432,8 @@ class NBT_Region_IO: public NBT_I, public NBT_O {
     }
     
     virtual void Write(void * bfr, size_t size) {
+        if(!decompBfr)
+            AllocChunkBuffer();
         memcpy(decompBfr + rwPtr, bfr, size);
         rwPtr += size;
         chunkBytes += size;
@@ -335,5 +446,34 @@ class NBT_Region_IO: public NBT_I, public NBT_O {
     virtual bool Eof() {return rwPtr >= chunkBytes;}
 };
 
+// A compressed chunk, ready to be placed in a region file.
+struct RegionChunkData {
+    int cx, cz;// chunk coordinates, only the low 5 bits (position in region) are used
+    uint32_t timestamp;
+    std::vector<uint8_t> compData;// zlib compressed chunk NBT
+};
+
+// Largest compressed chunk a region file can hold: 255 sectors, less the 5 byte
+// chunk header.
+const size_t kMaxRegionChunkBytes = 255*4096 - 5;
+
+// Write a complete region file from a set of compressed chunks. Sectors for all
+// chunks are allocated in one pass, packed in the order given, and the TOC is written
+// once, rather than updating free lists and TOC chunk by chunk as WriteChunk() does.
+// Replaces any existing file. Returns 0 on success, -1 on failure.
+int WriteRegionFile(const std::string & fpath, const std::vector<RegionChunkData> & chunks);
+
+// Compress a chunk's NBT data for storage in a region file.
+int CompressRegionChunk(const uint8_t * data, size_t size, std::vector<uint8_t> & compData);
+
+// Read compressed chunk data from a region file opened separately, given the chunk's
+// sector offset and size as recorded in the region TOC. Returns 0 on success, -1 on
+// failure.
+int ReadRegionChunkCompressed(FILE * regFile, int offset, size_t numSectors, std::vector<uint8_t> & compData);
+
+// Inflate compressed chunk data from ReadChunkCompressed(). Uses no shared state, so
+// may be called from any thread. Returns 0 on success, -1 on failure.
+int InflateRegionChunk(const std::vector<uint8_t> & compData, std::vector<uint8_t> & data);
+
 #endif // NBTIO_H
 
@@ -23,11 +23,13 @@
 
 #include "nbtrb.h"
 #include "nbt.h"
+#include "magellan.h"
 
 #include <string>
 
 #include <ruby.h>
 // #include <ruby/intern.h>
+#include <ruby/thread.h>
 
 using namespace std;
 
@@ -36,185 +38,240 @@ static VALUE mNBT;
 
 
 static VALUE NBT_initialize(int argc, VALUE *argv, VALUE self);
-static VALUE NBT_load(VALUE module, VALUE filePath);
+static VALUE NBT_load(VALUE /*module*/, VALUE filePath);
 static VALUE NBT_write(VALUE self, VALUE filePath);
 static VALUE NBT_dump(VALUE self);
 
 
-// The problem of getting proper interoperation between Ruby's garbage collection and
-// the manual memory management of the NBT library is solved by not even trying.
-// Instead, Ruby-side NBTs are simple pure-Ruby objects consisting of an integer NBT
-// type and a value that can be numeric, an array, a string, a hash, etc...
-static VALUE NBT_ByteToValue(NBT_TagByte * comp);
-static VALUE NBT_ShortToValue(NBT_TagShort * comp);
-static VALUE NBT_IntToValue(NBT_TagInt * comp);
-static VALUE NBT_LongToValue(NBT_TagLong * comp);
-static VALUE NBT_FloatToValue(NBT_TagFloat * comp);
-static VALUE NBT_DoubleToValue(NBT_TagDouble * comp);
-static VALUE NBT_ByteArrayToValue(NBT_TagByteArray * comp);
-static VALUE NBT_StringToValue(NBT_TagString * comp);
-static VALUE NBT_ListToValue(NBT_TagList * comp);
-
-VALUE CStrToSym(const char * str) {return ID2SYM(rb_intern(str));}
-VALUE CStrToSym(const string & str) {return ID2SYM(rb_intern(str.c_str()));}
-
-VALUE NBT_CompoundToValue(NBT_TagCompound * comp)
-{
-    // A compound is given a hash value
-    VALUE contents = rb_hash_new();
-    std::vector<NBT_Tag *>::iterator tagi;
-    for(tagi = comp->tags.begin(); tagi != comp->tags.end(); ++tagi)
-    {
-        NBT_Tag * tag = *tagi;
-        switch(tag->Type())
-        {
-            case kNBT_TAG_End:// NULL...shouldn't get this in a compound, but ignore it
-            break;
-            case kNBT_TAG_Byte:       // int8_t
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_ByteToValue(static_cast<NBT_TagByte *>(tag)));
-            break;
-            case kNBT_TAG_Short:      // int16_t
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_ShortToValue(static_cast<NBT_TagShort *>(tag)));
-            break;
-            case kNBT_TAG_Int:        // int32_t
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_IntToValue(static_cast<NBT_TagInt *>(tag)));
-            break;
-            case kNBT_TAG_Long:       // int64_t
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_LongToValue(static_cast<NBT_TagLong *>(tag)));
-            break;
-            case kNBT_TAG_Float:      // float
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_FloatToValue(static_cast<NBT_TagFloat *>(tag)));
-            break;
-            case kNBT_TAG_Double:     // double
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_DoubleToValue(static_cast<NBT_TagDouble *>(tag)));
-            break;
-            case kNBT_TAG_Byte_Array: // vector<int8_t> *
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_ByteArrayToValue(static_cast<NBT_TagByteArray *>(tag)));
-            break;
-            case kNBT_TAG_String:     // string *
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_StringToValue(static_cast<NBT_TagString *>(tag)));
-            break;
-            case kNBT_TAG_List:       // vector<NBT_Tag> *
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_ListToValue(static_cast<NBT_TagList *>(tag)));
-            break;
-            case kNBT_TAG_Compound:   // vector<NBT_Tag> *
-                rb_hash_aset(contents, CStrToSym(tag->name), NBT_CompoundToValue(static_cast<NBT_TagCompound *>(tag)));
-            break;
-            default:
-                // TODO: catch this and delete the tree
-                rb_raise(rb_eArgError, "Bad NBT tree");
-        }
-    }
-    
-    VALUE argv[] = {rb_str_new2(comp->name.c_str()), INT2FIX(kNBT_TAG_Compound), contents};
-    return rb_class_new_instance(3, argv, class_NBT);
-}
+// Ruby-side NBTs have a name, an integer NBT type, and a value that can be numeric,
+// an array of NBTs, a string, a hash of NBTs keyed by symbols, etc. NBTs read from
+// files are backed by the C++ tree they were read into, and fill in their name and
+// value only when asked for them: until then, they cost a small struct and nothing
+// more, however large the tag below them. The tree is held by a hidden Ruby object
+// referenced by every NBT backed by it, and freed by the GC along with the last one.
+// Backing trees are never modified. Once an NBT's value has been filled in, it is
+// the Ruby value that is written back, and changes made to it are kept.
+struct RbNBT {
+    VALUE name;// Qundef until filled in from tag
+    VALUE type;
+    VALUE value;// Qundef until filled in from tag
+    VALUE entryType;// lists only, Qnil for other tags
+    const NBT_Tag * tag;// backing tag, NULL for NBTs built in Ruby
+    VALUE tree;// owner of the tree tag belongs to
+};
 
-static VALUE NBT_ByteToValue(NBT_TagByte * tag)
-{
-    VALUE argv[] = {rb_str_new2(tag->name.c_str()), INT2FIX(kNBT_TAG_Byte), INT2NUM(tag->value)};
-    return rb_class_new_instance(3, argv, class_NBT);
-}
-static VALUE NBT_ShortToValue(NBT_TagShort * tag)
+static void RbNBT_Mark(void * ptr)
 {
-    VALUE argv[] = {rb_str_new2(tag->name.c_str()), INT2FIX(kNBT_TAG_Short), INT2NUM(tag->value)};
-    return rb_class_new_instance(3, argv, class_NBT);
+    RbNBT * nbt = static_cast<RbNBT *>(ptr);
+    rb_gc_mark(nbt->name);
+    rb_gc_mark(nbt->type);
+    rb_gc_mark(nbt->value);
+    rb_gc_mark(nbt->entryType);
+    rb_gc_mark(nbt->tree);
 }
-static VALUE NBT_IntToValue(NBT_TagInt * tag)
-{
-    VALUE argv[] = {rb_str_new2(tag->name.c_str()), INT2FIX(kNBT_TAG_Int), LONG2NUM(tag->value)};
-    return rb_class_new_instance(3, argv, class_NBT);
-}
-static VALUE NBT_LongToValue(NBT_TagLong * tag)
+
+static const rb_data_type_t RbNBT_type = {
+    "NBT",
+    {RbNBT_Mark, RUBY_TYPED_DEFAULT_FREE, NULL, NULL, {NULL}},
+    NULL, NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void NBTTree_Free(void * tree) {delete static_cast<NBT_Tag *>(tree);}
+
+static const rb_data_type_t NBTTree_type = {
+    "NBTTree",
+    {NULL, NBTTree_Free, NULL, NULL, {NULL}},
+    NULL, NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE NBT_allocate(VALUE klass)
 {
-    VALUE argv[] = {rb_str_new2(tag->name.c_str()), INT2FIX(kNBT_TAG_Long), LONG2NUM(tag->value)};
-    return rb_class_new_instance(3, argv, class_NBT);
+    RbNBT * nbt;
+    VALUE self = TypedData_Make_Struct(klass, RbNBT, &RbNBT_type, nbt);
+    nbt->name = Qnil;
+    nbt->type = Qnil;
+    nbt->value = Qnil;
+    nbt->entryType = Qnil;
+    nbt->tag = NULL;
+    nbt->tree = Qnil;
+    return self;
 }
 
-static VALUE NBT_FloatToValue(NBT_TagFloat * tag)
+static RbNBT * GetNBT(VALUE self)
 {
-    VALUE argv[] = {rb_str_new2(tag->name.c_str()), INT2FIX(kNBT_TAG_Float), DBL2NUM(tag->value)};
-    return rb_class_new_instance(3, argv, class_NBT);
+    RbNBT * nbt;
+    TypedData_Get_Struct(self, RbNBT, &RbNBT_type, nbt);
+    return nbt;
 }
-static VALUE NBT_DoubleToValue(NBT_TagDouble * tag)
+
+// Unfilled NBT backed by tag
+static VALUE NBT_TagToValue(const NBT_Tag * tag, VALUE tree)
 {
-    VALUE argv[] = {rb_str_new2(tag->name.c_str()), INT2FIX(kNBT_TAG_Double), DBL2NUM(tag->value)};
-    return rb_class_new_instance(3, argv, class_NBT);
+    VALUE self = NBT_allocate(class_NBT);
+    RbNBT * nbt = GetNBT(self);
+    nbt->name = Qundef;
+    nbt->type = INT2FIX(tag->Type());
+    nbt->value = Qundef;
+    if(tag->Type() == kNBT_TAG_List)
+        nbt->entryType = INT2FIX(static_cast<const NBT_TagList *>(tag)->ValueType());
+    nbt->tag = tag;
+    nbt->tree = tree;
+    return self;
 }
 
-static VALUE NBT_ByteArrayToValue(NBT_TagByteArray * tag)
+// Names are interned: a chunk's thousands of tags share a few dozen frozen strings
+static VALUE TagName(const NBT_Tag * tag)
 {
-    VALUE argv[] = {rb_str_new2(tag->name.c_str()), INT2FIX(kNBT_TAG_Byte_Array), rb_str_new((char *)&tag->value[0], tag->value.size())};
-    return rb_class_new_instance(3, argv, class_NBT);
+    return rb_interned_str(tag->name.data(), tag->name.size());
 }
-static VALUE NBT_StringToValue(NBT_TagString * tag)
+
+static VALUE TagSym(const NBT_Tag * tag)
 {
-    VALUE argv[] = {rb_str_new2(tag->name.c_str()), INT2FIX(kNBT_TAG_String), rb_str_new2(tag->value.c_str())};
-    return rb_class_new_instance(3, argv, class_NBT);
+    return ID2SYM(rb_intern2(tag->name.data(), tag->name.size()));
 }
 
-static VALUE NBT_ListToValue(NBT_TagList * lst)
+// Fill in the value of an NBT backed by a tag. Members of compounds and lists are
+// themselves unfilled NBTs.
+static VALUE FillValue(RbNBT * nbt)
 {
-    // With all the overhead of this binding, there's little need to bother with
-    // the optimization reusing a single type value. Members of the list array are
-    // full, typed NBT objects.
-    
-    VALUE contents = rb_ary_new();
-    std::vector<NBT_Tag *>::iterator tag;
-    switch(lst->ValueType())
+    if(nbt->value != Qundef)
+        return nbt->value;
+    const NBT_Tag * tag = nbt->tag;
+    VALUE value;
+    switch(tag->Type())
     {
-        case kNBT_TAG_End:// NULL...shouldn't get this, but ignore it
-        break;
         case kNBT_TAG_Byte:       // int8_t
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_ByteToValue(static_cast<NBT_TagByte *>(*tag)));
+            value = INT2FIX(static_cast<const NBT_TagByte *>(tag)->value);
         break;
         case kNBT_TAG_Short:      // int16_t
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_ShortToValue(static_cast<NBT_TagShort *>(*tag)));
+            value = INT2FIX(static_cast<const NBT_TagShort *>(tag)->value);
         break;
         case kNBT_TAG_Int:        // int32_t
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_IntToValue(static_cast<NBT_TagInt *>(*tag)));
+            value = LONG2NUM(static_cast<const NBT_TagInt *>(tag)->value);
         break;
         case kNBT_TAG_Long:       // int64_t
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_LongToValue(static_cast<NBT_TagLong *>(*tag)));
+            value = LL2NUM(static_cast<const NBT_TagLong *>(tag)->value);
         break;
         case kNBT_TAG_Float:      // float
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_FloatToValue(static_cast<NBT_TagFloat *>(*tag)));
+            value = DBL2NUM(static_cast<const NBT_TagFloat *>(tag)->value);
         break;
         case kNBT_TAG_Double:     // double
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_DoubleToValue(static_cast<NBT_TagDouble *>(*tag)));
-        break;
-        case kNBT_TAG_Byte_Array: // vector<int8_t> *
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_ByteArrayToValue(static_cast<NBT_TagByteArray *>(*tag)));
-        break;
-        case kNBT_TAG_String:     // string *
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_StringToValue(static_cast<NBT_TagString *>(*tag)));
-        break;
-        case kNBT_TAG_List:       // vector<NBT_Tag> *
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_ListToValue(static_cast<NBT_TagList *>(*tag)));
-        break;
-        case kNBT_TAG_Compound:   // vector<NBT_Tag> *
-            for(tag = lst->values.begin(); tag != lst->values.end(); ++tag)
-                rb_ary_push(contents, NBT_CompoundToValue(static_cast<NBT_TagCompound *>(*tag)));
+            value = DBL2NUM(static_cast<const NBT_TagDouble *>(tag)->value);
         break;
+        case kNBT_TAG_Byte_Array: {// vector<int8_t> *
+            // Copied once into a buffer Ruby owns. A string pointing into the tree
+            // can't keep it alive: strings Ruby derives from it (interned copies,
+            // hash keys) may take over the buffer with no reference to the tree.
+            // Writing adopts the string's buffer rather than copying it back.
+            const std::vector<uint8_t> & bytes = static_cast<const NBT_TagByteArray *>(tag)->value;
+            value = rb_str_new(bytes.empty()? NULL : (const char *)&bytes[0], bytes.size());
+        } break;
+        case kNBT_TAG_String: {   // string *
+            const string & str = static_cast<const NBT_TagString *>(tag)->value;
+            value = rb_str_new(str.data(), str.size());
+        } break;
+        case kNBT_TAG_List: {     // vector<NBT_Tag> *
+            const NBT_TagList * lst = static_cast<const NBT_TagList *>(tag);
+            value = rb_ary_new2(lst->values.size());
+            std::vector<NBT_Tag *>::const_iterator t;
+            for(t = lst->values.begin(); t != lst->values.end(); ++t)
+                rb_ary_push(value, NBT_TagToValue(*t, nbt->tree));
+        } break;
+        case kNBT_TAG_Compound: { // vector<NBT_Tag> *
+            const NBT_TagCompound * comp = static_cast<const NBT_TagCompound *>(tag);
+            value = rb_hash_new();
+            std::vector<NBT_Tag *>::const_iterator t;
+            for(t = comp->tags.begin(); t != comp->tags.end(); ++t)
+                if((*t)->Type() != kNBT_TAG_End)
+                    rb_hash_aset(value, TagSym(*t), NBT_TagToValue(*t, nbt->tree));
+        } break;
         default:
-            // TODO: catch this and delete the tree
             rb_raise(rb_eArgError, "Bad NBT tree");
     }
-    
-    VALUE argv[] = {rb_str_new2(lst->name.c_str()), INT2FIX(kNBT_TAG_List), contents, INT2FIX(lst->ValueType())};
-    return rb_class_new_instance(4, argv, class_NBT);
+    nbt->value = value;
+    return value;
+}
+
+static VALUE FillName(RbNBT * nbt)
+{
+    if(nbt->name == Qundef)
+        nbt->name = TagName(nbt->tag);
+    return nbt->name;
+}
+
+VALUE NBT_TreeToValue(NBT_TagCompound * root)
+{
+    VALUE tree = TypedData_Wrap_Struct(0, &NBTTree_type, root);
+    return NBT_TagToValue(root, tree);
 }
 
-static int CompoundMemberToNBT_CB(VALUE key, VALUE value, VALUE nbt) {
+VALUE NBT_Value(VALUE rbnbt) {return FillValue(GetNBT(rbnbt));}
+
+void NBT_SetValue(VALUE rbnbt, VALUE value) {GetNBT(rbnbt)->value = value;}
+
+size_t NBT_ValueBytes(VALUE rbnbt)
+{
+    RbNBT * nbt = GetNBT(rbnbt);
+    if(nbt->value != Qundef)
+        return RB_TYPE_P(nbt->value, T_STRING)? RSTRING_LEN(nbt->value) : 0;
+    if(nbt->tag->Type() == kNBT_TAG_Byte_Array)
+        return static_cast<const NBT_TagByteArray *>(nbt->tag)->value.size();
+    if(nbt->tag->Type() == kNBT_TAG_String)
+        return static_cast<const NBT_TagString *>(nbt->tag)->value.size();
+    return 0;
+}
+
+// Stand-in for a tag in a backing tree, written as the tag but under its own name.
+struct NBT_TagRef: public NBT_Tag {
+    const NBT_Tag * tag;
+    
+    NBT_TagRef(const std::string & nm, const NBT_Tag * t): NBT_Tag(nm), tag(t) {}
+    
+    virtual NBT_Tag * Clone() const {
+        NBT_Tag * clone = tag->Clone();
+        clone->name = name;
+        return clone;
+    }
+    virtual nbt_tag_t Type() const {return tag->Type();}
+    virtual void Print(std::ostream & ostrm, int indent = 0) {const_cast<NBT_Tag *>(tag)->Print(ostrm, indent);}
+    virtual void Write(NBT_O & fout) const {
+        fout.NBT_Write((int8_t)Type());
+        fout.NBT_Write(name);
+        tag->WriteData(fout);
+    }
+    virtual void WriteData(NBT_O & fout) const {tag->WriteData(fout);}
+};
+
+// Byte array tag written straight from the contents of a Ruby string
+struct NBT_TagBytesRef: public NBT_Tag {
+    const uint8_t * bytes;
+    size_t size;
+    
+    NBT_TagBytesRef(const std::string & nm, const uint8_t * b, size_t n): NBT_Tag(nm), bytes(b), size(n) {}
+    
+    virtual NBT_Tag * Clone() const {
+        NBT_TagByteArray * clone = new NBT_TagByteArray(name);
+        clone->value.assign(bytes, bytes + size);
+        return clone;
+    }
+    virtual nbt_tag_t Type() const {return kNBT_TAG_Byte_Array;}
+    virtual void Print(std::ostream & ostrm, int indent = 0) {
+        ostrm << TagTab(indent) << "TAG_Byte_Array(\"" << name << "\"): " << size << " bytes" << std::endl;
+    }
+    virtual void Write(NBT_O & fout) const {
+        fout.NBT_Write((int8_t)Type());
+        fout.NBT_Write(name);
+        WriteData(fout);
+    }
+    virtual void WriteData(NBT_O & fout) const {
+        fout.NBT_Write((int32_t)size);
+        fout.Write((void *)bytes, size);
+    }
+};
+
+static int CompoundMemberToNBT_CB(VALUE /*key*/, VALUE value, VALUE nbt) {
     NBT_TagCompound * nbtcpd = (NBT_TagCompound *)nbt;
     nbtcpd->AddTag(ValueToNBT(value));
     return ST_CONTINUE;
@@ -222,12 +279,17 @@ static int CompoundMemberToNBT_CB(VALUE key, VALUE value, VALUE nbt) {
 
 NBT_Tag * ValueToNBT(VALUE rbvalue)
 {
-    static ID id_next = rb_intern("next");
-    static ID id_each = rb_intern("each");
+    RbNBT * rbnbt = GetNBT(rbvalue);
+    if(rbnbt->value == Qundef) {
+        // Untouched since read, write the backing tag as is
+        if(rbnbt->name == Qundef)
+            return new NBT_TagRef(rbnbt->tag->name, rbnbt->tag);
+        return new NBT_TagRef(StringValueCStr(rbnbt->name), rbnbt->tag);
+    }
     NBT_Tag * nbt;
-    int type = NUM2INT(rb_iv_get(rbvalue, "@type"));
-    VALUE rbtagval = rb_iv_get(rbvalue, "@value");
-    VALUE rbtagname = rb_iv_get(rbvalue, "@name");
+    int type = NUM2INT(rbnbt->type);
+    VALUE rbtagval = rbnbt->value;
+    VALUE rbtagname = FillName(rbnbt);
     string name = StringValuePtr(rbtagname);
     switch(type)
     {
@@ -250,26 +312,16 @@ NBT_Tag * ValueToNBT(VALUE rbvalue)
             nbt = new NBT_TagDouble(name, NUM2DBL(rbtagval));
         break;
         case kNBT_TAG_Byte_Array: {// vector<int8_t> *
-            NBT_TagByteArray * nbtba = new NBT_TagByteArray(name);
-            nbt = nbtba;
-            int n = RSTRING_LENINT(rbtagval);
-            char * data = StringValuePtr(rbtagval);
-            nbtba->value.resize(n);
-            for(int j = 0; j < n; ++j)
-                nbtba->value[j] = data[j];
+            StringValue(rbtagval);
+            nbt = new NBT_TagBytesRef(name, (const uint8_t *)RSTRING_PTR(rbtagval), RSTRING_LEN(rbtagval));
         } break;
         case kNBT_TAG_String: {// string *
-            NBT_TagString * nbtstr = new NBT_TagString(name, "");
-            nbt = nbtstr;
-            int n = RSTRING_LENINT(rbtagval);
-            char * data = StringValuePtr(rbtagval);
-            nbtstr->value.resize(n);
-            for(int j = 0; j < n; ++j)
-                nbtstr->value[j] = data[j];
+            StringValue(rbtagval);
+            nbt = new NBT_TagString(name, string(RSTRING_PTR(rbtagval), RSTRING_LEN(rbtagval)));
         } break;
         case kNBT_TAG_List: {      // vector<NBT_Tag> *
             // value is an array of NBT objects.
-            NBT_TagList * nbtlst = new NBT_TagList(name, (nbt_tag_t)NUM2INT(rb_iv_get(rbvalue, "@entry_type")));
+            NBT_TagList * nbtlst = new NBT_TagList(name, (nbt_tag_t)NUM2INT(rbnbt->entryType));
             nbt = nbtlst;
             int n = RARRAY_LENINT(rbtagval);
             nbtlst->values.resize(n);
@@ -288,13 +340,180 @@ NBT_Tag * ValueToNBT(VALUE rbvalue)
     return nbt;
 }
 
+// Serialization straight from the Ruby NBTs, in one pass without building a tree. Struct
+// fields are read directly, and unfilled NBTs write their backing tags as they are.
+static void WriteNBTName(NBT_O & fout, const RbNBT * nbt)
+{
+    if(nbt->name == Qundef) {
+        fout.NBT_Write(nbt->tag->name);
+        return;
+    }
+    VALUE rbname = nbt->name;
+    StringValue(rbname);
+    fout.NBT_Write((int16_t)RSTRING_LEN(rbname));
+    fout.Write(RSTRING_PTR(rbname), RSTRING_LEN(rbname));
+}
+
+static void WriteNBTData(NBT_O & fout, VALUE rbvalue);
+
+static int WriteCompoundMember_CB(VALUE /*key*/, VALUE value, VALUE fout) {
+    WriteNBT(*(NBT_O *)fout, value);
+    return ST_CONTINUE;
+}
+
+static void WriteNBTData(NBT_O & fout, VALUE rbvalue)
+{
+    const RbNBT * nbt = GetNBT(rbvalue);
+    if(nbt->value == Qundef) {
+        nbt->tag->WriteData(fout);
+        return;
+    }
+    VALUE rbtagval = nbt->value;
+    switch(NUM2INT(nbt->type))
+    {
+        case kNBT_TAG_Byte:       // int8_t
+            fout.NBT_Write((int8_t)NUM2INT(rbtagval));
+        break;
+        case kNBT_TAG_Short:      // int16_t
+            fout.NBT_Write((int16_t)NUM2INT(rbtagval));
+        break;
+        case kNBT_TAG_Int:        // int32_t
+            fout.NBT_Write((int32_t)NUM2INT(rbtagval));
+        break;
+        case kNBT_TAG_Long:       // int64_t
+            fout.NBT_Write((int64_t)NUM2LL(rbtagval));
+        break;
+        case kNBT_TAG_Float:      // float
+            fout.NBT_Write((float)NUM2DBL(rbtagval));
+        break;
+        case kNBT_TAG_Double:     // double
+            fout.NBT_Write((double)NUM2DBL(rbtagval));
+        break;
+        case kNBT_TAG_Byte_Array: // vector<int8_t> *
+            StringValue(rbtagval);
+            fout.NBT_Write((int32_t)RSTRING_LEN(rbtagval));
+            fout.Write(RSTRING_PTR(rbtagval), RSTRING_LEN(rbtagval));
+        break;
+        case kNBT_TAG_String:     // string *
+            StringValue(rbtagval);
+            fout.NBT_Write((int16_t)RSTRING_LEN(rbtagval));
+            fout.Write(RSTRING_PTR(rbtagval), RSTRING_LEN(rbtagval));
+        break;
+        case kNBT_TAG_List: {     // vector<NBT_Tag> *
+            // Single type shared among all list entries, entries are unnamed
+            Check_Type(rbtagval, T_ARRAY);
+            fout.NBT_Write((int8_t)NUM2INT(nbt->entryType));
+            long n = RARRAY_LEN(rbtagval);
+            fout.NBT_Write((int32_t)n);
+            for(long j = 0; j < n; ++j)
+                WriteNBTData(fout, rb_ary_entry(rbtagval, j));
+        } break;
+        case kNBT_TAG_Compound:   // vector<NBT_Tag> *
+            Check_Type(rbtagval, T_HASH);
+            rb_hash_foreach(rbtagval, WriteCompoundMember_CB, (VALUE)&fout);
+            fout.NBT_Write((int8_t)kNBT_TAG_End);
+        break;
+        default:
+            rb_raise(rb_eArgError, "Bad NBT tree");
+    }
+}
+
+void WriteNBT(NBT_O & fout, VALUE rbnbt)
+{
+    const RbNBT * nbt = GetNBT(rbnbt);
+    fout.NBT_Write((int8_t)NUM2INT(nbt->type));
+    WriteNBTName(fout, nbt);
+    WriteNBTData(fout, rbnbt);
+}
+
+// Serialization into a buffer that must be freed if it raises: run under rb_protect(),
+// with the exception rethrown by the caller once the buffer is out of scope.
+struct SerializeCall {
+    NBT_Buffer_O * bfr;
+    VALUE rbnbt;
+    NBT_Region_IO * rgn;// if given, the buffer is written to chunk cx, cz
+    int cx, cz;
+    int status;
+};
+
+static VALUE Serialize_Protected(VALUE data)
+{
+    SerializeCall * call = (SerializeCall *)data;
+    WriteNBT(*call->bfr, call->rbnbt);
+    if(call->rgn)
+        call->status = WriteRegionChunkData(call->rgn, call->cx, call->cz, call->bfr->data);
+    return Qnil;
+}
+
+int WriteRegionChunk(NBT_Region_IO & rgn, int cx, int cz, VALUE rbnbt)
+{
+    // Serialized while holding the interpreter lock, as the NBTs may be changed by
+    // other threads once it's released.
+    int state = 0;
+    int status = -1;
+    {
+        NBT_Buffer_O bfr;
+        SerializeCall call = {&bfr, rbnbt, &rgn, cx, cz, -1};
+        rb_protect(Serialize_Protected, (VALUE)&call, &state);
+        status = call.status;
+    }
+    if(state)
+        rb_jump_tag(state);
+    return status;
+}
+
+static VALUE NBT_get_name(VALUE self) {return FillName(GetNBT(self));}
+static VALUE NBT_get_type(VALUE self) {return GetNBT(self)->type;}
+static VALUE NBT_get_value(VALUE self) {return FillValue(GetNBT(self));}
+static VALUE NBT_get_entry_type(VALUE self) {return GetNBT(self)->entryType;}
+
+static VALUE NBT_set_name(VALUE self, VALUE name) {return GetNBT(self)->name = name;}
+static VALUE NBT_set_value(VALUE self, VALUE value) {return GetNBT(self)->value = value;}
+static VALUE NBT_set_entry_type(VALUE self, VALUE entryType) {return GetNBT(self)->entryType = entryType;}
+
+// Changing the type detaches the NBT from any backing tag
+static VALUE NBT_set_type(VALUE self, VALUE type) {
+    RbNBT * nbt = GetNBT(self);
+    FillName(nbt);
+    FillValue(nbt);
+    return nbt->type = type;
+}
+
+static VALUE NBT_initialize_copy(VALUE self, VALUE orig) {
+    if(self != orig)
+        *GetNBT(self) = *GetNBT(orig);
+    return self;
+}
+
+static VALUE NBT_marshal_dump(VALUE self) {
+    RbNBT * nbt = GetNBT(self);
+    return rb_ary_new3(4, FillName(nbt), nbt->type, FillValue(nbt), nbt->entryType);
+}
+
+static VALUE NBT_marshal_load(VALUE self, VALUE fields) {
+    Check_Type(fields, T_ARRAY);
+    return NBT_initialize(RARRAY_LENINT(fields), RARRAY_PTR(fields), self);
+}
+
 void Init_nbt()
 {
     // mNBT = rb_define_module("NBT");
     
     class_NBT = rb_define_class("NBT", rb_cObject);
+    rb_define_alloc_func(class_NBT, NBT_allocate);
     rb_define_singleton_method(class_NBT, "load", RUBY_METHOD_FUNC(NBT_load), 1);
     rb_define_method(class_NBT, "initialize", RUBY_METHOD_FUNC(NBT_initialize), -1);
+    rb_define_method(class_NBT, "initialize_copy", RUBY_METHOD_FUNC(NBT_initialize_copy), 1);
+    rb_define_method(class_NBT, "name", RUBY_METHOD_FUNC(NBT_get_name), 0);
+    rb_define_method(class_NBT, "type", RUBY_METHOD_FUNC(NBT_get_type), 0);
+    rb_define_method(class_NBT, "value", RUBY_METHOD_FUNC(NBT_get_value), 0);
+    rb_define_method(class_NBT, "entry_type", RUBY_METHOD_FUNC(NBT_get_entry_type), 0);
+    rb_define_method(class_NBT, "name=", RUBY_METHOD_FUNC(NBT_set_name), 1);
+    rb_define_method(class_NBT, "type=", RUBY_METHOD_FUNC(NBT_set_type), 1);
+    rb_define_method(class_NBT, "value=", RUBY_METHOD_FUNC(NBT_set_value), 1);
+    rb_define_method(class_NBT, "entry_type=", RUBY_METHOD_FUNC(NBT_set_entry_type), 1);
+    rb_define_method(class_NBT, "marshal_dump", RUBY_METHOD_FUNC(NBT_marshal_dump), 0);
+    rb_define_method(class_NBT, "marshal_load", RUBY_METHOD_FUNC(NBT_marshal_load), 1);
     rb_define_method(class_NBT, "write", RUBY_METHOD_FUNC(NBT_write), 1);
     rb_define_method(class_NBT, "dump", RUBY_METHOD_FUNC(NBT_dump), 0);
 }
@@ -305,35 +524,61 @@ static VALUE NBT_initialize(int argc, VALUE *argv, VALUE self)
     if(argc < 3 || argc > 4)
     	rb_raise(rb_eArgError, "Expected 3 or 4 arguments");
     
-    rb_iv_set(self, "@name", argv[0]);
-    rb_iv_set(self, "@type", argv[1]);
-    rb_iv_set(self, "@value", argv[2]);
-    if(argc == 4)
-        rb_iv_set(self, "@entry_type", argv[3]);
+    RbNBT * nbt = GetNBT(self);
+    nbt->name = argv[0];
+    nbt->type = argv[1];
+    nbt->value = argv[2];
+    nbt->entryType = (argc == 4)? argv[3] : Qnil;
+    nbt->tag = NULL;
+    nbt->tree = Qnil;
     return self;
 }
 
-static VALUE NBT_load(VALUE module, VALUE filePath)
+struct LoadCall {
+    string path;
+    NBT_TagCompound * nbt;
+};
+
+// Read and parse with the interpreter lock released
+static void * NBT_load_NoGVL(void * data)
 {
-    NBT_gzFile_I fin(StringValueCStr(filePath));
-    NBT_TagCompound * nbt = LoadNBT_File(fin);
-    VALUE rbnbt = NBT_CompoundToValue(nbt);
-    delete nbt;
-    return rbnbt;
+    LoadCall * call = static_cast<LoadCall *>(data);
+    NBT_gzFile_I fin(call->path);
+    call->nbt = LoadNBT_File(fin);
+    return NULL;
+}
+
+static VALUE NBT_load(VALUE /*module*/, VALUE filePath)
+{
+    LoadCall call;
+    call.path = StringValueCStr(filePath);
+    call.nbt = NULL;
+    rb_thread_call_without_gvl(NBT_load_NoGVL, &call, NULL, NULL);
+    if(!call.nbt)
+        rb_raise(rb_eArgError, "Bad NBT file format");
+    return NBT_TreeToValue(call.nbt);
 }
 
 static VALUE NBT_write(VALUE self, VALUE filePath)
 {
-    NBT_Tag * nbt = ValueToNBT(self);
-    // Construct NBT tree
-    
     string outputFilePath = StringValueCStr(filePath);
-    NBT_gzFile_O fout(outputFilePath);
-    // if(!fout) {
-    //     rb_raise(rb_eArgError, "Could not write NBT file");
-    // }
-    nbt->Write(fout);
-    delete nbt;
+    // Serialized first, so a bad tree leaves any existing file alone
+    int state = 0;
+    {
+        NBT_Buffer_O bfr;
+        SerializeCall call = {&bfr, self, NULL, 0, 0, 0};
+        rb_protect(Serialize_Protected, (VALUE)&call, &state);
+        if(!state) {
+            NBT_gzFile_O fout(outputFilePath);
+            // if(!fout) {
+            //     rb_raise(rb_eArgError, "Could not write NBT file");
+            // }
+            if(!bfr.data.empty())
+                fout.Write(&bfr.data[0], bfr.data.size());
+        }
+    }
+    if(state)
+        rb_jump_tag(state);
     return self;
 }
 
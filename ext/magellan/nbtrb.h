@@ -28,10 +28,31 @@
 
 class NBT_Tag;
 class NBT_TagCompound;
+class NBT_Region_IO;
+class NBT_O;
 
 void Init_nbt();
 
+// C++ tree for a Ruby NBT, for writing it out. To avoid copying, the tree refers to
+// the contents of byte array strings and the trees backing unchanged NBTs, so it must
+// be used and deleted before rbvalue is changed or any Ruby code runs.
 NBT_Tag * ValueToNBT(VALUE rbvalue);
-VALUE NBT_CompoundToValue(NBT_TagCompound * comp);
+
+// Ruby NBT for a tree read from a file. Takes ownership of root: the tree is freed
+// when no Ruby NBT refers to any part of it.
+VALUE NBT_TreeToValue(NBT_TagCompound * root);
+
+// Value of a Ruby NBT, filled in from its backing tag if it hasn't been yet
+VALUE NBT_Value(VALUE rbnbt);
+void NBT_SetValue(VALUE rbnbt, VALUE value);
+// Length of a string or byte array NBT's value, without filling it in
+size_t NBT_ValueBytes(VALUE rbnbt);
+
+// Serialize a Ruby NBT directly from the Ruby objects, without building a tree
+void WriteNBT(NBT_O & fout, VALUE rbnbt);
+
+// Serialize a Ruby NBT and write it to a region as chunk cx, cz, compressing and
+// writing it with the interpreter lock released.
+int WriteRegionChunk(NBT_Region_IO & rgn, int cx, int cz, VALUE rbnbt);
 
 #endif // NBTRB_H
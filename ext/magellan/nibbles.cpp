@@ -0,0 +1,264 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#include "nibbles.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define NIBBLES_SSE2
+#include <emmintrin.h>
+#if (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)) || defined(__clang__)
+// AVX2 versions are compiled with a target attribute and chosen at runtime, so the
+// extension still runs on processors without it.
+#define NIBBLES_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+//******************************************************************************
+// Scalar versions, also used for the tails left over by the vector loops
+
+static void UnpackNibblesScalar(uint8_t * dst, const uint8_t * src, size_t n)
+{
+    for(size_t j = 0; j < n/2; ++j) {
+        dst[2*j] = src[j] & 0x0F;
+        dst[2*j + 1] = src[j] >> 4;
+    }
+    if(n & 1)
+        dst[n - 1] = src[n/2] & 0x0F;
+}
+
+static void PackNibblesScalar(uint8_t * dst, const uint8_t * src, size_t n)
+{
+    for(size_t j = 0; j < n/2; ++j)
+        dst[j] = (src[2*j] & 0x0F) | (src[2*j + 1] << 4);
+}
+
+static void CopyWhereNonzeroScalar(uint8_t * dst, const uint8_t * src, const uint8_t * key, size_t n)
+{
+    for(size_t j = 0; j < n; ++j)
+        dst[j] = key[j]? src[j] : dst[j];
+}
+
+#ifdef NIBBLES_SSE2
+//******************************************************************************
+
+static void UnpackNibblesSSE2(uint8_t * dst, const uint8_t * src, size_t n)
+{
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t j = 0;
+    for(; j + 32 <= n; j += 32)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + j/2));
+        __m128i lo = _mm_and_si128(v, mask);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i *)(dst + j + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+    UnpackNibblesScalar(dst + j, src + j/2, n - j);
+}
+
+static void PackNibblesSSE2(uint8_t * dst, const uint8_t * src, size_t n)
+{
+    // Each 16 bit lane holds an even/odd pair, combine to one byte then narrow
+    const __m128i loMask = _mm_set1_epi16(0x000F);
+    const __m128i hiMask = _mm_set1_epi16(0x00F0);
+    size_t j = 0;
+    for(; j + 32 <= n; j += 32)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + j));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + j + 16));
+        a = _mm_or_si128(_mm_and_si128(a, loMask), _mm_and_si128(_mm_srli_epi16(a, 4), hiMask));
+        b = _mm_or_si128(_mm_and_si128(b, loMask), _mm_and_si128(_mm_srli_epi16(b, 4), hiMask));
+        _mm_storeu_si128((__m128i *)(dst + j/2), _mm_packus_epi16(a, b));
+    }
+    PackNibblesScalar(dst + j/2, src + j, n - j);
+}
+
+static void CopyWhereNonzeroSSE2(uint8_t * dst, const uint8_t * src, const uint8_t * key, size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t j = 0;
+    for(; j + 16 <= n; j += 16)
+    {
+        // keep is all ones where key is zero
+        __m128i keep = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(key + j)), zero);
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + j));
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + j));
+        _mm_storeu_si128((__m128i *)(dst + j), _mm_or_si128(_mm_and_si128(keep, d), _mm_andnot_si128(keep, s)));
+    }
+    CopyWhereNonzeroScalar(dst + j, src + j, key + j, n - j);
+}
+#endif // NIBBLES_SSE2
+
+#ifdef NIBBLES_AVX2
+//******************************************************************************
+
+__attribute__((target("avx2")))
+static void UnpackNibblesAVX2(uint8_t * dst, const uint8_t * src, size_t n)
+{
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t j = 0;
+    for(; j + 64 <= n; j += 64)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + j/2));
+        __m256i lo = _mm256_and_si256(v, mask);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+        // Unpacks work within 128 bit lanes, lane 0 of both results is the first 32
+        // values and lane 1 the second
+        __m256i a = _mm256_unpacklo_epi8(lo, hi);
+        __m256i b = _mm256_unpackhi_epi8(lo, hi);
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256((__m256i *)(dst + j + 32), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    UnpackNibblesSSE2(dst + j, src + j/2, n - j);
+}
+
+__attribute__((target("avx2")))
+static void PackNibblesAVX2(uint8_t * dst, const uint8_t * src, size_t n)
+{
+    const __m256i loMask = _mm256_set1_epi16(0x000F);
+    const __m256i hiMask = _mm256_set1_epi16(0x00F0);
+    size_t j = 0;
+    for(; j + 64 <= n; j += 64)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + j));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + j + 32));
+        a = _mm256_or_si256(_mm256_and_si256(a, loMask), _mm256_and_si256(_mm256_srli_epi16(a, 4), hiMask));
+        b = _mm256_or_si256(_mm256_and_si256(b, loMask), _mm256_and_si256(_mm256_srli_epi16(b, 4), hiMask));
+        // Pack also works within lanes, giving a0 b0 a1 b1: reorder quadwords
+        __m256i p = _mm256_packus_epi16(a, b);
+        _mm256_storeu_si256((__m256i *)(dst + j/2), _mm256_permute4x64_epi64(p, 0xD8));
+    }
+    PackNibblesSSE2(dst + j/2, src + j, n - j);
+}
+
+__attribute__((target("avx2")))
+static void CopyWhereNonzeroAVX2(uint8_t * dst, const uint8_t * src, const uint8_t * key, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    size_t j = 0;
+    for(; j + 32 <= n; j += 32)
+    {
+        __m256i keep = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(key + j)), zero);
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + j));
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + j));
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_blendv_epi8(s, d, keep));
+    }
+    CopyWhereNonzeroSSE2(dst + j, src + j, key + j, n - j);
+}
+
+static bool DetectAVX2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+}
+
+// Static initialization is guarded, so this is safe to call from any thread
+static bool HaveAVX2()
+{
+    static const bool have = DetectAVX2();
+    return have;
+}
+#endif // NIBBLES_AVX2
+
+//******************************************************************************
+
+bool NibblesImplAvailable(int impl)
+{
+    switch(impl) {
+      case kNibblesScalar: return true;
+#ifdef NIBBLES_SSE2
+      case kNibblesSSE2: return true;
+#endif
+#ifdef NIBBLES_AVX2
+      case kNibblesAVX2: return HaveAVX2();
+#endif
+      default: return false;
+    }
+}
+
+static int BestImpl()
+{
+#if defined(NIBBLES_AVX2)
+    return HaveAVX2()? kNibblesAVX2 : kNibblesSSE2;
+#elif defined(NIBBLES_SSE2)
+    return kNibblesSSE2;
+#else
+    return kNibblesScalar;
+#endif
+}
+
+void UnpackNibbles(uint8_t * dst, const uint8_t * src, size_t n, int impl)
+{
+    if(!NibblesImplAvailable(impl))
+        impl = kNibblesScalar;
+    switch(impl) {
+#ifdef NIBBLES_AVX2
+      case kNibblesAVX2: UnpackNibblesAVX2(dst, src, n); break;
+#endif
+#ifdef NIBBLES_SSE2
+      case kNibblesSSE2: UnpackNibblesSSE2(dst, src, n); break;
+#endif
+      default: UnpackNibblesScalar(dst, src, n);
+    }
+}
+
+void PackNibbles(uint8_t * dst, const uint8_t * src, size_t n, int impl)
+{
+    if(!NibblesImplAvailable(impl))
+        impl = kNibblesScalar;
+    switch(impl) {
+#ifdef NIBBLES_AVX2
+      case kNibblesAVX2: PackNibblesAVX2(dst, src, n); break;
+#endif
+#ifdef NIBBLES_SSE2
+      case kNibblesSSE2: PackNibblesSSE2(dst, src, n); break;
+#endif
+      default: PackNibblesScalar(dst, src, n);
+    }
+}
+
+void CopyWhereNonzero(uint8_t * dst, const uint8_t * src, const uint8_t * key, size_t n, int impl)
+{
+    if(!NibblesImplAvailable(impl))
+        impl = kNibblesScalar;
+    switch(impl) {
+#ifdef NIBBLES_AVX2
+      case kNibblesAVX2: CopyWhereNonzeroAVX2(dst, src, key, n); break;
+#endif
+#ifdef NIBBLES_SSE2
+      case kNibblesSSE2: CopyWhereNonzeroSSE2(dst, src, key, n); break;
+#endif
+      default: CopyWhereNonzeroScalar(dst, src, key, n);
+    }
+}
+
+void UnpackNibbles(uint8_t * dst, const uint8_t * src, size_t n) {UnpackNibbles(dst, src, n, BestImpl());}
+
+void PackNibbles(uint8_t * dst, const uint8_t * src, size_t n) {PackNibbles(dst, src, n, BestImpl());}
+
+void CopyWhereNonzero(uint8_t * dst, const uint8_t * src, const uint8_t * key, size_t n) {
+    CopyWhereNonzero(dst, src, key, n, BestImpl());
+}
+
+//******************************************************************************
@@ -0,0 +1,59 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef NIBBLES_H
+#define NIBBLES_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Bulk conversion between packed 4-bit arrays, as used for block data and lighting in
+// chunks, and byte-per-value planes. Nibble j is in byte j/2, even nibbles in the low
+// half of the byte.
+// These are vectorized with SSE2 on x86, with AVX2 used when the processor supports
+// it, and fall back to plain loops elsewhere. There is no per-value branching, and
+// src and dst are each walked once, front to back.
+
+// Expand n nibbles (n/2 bytes) of src to n bytes of dst.
+void UnpackNibbles(uint8_t * dst, const uint8_t * src, size_t n);
+
+// Pack n bytes of src to n nibbles (n/2 bytes) of dst. Only the low 4 bits of each
+// source byte are used. n must be even.
+void PackNibbles(uint8_t * dst, const uint8_t * src, size_t n);
+
+// Copy n bytes of src to dst where the corresponding byte of key is nonzero, leaving
+// the rest of dst unchanged. Used to merge blocks over existing ones, with the block
+// types as key so that air does not overwrite anything.
+void CopyWhereNonzero(uint8_t * dst, const uint8_t * src, const uint8_t * key, size_t n);
+
+// The same operations done by a given implementation, so they can be tested against
+// each other. The functions above use the fastest available. Calling with an
+// implementation that isn't available falls back to the scalar one.
+enum NibblesImpl {kNibblesScalar, kNibblesSSE2, kNibblesAVX2};
+// True if impl was compiled in and the processor supports it
+bool NibblesImplAvailable(int impl);
+void UnpackNibbles(uint8_t * dst, const uint8_t * src, size_t n, int impl);
+void PackNibbles(uint8_t * dst, const uint8_t * src, size_t n, int impl);
+void CopyWhereNonzero(uint8_t * dst, const uint8_t * src, const uint8_t * key, size_t n, int impl);
+
+#endif // NIBBLES_H
@@ -238,9 +238,122 @@ inline bool PNG_FileInfo::Write(const std::string & filename, const SimpleImage
     
     png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
     png_write_end(png_ptr, info_ptr);
-    png_destroy_write_struct(&png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
     fclose(fp);
 	return true;
 }
 
+//******************************************************************************
+// Writes a PNG a band of rows at a time, so images too large to hold in memory can
+// be rendered and written piece by piece. Bands are written top down, the reverse of
+// the order of SimpleImage rows, and must be as wide as the PNG.
+class PNG_StreamWriter {
+  private:
+    FILE * fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_uint_32 width, height, rowsWritten;
+    
+    void Destroy() {
+        if(png_ptr)
+            png_destroy_write_struct(&png_ptr, info_ptr? &info_ptr : NULL);
+        if(fp)
+            fclose(fp);
+        png_ptr = NULL;
+        info_ptr = NULL;
+        fp = NULL;
+    }
+  
+  public:
+    PNG_StreamWriter(): fp(NULL), png_ptr(NULL), info_ptr(NULL), width(0), height(0), rowsWritten(0) {}
+    ~PNG_StreamWriter() {Destroy();}
+    
+    bool Open(const std::string & filename, png_uint_32 w, png_uint_32 h);
+    bool WriteRows(const SimpleImage & band);
+    // Finish the file, fails if not all rows were written
+    bool Close();
+};
+
+inline bool PNG_StreamWriter::Open(const std::string & filename, png_uint_32 w, png_uint_32 h)
+{
+    Destroy();
+    width = w;
+    height = h;
+    rowsWritten = 0;
+    
+    fp = fopen(filename.c_str(), "wb");
+    if(!fp) return false;
+    
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if(!png_ptr) {
+        Destroy();
+        std::cerr << "Could not create PNG write struct" << std::endl;
+        return false;
+    }
+    
+    info_ptr = png_create_info_struct(png_ptr);
+    if(!info_ptr) {
+        Destroy();
+        std::cerr << "Could not create PNG info struct" << std::endl;
+        return false;
+    }
+    
+    if(setjmp(png_jmpbuf(png_ptr)))
+    {
+        Destroy();
+        std::cerr << "PNG error" << std::endl;
+        return false;
+    }
+    
+    png_init_io(png_ptr, fp);
+    png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+    png_set_IHDR(png_ptr, info_ptr, width, height,
+       8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+       PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+	return true;
+}
+
+inline bool PNG_StreamWriter::WriteRows(const SimpleImage & band)
+{
+    if(!png_ptr || (png_uint_32)band.width != width || band.pixelBytes != 4 ||
+       rowsWritten + band.height > height)
+    {
+        std::cerr << "PNG band doesn't fit image" << std::endl;
+        return false;
+    }
+    
+    if(setjmp(png_jmpbuf(png_ptr)))
+    {
+        Destroy();
+        std::cerr << "PNG error" << std::endl;
+        return false;
+    }
+    
+    for(int32_t y = band.height - 1; y >= 0; --y)
+        png_write_row(png_ptr, band.rows[y]);
+    rowsWritten += band.height;
+	return true;
+}
+
+inline bool PNG_StreamWriter::Close()
+{
+    if(!png_ptr || rowsWritten != height) {
+        Destroy();
+        std::cerr << "PNG closed before all rows were written" << std::endl;
+        return false;
+    }
+    
+    if(setjmp(png_jmpbuf(png_ptr)))
+    {
+        Destroy();
+        std::cerr << "PNG error" << std::endl;
+        return false;
+    }
+    
+    png_write_end(png_ptr, info_ptr);
+    Destroy();
+	return true;
+}
+
 #endif // PNGIMAGE_H
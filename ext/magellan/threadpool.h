@@ -0,0 +1,151 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <vector>
+
+//******************************************************************************
+
+// Number of processors available, used as the default thread count.
+inline int NumCPUs()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0)? (int)n : 1;
+}
+
+// Simple wrapper for a pthreads mutex, locked for the lifetime of a MutexLock.
+class Mutex {
+    pthread_mutex_t mutex;
+    Mutex(const Mutex &);
+    Mutex & operator=(const Mutex &);
+  public:
+    Mutex() {pthread_mutex_init(&mutex, NULL);}
+    ~Mutex() {pthread_mutex_destroy(&mutex);}
+    void Lock() {pthread_mutex_lock(&mutex);}
+    bool TryLock() {return pthread_mutex_trylock(&mutex) == 0;}
+    void Unlock() {pthread_mutex_unlock(&mutex);}
+    pthread_mutex_t * Native() {return &mutex;}
+};
+
+class MutexLock {
+    Mutex & mutex;
+  public:
+    MutexLock(Mutex & m): mutex(m) {mutex.Lock();}
+    ~MutexLock() {mutex.Unlock();}
+};
+
+// Condition variable, waited on with its Mutex locked.
+class CondVar {
+    pthread_cond_t cond;
+    CondVar(const CondVar &);
+    CondVar & operator=(const CondVar &);
+  public:
+    CondVar() {pthread_cond_init(&cond, NULL);}
+    ~CondVar() {pthread_cond_destroy(&cond);}
+    void Wait(Mutex & mutex) {pthread_cond_wait(&cond, mutex.Native());}
+    void Signal() {pthread_cond_signal(&cond);}
+    void Broadcast() {pthread_cond_broadcast(&cond);}
+};
+
+// Flag set from one thread to ask work running on others to finish early.
+class StopFlag {
+    volatile int flag;
+  public:
+    StopFlag(): flag(0) {}
+    void Stop() {__sync_fetch_and_or(&flag, 1);}
+    bool Stopped() {return __sync_fetch_and_or(&flag, 0) != 0;}
+};
+
+//******************************************************************************
+// ParallelFor(n, task, numThreads)
+// Calls task(j, thread) for each j in [0, n), spread over numThreads threads (the
+// calling thread included), and returns when all have completed. thread is the
+// index of the executing thread, in [0, numThreads), for use with per-thread
+// scratch space and counters.
+// Indices are claimed one at a time from a shared counter, so threads that draw
+// cheap items simply go on to claim more and uneven work balances out. Tasks should
+// be coarse (a chunk or a region, not a block).
+// numThreads <= 0 uses one thread per processor.
+
+template<typename Task>
+struct ParallelForState {
+    Task * task;
+    size_t n;
+    volatile size_t next;
+};
+
+template<typename Task>
+struct ParallelForThread {
+    ParallelForState<Task> * state;
+    int thread;
+    
+    void Run() {
+        size_t j;
+        while((j = __sync_fetch_and_add(&state->next, 1)) < state->n)
+            (*state->task)(j, thread);
+    }
+    static void * Entry(void * arg) {
+        static_cast<ParallelForThread *>(arg)->Run();
+        return NULL;
+    }
+};
+
+template<typename Task>
+void ParallelFor(size_t n, Task & task, int numThreads = 0)
+{
+    if(numThreads <= 0)
+        numThreads = NumCPUs();
+    if((size_t)numThreads > n)
+        numThreads = (int)n;
+    
+    ParallelForState<Task> state;
+    state.task = &task;
+    state.n = n;
+    state.next = 0;
+    
+    std::vector<ParallelForThread<Task> > threads(numThreads > 0? numThreads : 1);
+    std::vector<pthread_t> tids(threads.size());
+    for(size_t t = 0; t < threads.size(); ++t) {
+        threads[t].state = &state;
+        threads[t].thread = (int)t;
+    }
+    
+    // Thread 0 is the caller
+    size_t started = 1;
+    for(size_t t = 1; t < threads.size(); ++t, ++started) {
+        if(pthread_create(&tids[t], NULL, ParallelForThread<Task>::Entry, &threads[t]) != 0)
+            break;// run with what we have, remaining indices get picked up anyway
+    }
+    threads[0].Run();
+    for(size_t t = 1; t < started; ++t)
+        pthread_join(tids[t], NULL);
+}
+
+//******************************************************************************
+#endif // THREADPOOL_H
@@ -0,0 +1,620 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+
+
+#include "worldrb.h"
+#include "chunkrb.h"
+#include "nbtrb.h"
+#include "nbtio.h"
+#include "magellan.h"
+
+#include <cstddef>
+#include <map>
+#include <algorithm>
+
+using namespace std;
+
+static VALUE class_MCBlockWorld;
+static VALUE class_MCBlockBuffer;
+
+struct RbBlockWorld {
+    MC_World * world;
+    // Region each chunk was read from, and its coordinates there, by world chunk coordinates
+    struct Source {
+        VALUE region;
+        int rx, rz;
+    };
+    map<pair<int32_t, int32_t>, Source> sources;
+};
+
+static void RbBlockWorld_Mark(void * ptr)
+{
+    RbBlockWorld * rbworld = static_cast<RbBlockWorld *>(ptr);
+    map<pair<int32_t, int32_t>, RbBlockWorld::Source>::iterator src;
+    for(src = rbworld->sources.begin(); src != rbworld->sources.end(); ++src)
+        rb_gc_mark(src->second.region);
+}
+
+static void RbBlockWorld_Free(void * ptr)
+{
+    RbBlockWorld * rbworld = static_cast<RbBlockWorld *>(ptr);
+    delete rbworld->world;
+    delete rbworld;
+}
+
+static const rb_data_type_t RbBlockWorld_type = {
+    "MCBlockWorld",
+    {RbBlockWorld_Mark, RbBlockWorld_Free, NULL, NULL, {NULL}},
+    NULL, NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE MCBlockWorld_allocate(VALUE klass)
+{
+    RbBlockWorld * rbworld = new RbBlockWorld;
+    rbworld->world = new MC_World;
+    return TypedData_Wrap_Struct(klass, &RbBlockWorld_type, rbworld);
+}
+
+static RbBlockWorld * GetRbBlockWorld(VALUE self)
+{
+    RbBlockWorld * rbworld;
+    TypedData_Get_Struct(self, RbBlockWorld, &RbBlockWorld_type, rbworld);
+    return rbworld;
+}
+
+MC_World * GetMCWorld(VALUE value) {return GetRbBlockWorld(value)->world;}
+
+// MCBlockWorld.new(opts = {})
+// With opts[:compact], chunks are held in compact mode (see compact_storage=).
+static VALUE MCBlockWorld_initialize(int argc, VALUE * argv, VALUE self)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "01", &opts);
+    if(!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        GetMCWorld(self)->SetCompactStorage(RTEST(rb_hash_aref(opts, ID2SYM(rb_intern("compact")))));
+    }
+    return self;
+}
+
+// Hold chunks run length encoded, usually a small fraction of their size, for
+// reading and searching areas too large to hold uncompressed. Turning it on compacts
+// all chunks held and any read later. Chunks that are edited are expanded again until
+// the next compact_chunks().
+static VALUE MCBlockWorld_set_compact_storage(VALUE self, VALUE on) {
+    GetMCWorld(self)->SetCompactStorage(RTEST(on));
+    return on;
+}
+
+static VALUE MCBlockWorld_compact_storage(VALUE self) {
+    return GetMCWorld(self)->CompactStorage()? Qtrue : Qfalse;
+}
+
+// Compact chunks expanded by edits, if compact storage is on
+static VALUE MCBlockWorld_compact_chunks(VALUE self) {
+    GetMCWorld(self)->CompactChunks();
+    return self;
+}
+
+// Approximate memory used by blocks, data and lighting of the chunks held
+static VALUE MCBlockWorld_storage_bytes(VALUE self) {
+    return SIZET2NUM(GetMCWorld(self)->StorageBytes());
+}
+
+// Box corners from the first six arguments
+static void GetBox(const VALUE * argv, int32_t box[6])
+{
+    for(int j = 0; j < 6; ++j)
+        box[j] = NUM2INT(argv[j]);
+}
+
+// read_chunk(region, x, z)
+// Read chunk x, z (0-31) of a MCRegion into the world. Returns false if it doesn't
+// exist, raises if the world already holds a chunk at its coordinates.
+static VALUE MCBlockWorld_read_chunk(VALUE self, VALUE region, VALUE rbx, VALUE rbz)
+{
+    RbBlockWorld * rbworld = GetRbBlockWorld(self);
+    int rx = NUM2INT(rbx), rz = NUM2INT(rbz);
+    NBT_Region_IO * rgn = GetMCRegion(region);
+    {
+        RegionLock lock(rgn);
+        if(!rgn->ChunkExists(rx, rz))
+            return Qfalse;
+    }
+    NBT_TagCompound * root = ReadRegionChunkNBT(rgn, rx, rz);
+    if(!root)
+        return Qfalse;
+    if(!ValidChunkNBT(root)) {
+        delete root;
+        rb_raise(rb_eArgError, "Not a valid chunk NBT");
+    }
+    MC_Chunk * chunk = new MC_Chunk(root);
+    if(rbworld->world->ChunkAt(chunk->xPos, chunk->zPos)) {
+        int32_t cx = chunk->xPos, cz = chunk->zPos;
+        delete chunk;
+        rb_raise(rb_eArgError, "World already holds chunk %d, %d", cx, cz);
+    }
+    RbBlockWorld::Source src = {region, rx, rz};
+    rbworld->sources[make_pair(chunk->xPos, chunk->zPos)] = src;
+    rbworld->world->AddChunk(chunk);
+    return Qtrue;
+}
+
+// Number of chunks held
+static VALUE MCBlockWorld_size(VALUE self) {
+    return SIZET2NUM(GetMCWorld(self)->GetAllChunks().size());
+}
+
+// World coordinates of the chunks held, as [x, z] pairs
+static VALUE MCBlockWorld_chunk_coords(VALUE self)
+{
+    const vector<MC_Chunk *> & chunks = GetMCWorld(self)->GetAllChunks();
+    VALUE coords = rb_ary_new2(chunks.size());
+    for(size_t j = 0; j < chunks.size(); ++j)
+        rb_ary_push(coords, rb_assoc_new(INT2NUM(chunks[j]->xPos), INT2NUM(chunks[j]->zPos)));
+    return coords;
+}
+
+// get_block(x, y, z)
+// Block type and data as [type, data], nil if the chunk isn't held or y is out of range.
+static VALUE MCBlockWorld_get_block(VALUE self, VALUE rbx, VALUE rby, VALUE rbz)
+{
+    MC_World * world = GetMCWorld(self);
+    int32_t x = NUM2INT(rbx), y = NUM2INT(rby), z = NUM2INT(rbz);
+    if(y < 0 || y > 127 || !world->ChunkAt(x >> 4, z >> 4))
+        return Qnil;
+    MC_Block block = world->GetBlock(x, y, z);
+    return rb_assoc_new(INT2FIX(block.type), INT2FIX(block.data));
+}
+
+// set_block(x, y, z, type, data = 0)
+// Set block type and data, keeping its lighting until relit. Returns false if the chunk
+// isn't held.
+static VALUE MCBlockWorld_set_block(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rbx, rby, rbz, rbtype, rbdata;
+    rb_scan_args(argc, argv, "41", &rbx, &rby, &rbz, &rbtype, &rbdata);
+    MC_World * world = GetMCWorld(self);
+    int32_t x = NUM2INT(rbx), y = NUM2INT(rby), z = NUM2INT(rbz);
+    if(y < 0 || y > 127)
+        rb_raise(rb_eIndexError, "y coordinate %d out of range", y);
+    if(!world->ChunkAt(x >> 4, z >> 4))
+        return Qfalse;
+    MC_Block block = world->GetBlock(x, y, z);
+    block.type = NUM2UINT(rbtype) & 0xFF;
+    block.data = NIL_P(rbdata)? 0 : NUM2UINT(rbdata) & 0x0F;
+    world->SetBlock(block, x, y, z);
+    return Qtrue;
+}
+
+// Block of type argv[0] and data argv[1] if given, with light from the array
+// [skylight, blocklight] in argv[2] if given. Returns true if light was given.
+static bool GetFillBlock(int argc, VALUE * argv, MC_Block & block)
+{
+    block.type = NUM2UINT(argv[0]) & 0xFF;
+    block.data = (argc > 1)? NUM2UINT(argv[1]) & 0x0F : 0;
+    block.skylight = block.blocklight = 0;
+    if(argc < 3 || NIL_P(argv[2]))
+        return false;
+    Check_Type(argv[2], T_ARRAY);
+    if(RARRAY_LEN(argv[2]) != 2)
+        rb_raise(rb_eArgError, "light must be [skylight, blocklight]");
+    block.skylight = NUM2UINT(rb_ary_entry(argv[2], 0)) & 0x0F;
+    block.blocklight = NUM2UINT(rb_ary_entry(argv[2], 1)) & 0x0F;
+    return true;
+}
+
+// fill(x0, y0, z0, x1, y1, z1, type, data = 0, light = nil)
+// Set type and data of the blocks of a box (inclusive world coordinates, corners in
+// any order) in the chunks held. Lighting is left to compute_lights() or
+// update_lights(), unless light is given as [skylight, blocklight] to set as well.
+// Returns the number set.
+static VALUE MCBlockWorld_fill(int argc, VALUE * argv, VALUE self)
+{
+    rb_check_arity(argc, 7, 9);
+    int32_t box[6];
+    GetBox(argv, box);
+    MC_Block block;
+    MC_World * world = GetMCWorld(self);
+    if(GetFillBlock(argc - 6, argv + 6, block))
+        return SIZET2NUM(world->FillBox(block, box[0], box[1], box[2], box[3], box[4], box[5]));
+    return SIZET2NUM(world->FillBox(block.type, block.data, box[0], box[1], box[2], box[3], box[4], box[5]));
+}
+
+// replace(from_type, x0, y0, z0, x1, y1, z1, type, data = 0, light = nil)
+// As fill(), but only setting blocks of from_type. Returns the number replaced.
+static VALUE MCBlockWorld_replace(int argc, VALUE * argv, VALUE self)
+{
+    rb_check_arity(argc, 8, 10);
+    int32_t box[6];
+    GetBox(argv + 1, box);
+    uint8_t fromType = NUM2UINT(argv[0]) & 0xFF;
+    MC_Block block;
+    MC_World * world = GetMCWorld(self);
+    if(GetFillBlock(argc - 7, argv + 7, block))
+        return SIZET2NUM(world->ReplaceBox(fromType, block, box[0], box[1], box[2], box[3], box[4], box[5]));
+    return SIZET2NUM(world->ReplaceBox(fromType, block.type, block.data, box[0], box[1], box[2], box[3], box[4], box[5]));
+}
+
+// read_box(x0, y0, z0, x1, y1, z1, opts = {})
+// Read the blocks of a box as MCWorld#read_box() does, a string of one byte per block
+// for each plane in opts[:planes] (default [:type]).
+static VALUE MCBlockWorld_read_box(int argc, VALUE * argv, VALUE self)
+{
+    rb_check_arity(argc, 6, 7);
+    int32_t box[6];
+    GetBox(argv, box);
+    VALUE rbplanes = Qnil;
+    if(argc > 6 && !NIL_P(argv[6])) {
+        Check_Type(argv[6], T_HASH);
+        rbplanes = rb_hash_aref(argv[6], ID2SYM(rb_intern("planes")));
+    }
+    if(NIL_P(rbplanes))
+        rbplanes = rb_ary_new3(1, ID2SYM(rb_intern("type")));
+    Check_Type(rbplanes, T_ARRAY);
+    
+    // Offset of each plane's field in MC_Block
+    vector<size_t> fields;
+    for(long j = 0; j < RARRAY_LEN(rbplanes); ++j)
+    {
+        VALUE plane = rb_ary_entry(rbplanes, j);
+        if(plane == ID2SYM(rb_intern("type"))) fields.push_back(offsetof(MC_Block, type));
+        else if(plane == ID2SYM(rb_intern("data"))) fields.push_back(offsetof(MC_Block, data));
+        else if(plane == ID2SYM(rb_intern("skylight"))) fields.push_back(offsetof(MC_Block, skylight));
+        else if(plane == ID2SYM(rb_intern("blocklight"))) fields.push_back(offsetof(MC_Block, blocklight));
+        else
+            rb_raise(rb_eArgError, "Unknown plane %s", RSTRING_PTR(rb_inspect(plane)));
+    }
+    
+    vector<MC_Block> blocks;
+    GetMCWorld(self)->ReadBox(blocks, box[0], box[1], box[2], box[3], box[4], box[5]);
+    VALUE rbbufs = rb_ary_new2(fields.size());
+    for(size_t j = 0; j < fields.size(); ++j)
+    {
+        VALUE rbbuf = rb_str_new(NULL, blocks.size());
+        uint8_t * dst = (uint8_t *)RSTRING_PTR(rbbuf);
+        for(size_t b = 0; b < blocks.size(); ++b)
+            dst[b] = reinterpret_cast<const uint8_t *>(&blocks[b])[fields[j]];
+        rb_ary_push(rbbufs, rbbuf);
+    }
+    return rbbufs;
+}
+
+// find_blocks(types, opts = {})
+// Find blocks of the given types (an id or array of ids) in the chunks held, as
+// MC_World#find_blocks() does, returning a string of native 32 bit x, y, z triples.
+// Options are data_mask, box and num_threads, as for MC_World#find_blocks().
+static VALUE MCBlockWorld_find_blocks(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rbtypes, opts;
+    rb_scan_args(argc, argv, "11", &rbtypes, &opts);
+    MC_BlockQuery query;
+    rbtypes = rb_Array(rbtypes);
+    for(long j = 0; j < RARRAY_LEN(rbtypes); ++j)
+        query.types.Insert(NUM2UINT(rb_ary_entry(rbtypes, j)) & 0xFF);
+    int numThreads = 0;
+    if(!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        VALUE rbmask = rb_hash_aref(opts, ID2SYM(rb_intern("data_mask")));
+        VALUE rbbox = rb_hash_aref(opts, ID2SYM(rb_intern("box")));
+        VALUE rbthreads = rb_hash_aref(opts, ID2SYM(rb_intern("num_threads")));
+        if(!NIL_P(rbmask))
+            query.dataMask = NUM2UINT(rbmask) & 0xFFFF;
+        if(!NIL_P(rbbox)) {
+            Check_Type(rbbox, T_ARRAY);
+            if(RARRAY_LEN(rbbox) != 6)
+                rb_raise(rb_eArgError, "Box must be [x0, y0, z0, x1, y1, z1]");
+            int32_t box[6];
+            GetBox(RARRAY_CONST_PTR(rbbox), box);
+            query.SetBox(box[0], box[1], box[2], box[3], box[4], box[5]);
+        }
+        if(!NIL_P(rbthreads))
+            numThreads = NUM2INT(rbthreads);
+    }
+    vector<int32_t> found;
+    GetMCWorld(self)->FindBlocks(query, found, numThreads);
+    return rb_str_new(found.empty()? NULL : (const char *)&found[0], found.size()*sizeof(int32_t));
+}
+
+// compute_lights(num_threads = 0)
+// Recompute lighting and heightmaps of dirty chunks and the chunks held beside them,
+// on num_threads threads (one per processor if 0). Returns the number of chunks relit.
+static VALUE MCBlockWorld_compute_lights(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rbthreads;
+    rb_scan_args(argc, argv, "01", &rbthreads);
+    return SIZET2NUM(GetMCWorld(self)->CalcLighting(NIL_P(rbthreads)? 0 : NUM2INT(rbthreads)));
+}
+
+// With light tracking on, blocks changed by set_block(), fill() and replace() are
+// recorded for update_lights(). Turning it off discards edits not yet relit.
+static VALUE MCBlockWorld_set_light_tracking(VALUE self, VALUE on) {
+    GetMCWorld(self)->SetLightTracking(RTEST(on));
+    return on;
+}
+
+static VALUE MCBlockWorld_light_tracking(VALUE self) {
+    return GetMCWorld(self)->LightTracking()? Qtrue : Qfalse;
+}
+
+// Relight around the edits recorded since light tracking was turned on or
+// update_lights() last ran, only as far as their effects reach, and update
+// heightmaps of the edited columns. Returns the number of light values set.
+static VALUE MCBlockWorld_update_lights(VALUE self) {
+    return SIZET2NUM(GetMCWorld(self)->UpdateLighting());
+}
+
+static int LightingModeArg(VALUE rbmode)
+{
+    if(NIL_P(rbmode))
+        return kLightingAltitude;
+    if(rbmode == ID2SYM(rb_intern("altitude"))) return kLightingAltitude;
+    if(rbmode == ID2SYM(rb_intern("day"))) return kLightingDay;
+    if(rbmode == ID2SYM(rb_intern("night"))) return kLightingNight;
+    if(rbmode == ID2SYM(rb_intern("morning"))) return kLightingMorning;
+    if(rbmode == ID2SYM(rb_intern("evening"))) return kLightingEvening;
+    rb_raise(rb_eArgError, "Unknown lighting mode %s", RSTRING_PTR(rb_inspect(rbmode)));
+    return kLightingAltitude;
+}
+
+// render_map(path, opts = {})
+// Render a map of the tops of the chunks held to the PNG at path. Options are scale
+// (pixels per block, default 2), lighting (:altitude, the default, :day, :night,
+// :morning or :evening), peel, num_threads, band_rows and tile_chunks, as for
+// MagellanOptions. Scales above 1 draw block textures, see Magellan.load_textures().
+static VALUE MCBlockWorld_render_map(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rbpath, opts;
+    rb_scan_args(argc, argv, "11", &rbpath, &opts);
+    MC_World * world = GetMCWorld(self);
+    MagellanOptions mopts;
+    mopts.outputFile = StringValueCStr(rbpath);
+    if(!NIL_P(opts)) {
+        Check_Type(opts, T_HASH);
+        VALUE rbscale = rb_hash_aref(opts, ID2SYM(rb_intern("scale")));
+        VALUE rbpeel = rb_hash_aref(opts, ID2SYM(rb_intern("peel")));
+        VALUE rbthreads = rb_hash_aref(opts, ID2SYM(rb_intern("num_threads")));
+        VALUE rbbands = rb_hash_aref(opts, ID2SYM(rb_intern("band_rows")));
+        VALUE rbtiles = rb_hash_aref(opts, ID2SYM(rb_intern("tile_chunks")));
+        mopts.lightingMode = LightingModeArg(rb_hash_aref(opts, ID2SYM(rb_intern("lighting"))));
+        if(!NIL_P(rbscale)) mopts.scale = NUM2INT(rbscale);
+        if(!NIL_P(rbpeel)) mopts.peel = NUM2INT(rbpeel);
+        if(!NIL_P(rbthreads)) mopts.numThreads = NUM2INT(rbthreads);
+        if(!NIL_P(rbbands)) mopts.bandRows = NUM2INT(rbbands);
+        if(!NIL_P(rbtiles)) mopts.tileChunks = NUM2INT(rbtiles);
+    }
+    if(mopts.scale < 1 || mopts.scale > 16)
+        rb_raise(rb_eArgError, "Scale %d out of range 1..16", mopts.scale);
+    if(mopts.tileChunks < 1)
+        rb_raise(rb_eArgError, "Tiles must be at least one chunk");
+    if(mopts.scale > 1 && !TexturesLoaded())
+        rb_raise(rb_eRuntimeError, "No textures loaded");
+    if(world->GetAllChunks().empty())
+        rb_raise(rb_eArgError, "No chunks to render");
+    
+    mopts.xMin = world->xChunkMin;
+    mopts.xMax = world->xChunkMax;
+    mopts.zMin = world->zChunkMin;
+    mopts.zMax = world->zChunkMax;
+    mopts.xSize = world->xSize;
+    mopts.zSize = world->zSize;
+    mopts.xMinBlock = mopts.xMin*16;
+    mopts.xMaxBlock = mopts.xMax*16 + 15;
+    mopts.zMinBlock = mopts.zMin*16;
+    mopts.zMaxBlock = mopts.zMax*16 + 15;
+    if(!RenderMap(*world, mopts))
+        rb_raise(rb_eIOError, "Could not write %s", mopts.outputFile.c_str());
+    return self;
+}
+
+//******************************************************************************
+// MCBlockBuffer
+
+static void RbBlockBuffer_Free(void * ptr) {delete static_cast<MC_BlockBuffer *>(ptr);}
+
+static const rb_data_type_t RbBlockBuffer_type = {
+    "MCBlockBuffer",
+    {NULL, RbBlockBuffer_Free, NULL, NULL, {NULL}},
+    NULL, NULL,
+    RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE MCBlockBuffer_allocate(VALUE klass) {
+    return TypedData_Wrap_Struct(klass, &RbBlockBuffer_type, NULL);
+}
+
+static MC_BlockBuffer * GetMCBlockBuffer(VALUE self)
+{
+    MC_BlockBuffer * buffer;
+    TypedData_Get_Struct(self, MC_BlockBuffer, &RbBlockBuffer_type, buffer);
+    if(!buffer)
+        rb_raise(rb_eRuntimeError, "MCBlockBuffer not initialized");
+    return buffer;
+}
+
+// MCBlockBuffer.new(x_size, y_size, z_size)
+// Buffer of air blocks, with no entities.
+static VALUE MCBlockBuffer_initialize(VALUE self, VALUE rbxsize, VALUE rbysize, VALUE rbzsize)
+{
+    int xSize = NUM2INT(rbxsize), ySize = NUM2INT(rbysize), zSize = NUM2INT(rbzsize);
+    if(xSize < 1 || ySize < 1 || ySize > 128 || zSize < 1)
+        rb_raise(rb_eArgError, "Bad buffer size %d, %d, %d", xSize, ySize, zSize);
+    if(DATA_PTR(self))
+        rb_raise(rb_eRuntimeError, "MCBlockBuffer already initialized");
+    DATA_PTR(self) = new MC_BlockBuffer(xSize, ySize, zSize);
+    return self;
+}
+
+static VALUE MCBlockBuffer_size(VALUE self) {
+    MC_BlockBuffer * buffer = GetMCBlockBuffer(self);
+    return rb_ary_new3(3, INT2NUM(buffer->XSize()), INT2NUM(buffer->YSize()), INT2NUM(buffer->ZSize()));
+}
+
+// Buffer coordinates, raising if out of range
+static void BufferCoords(MC_BlockBuffer * buffer, VALUE rbx, VALUE rby, VALUE rbz, int & x, int & y, int & z)
+{
+    x = NUM2INT(rbx); y = NUM2INT(rby); z = NUM2INT(rbz);
+    if(x < 0 || x >= buffer->XSize() || y < 0 || y >= buffer->YSize() || z < 0 || z >= buffer->ZSize())
+        rb_raise(rb_eIndexError, "Block %d, %d, %d outside buffer", x, y, z);
+}
+
+// get_block(x, y, z)
+// Block type and data at buffer coordinates as [type, data]
+static VALUE MCBlockBuffer_get_block(VALUE self, VALUE rbx, VALUE rby, VALUE rbz)
+{
+    MC_BlockBuffer * buffer = GetMCBlockBuffer(self);
+    int x, y, z;
+    BufferCoords(buffer, rbx, rby, rbz, x, y, z);
+    MC_Block block = buffer->GetBlock(x, y, z);
+    return rb_assoc_new(INT2FIX(block.type), INT2FIX(block.data));
+}
+
+// set_block(x, y, z, type, data = 0)
+// Set block type and data at buffer coordinates, keeping its lighting.
+static VALUE MCBlockBuffer_set_block(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rbx, rby, rbz, rbtype, rbdata;
+    rb_scan_args(argc, argv, "41", &rbx, &rby, &rbz, &rbtype, &rbdata);
+    MC_BlockBuffer * buffer = GetMCBlockBuffer(self);
+    int x, y, z;
+    BufferCoords(buffer, rbx, rby, rbz, x, y, z);
+    MC_Block block = buffer->GetBlock(x, y, z);
+    block.type = NUM2UINT(rbtype) & 0xFF;
+    block.data = NIL_P(rbdata)? 0 : NUM2UINT(rbdata) & 0x0F;
+    buffer->SetBlock(x, y, z, block);
+    return self;
+}
+
+// Copy of the buffer's entities and tile entities, as the Entities and TileEntities
+// lists of a compound, with positions relative to the buffer.
+static VALUE MCBlockBuffer_entities_nbt(VALUE self)
+{
+    MC_BlockBuffer * buffer = GetMCBlockBuffer(self);
+    NBT_TagCompound * root = new NBT_TagCompound("");
+    root->AddTag(buffer->GetEntities().Clone());
+    root->AddTag(buffer->GetTileEntities().Clone());
+    return NBT_TreeToValue(root);
+}
+
+// copy(buffer, x, y, z)
+// Copy blocks and entities of the box of buffer's size with lowest corner x, y, z into
+// buffer, replacing its contents. Blocks outside the chunks held read as air.
+static VALUE MCBlockWorld_copy(VALUE self, VALUE rbbuffer, VALUE rbx, VALUE rby, VALUE rbz)
+{
+    MC_World * world = GetMCWorld(self);
+    GetMCBlockBuffer(rbbuffer)->CopyFrom(*world, NUM2INT(rbx), NUM2INT(rby), NUM2INT(rbz));
+    return rbbuffer;
+}
+
+// paste(buffer, x, y, z)
+// Copy blocks and entities of buffer to the box with lowest corner x, y, z, removing
+// the entities already there. Lighting is copied with the blocks: follow with
+// compute_lights() where the surroundings differ. Returns self.
+static VALUE MCBlockWorld_paste(VALUE self, VALUE rbbuffer, VALUE rbx, VALUE rby, VALUE rbz)
+{
+    MC_World * world = GetMCWorld(self);
+    GetMCBlockBuffer(rbbuffer)->CopyTo(*world, NUM2INT(rbx), NUM2INT(rby), NUM2INT(rbz));
+    return self;
+}
+
+// merge(buffer, x, y, z)
+// As paste(), but air in buffer leaves the block there alone, and only tile entities
+// of replaced blocks are removed.
+static VALUE MCBlockWorld_merge(VALUE self, VALUE rbbuffer, VALUE rbx, VALUE rby, VALUE rbz)
+{
+    MC_World * world = GetMCWorld(self);
+    GetMCBlockBuffer(rbbuffer)->MergeTo(*world, NUM2INT(rbx), NUM2INT(rby), NUM2INT(rbz));
+    return self;
+}
+
+//******************************************************************************
+
+// write(last_update = nil)
+// Write dirty chunks back to the regions they were read from, setting their LastUpdate
+// tags first if last_update is given. Returns the number written.
+static VALUE MCBlockWorld_write(int argc, VALUE * argv, VALUE self)
+{
+    VALUE rblastupdate;
+    rb_scan_args(argc, argv, "01", &rblastupdate);
+    RbBlockWorld * rbworld = GetRbBlockWorld(self);
+    const vector<MC_Chunk *> & chunks = rbworld->world->GetAllChunks();
+    size_t count = 0;
+    for(size_t j = 0; j < chunks.size(); ++j)
+    {
+        MC_Chunk * chunk = chunks[j];
+        if(!chunk->IsDirty())
+            continue;
+        const RbBlockWorld::Source & src = rbworld->sources[make_pair(chunk->xPos, chunk->zPos)];
+        NBT_TagCompound * root = chunk->GetChunkNBT();
+        if(!NIL_P(rblastupdate))
+            root->GetTag<NBT_TagCompound>("Level")->GetTag<NBT_TagLong>("LastUpdate")->value = NUM2LL(rblastupdate);
+        NBT_Buffer_O bfr;
+        root->Write(bfr);
+        if(WriteRegionChunkData(GetMCRegion(src.region), src.rx, src.rz, bfr.data) != 0)
+            rb_raise(rb_eIOError, "Could not write chunk %d, %d", chunk->xPos, chunk->zPos);
+        chunk->SetDirty(false);
+        ++count;
+    }
+    return SIZET2NUM(count);
+}
+
+void Init_mcblockworld()
+{
+    class_MCBlockWorld = rb_define_class("MCBlockWorld", rb_cObject);
+    rb_define_alloc_func(class_MCBlockWorld, MCBlockWorld_allocate);
+    rb_undef_method(class_MCBlockWorld, "initialize_copy");
+    rb_define_method(class_MCBlockWorld, "initialize", RUBY_METHOD_FUNC(MCBlockWorld_initialize), -1);
+    rb_define_method(class_MCBlockWorld, "compact_storage=", RUBY_METHOD_FUNC(MCBlockWorld_set_compact_storage), 1);
+    rb_define_method(class_MCBlockWorld, "compact_storage?", RUBY_METHOD_FUNC(MCBlockWorld_compact_storage), 0);
+    rb_define_method(class_MCBlockWorld, "compact_chunks", RUBY_METHOD_FUNC(MCBlockWorld_compact_chunks), 0);
+    rb_define_method(class_MCBlockWorld, "storage_bytes", RUBY_METHOD_FUNC(MCBlockWorld_storage_bytes), 0);
+    rb_define_method(class_MCBlockWorld, "read_chunk", RUBY_METHOD_FUNC(MCBlockWorld_read_chunk), 3);
+    rb_define_method(class_MCBlockWorld, "size", RUBY_METHOD_FUNC(MCBlockWorld_size), 0);
+    rb_define_method(class_MCBlockWorld, "chunk_coords", RUBY_METHOD_FUNC(MCBlockWorld_chunk_coords), 0);
+    rb_define_method(class_MCBlockWorld, "get_block", RUBY_METHOD_FUNC(MCBlockWorld_get_block), 3);
+    rb_define_method(class_MCBlockWorld, "set_block", RUBY_METHOD_FUNC(MCBlockWorld_set_block), -1);
+    rb_define_method(class_MCBlockWorld, "fill", RUBY_METHOD_FUNC(MCBlockWorld_fill), -1);
+    rb_define_method(class_MCBlockWorld, "replace", RUBY_METHOD_FUNC(MCBlockWorld_replace), -1);
+    rb_define_method(class_MCBlockWorld, "read_box", RUBY_METHOD_FUNC(MCBlockWorld_read_box), -1);
+    rb_define_method(class_MCBlockWorld, "find_blocks", RUBY_METHOD_FUNC(MCBlockWorld_find_blocks), -1);
+    rb_define_method(class_MCBlockWorld, "compute_lights", RUBY_METHOD_FUNC(MCBlockWorld_compute_lights), -1);
+    rb_define_method(class_MCBlockWorld, "light_tracking=", RUBY_METHOD_FUNC(MCBlockWorld_set_light_tracking), 1);
+    rb_define_method(class_MCBlockWorld, "light_tracking?", RUBY_METHOD_FUNC(MCBlockWorld_light_tracking), 0);
+    rb_define_method(class_MCBlockWorld, "update_lights", RUBY_METHOD_FUNC(MCBlockWorld_update_lights), 0);
+    rb_define_method(class_MCBlockWorld, "render_map", RUBY_METHOD_FUNC(MCBlockWorld_render_map), -1);
+    rb_define_method(class_MCBlockWorld, "copy", RUBY_METHOD_FUNC(MCBlockWorld_copy), 4);
+    rb_define_method(class_MCBlockWorld, "paste", RUBY_METHOD_FUNC(MCBlockWorld_paste), 4);
+    rb_define_method(class_MCBlockWorld, "merge", RUBY_METHOD_FUNC(MCBlockWorld_merge), 4);
+    rb_define_method(class_MCBlockWorld, "write", RUBY_METHOD_FUNC(MCBlockWorld_write), -1);
+    
+    class_MCBlockBuffer = rb_define_class("MCBlockBuffer", rb_cObject);
+    rb_define_alloc_func(class_MCBlockBuffer, MCBlockBuffer_allocate);
+    rb_undef_method(class_MCBlockBuffer, "initialize_copy");
+    rb_define_method(class_MCBlockBuffer, "initialize", RUBY_METHOD_FUNC(MCBlockBuffer_initialize), 3);
+    rb_define_method(class_MCBlockBuffer, "size", RUBY_METHOD_FUNC(MCBlockBuffer_size), 0);
+    rb_define_method(class_MCBlockBuffer, "get_block", RUBY_METHOD_FUNC(MCBlockBuffer_get_block), 3);
+    rb_define_method(class_MCBlockBuffer, "set_block", RUBY_METHOD_FUNC(MCBlockBuffer_set_block), -1);
+    rb_define_method(class_MCBlockBuffer, "entities_nbt", RUBY_METHOD_FUNC(MCBlockBuffer_entities_nbt), 0);
+}
@@ -0,0 +1,44 @@
+//******************************************************************************
+//    Copyright (c) 2011, Christopher James Huff
+//    All rights reserved.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//******************************************************************************
+
+
+#ifndef WORLDRB_H
+#define WORLDRB_H
+
+#include <ruby.h>
+
+class MC_World;
+
+// MCBlockWorld is a Ruby class wrapping a MC_World, a set of chunks held in memory as
+// MC_Chunks, for operations over many chunks at once: bulk edits of boxes, copying
+// and pasting, searching, relighting and rendering, all in C++. Each chunk remembers
+// the MCRegion it was read from, and dirty chunks are written back there.
+// MCBlockBuffer wraps a MC_BlockBuffer, a box of blocks with their entities copied out
+// of a MCBlockWorld, to be pasted or merged back elsewhere.
+
+// World wrapped by a MCBlockWorld
+MC_World * GetMCWorld(VALUE value);
+
+void Init_mcblockworld();
+
+#endif // WORLDRB_H
@@ -0,0 +1,36 @@
+
+require 'magellan'
+require 'magellan/chunkresults'
+
+module Magellan
+
+# Index of the block types present in each chunk, for finding the chunks that hold a
+# type without reading or inflating any of them. Each chunk's entry is a 32 byte
+# bitset (see Magellan.block_types_present()), recorded with the chunk's region
+# timestamp like any other MC_ChunkResults and saved in the same kind of cache file.
+#
+#   index = MC_BlockIndex.new("#{world.world_dir}/blocktypes.cache")
+#   world.update_block_index(index)
+#   index.save()
+#   index.chunks_containing(BLOCKS_BY_NAME[:SilverfishNest][:id]).each {|coords| ...}
+#
+# Only chunks written since the last update are read again.
+class MC_BlockIndex < MC_ChunkResults
+    # True if the chunk is indexed and holds the block type
+    def contains?(coords, type)
+        bits = self[coords]
+        bits != nil && bits.getbyte(type >> 3)[type & 7] == 1
+    end
+
+    # Coordinates of indexed chunks holding any of the given block types
+    def chunks_containing(*types)
+        types = types.flatten
+        found = []
+        each {|coords, bits|
+            found.push(coords) if(types.any? {|type| bits.getbyte(type >> 3)[type & 7] == 1})
+        }
+        found
+    end
+end # class MC_BlockIndex
+
+end # module Magellan
@@ -0,0 +1,110 @@
+
+require 'magellan'
+
+module Magellan
+
+# Per-chunk results of an incremental computation (rendered tiles, block counts,
+# entity lists, heightmaps...), each recorded along with the timestamp the chunk had
+# in its region file's TOC when the result was computed. The results are kept in a
+# cache file between runs, and a chunk only needs to be recomputed if its current
+# timestamp differs from the recorded one. See MC_World#each_changed_chunk().
+#
+# Results are keyed by world chunk coordinates, [chunk_x, chunk_z], and may be any
+# object that Marshal can dump.
+#
+#   results = MC_ChunkResults.new("blockcounts.cache")
+#   world.each_changed_chunk(results) {|chunk| count_blocks(chunk)}
+#   results.save()
+#   results.each {|coords, counts| ...}
+#
+# Region timestamps have a resolution of one second, and are only updated when a
+# chunk is written to disk: write any modified chunks before updating results.
+# A chunk written again within the second its timestamp was read keeps the same
+# timestamp, so results are also recorded with the time the timestamp was read, and
+# are never fresh if the chunk's timestamp is not older than that.
+class MC_ChunkResults
+    # Bump when the file layout changes. Old cache files are ignored, not converted.
+    CACHE_VERSION = 2
+
+    attr_reader :path
+
+    def initialize(path = nil)
+        @path = path
+        @entries = {}
+        if(path && File.exist?(path))
+            load(path)
+        end
+    end
+
+    # Load results from a cache file, replacing any current contents. An unreadable
+    # or out of date file is treated as empty, forcing a full recompute.
+    def load(path = @path)
+        @entries = {}
+        begin
+            data = File.open(path, 'rb') {|fin| Marshal.load(fin)}
+            if(data.is_a?(Hash) && data[:version] == CACHE_VERSION)
+                @entries = data[:entries]
+            end
+        rescue StandardError => e
+            warn "Discarding chunk result cache #{path}: #{e.message}"
+        end
+        self
+    end
+
+    # Write results to cache file. A temporary file is written and renamed over the
+    # old one, so an interrupted save leaves the previous cache intact.
+    def save(path = @path)
+        tmppath = "#{path}.tmp"
+        File.open(tmppath, 'wb') {|fout|
+            Marshal.dump({version: CACHE_VERSION, entries: @entries}, fout)
+        }
+        File.rename(tmppath, path)
+        self
+    end
+
+    # True if a result is recorded for chunk and was computed from the chunk as of the
+    # given timestamp, and the chunk can't have been written again within the same
+    # second.
+    def fresh?(coords, timestamp)
+        entry = @entries[coords]
+        entry != nil && entry[0] == timestamp && timestamp < entry[2]
+    end
+
+    def timestamp(coords)
+        entry = @entries[coords]
+        entry && entry[0]
+    end
+
+    def [](coords)
+        entry = @entries[coords]
+        entry && entry[1]
+    end
+
+    # Record result computed from the chunk as of timestamp. read_time is the time
+    # (in seconds, as Time#to_i) at or before which timestamp was read from the TOC.
+    def store(coords, timestamp, result, read_time = Time.now.to_i)
+        @entries[coords] = [timestamp, result, read_time]
+    end
+
+    def delete(coords)
+        entry = @entries.delete(coords)
+        entry && entry[1]
+    end
+
+    # Drop results for any chunks not in live_coords (a hash keyed by chunk coordinates),
+    # such as chunks that have been deleted or regions that are no longer present.
+    def retain(live_coords)
+        @entries.delete_if {|coords, entry| !live_coords.has_key?(coords)}
+        self
+    end
+
+    def each()
+        @entries.each {|coords, entry| yield(coords, entry[1])}
+    end
+
+    def size()
+        @entries.size
+    end
+end # class MC_ChunkResults
+
+end # module Magellan
@@ -489,6 +489,14 @@ ARMOR_SLOTS = {
     helmet: 103,
 }
 
+# The tables are never modified after this point. Deep-freeze them so they can be
+# read from any Ractor.
+if(defined?(Ractor))
+    [CHUNK_DIRS, BLOCKS_BY_ID, BLOCKS_BY_NAME, BLOCK_TYPES, ITEMS_BY_ID, ITEMS_BY_NAME,
+     OTHER_ITEM_TYPES, ITEM_TYPES, DYE_IDS, SLAB_IDS, WOOD_IDS, FUEL_IDS, STONE_BRICK_IDS,
+     SHRUB_IDS, ARMOR_SLOTS].each {|table| Ractor.make_shareable(table)}
+end
+
 def load_level_dat(world_name)
     NBT.load(MCPATH + "/saves/" + world_name + "/level.dat")
 end
@@ -103,7 +103,7 @@ end
 
 class MC_Torch
     # block data value is direction
-    DIRS = {s: 1, n: 2, w: 3, e: 4, floor: 5}
+    DIRS = {s: 1, n: 2, w: 3, e: 4, floor: 5}.freeze
 end
 
 class MC_Rail
@@ -112,17 +112,17 @@ class MC_Rail
         ew: 0, ns: 1, # flat
         as: 2, an: 3, ae: 4, aw: 5, # ascending in a cardinal direction
         ne: 6, se: 7, sw: 8, nw: 9 # curved
-    }
+    }.freeze
 end
 
 class MC_Ladder
     # block data value is direction
-    DIRS = {e: 2, w: 3, n: 4, s: 5}
+    DIRS = {e: 2, w: 3, n: 4, s: 5}.freeze
 end
 
 class MC_Stairs
     # block data value is ascending direction
-    DIRS = {s: 0, n: 1, w: 2, e: 3}
+    DIRS = {s: 0, n: 1, w: 2, e: 3}.freeze
 end
 
 class MC_Furnace
@@ -131,7 +131,7 @@ class MC_Furnace
     # TAG_Short("BurnTime")
     # TAG_Short("CookTime")
     # TAG_List("Items")
-    DIRS = {e: 2, w: 3, n: 4, s: 5}
+    DIRS = {e: 2, w: 3, n: 4, s: 5}.freeze
 end
 class MC_Dispenser
     # block data value is direction
@@ -160,7 +160,7 @@ end
 
 class MC_Pumpkin
     # block data value is direction
-    DIRS = {e: 0, s: 1, w: 2, n: 3}
+    DIRS = {e: 0, s: 1, w: 2, n: 3}.freeze
 end
 
 class MC_SignPost
@@ -171,7 +171,7 @@ class MC_SignPost
         n:  4, nne:  5, ne:  6, ene: 7,
         e:  8, ese:  9, se: 10, sse: 11,
         s: 12, ssw: 13, sw: 14, wsw: 15
-    }
+    }.freeze
     def initialize(coords, dir, text1, text2 = "", text3 = "", text4 = "")
         super(coords, "Sign")
         @dir = dir
@@ -3,6 +3,8 @@ require 'magellan'
 require 'magellan/mcdefs'
 require 'magellan/mcentity'
 require 'magellan/mcleveldat'
+require 'magellan/chunkresults'
+require 'magellan/blockindex'
 
 module Magellan
 
@@ -16,6 +18,7 @@ module Magellan
 # 
 # Chunks do not have a full class at this time, they are simple hashes:
 # chunk = {
+#     coords: [chunk_x, chunk_z],
 #     region: region,
 #     region_coords: [region_chunk_x, region_chunk_z],
 #     nbt: chunk_nbt,
@@ -24,16 +27,31 @@ module Magellan
 #     dirty: true/false,
 #     accessed: incrementing integer
 # }
+#
+# Loaded chunks are held in a MCChunkCache, which keeps them within a memory budget
+# (opts[:chunk_cache_bytes], 256 MB by default) by dropping the least recently used
+# ones, writing them back first if dirty. Don't hold on to a chunk hash across calls
+# that may load other chunks: get it again with get_chunk().
+#
+# With opts[:compact_storage], block worlds loaded with load_block_world() hold their
+# chunks compacted (see MCBlockWorld#compact_storage=), for analysis of areas too large
+# to hold uncompressed.
 
 # Region-relative coordinates of the chunks contained within the region
-CHUNK_COORDS = (0..31).to_a.product((0..31).to_a)
+CHUNK_COORDS = (0..31).to_a.product((0..31).to_a).each(&:freeze).freeze
 
-class MC_World
+# The native MCWorld base class provides the compute_*_intern() methods.
+class MC_World < MCWorld
     attr_reader :level_dat, :world_dir, :world_name, :all_regions
+    attr_accessor :compact_storage
     
     def initialize(opts = {})
         # @gen_chunks = opts.fetch(:gen_chunks, true)
         @all_regions = {}
+        @chunks = MCChunkCache.new(opts.fetch(:chunk_cache_bytes, 256*1024*1024))
+        @access_ctr = 0
+        @light_changes = nil
+        @compact_storage = opts.fetch(:compact_storage, false)
         if(opts[:world_dir])
             load_world(opts[:world_dir])
         elsif(opts[:world_name])
@@ -42,6 +60,8 @@ class MC_World
     end
     
     # Load world...opens all region files and level.dat for world, does not load any chunks.
+    # Region TOCs stay in memory, but at most MCRegion.max_open_files region files are
+    # held open at once: others are closed, and reopened when a chunk is read or written.
     def load_world(world_dir)
         @world_dir = world_dir
         @world_name = world_dir.split('/')[-1]
@@ -52,7 +72,7 @@ class MC_World
         
         region_files.each {|fin|
             # Extract coordinates from file name. File name format is r.X.Y.mcr
-            coords = fin.split('.')[1, 2]
+            coords = File.basename(fin).split('.')[1, 2].map {|c| c.to_i}
             region = MCRegion.new
             if(region.open(fin) == 0)
             # if(region.open("#{@world_dir}/region/#{fin}") == 0)
@@ -72,16 +92,67 @@ class MC_World
         ts = mc_timestamp()
         tsbytes = (0..7).map {|x| (ts >> (8*(7-x))) & 0xFF}
         @slock.write(tsbytes.pack("CCCCCCCC"))
-        
-        @chunks = {}
     end
     
-    def compute_lights()
-        compute_lights_intern()
+    # Recompute lighting and heightmaps of loaded dirty chunks and the chunks beside
+    # them, on num_threads threads (one per processor if 0). Returns the number of
+    # chunks relit, which are marked dirty. Chunks around the dirty ones that aren't
+    # loaded are read without adding them to the chunk cache, and written back
+    # straight away if relit.
+    def compute_lights(num_threads = 0)
+        loaded = {}
+        @chunks.each {|coords, chunk| loaded[coords] = chunk}
+        # Relit chunks are lit across their borders by the chunks beside them, so two
+        # chunks out from each dirty one are needed
+        around = {}
+        loaded.each {|(cx, cz), chunk|
+            next unless chunk[:dirty]
+            (-2..2).each {|dx| (-2..2).each {|dz| around[[cx + dx, cz + dz]] = true}}
+        }
+        unloaded = around.keys.reject {|coords| loaded[coords]}.map {|cx, cz| read_chunk(cx, cz)}.compact
+        relit = compute_lights_intern(num_threads, unloaded)
+        unloaded.each {|chunk| write_chunk(chunk) if(chunk[:dirty])}
+        relit
+    end
+    
+    # With light tracking on, blocks whose type is changed by set_block2() and
+    # write_box() are recorded for update_lights(). Turning it off discards edits not
+    # yet relit.
+    def light_tracking=(on)
+        @light_changes = on ? "".b : nil
+        @light_chunks = {}
+    end
+    
+    def light_tracking?()
+        @light_changes != nil
+    end
+    
+    # Relight around the edits recorded since light tracking was turned on or
+    # update_lights() last ran, only as far as their effects reach, and update
+    # heightmaps of the edited columns. Far less work than compute_lights() for small
+    # edits. Chunks beside the edited ones that aren't loaded are read without caching
+    # them, and written back straight away if their light changes. Returns the number
+    # of light values set.
+    def update_lights()
+        return 0 if(!@light_changes || @light_changes.empty?)
+        around = {}
+        @light_chunks.each_key {|cx, cz|
+            (-1..1).each {|dx| (-1..1).each {|dz| around[[cx + dx, cz + dz]] = true}}
+        }
+        loaded = {}
+        @chunks.each {|coords, chunk| loaded[coords] = true}
+        unloaded = around.keys.reject {|coords| loaded[coords]}.map {|cx, cz| read_chunk(cx, cz)}.compact
+        count = update_lights_intern(@light_changes, unloaded)
+        unloaded.each {|chunk| write_chunk(chunk) if(chunk[:dirty])}
+        @light_changes.clear
+        @light_chunks.clear
+        count
     end
     
-    def compute_heights()
-        compute_heights_intern()
+    # Recompute heightmaps of loaded dirty chunks, on num_threads threads (one per
+    # processor if 0). Returns the number of chunks updated.
+    def compute_heights(num_threads = 0)
+        compute_heights_intern(num_threads)
     end
     
     def mc_timestamp()
@@ -93,25 +164,156 @@ class MC_World
     # end
     
     # Iterate over each non-empty chunk in the world, calling block on each.
-    def each_chunk(fn)
-        @all_regions.each_key {|rgmcoord|
+    # Chunks are read ahead of the block, up to opts[:depth] (default 64) at once, and
+    # inflated and parsed on opts[:num_threads] threads (one per processor if 0, the
+    # default), so the block rarely waits on disk or zlib. Chunks already loaded, or
+    # written by the block before they come up, are taken from the chunk cache or
+    # read again as get_chunk() would.
+    def each_chunk(opts = {})
+        depth = opts.fetch(:depth, 64)
+        num_threads = opts.fetch(:num_threads, 0)
+        each_chunk_intern(@all_regions.to_a, @chunks, depth, num_threads) {|coords, region, chunk_nbt|
+            if(chunk_nbt)
+                chunk = new_chunk(coords, region, chunk_nbt)
+                @chunks[coords] = chunk
+                chunk[:accessed] = (@access_ctr += 1)
+            else
+                chunk = get_chunk(coords[0]*16, coords[1]*16)
+            end
+            if(chunk)
+                yield(chunk)
+            end
+        }
+    end
+    
+    # Incremental version of each_chunk(). Calls block only on chunks whose region
+    # timestamp differs from the one recorded in results (a MC_ChunkResults), and
+    # stores the value returned by the block as the chunk's new result. Results for
+    # chunks that no longer exist are dropped. Chunks are selected using only the
+    # region TOCs, unchanged chunks are never read.
+    # Returns the number of chunks recomputed.
+    def each_changed_chunk(results)
+        live = {}
+        recomputed = 0
+        @all_regions.each {|rgncoord, rgn|
+            read_time = Time.now.to_i
+            timestamps = rgn.chunk_timestamps
+            CHUNK_COORDS.each {|chunkcoord|
+                timestamp = timestamps[chunkcoord[0] + chunkcoord[1]*32]
+                next if(timestamp == nil)
+                
+                coords = [rgncoord[0]*32 + chunkcoord[0], rgncoord[1]*32 + chunkcoord[1]]
+                live[coords] = true
+                next if(results.fresh?(coords, timestamp))
+                
+                chunk = get_chunk(coords[0]*16, coords[1]*16)
+                if(chunk)
+                    results.store(coords, timestamp, yield(chunk), read_time)
+                    recomputed += 1
+                end
+            }
+        }
+        results.retain(live)
+        recomputed
+    end
+
+    # Bring a MC_BlockIndex up to date, reading only chunks changed since it was last
+    # updated. Returns the number of chunks indexed.
+    def update_block_index(index)
+        each_changed_chunk(index) {|chunk| Magellan.block_types_present(chunk[:blocks])}
+    end
+
+    # Bring a MCEntityIndex up to date, reading and parsing only chunks written since
+    # it was last updated, on num_threads threads (one per processor if 0). Changes to
+    # loaded chunks are seen once they are written. Returns the number of chunks indexed.
+    def update_entity_index(index, num_threads = 0)
+        index.update(@all_regions, num_threads)
+    end
+
+    # The world's entity index, created on first use and updated on each call.
+    #   world.entity_index.within(spawn_x, spawn_y, spawn_z, 200, "Chest")
+    #   world.entity_index.with_id("MobSpawner")
+    def entity_index(num_threads = 0)
+        @entity_index ||= MCEntityIndex.new
+        update_entity_index(@entity_index, num_threads)
+        @entity_index
+    end
+
+    # Find blocks of the given types (an id or array of ids). Returns their coordinates
+    # as a string of native 32 bit x, y, z triples: use found.unpack("l*").each_slice(3)
+    # to get them as arrays. Options:
+    #   data_mask: integer with bit d set for each data value d to accept (default all)
+    #   box: [x0, y0, z0, x1, y1, z1], inclusive block coordinates to search within
+    #   index: MC_BlockIndex used to skip unchanged chunks that can't hold the types
+    #   num_threads: threads to search on, one per processor if 0 (the default)
+    #   with_types: if true, return x, y, z, type quadruples instead, for searching
+    #               for several types at once and telling the results apart
+    # Loaded chunks are searched as they are in memory, others are read from their
+    # region files without going through the chunk cache. The world is searched a
+    # region at a time: if a block is given, it is called with the results for each
+    # region instead.
+    def find_blocks(types, opts = {})
+        types = [types].flatten
+        type_set = "\0"*32
+        types.each {|type| type_set.setbyte(type >> 3, type_set.getbyte(type >> 3) | (1 << (type & 7)))}
+        data_mask = opts.fetch(:data_mask, 0xFFFF)
+        box = opts[:box]
+        index = opts[:index]
+        num_threads = opts.fetch(:num_threads, 0)
+        with_types = opts.fetch(:with_types, false)
+        if(box)
+            xrange = ([box[0], box[3]].min/16)..([box[0], box[3]].max/16)
+            zrange = ([box[2], box[5]].min/16)..([box[2], box[5]].max/16)
+        end
+        
+        all_found = ''.b
+        @all_regions.each {|rgncoord, rgn|
+            timestamps = rgn.chunk_timestamps
+            search = []
             CHUNK_COORDS.each {|chunkcoord|
-                chunk = get_chunk(rgmcoord[0] + chunkcoord[0], rgmcoord[1] + chunkcoord[1])
+                timestamp = timestamps[chunkcoord[0] + chunkcoord[1]*32]
+                next if(timestamp == nil)
+                
+                coords = [rgncoord[0]*32 + chunkcoord[0], rgncoord[1]*32 + chunkcoord[1]]
+                next if(box && !(xrange.include?(coords[0]) && zrange.include?(coords[1])))
+                
+                chunk = @chunks[coords]
                 if(chunk)
-                    yield(chunk)
+                    search.push(chunk)
+                elsif(!(index && index.fresh?(coords, timestamp) && types.none? {|type| index.contains?(coords, type)}))
+                    search.push([rgn, chunkcoord[0], chunkcoord[1]])
                 end
             }
+            next if(search.empty?)
+            
+            found = find_blocks_intern(type_set, data_mask, box, search, num_threads, with_types)
+            if(block_given?)
+                yield(found)
+            else
+                all_found << found
+            end
         }
+        all_found
     end
 
-    def each_entity_nbt(fn)
+    def each_entity_nbt()
         each_chunk {|chunk| chunk[:entities].each {|ent| yield(ent)}}
     end
 
-    def each_tile_entity_nbt(fn)
+    def each_tile_entity_nbt()
         each_chunk {|chunk| chunk[:tile_entities].each {|ent| yield(ent)}}
     end
     
+    # Chunk cache counters: hits, misses, evictions, writebacks, and current chunks,
+    # bytes and budget.
+    def cache_stats()
+        @chunks.stats
+    end
+    
+    def chunk_cache_budget=(bytes)
+        @chunks.budget = bytes
+    end
+    
     def get_stats()
         stats = {}
         stats[:world_name] = @world_name
@@ -148,42 +350,47 @@ class MC_World
     # Parameters are world XZ coordinates for any column of blocks in the desired chunk.
     # Loads NBT for chunk containing coordinates if not already loaded, or creates new one with
     # fill_empty_chunk() if chunk doesn't yet exist.
-    # TODO: unload a chunk if more than a maximum number are loaded. Unload clean chunk if any
-    # exist unless it was just loaded, otherwise write and unload least recently accessed chunk.
+    # The chunk cache unloads least recently accessed chunks when over its memory budget,
+    # clean chunks first, writing back dirty chunks if necessary.
     def load_chunk(x, z)
-        chunk_nbt = nil
-        region = @all_regions[[x/512, z/512]]
-        
-        if(region)
-            region_chunk_x = (x/16) & 31
-            region_chunk_z = (z/16) & 31
-            if(region.chunk_exists(region_chunk_x, region_chunk_z))
-                chunk_nbt = region.read_chunk_nbt(region_chunk_x, region_chunk_z)
-            end
-        end
-        
-        if(chunk_nbt)
-            level = chunk_nbt[:Level]
-            chunk = {
-                region: region,
-                region_coords: [region_chunk_x, region_chunk_z],
-                nbt: chunk_nbt,
-                blocks: level[:Blocks].value,
-                block_data: level[:Data].value,
-                entities: level[:Entities].value,
-                tile_entities: level[:TileEntities].value,
-                dirty: false,
-                accessed: 0
-            }
+        chunk = read_chunk(x/16, z/16)
+        if(chunk)
             @chunks[[x/16, z/16]] = chunk
-            chunk
-        else
-            nil
         end
+        chunk
+    end
+    
+    # Chunk hash for chunk cx, cz (chunk coordinates) read from its region, without
+    # adding it to the chunk cache. nil if it doesn't exist.
+    def read_chunk(cx, cz)
+        region = @all_regions[[cx >> 5, cz >> 5]]
+        if(region && region.chunk_exists(cx & 31, cz & 31))
+            chunk_nbt = region.read_chunk_nbt(cx & 31, cz & 31)
+            chunk_nbt && new_chunk([cx, cz], region, chunk_nbt)
+        end
+    end
+    
+    # Chunk hash for chunk_nbt, read from region at world chunk coordinates coords
+    def new_chunk(coords, region, chunk_nbt)
+        level = chunk_nbt[:Level]
+        {
+            coords: coords,
+            region: region,
+            region_coords: [coords[0] & 31, coords[1] & 31],
+            nbt: chunk_nbt,
+            blocks: level[:Blocks].value,
+            block_data: level[:Data].value,
+            entities: level[:Entities].value,
+            tile_entities: level[:TileEntities].value,
+            dirty: false,
+            accessed: 0
+        }
     end
     
     def unload_chunk(chunk)
-        chunk = @chunks.delete(chunk[:region_coords]) {raise "Attempt to unload chunk that isn't loaded"}
+        if(@chunks.delete(chunk[:coords]) == nil)
+            raise "Attempt to unload chunk that isn't loaded"
+        end
         if(chunk[:dirty])
             write_chunk(chunk)
         end
@@ -194,17 +401,54 @@ class MC_World
         # "Tick when the chunk was last saved". Unclear whether
         # this is the same quantity written to the session lock file.
         chunk[:nbt][:Level][:LastUpdate].value = mc_timestamp()
-        chunk[:region].write_chunk_nbt(x, z, chunk[:nbt])
+        rcoords = chunk[:region_coords]
+        chunk[:region].write_chunk_nbt(rcoords[0], rcoords[1], chunk[:nbt])
         chunk[:dirty] = false
     end
     
-    # Write all loaded/modified chunks to disk
+    # Write all loaded/modified chunks to disk, grouped by region
     def write_chunks()
-        @chunks.each {|chunk|
-            if(chunk[:dirty])
-                write_chunk(chunk)
-            end
+        @chunks.flush
+    end
+    
+    # Native MCChunk for the chunk containing XZ block coordinates, nil if it doesn't
+    # exist. Its get_block/set_block, fill and replace run in C, far faster than
+    # set_block2() and get_block2() on chunk hashes when placing many blocks. It isn't
+    # held in the chunk cache: a loaded chunk hash for the same chunk is written back if
+    # dirty and unloaded first, and the MCChunk must be written with write_mc_chunk()
+    # once edited.
+    def load_mc_chunk(x, z)
+        chunk = @chunks[[x/16, z/16]]
+        unload_chunk(chunk) if(chunk)
+        region = @all_regions[[x/512, z/512]]
+        region && MCChunk.read(region, (x/16) & 31, (z/16) & 31)
+    end
+    
+    def write_mc_chunk(mc_chunk)
+        mc_chunk.write(mc_timestamp())
+    end
+
+    # Native MCBlockWorld holding the chunks overlapping XZ block coordinates x0..x1,
+    # z0..z1, for bulk edits and reads spanning many chunks: its fill, replace and
+    # read_box work a column run at a time in C, with no per-chunk Ruby calls. As with
+    # load_mc_chunk(), loaded chunk hashes in the area are written back if dirty and
+    # unloaded first, and the block world must be written with write_block_world().
+    # Chunks are held compacted (see MCBlockWorld#compact_storage=) if opts[:compact]
+    # is set, or by default if the world was opened with compact_storage.
+    def load_block_world(x0, z0, x1, z1, opts = {})
+        block_world = MCBlockWorld.new(compact: opts.fetch(:compact, @compact_storage))
+        box_chunk_coords([x0, 0, z0, x1, 0, z1]).each {|cx, cz|
+            chunk = @chunks[[cx, cz]]
+            unload_chunk(chunk) if(chunk)
+            region = @all_regions[[cx >> 5, cz >> 5]]
+            block_world.read_chunk(region, cx & 31, cz & 31) if(region)
         }
+        block_world
+    end
+
+    # Write the dirty chunks of a MCBlockWorld, returns the number written
+    def write_block_world(block_world)
+        block_world.write(mc_timestamp())
     end
     
     # Get the chunk containing given coordinates
@@ -217,8 +461,8 @@ class MC_World
     # 
     # to automatically load chunks on access.
     def get_chunk(x, z)
-        chunk = @chunks.fetch([x/16, z/16]) {load_chunk(x, z)}
-        if(chunk == nil)
+        chunk = @chunks[[x/16, z/16]] || load_chunk(x, z)
+        if(chunk == nil && block_given?)
             chunk = yield(x, z)
         end
         if(chunk != nil)
@@ -237,7 +481,7 @@ class MC_World
         [block_coords[0]/16, block_coords[10]/16]
     end
     
-    # Sets block type and data.
+    # Sets block type and data. For many blocks, use a MCChunk (see load_mc_chunk()).
     def set_block2(x, y, z, bid, data)
         chunk = get_chunk(x, z)
         chunk[:dirty] = true
@@ -247,6 +491,14 @@ class MC_World
         
         # Set block
         bidx = ((x & 15)*16 + (z & 15))*128 + y
+        if(@light_changes && blocks.getbyte(bidx) != bid)
+            level = chunk[:nbt][:Level]
+            shift = 4*(bidx & 1)
+            sky = (level[:SkyLight].value.getbyte(bidx >> 1) >> shift) & 15
+            block = (level[:BlockLight].value.getbyte(bidx >> 1) >> shift) & 15
+            @light_changes << [x, y, z, sky, block].pack("l3C2")
+            @light_chunks[[x >> 4, z >> 4]] = true
+        end
         blocks.setbyte(bidx, bid)
         
         # Set data
@@ -267,6 +519,41 @@ class MC_World
         [chunk[:blocks].getbyte(bidx), chunk[:block_data].getbyte(bidx >> 1)]
     end
     
+    # Read the blocks in box x0..x1, y0..y1, z0..z1 (inclusive, corners in any order) in
+    # one pass, returning a string per plane in opts[:planes] (default [:type]), each of
+    # :type, :data, :skylight or :blocklight. Strings hold one byte per block, indexed
+    # ((x - x0)*z_size + (z - z0))*y_size + (y - y0) from the lowest corner, the order
+    # chunks store blocks in. Blocks in missing chunks or outside y 0..127 read as 0.
+    def read_box(x0, y0, z0, x1, y1, z1, opts = {})
+        box = [x0, y0, z0, x1, y1, z1]
+        chunks = box_chunk_coords(box).map {|cx, cz| get_chunk(cx*16, cz*16)}.compact
+        read_box_intern(box, chunks, opts.fetch(:planes, [:type]))
+    end
+    
+    # Write strings laid out as returned by read_box() back into the box, one for each
+    # plane in opts[:planes] (default [:type]). Blocks in missing chunks or outside y
+    # 0..127 are skipped. Chunks written to are marked dirty; lighting and heightmaps
+    # are left to compute_lights() or update_lights(). Returns the number of blocks
+    # written.
+    def write_box(x0, y0, z0, x1, y1, z1, bufs, opts = {})
+        box = [x0, y0, z0, x1, y1, z1]
+        planes = opts.fetch(:planes, [:type])
+        # A chunk at a time, so the cache can't unload chunks already written
+        box_chunk_coords(box).inject(0) {|count, (cx, cz)|
+            chunk = get_chunk(cx*16, cz*16)
+            next count unless chunk
+            @light_chunks[[cx, cz]] = true if(@light_changes)
+            count + write_box_intern(box, [chunk], planes, bufs, @light_changes)
+        }
+    end
+    
+    # Coordinates of chunks overlapping box
+    def box_chunk_coords(box)
+        xr = Range.new(*[box[0], box[3]].minmax.map {|x| x/16})
+        zr = Range.new(*[box[2], box[5]].minmax.map {|z| z/16})
+        xr.to_a.product(zr.to_a)
+    end
+    
     # Find first empty block location immediately above a non-empty block,
     # starting from given location.
     def find_drop_pt(x, y, z)
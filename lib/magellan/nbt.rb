@@ -1,7 +1,8 @@
 require 'magellan/magellan'
 
+# The native NBT class provides name, type, value and entry_type accessors. NBTs
+# read from files fill in their name and value only when first asked for them.
 class NBT
-    attr_accessor :name, :type, :value, :entry_type
     TAG_END = 0
     TAG_BYTE = 1
     TAG_SHORT = 2
@@ -15,9 +16,9 @@ class NBT
     TAG_COMPOUND = 10
     
     TAG_NAMES = %w[TAG_END TAG_BYTE TAG_SHORT TAG_INT TAG_LONG TAG_FLOAT
-        TAG_DOUBLE TAG_BYTE_ARRAY TAG_STRING TAG_LIST TAG_COMPOUND]
+        TAG_DOUBLE TAG_BYTE_ARRAY TAG_STRING TAG_LIST TAG_COMPOUND].each(&:freeze).freeze
     
-    # NBTs are simple objects with @name, @type, and @value. Lists also have @entry_type.
+    # NBTs are simple objects with a name, type, and value. Lists also have an entry_type.
     # There is currently no actual class heirarchy for the various types.
     def self.new_byte(name, val = 0)
         NBT.new(name, NBT::TAG_BYTE, val)
@@ -51,28 +52,28 @@ class NBT
         NBT.new(name, NBT::TAG_COMPOUND, val)
     end
     
-    @@printindent = 0
-    def to_s()
-        if(@type == NBT::TAG_BYTE_ARRAY)
-            "  "*@@printindent + "#{@name}: <BYTE_ARRAY>[#{@value.length}]"
-        elsif(@type == NBT::TAG_COMPOUND)
-            @@printindent += 1
-            contstr = @value.map {|v| v[1].to_s}.join(",\n")
-            @@printindent -= 1
-            "  "*@@printindent + "#{@name}: {\n#{contstr}\n" + "  "*@@printindent +  "}"
-        elsif(@type == NBT::TAG_LIST)
-            @@printindent += 1
-            contstr = @value.map {|value| value.to_s}.join(",\n")
-            @@printindent -= 1
-            "  "*@@printindent + "#{@name}: (#{TAG_NAMES[@entry_type]})[\n#{contstr}\n" + "  "*@@printindent +  "]"
+    def to_s(indent = 0)
+        tab = "  "*indent
+        if(type == NBT::TAG_BYTE_ARRAY)
+            tab + "#{name}: <BYTE_ARRAY>[#{value.length}]"
+        elsif(type == NBT::TAG_COMPOUND)
+            contstr = value.map {|v| v[1].to_s(indent + 1)}.join(",\n")
+            tab + "#{name}: {\n#{contstr}\n" + tab +  "}"
+        elsif(type == NBT::TAG_LIST)
+            contstr = value.map {|entry| entry.to_s(indent + 1)}.join(",\n")
+            tab + "#{name}: (#{TAG_NAMES[entry_type]})[\n#{contstr}\n" + tab +  "]"
         else
-            "  "*@@printindent + "#{@name}: (#{TAG_NAMES[@type]})#{@value.to_s}"
+            tab + "#{name}: (#{TAG_NAMES[type]})#{value.to_s}"
         end
     end
     
+    def inspect()
+        "#<NBT #{name.inspect} #{TAG_NAMES[type]} #{value.inspect}>"
+    end
+    
     def [](idx)
-        if(@type == NBT::TAG_COMPOUND || @type == NBT::TAG_LIST)
-            @value[idx]
+        if(type == NBT::TAG_COMPOUND || type == NBT::TAG_LIST)
+            value[idx]
         else
             puts "attempt to use operator []= on non-composite tag"
             nil
@@ -80,8 +81,8 @@ class NBT
     end
     
     def []=(idx, val)
-        if(@type == NBT::TAG_COMPOUND || @type == NBT::TAG_LIST)
-            @value[idx] = val
+        if(type == NBT::TAG_COMPOUND || type == NBT::TAG_LIST)
+            value[idx] = val
         else
             puts "attempt to use operator []= on non-composite tag"
             nil
@@ -89,8 +90,8 @@ class NBT
     end
     
     def insert(val)
-        if(@type == NBT::TAG_COMPOUND)
-            @value[val.name.to_sym] = val
+        if(type == NBT::TAG_COMPOUND)
+            value[val.name.to_sym] = val
         end
     end
 end # class NBT
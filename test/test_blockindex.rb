@@ -0,0 +1,75 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestBlockIndex < Test::Unit::TestCase
+  # Bit (type & 7) of byte (type >> 3) for each type present
+  def test_block_types_present
+    bits = Magellan.block_types_present("\x00\x01\x09\x41\xFF\x01".b)
+    assert_equal(32, bits.bytesize)
+    expected = [0]*32
+    expected[0] = 0b11
+    expected[1] = 0b10
+    expected[8] = 0b10
+    expected[31] = 0b10000000
+    assert_equal(expected, bits.bytes)
+    assert_equal([0]*32, Magellan.block_types_present("").bytes)
+  end
+
+  def test_contains
+    index = MC_BlockIndex.new
+    index.store([0, 0], 1000, Magellan.block_types_present("\x01\x30".b))
+    index.store([-3, 2], 1000, Magellan.block_types_present("\x02\xFF".b))
+    assert(index.contains?([0, 0], 48))
+    assert(index.contains?([-3, 2], 255))
+    assert(!index.contains?([0, 0], 2))
+    assert(!index.contains?([5, 5], 1))
+    assert_equal([[0, 0]], index.chunks_containing(48))
+    assert_equal([[-3, 2], [0, 0]], index.chunks_containing(2, 49, 1).sort)
+    assert_equal([[-3, 2], [0, 0]], index.chunks_containing([48, 255]).sort)
+    assert_equal([], index.chunks_containing(3))
+  end
+
+  def test_update_and_reload
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      index = MC_BlockIndex.new("#{dir}/blocktypes.cache")
+      assert_equal(12, world.update_block_index(index))
+      index.save
+      assert(index.contains?([0, 0], 1))
+      assert(index.contains?([-30, 1], 2))
+      assert(!index.contains?([0, 0], 48))
+
+      # Reloaded from the cache file, nothing has changed since
+      index = MC_BlockIndex.new("#{dir}/blocktypes.cache")
+      assert_equal(12, index.size)
+      assert_equal(12, index.chunks_containing(2).size)
+      assert_equal(0, world.update_block_index(index))
+
+      world.set_block2(5, 70, 5, 48, 0)
+      world.write_chunks
+      assert_equal(1, world.update_block_index(index))
+      assert_equal([[0, 0]], index.chunks_containing(48))
+    }
+  end
+
+  # Chunks the index rules out aren't searched. The index is made to claim chunk 1, 0
+  # holds nothing, to tell skipped chunks from those that are searched and hold none.
+  def test_find_blocks_with_index
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      index = MC_BlockIndex.new
+      world.update_block_index(index)
+      index.store([1, 0], index.timestamp([1, 0]), "\0"*32)
+
+      box = [0, 60, 0, 31, 60, 0]
+      world = MC_World.new(world_dir: dir)
+      assert_equal(32, world.find_blocks(1, box: box).unpack("l*").size/3)
+      found = world.find_blocks(1, box: box, index: index).unpack("l*").each_slice(3).to_a
+      assert_equal((0..15).map {|x| [x, 60, 0]}, found.sort)
+      assert_equal("", world.find_blocks(48, index: index))
+    }
+  end
+end
@@ -0,0 +1,198 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestBlockWorld < Test::Unit::TestCase
+  def test_load
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      # Chunk -1, 0 doesn't exist
+      bw = world.load_block_world(-16, 0, 47, 31)
+      assert_equal(6, bw.size)
+      assert_equal([0, 1, 2].product([0, 1]), bw.chunk_coords.sort)
+      assert_equal([1, 0], bw.get_block(5, 60, 5))
+      assert_equal([2, 0], bw.get_block(47, 61, 31))
+      assert_nil(bw.get_block(-1, 60, 5))
+      assert_raise(ArgumentError) { bw.read_chunk(world.all_regions[[0, 0]], 1, 1) }
+    }
+  end
+
+  # Chunks at negative coordinates and far apart, in more pages of the chunk table than
+  # it starts out with room for
+  def test_far_apart_chunks
+    regions = [[0, 0], [-1, 0], [-1, -1], [3, -7], [-100, 70], [1000, -1000], [-40000, 40000],
+               [65535, 65535], [-65536, -65536], [12, 12], [-13, 12]]
+    WorldFixture.with_world(regions) {|dir|
+      world = MC_World.new(world_dir: dir)
+      bw = MCBlockWorld.new
+      regions.each {|rx, rz| WorldFixture::CHUNKS.each {|x, z| bw.read_chunk(world.all_regions[[rx, rz]], x, z)}}
+      coords = regions.product(WorldFixture::CHUNKS).map {|(rx, rz), (x, z)| [rx*32 + x, rz*32 + z]}
+      assert_equal(coords.size, bw.size)
+      assert_equal(coords.sort, bw.chunk_coords.sort)
+      coords.each_with_index {|(cx, cz), j| assert(bw.set_block(cx*16 + 15, 70, cz*16 + 1, j + 1))}
+      coords.each_with_index {|(cx, cz), j|
+        assert_equal([j + 1, 0], bw.get_block(cx*16 + 15, 70, cz*16 + 1))
+        assert_equal([2, 0], bw.get_block(cx*16, 61, cz*16 + 15))
+      }
+      # Beside chunks held, in pages held and not
+      assert_nil(bw.get_block(3*16, 61, 0))
+      assert_nil(bw.get_block(-1, 61, -1 - 32*16))
+      assert_nil(bw.get_block(65535*512 - 1, 61, 65535*512))
+      assert_nil(bw.get_block(-65536*512, 61, -65535*512))
+    }
+  end
+
+  def test_edit_and_write
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      bw = world.load_block_world(0, 0, 47, 31)
+      # Spans four chunks, clipped to the height range
+      assert_equal(11*11*4, bw.fill(20, 124, 10, 10, 130, 20, 20, 3))
+      assert_equal([20, 3], bw.get_block(15, 127, 16))
+      assert_equal(4*2, bw.replace(2, 30, 61, 30, 33, 0, 33, 4))
+      assert_equal([4, 0], bw.get_block(31, 61, 31))
+      assert_equal([2, 0], bw.get_block(31, 61, 29))
+      assert_equal(true, bw.set_block(40, 70, 2, 35, 14))
+      assert_equal(false, bw.set_block(-1, 70, 2, 35))
+      assert_raise(IndexError) { bw.set_block(40, 128, 2, 35) }
+
+      types, data = bw.read_box(10, 60, 10, 20, 127, 20, planes: [:type, :data])
+      assert_equal(11*68*11, types.bytesize)
+      assert_equal(20, types.getbyte(((15 - 10)*11 + (16 - 10))*68 + (127 - 60)))
+      assert_equal(3, data.getbyte(((15 - 10)*11 + (16 - 10))*68 + (127 - 60)))
+      assert_equal(1, types.getbyte(0))
+
+      assert_equal(6, world.write_block_world(bw))
+      assert_equal(0, bw.write)
+
+      # Read back through chunk hashes
+      world = MC_World.new(world_dir: dir)
+      assert_equal([types, data], world.read_box(10, 60, 10, 20, 127, 20, planes: [:type, :data]))
+      assert_equal(35, world.get_block2(40, 70, 2)[0])
+      assert_equal(4, world.get_block2(33, 61, 31)[0])
+    }
+  end
+
+  # Box operations walk the chunks with a cursor, here across chunk edges at negative
+  # coordinates and past the chunks held. Reads start at an odd height, halfway through
+  # a byte of nibbles, and have an odd length.
+  def test_box_across_chunk_edges
+    WorldFixture.with_world([[-1, -1]]) {|dir|
+      world = MC_World.new(world_dir: dir)
+      # Chunks -32..-30 by -32..-31
+      bw = world.load_block_world(-512, -512, -465, -481)
+      assert_equal(24*4*11, bw.fill(-477, 58, -490, -500, 61, -500, 4, 2, [9, 3]))
+      assert_equal(4*2*4, bw.replace(4, -497, 60, -497, -494, 63, -494, 5, 1, [0, 7]))
+      assert_equal(3*2*2, bw.replace(4, -482, 58, -492, -480, 59, -491, 6))
+
+      x0, y0, z0, x1, y1, z1 = -502, 57, -502, -460, 65, -488
+      planes = bw.read_box(x0, y0, z0, x1, y1, z1, planes: [:type, :data, :skylight, :blocklight])
+      j = 0
+      (x0..x1).each {|x|
+        (z0..z1).each {|z|
+          (y0..y1).each {|y|
+            expected = if x > -465 then [0, 0, 0, 0]
+                       elsif (-497..-494) === x && (-497..-494) === z && (60..61) === y then [5, 1, 0, 7]
+                       elsif (-482..-480) === x && (-492..-491) === z && (58..59) === y then [6, 0, 9, 3]
+                       elsif (-500..-477) === x && (-500..-490) === z && (58..61) === y then [4, 2, 9, 3]
+                       elsif y <= 60 then [1, 0, 0, 0]
+                       elsif y == 61 then [2, 0, 0, 0]
+                       else [0, 0, 0, 0]
+                       end
+            assert_equal(expected, planes.map {|plane| plane.getbyte(j)}, "#{x}, #{y}, #{z}")
+            assert_equal((x > -465)? nil : expected[0, 2], bw.get_block(x, y, z))
+            j += 1
+          }
+        }
+      }
+    }
+  end
+
+  def test_find_blocks
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      bw = world.load_block_world(0, 0, 47, 31)
+      bw.set_block(5, 70, 6, 48)
+      bw.set_block(40, 10, 20, 97)
+      assert_equal([[5, 70, 6], [40, 10, 20]], bw.find_blocks([48, 97]).unpack("l*").each_slice(3).sort)
+      assert_equal([[40, 10, 20]], bw.find_blocks(97, box: [32, 0, 16, 47, 127, 31]).unpack("l*").each_slice(3).to_a)
+      world.write_block_world(bw)
+
+      world = MC_World.new(world_dir: dir)
+      found = world.find_blocks([48, 97], with_types: true).unpack("l*").each_slice(4).sort
+      assert_equal([[5, 70, 6, 48], [40, 10, 20, 97]], found)
+    }
+  end
+
+  def test_compact_storage
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      bw = world.load_block_world(0, 0, 47, 31)
+      full = bw.read_box(0, 0, 0, 47, 127, 31, planes: [:type, :data, :skylight])
+      full_bytes = bw.storage_bytes
+
+      bw = world.load_block_world(0, 0, 47, 31, compact: true)
+      assert(bw.compact_storage?)
+      assert_operator(bw.storage_bytes, :<, full_bytes/10)
+      assert_equal(full, bw.read_box(0, 0, 0, 47, 127, 31, planes: [:type, :data, :skylight]))
+
+      # Edits expand chunks until compacted again
+      bw.fill(0, 70, 0, 3, 70, 3, 4)
+      compact_bytes = bw.storage_bytes
+      bw.compact_chunks
+      assert_operator(bw.storage_bytes, :<, compact_bytes)
+      assert_equal([4, 0], bw.get_block(3, 70, 3))
+      assert_equal(1, world.write_block_world(bw))
+      assert_equal(4, MC_World.new(world_dir: dir).get_block2(3, 70, 3)[0])
+
+      # Selected for the whole world
+      world = MC_World.new(world_dir: dir, compact_storage: true)
+      assert(world.compact_storage)
+      bw = world.load_block_world(0, 0, 47, 31)
+      assert(bw.compact_storage?)
+      assert_equal(false, world.load_block_world(0, 0, 47, 31, compact: false).compact_storage?)
+      world.compact_storage = false
+      assert_equal(false, world.load_block_world(0, 0, 47, 31).compact_storage?)
+    }
+  end
+
+  def test_copy_paste_merge
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      bw = world.load_block_world(0, 0, 47, 31)
+      bw.set_block(3, 62, 4, 54)
+      bw.set_block(5, 63, 6, 20)
+      buffer = bw.copy(MCBlockBuffer.new(8, 4, 8), 0, 60, 0)
+      assert_equal([8, 4, 8], buffer.size)
+      assert_equal([54, 0], buffer.get_block(3, 2, 4))
+      assert_equal([2, 0], buffer.get_block(0, 1, 0))
+      tiles = buffer.entities_nbt[:TileEntities].value
+      assert_equal(1, tiles.size)
+      assert_equal([3, 2, 4], [:x, :y, :z].map {|k| tiles[0][k].value})
+
+      # Across the corner of four chunks, replacing the chest of chunk 1, 1
+      bw.set_block(19, 62, 20, 54)
+      bw.paste(buffer, 12, 60, 14)
+      types, = bw.read_box(12, 60, 14, 19, 63, 21)
+      assert_equal(bw.read_box(0, 60, 0, 7, 63, 7), [types])
+      assert_equal([0, 0], bw.get_block(19, 62, 20))
+      world.write_block_world(bw)
+      world = MC_World.new(world_dir: dir)
+      chests = []
+      world.each_tile_entity_nbt {|te| chests << [:x, :y, :z].map {|k| te[k].value}}
+      assert(chests.include?([15, 62, 18]))
+      assert(!chests.include?([19, 62, 20]))
+
+      # Air in the buffer leaves blocks alone
+      bw = world.load_block_world(0, 0, 47, 31)
+      glass = MCBlockBuffer.new(2, 2, 2)
+      glass.set_block(1, 1, 1, 20, 3)
+      bw.merge(glass, 30, 61, 5)
+      assert_equal([20, 3], bw.get_block(31, 62, 6))
+      assert_equal([2, 0], bw.get_block(30, 61, 5))
+      assert_equal([0, 0], bw.get_block(30, 62, 5))
+    }
+  end
+end
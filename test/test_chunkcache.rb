@@ -0,0 +1,66 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestChunkCache < Test::Unit::TestCase
+  # A fixture chunk is counted as about 87 KB, so this holds two
+  BUDGET = 200_000
+
+  def edit(world, x, z, byte)
+    chunk = world.get_chunk(x, z)
+    chunk[:blocks].setbyte(5, byte)
+    chunk[:dirty] = true
+  end
+
+  def test_evict_and_write_back
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir, chunk_cache_bytes: BUDGET)
+      world.get_chunk(0, 0)
+      world.get_chunk(16, 0)
+      world.get_chunk(0, 0)
+      # Chunk 1, 0 is least recently used, and dropped without writing
+      world.get_chunk(32, 16)
+      stats = world.cache_stats
+      assert_equal([1, 3, 1, 0, 2], stats.values_at(:hits, :misses, :evictions, :writebacks, :chunks))
+      assert_operator(stats[:bytes], :<=, BUDGET)
+      assert_equal(BUDGET, stats[:budget])
+
+      # Only dirty chunks to drop: both of region 0, 0 are written back together, and
+      # the oldest then dropped
+      edit(world, 0, 0, 7)
+      edit(world, 32, 16, 8)
+      world.get_chunk(-512, 0)
+      stats = world.cache_stats
+      assert_equal([2, 2, 2], stats.values_at(:evictions, :writebacks, :chunks))
+      assert_equal(false, world.get_chunk(32, 16)[:dirty])
+
+      # The most recently used chunk is kept whatever the budget, until flushed
+      edit(world, -512, 16, 9)
+      world.chunk_cache_budget = 0
+      assert_equal([1, 2], world.cache_stats.values_at(:chunks, :writebacks))
+      assert_equal(1, world.write_chunks)
+
+      world = MC_World.new(world_dir: dir)
+      assert_equal([7, 8, 9], [[0, 0], [32, 16], [-512, 16]].map {|x, z| world.get_chunk(x, z)[:blocks].getbyte(5)})
+      assert_equal(1, world.get_chunk(16, 0)[:blocks].getbyte(5))
+    }
+  end
+
+  def test_flush
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      edit(world, 0, 0, 7)
+      edit(world, -512, 0, 8)
+      world.get_chunk(16, 0)
+      assert_equal(2, world.write_chunks)
+      assert_equal(0, world.write_chunks)
+      assert_equal(2, world.cache_stats[:writebacks])
+      assert_equal(3, world.cache_stats[:chunks])
+
+      world = MC_World.new(world_dir: dir)
+      assert_equal([7, 8], [[0, 0], [-512, 0]].map {|x, z| world.get_chunk(x, z)[:blocks].getbyte(5)})
+    }
+  end
+end
@@ -0,0 +1,65 @@
+require "test/unit"
+require "stringio"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestChunkResults < Test::Unit::TestCase
+  def count_stone(chunk)
+    chunk[:blocks].count("\x01")
+  end
+
+  def test_recompute_changed_chunks_only
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      results = MC_ChunkResults.new("#{dir}/results.cache")
+      assert_equal(12, world.each_changed_chunk(results) {|chunk| count_stone(chunk)})
+      results.save
+
+      results = MC_ChunkResults.new("#{dir}/results.cache")
+      assert_equal(12, results.size)
+      assert_equal(16*16*61, results[[0, 0]])
+      assert_equal(0, world.each_changed_chunk(results) {|chunk| flunk("chunk not changed")})
+
+      world.set_block2(5, 70, 5, 1, 0)
+      world.write_chunks
+      recomputed = []
+      world.each_changed_chunk(results) {|chunk| recomputed << chunk[:coords]; count_stone(chunk)}
+      assert_equal([[0, 0]], recomputed)
+      assert_equal(16*16*61 + 1, results[[0, 0]])
+    }
+  end
+
+  def test_rewrite_within_same_second
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      results = MC_ChunkResults.new
+      world.set_block2(5, 70, 5, 1, 0)
+      world.write_chunks
+      world.each_changed_chunk(results) {|chunk| count_stone(chunk)}
+      assert_equal(16*16*61 + 1, results[[0, 0]])
+
+      # Most likely written again within the second the timestamps were read: the
+      # timestamp doesn't change, but the result must not be taken as fresh
+      world.set_block2(6, 70, 5, 1, 0)
+      world.write_chunks
+      world.each_changed_chunk(results) {|chunk| count_stone(chunk)}
+      assert_equal(16*16*61 + 2, results[[0, 0]])
+    }
+  end
+
+  def test_unreadable_cache
+    Dir.mktmpdir("magellan") {|dir|
+      File.binwrite("#{dir}/results.cache", "garbage")
+      stderr, $stderr = $stderr, StringIO.new
+      begin
+        results = MC_ChunkResults.new("#{dir}/results.cache")
+        assert_equal(0, results.size)
+        assert_match(/Discarding/, $stderr.string)
+      ensure
+        $stderr = stderr
+      end
+    }
+  end
+end
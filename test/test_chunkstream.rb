@@ -0,0 +1,32 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestChunkStream < Test::Unit::TestCase
+  def test_each_chunk
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      coords = []
+      world.each_chunk(depth: 2, num_threads: 2) {|chunk| coords << chunk[:coords]}
+      assert_equal(WorldFixture::REGIONS.product(WorldFixture::CHUNKS).map {|(rx, rz), (x, z)|
+        [rx*32 + x, rz*32 + z]
+      }.sort, coords.sort)
+    }
+  end
+
+  # Leaving the block early stops the stream, and the world can be streamed again
+  def test_break_and_raise
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir, chunk_cache_bytes: 0)
+      n = 0
+      world.each_chunk(depth: 1) {|chunk| n += 1; break}
+      assert_equal(1, n)
+      assert_raise(RuntimeError) { world.each_chunk {|chunk| raise "stop"} }
+      n = 0
+      world.each_chunk {|chunk| n += 1}
+      assert_equal(12, n)
+    }
+  end
+end
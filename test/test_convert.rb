@@ -0,0 +1,66 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestConvertAlphaWorld < Test::Unit::TestCase
+  # Write the chunks of world_dir in Alpha format under alpha_dir, returns count
+  def write_alpha_chunks(world_dir, alpha_dir)
+    world = MC_World.new(world_dir: world_dir)
+    count = 0
+    world.all_regions.each {|(rx, rz), region|
+      CHUNK_COORDS.each {|cx, cz|
+        next unless region.chunk_exists(cx, cz)
+        x = rx*32 + cx
+        z = rz*32 + cz
+        write_alpha_chunk(alpha_dir, x, z, region.read_chunk_nbt(cx, cz))
+        count += 1
+      }
+    }
+    count
+  end
+
+  def write_alpha_chunk(alpha_dir, x, z, nbt)
+    dir = "#{alpha_dir}/#{CHUNK_DIRS[x % 64]}/#{CHUNK_DIRS[z % 64]}"
+    FileUtils.mkdir_p(dir)
+    nbt.write("#{dir}/c.#{x.to_s(36)}.#{z.to_s(36)}.dat")
+  end
+
+  def test_convert
+    WorldFixture.with_world {|world_dir|
+      Dir.mktmpdir("magellan") {|alpha_dir|
+        count = write_alpha_chunks(world_dir, alpha_dir)
+        converted = Magellan.convert_alpha_world(alpha_dir, 4)
+        assert_equal(count, converted)
+        region = MCRegion.new
+        assert_equal(0, region.open("#{alpha_dir}/region/r.-1.0.mcr"))
+        assert_equal(-30, region.read_chunk_nbt(2, 1)[:Level][:xPos].value)
+        region.close
+
+        # Existing region files are only replaced when asked to
+        assert_raise(IOError) { Magellan.convert_alpha_world(alpha_dir, 4) }
+        assert_equal(count, Magellan.convert_alpha_world(alpha_dir, 4, true))
+      }
+    }
+  end
+
+  def test_skip_oversized_chunk
+    WorldFixture.with_world {|world_dir|
+      Dir.mktmpdir("magellan") {|alpha_dir|
+        count = write_alpha_chunks(world_dir, alpha_dir)
+        # Doesn't compress to 255 sectors
+        nbt = WorldFixture.chunk_nbt(5, 0)
+        nbt[:Level].insert(NBT.new_byte_array("Noise", Random.new(1).bytes(1100*1024)))
+        write_alpha_chunk(alpha_dir, 5, 0, nbt)
+
+        assert_equal(count, Magellan.convert_alpha_world(alpha_dir, 2))
+        region = MCRegion.new
+        assert_equal(0, region.open("#{alpha_dir}/region/r.0.0.mcr"))
+        assert(region.chunk_exists(2, 1))
+        assert(!region.chunk_exists(5, 0))
+        region.close
+      }
+    }
+  end
+end
@@ -0,0 +1,26 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestEntityIndex < Test::Unit::TestCase
+  def test_rewrite_within_same_second
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      index = MCEntityIndex.new
+      assert_equal(12, world.update_entity_index(index))
+      assert_equal(12, index.with_id("Chest").size)
+
+      # Most likely written again within the second the timestamps were read: the
+      # timestamp doesn't change, but the chunk must be indexed again
+      chunk = world.get_chunk(0, 0)
+      chunk[:nbt][:Level][:TileEntities].value = []
+      chunk[:dirty] = true
+      world.write_chunks
+      world.update_entity_index(index)
+      assert_equal(11, index.with_id("Chest").size)
+      assert_equal([], index.within(3, 62, 4, 1, "Chest"))
+    }
+  end
+end
@@ -0,0 +1,176 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestLighting < Test::Unit::TestCase
+  # Skylight and block light arrays of chunk cx, cz as stored on disk
+  def stored_light(dir, cx, cz)
+    level = MC_World.new(world_dir: dir).read_chunk(cx, cz)[:nbt][:Level]
+    [level[:SkyLight].value, level[:BlockLight].value]
+  end
+
+  # A torch in a hollow at the corner of chunk 0, 0, lighting across into the next chunks
+  def dig(world)
+    (14..17).each {|x| (14..17).each {|z| (40..42).each {|y| world.set_block2(x, y, z, 0, 0)}}}
+    world.set_block2(15, 40, 15, 50, 0)
+  end
+
+  # Light every chunk of the world in dir from scratch
+  def light_all(dir)
+    world = MC_World.new(world_dir: dir)
+    [0, 1, 2].product([0, 1]).each {|cx, cz| world.get_chunk(cx*16, cz*16)[:dirty] = true}
+    world.compute_lights
+    world.write_chunks
+  end
+
+  def test_update_lights_world
+    WorldFixture.with_world {|dir_a|
+      WorldFixture.with_world {|dir_b|
+        light_all(dir_a)
+        light_all(dir_b)
+        # A shaft to the sky into the hollow, and a roof shadowing the grass
+        shaft = [20, 43, 20, 21, 61, 21]
+        roof = [26, 70, 2, 36, 70, 12]
+        air = ["\0"*(2*19*2)]
+        stone = ["\1"*(11*11)]
+
+        world = MC_World.new(world_dir: dir_a)
+        world.light_tracking = true
+        dig(world)
+        world.write_box(*shaft, air)
+        world.write_box(*roof, stone)
+        assert_operator(world.update_lights, :>, 0)
+        assert_equal(0, world.update_lights)
+        world.write_chunks
+
+        world = MC_World.new(world_dir: dir_b)
+        dig(world)
+        world.write_box(*shaft, air)
+        world.write_box(*roof, stone)
+        world.compute_lights
+        world.write_chunks
+
+        [0, 1, 2].product([0, 1]).each {|cx, cz|
+          assert_equal(stored_light(dir_b, cx, cz), stored_light(dir_a, cx, cz), "chunk #{cx}, #{cz}")
+        }
+      }
+    }
+  end
+
+  def test_update_lights_block_world
+    WorldFixture.with_world {|dir|
+      light_all(dir)
+      world = MC_World.new(world_dir: dir)
+      edit = lambda {|bw|
+        bw.fill(14, 40, 14, 17, 42, 17, 0)
+        bw.set_block(15, 40, 15, 50)
+        bw.fill(20, 43, 20, 21, 61, 21, 0)
+        bw.fill(26, 70, 2, 36, 70, 12, 1)
+        bw.replace(2, 40, 61, 20, 44, 61, 24, 20)
+      }
+      incremental = world.load_block_world(0, 0, 47, 31)
+      incremental.light_tracking = true
+      edit[incremental]
+      assert_operator(incremental.update_lights, :>, 0)
+      full = world.load_block_world(0, 0, 47, 31)
+      edit[full]
+      full.compute_lights
+      planes = {planes: [:skylight, :blocklight]}
+      assert_equal(full.read_box(0, 0, 0, 47, 127, 31, planes), incremental.read_box(0, 0, 0, 47, 127, 31, planes))
+    }
+  end
+
+  # As above at negative coordinates, with light spreading across chunk edges toward
+  # -x and -z, and a roof running off the chunks held
+  def test_update_lights_negative
+    WorldFixture.with_world([[-1, -1]]) {|dir|
+      world = MC_World.new(world_dir: dir)
+      WorldFixture::CHUNKS.each {|x, z| world.get_chunk(-512 + x*16, -512 + z*16)[:dirty] = true}
+      world.compute_lights
+      world.write_chunks
+      world = MC_World.new(world_dir: dir)
+      edit = lambda {|bw|
+        bw.fill(-499, 40, -499, -493, 42, -493, 0)
+        bw.set_block(-496, 40, -496, 50)
+        bw.fill(-482, 43, -485, -481, 61, -484, 0)
+        bw.fill(-470, 70, -500, -460, 70, -490, 1)
+      }
+      incremental = world.load_block_world(-512, -512, -465, -481)
+      incremental.light_tracking = true
+      edit[incremental]
+      assert_operator(incremental.update_lights, :>, 0)
+      full = world.load_block_world(-512, -512, -465, -481)
+      edit[full]
+      full.compute_lights
+      box = [-512, 0, -512, -465, 127, -481]
+      planes = {planes: [:skylight, :blocklight]}
+      lights = incremental.read_box(*box, planes)
+      assert_equal(full.read_box(*box, planes), lights)
+      # Torchlight reaches the chunks at lower x and z
+      assert_operator(incremental.read_box(-499, 40, -499, -497, 40, -497, planes)[1].bytes.min, :>, 0)
+    }
+  end
+
+  # Light doesn't leave a MCChunk, so the edit is enclosed within it
+  def test_update_lights_chunk
+    WorldFixture.with_world {|dir_a|
+      WorldFixture.with_world {|dir_b|
+        light_all(dir_a)
+        light_all(dir_b)
+        world = MC_World.new(world_dir: dir_a)
+        chunk = world.load_mc_chunk(16, 0)
+        chunk.light_tracking = true
+        chunk.fill(20, 30, 4, 26, 33, 9, 0)
+        chunk.set_block(22, 30, 6, 50)
+        chunk.set_block(22, 31, 6, 0)
+        assert_operator(chunk.update_lights, :>, 0)
+        world.write_mc_chunk(chunk)
+
+        world = MC_World.new(world_dir: dir_b)
+        (20..26).each {|x| (4..9).each {|z| (30..33).each {|y| world.set_block2(x, y, z, 0, 0)}}}
+        world.set_block2(22, 30, 6, 50, 0)
+        world.compute_lights
+        world.write_chunks
+
+        assert_equal(stored_light(dir_b, 1, 0), stored_light(dir_a, 1, 0))
+        assert(stored_light(dir_a, 1, 0)[1].bytes.any? {|b| b != 0})
+      }
+    }
+  end
+
+  def test_unloaded_neighbors
+    WorldFixture.with_world {|dir_a|
+      WorldFixture.with_world {|dir_b|
+        # Only the edited chunks loaded
+        world = MC_World.new(world_dir: dir_a)
+        dig(world)
+        world.write_chunks
+        world = MC_World.new(world_dir: dir_a)
+        world.get_chunk(0, 0)[:dirty] = true
+        # Chunk 0, 0 and the three beside it that exist
+        assert_equal(4, world.compute_lights)
+        world.write_chunks
+
+        # Every chunk loaded
+        world = MC_World.new(world_dir: dir_b)
+        dig(world)
+        [0, 1, 2].product([0, 1]).each {|cx, cz| world.get_chunk(cx*16, cz*16)}
+        world.get_chunk(16, 0)[:dirty] = false
+        world.get_chunk(0, 16)[:dirty] = false
+        world.get_chunk(16, 16)[:dirty] = false
+        assert_equal(4, world.compute_lights)
+        world.write_chunks
+
+        [0, 1].product([0, 1]).each {|cx, cz|
+          sky, block = stored_light(dir_a, cx, cz)
+          assert_equal(stored_light(dir_b, cx, cz), [sky, block], "chunk #{cx}, #{cz}")
+          assert(sky.bytes.any? {|b| b != 0})
+        }
+        # Torchlight reaches chunk 1, 1
+        assert(stored_light(dir_a, 1, 1)[1].bytes.any? {|b| b != 0})
+      }
+    }
+  end
+end
@@ -0,0 +1,132 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestMCChunk < Test::Unit::TestCase
+  def test_get_and_set_block
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      chunk = world.load_mc_chunk(16, 0)
+      assert_equal([1, 0], chunk.coords)
+      assert_equal([1, 0], chunk.region_coords)
+      assert_same(world.all_regions[[0, 0]], chunk.region)
+      # World or chunk-relative x, z
+      assert_equal([1, 0], chunk.get_block(21, 60, 3))
+      assert_equal([1, 0], chunk.get_block(5, 60, 3))
+      assert_equal([2, 0], chunk.get_block(5, 61, 3))
+      assert_equal([0, 0], chunk.get_block(5, 62, 3))
+      assert_raise(IndexError) { chunk.get_block(5, 128, 3) }
+      assert_raise(IndexError) { chunk.set_block(5, -1, 3, 1) }
+
+      assert_equal(false, chunk.dirty?)
+      assert_same(chunk, chunk.set_block(21, 70, 3, 20, 5))
+      assert_equal(true, chunk.dirty?)
+      assert_equal([20, 5], chunk.get_block(5, 70, 3))
+      chunk.set_block(6, 70, 3, 35)
+      assert_equal([35, 0], chunk.get_block(6, 70, 3))
+      chunk.dirty = false
+      assert_equal(false, chunk.dirty?)
+    }
+  end
+
+  def test_fill_and_replace
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      chunk = world.load_mc_chunk(16, 0)
+      # Clipped to the chunk, corners in any order
+      assert_equal(16*2*2, chunk.fill(40, 71, 1, 0, 70, 0, 4))
+      assert_equal([4, 0], chunk.get_block(31, 71, 1))
+      assert_equal([0, 0], chunk.get_block(31, 71, 2))
+      assert_equal(16*1*2, chunk.replace(4, 0, 70, 0, 100, 70, 100, 5, 2))
+      assert_equal([5, 2], chunk.get_block(16, 70, 0))
+      assert_equal([4, 0], chunk.get_block(16, 71, 0))
+      assert_equal(0, chunk.replace(4, 0, 0, 32, 100, 127, 100, 5))
+    }
+  end
+
+  def test_columns
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      chunk = world.load_mc_chunk(16, 16)
+      chunk.set_block(19, 100, 20, 20)
+      column = chunk.column(3, 4)
+      assert_equal(128, column.bytesize)
+      assert_equal(["\x01"*61, "\x02", "\0"*38, "\x14", "\0"*27].join.b, column)
+      assert_equal(column, chunk.column(19, 20))
+
+      columns = []
+      chunk.each_column {|x, z, types| columns << [x, z, types]}
+      assert_equal((16..31).to_a.product((16..31).to_a), columns.map {|x, z, | [x, z]})
+      columns.each {|x, z, types| assert_equal(chunk.column(x, z), types)}
+      assert_equal([[19, 20]], columns.select {|x, z, types| types.getbyte(100) == 20}.map {|x, z, | [x, z]})
+      assert_kind_of(Enumerator, chunk.each_column)
+    }
+  end
+
+  # nbt() and dup are copies, changes to them don't reach the chunk
+  def test_nbt_and_copy
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      chunk = world.load_mc_chunk(0, 0)
+      chunk.set_block(5, 70, 6, 48)
+      nbt = chunk.nbt
+      assert_equal(0, nbt[:Level][:xPos].value)
+      blocks = nbt[:Level][:Blocks].value
+      assert_equal(48, blocks.getbyte((5*16 + 6)*128 + 70))
+      blocks.setbyte((5*16 + 6)*128 + 70, 1)
+      assert_equal([48, 0], chunk.get_block(5, 70, 6))
+      assert_equal(48, chunk.nbt[:Level][:Blocks].value.getbyte((5*16 + 6)*128 + 70))
+
+      copy = chunk.dup
+      assert_equal(true, copy.dirty?)
+      assert_equal(chunk.coords, copy.coords)
+      assert_same(chunk.region, copy.region)
+      copy.set_block(5, 70, 6, 49)
+      assert_equal([49, 0], copy.get_block(5, 70, 6))
+      assert_equal([48, 0], chunk.get_block(5, 70, 6))
+      chunk.dirty = false
+      assert_equal(false, chunk.dup.dirty?)
+
+      # A chunk built from NBT, to be written over another
+      rebuilt = MCChunk.new(nbt, world.all_regions[[0, 0]], 0, 0)
+      assert_equal([1, 0], rebuilt.get_block(5, 70, 6))
+      assert_equal([0, 0], rebuilt.region_coords)
+    }
+  end
+
+  # Edits made through a MCChunk, written and read back through chunk hashes
+  def test_write
+    WorldFixture.with_world {|dir|
+      world = MC_World.new(world_dir: dir)
+      chunk = world.load_mc_chunk(16, 16)
+      chunk.set_block(20, 70, 21, 20, 3)
+      chunk.fill(16, 80, 16, 31, 80, 31, 5, 1)
+      chunk.replace(2, 16, 61, 16, 17, 61, 17, 3)
+      world.write_mc_chunk(chunk)
+      assert_equal(false, chunk.dirty?)
+
+      # At negative x, in region -1, 0
+      chunk = world.load_mc_chunk(-500, 20)
+      assert_equal([-32, 1], chunk.coords)
+      assert_equal([0, 1], chunk.region_coords)
+      chunk.set_block(-500, 70, 20, 35, 14)
+      world.write_mc_chunk(chunk)
+
+      world = MC_World.new(world_dir: dir)
+      assert_equal([20, 3], world.get_block2(20, 70, 21))
+      assert_equal([5, 1], world.get_block2(31, 80, 16))
+      assert_equal([3, 0], world.get_block2(17, 61, 17))
+      assert_equal([2, 0], world.get_block2(18, 61, 17))
+      assert_equal([35, 14], world.get_block2(-500, 70, 20))
+      assert_equal([1, 0], world.get_block2(-500, 60, 20))
+      # Untouched chunks keep their blocks
+      assert_equal([0, 0], world.get_block2(0, 80, 0))
+
+      chunk = MCChunk.new(world.get_chunk(0, 0)[:nbt])
+      assert_nil(chunk.region)
+      assert_raise(RuntimeError) { chunk.write }
+    }
+  end
+end
@@ -0,0 +1,65 @@
+require "test/unit"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestMCRegion < Test::Unit::TestCase
+  def setup
+    @max_open_files = MCRegion.max_open_files
+  end
+
+  def teardown
+    MCRegion.max_open_files = @max_open_files
+  end
+
+  def test_open_file_limit
+    WorldFixture.with_world {|dir|
+      MCRegion.max_open_files = 1
+      world = MC_World.new(world_dir: dir)
+      assert_equal(1, MCRegion.open_files)
+      a = world.all_regions[[0, 0]].read_chunk_nbt(1, 1)
+      b = world.all_regions[[-1, 0]].read_chunk_nbt(1, 1)
+      assert_equal(1, a[:Level][:xPos].value)
+      assert_equal(-31, b[:Level][:xPos].value)
+      assert_equal(1, MCRegion.open_files)
+      assert(!world.all_regions[[0, 0]].file_open?)
+      assert(world.all_regions[[-1, 0]].file_open?)
+
+      # Reopened to write
+      world.set_block2(5, 70, 5, 1, 0)
+      world.write_chunks
+      assert_equal(1, MCRegion.open_files)
+      assert_equal([1, 0], world.get_block2(5, 70, 5))
+      world.all_regions.each_value {|region| region.close}
+      assert_equal(0, MCRegion.open_files)
+    }
+  end
+
+  def test_write_bad_chunk
+    WorldFixture.with_world {|dir|
+      region = MC_World.new(world_dir: dir).all_regions[[0, 0]]
+      nbt = region.read_chunk_nbt(1, 1)
+      nbt[:Level][:xPos].value = "one"
+      assert_raise(TypeError) { region.write_chunk_nbt(1, 1, nbt) }
+      assert_equal(1, region.read_chunk_nbt(1, 1)[:Level][:xPos].value)
+    }
+  end
+
+  # TOC reads wait for the region's mutex without blocking threads reading chunks
+  def test_concurrent_access
+    WorldFixture.with_world {|dir|
+      region = MC_World.new(world_dir: dir).all_regions[[0, 0]]
+      readers = (0...4).map {|t|
+        Thread.new {
+          50.times.map {|j|
+            t.even? ? region.read_chunk_nbt(j % 3, 1)[:Level][:xPos].value : region.chunk_timestamps.compact.size
+          }
+        }
+      }
+      readers.each_with_index {|thread, t|
+        assert_equal(t.even? ? (0...50).map {|j| j % 3} : [6]*50, thread.value)
+      }
+    }
+  end
+end
@@ -1,6 +1,8 @@
 require "test/unit"
 require "magellan"
 require 'magellan/mcdefs'
+require "tmpdir"
+require "zlib"
 
 include Magellan
 
@@ -10,6 +12,57 @@ class TestMagellan < Test::Unit::TestCase
     win = true
     win
   end
+
+  # Bad files raise rather than exiting
+  def test_load_bad_data
+    Dir.mktmpdir {|dir|
+      path = File.join(dir, "bad.dat")
+      # Root tag not a compound, then an unknown tag type inside the root
+      ["\x01\x00\x01a\x05", "\x0A\x00\x00\x63\x00\x01a"].each {|bytes|
+        Zlib::GzipWriter.open(path) {|gz| gz.write(bytes)}
+        assert_raise(ArgumentError) { NBT.load(path) }
+      }
+    }
+  end
+
+  # Strings derived from byte arrays, which may share their buffers, must stay valid
+  # once the NBT and the tree it was loaded into are dropped.
+  def test_byte_array_outlives_nbt
+    Dir.mktmpdir {|dir|
+      path = File.join(dir, "blocks.dat")
+      root = NBT.new_compound("")
+      root.insert(NBT.new_byte_array("Blocks", "\x07"*32768))
+      root.write(path)
+
+      derived = [
+        lambda {|blocks| blocks.b},
+        lambda {|blocks| blocks.dup},
+        lambda {|blocks| blocks[100, 30000]},
+        lambda {|blocks| blocks[100, 30000].b},
+        lambda {|blocks| -blocks},
+      ]
+      strings = derived.map {|derive| derive[NBT.load(path).value[:Blocks].value]}
+      GC.start
+      garbage = (0...64).map {|j| ([j].pack("C")*32768).b}
+      strings.each_with_index {|str, j| assert_equal([7], str.bytes.uniq, "string #{j}")}
+      assert_equal([32768, 32768, 30000, 30000, 32768], strings.map(&:bytesize))
+      garbage.clear
+    }
+  end
+
+  # A tree that can't be serialized leaves the file alone
+  def test_write_bad_tree
+    Dir.mktmpdir {|dir|
+      path = File.join(dir, "out.dat")
+      good = NBT.new_compound("")
+      good.insert(NBT.new_int("a", 1))
+      good.write(path)
+      bad = NBT.new_compound("")
+      bad.insert(NBT.new_int("a", "one"))
+      assert_raise(TypeError) { bad.write(path) }
+      assert_equal(1, NBT.load(path)[:a].value)
+    }
+  end
 end
 
 # str = NBT.load("./test/testfiles/level.dat").to_s
@@ -0,0 +1,58 @@
+require "test/unit"
+require "magellan"
+
+# The SSE2 and AVX2 nibble kernels against the scalar ones and a plain Ruby version,
+# at lengths around their vector widths so the scalar tails are exercised too.
+class TestNibbles < Test::Unit::TestCase
+  LENGTHS = [0, 1, 2, 15, 16, 17, 31, 32, 33, 63, 64, 65, 66, 127, 129, 1000, 16384, 32767]
+
+  def setup
+    @rng = Random.new(12345)
+    @impls = Magellan.nibbles_impls
+  end
+
+  def test_impls
+    assert(@impls.include?(:scalar))
+    assert_raise(ArgumentError) { Magellan.unpack_nibbles("\0", 2, :altivec) }
+  end
+
+  def test_unpack
+    LENGTHS.each {|n|
+      packed = @rng.bytes((n + 1)/2)
+      expect = (0...n).map {|j| (packed.getbyte(j/2) >> (4*(j & 1))) & 0x0F}.pack("C*")
+      assert_equal(expect, Magellan.unpack_nibbles(packed, n), "n = #{n}")
+      @impls.each {|impl|
+        assert_equal(expect, Magellan.unpack_nibbles(packed, n, impl), "#{impl}, n = #{n}")
+      }
+    }
+  end
+
+  def test_pack
+    LENGTHS.select {|n| n.even?}.each {|n|
+      # High bits of the source bytes must be ignored
+      bytes = @rng.bytes(n)
+      expect = (0...n/2).map {|j|
+        (bytes.getbyte(2*j) & 0x0F) | ((bytes.getbyte(2*j + 1) & 0x0F) << 4)
+      }.pack("C*")
+      assert_equal(expect, Magellan.pack_nibbles(bytes), "n = #{n}")
+      @impls.each {|impl|
+        assert_equal(expect, Magellan.pack_nibbles(bytes, impl), "#{impl}, n = #{n}")
+      }
+    }
+    assert_raise(ArgumentError) { Magellan.pack_nibbles("\0"*3) }
+  end
+
+  def test_copy_where_nonzero
+    LENGTHS.each {|n|
+      dst = @rng.bytes(n)
+      src = @rng.bytes(n)
+      # Mostly zero keys, with some high-bit keys to catch signed compares
+      key = (0...n).map { r = @rng.rand(4); r == 0 ? 0x80 + @rng.rand(128) : (r == 1 ? 1 : 0) }.pack("C*")
+      expect = (0...n).map {|j| key.getbyte(j) != 0 ? src.getbyte(j) : dst.getbyte(j)}.pack("C*")
+      assert_equal(expect, Magellan.copy_where_nonzero(dst, src, key), "n = #{n}")
+      @impls.each {|impl|
+        assert_equal(expect, Magellan.copy_where_nonzero(dst, src, key, impl), "#{impl}, n = #{n}")
+      }
+    }
+  end
+end
@@ -0,0 +1,89 @@
+require "test/unit"
+require "tmpdir"
+require "magellan"
+require_relative "world_fixture"
+
+include Magellan
+
+class TestRender < Test::Unit::TestCase
+  def setup
+    @out = Dir.mktmpdir("magellan")
+    WorldFixture.write_terrain("#{@out}/terrain.png")
+    Magellan.load_textures("#{@out}/terrain.png")
+  end
+
+  def teardown
+    FileUtils.rm_rf(@out)
+  end
+
+  # The fixture world's chunks 0..2 x 0..1, with blocks of varied type and height
+  # scattered over the grass for textures to overhang
+  def block_world(dir)
+    bw = MC_World.new(world_dir: dir).load_block_world(0, 0, 47, 31)
+    rng = Random.new(7)
+    300.times { bw.set_block(rng.rand(48), 61 + rng.rand(4), rng.rand(32), [4, 12, 18, 20, 45].sample(random: rng)) }
+    bw
+  end
+
+  # What the block writes to the stdout file descriptor, where the renderer reports
+  def native_output
+    File.open("#{@out}/stdout.txt", "w+") {|file|
+      saved = STDOUT.dup
+      STDOUT.flush
+      STDOUT.reopen(file)
+      begin
+        yield
+      ensure
+        STDOUT.flush
+        STDOUT.reopen(saved)
+        saved.close
+      end
+      file.rewind
+      file.read
+    }
+  end
+
+  # Textures are larger than the blocks at scales 3, 5 and 9..15, and overhang across
+  # tile edges
+  def test_tiles_match_serial
+    WorldFixture.with_world {|dir|
+      bw = block_world(dir)
+      [2, 3, 5, 9].each {|scale|
+        bw.render_map("#{@out}/serial.png", scale: scale, band_rows: 0, tile_chunks: 3, num_threads: 1)
+        bw.render_map("#{@out}/tiled.png", scale: scale, band_rows: 0, tile_chunks: 1, num_threads: 4)
+        assert_equal(File.binread("#{@out}/serial.png"), File.binread("#{@out}/tiled.png"), "scale #{scale}")
+      }
+    }
+  end
+
+  # Bands of one and two chunk rows, the last of two short, against the whole map at
+  # once. Both report the blocks drawn once, for the whole map.
+  def test_bands_match_whole_map
+    WorldFixture.with_world {|dir|
+      bw = block_world(dir)
+      [2, 3, 5].each {|scale|
+        done = native_output { bw.render_map("#{@out}/whole.png", scale: scale, band_rows: 0) }.scan(/^Done.*$/)
+        assert_equal(1, done.size)
+        assert_match(/^Done\. Blocks drawn: [1-9]\d*$/, done[0])
+        whole = WorldFixture.read_png("#{@out}/whole.png")
+        assert_equal([32*scale, 48*scale], whole[0, 2])
+        [1, 2].each {|rows|
+          output = native_output { bw.render_map("#{@out}/bands.png", scale: scale, band_rows: rows) }
+          assert_equal(done, output.scan(/^Done.*$/), "scale #{scale}, #{rows} rows")
+          assert_equal(whole, WorldFixture.read_png("#{@out}/bands.png"), "scale #{scale}, #{rows} rows")
+        }
+      }
+    }
+  end
+
+  def test_bad_options
+    WorldFixture.with_world {|dir|
+      bw = block_world(dir)
+      assert_raise(ArgumentError) { bw.render_map("#{@out}/map.png", scale: 17) }
+      assert_raise(ArgumentError) { bw.render_map("#{@out}/map.png", tile_chunks: 0) }
+      assert_raise(ArgumentError) { bw.render_map("#{@out}/map.png", lighting: :dusk) }
+      assert_raise(IOError) { bw.render_map("#{@out}/none/map.png") }
+    }
+    assert_raise(IOError) { Magellan.load_textures("#{@out}/none.png") }
+  end
+end
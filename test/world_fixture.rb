@@ -0,0 +1,124 @@
+require "fileutils"
+require "tmpdir"
+require "zlib"
+require "magellan"
+
+# Small worlds for tests, built in temporary directories: regions r.0.0 and r.-1.0, or
+# those given, each hold chunks 0..2 x 0..1, stone up to y 60 under a layer of grass, with a chest
+# tile entity per chunk. Lighting and heightmaps are left zeroed.
+module WorldFixture
+  include Magellan
+
+  TESTFILES = File.join(File.dirname(__FILE__), "testfiles")
+  REGIONS = [[0, 0], [-1, 0]]
+  CHUNKS = [0, 1, 2].product([0, 1])
+
+  def self.chunk_nbt(cx, cz)
+    blocks = "\0"*32768
+    (0...256).each {|col|
+      blocks[col*128, 61] = "\x01"*61
+      blocks.setbyte(col*128 + 61, 2)
+    }
+    chest = NBT.new_compound("")
+    chest.insert(NBT.new_string("id", "Chest"))
+    chest.insert(NBT.new_int("x", cx*16 + 3))
+    chest.insert(NBT.new_int("y", 62))
+    chest.insert(NBT.new_int("z", cz*16 + 4))
+
+    level = NBT.new_compound("Level")
+    level.insert(NBT.new_byte_array("Blocks", blocks))
+    level.insert(NBT.new_byte_array("Data", "\0"*16384))
+    level.insert(NBT.new_byte_array("SkyLight", "\0"*16384))
+    level.insert(NBT.new_byte_array("BlockLight", "\0"*16384))
+    level.insert(NBT.new_byte_array("HeightMap", "\0"*256))
+    level.insert(NBT.new_list("Entities", [], NBT::TAG_COMPOUND))
+    level.insert(NBT.new_list("TileEntities", [chest], NBT::TAG_COMPOUND))
+    level.insert(NBT.new_long("LastUpdate", 0))
+    level.insert(NBT.new_int("xPos", cx))
+    level.insert(NBT.new_int("zPos", cz))
+    level.insert(NBT.new_byte("TerrainPopulated", 1))
+    root = NBT.new_compound("")
+    root.insert(level)
+    root
+  end
+
+  # Build the world in dir, returns dir. Region files are written directly, with TOC
+  # timestamps long in the past.
+  def self.build(dir, regions = REGIONS)
+    FileUtils.mkdir_p("#{dir}/region")
+    FileUtils.cp("#{TESTFILES}/level.dat", "#{dir}/level.dat")
+    regions.each {|rx, rz|
+      locations = "\0"*4096
+      timestamps = "\0"*4096
+      sectors = "".b
+      CHUNKS.each {|x, z|
+        chunk_nbt(rx*32 + x, rz*32 + z).write("#{dir}/chunk.nbt")
+        nbt = Zlib::GzipReader.open("#{dir}/chunk.nbt") {|gz| gz.read}
+        comp = Zlib::Deflate.deflate(nbt)
+        data = [comp.bytesize + 1, 2].pack("NC") + comp
+        num_sectors = (data.bytesize + 4095)/4096
+        idx = x + z*32
+        locations[idx*4, 4] = [((2 + sectors.bytesize/4096) << 8) | num_sectors].pack("N")
+        timestamps[idx*4, 4] = [1000 + idx].pack("N")
+        sectors << data << "\0"*(num_sectors*4096 - data.bytesize)
+      }
+      File.binwrite("#{dir}/region/r.#{rx}.#{rz}.mcr", locations + timestamps + sectors)
+    }
+    File.delete("#{dir}/chunk.nbt")
+    dir
+  end
+
+  # Write a terrain.png of noise to path, with partly transparent pixels so textures
+  # blend with those beneath
+  def self.write_terrain(path)
+    rng = Random.new(1)
+    pixels = (0...256).map { "\0" + rng.bytes(256*4) }.join
+    chunk = lambda {|type, data| [data.bytesize].pack("N") + type + data + [Zlib.crc32(type + data)].pack("N")}
+    File.binwrite(path, "\x89PNG\r\n\x1A\n".b + chunk["IHDR", [256, 256, 8, 6, 0, 0, 0].pack("N2C5")] +
+                  chunk["IDAT", Zlib::Deflate.deflate(pixels)] + chunk["IEND", ""])
+  end
+
+  # Width, height and pixels, top row first, of the 8 bit RGBA PNG at path
+  def self.read_png(path)
+    data = File.binread(path)
+    pos = 8
+    width = height = nil
+    idat = "".b
+    while pos < data.bytesize
+      len, type = data.unpack("@#{pos}Na4")
+      body = data.byteslice(pos + 8, len)
+      width, height = body.unpack("N2") if type == "IHDR"
+      idat << body if type == "IDAT"
+      pos += len + 12
+    end
+    raw = Zlib::Inflate.inflate(idat)
+    stride = width*4
+    prev = [0]*stride
+    rows = (0...height).map {|y|
+      filter = raw.getbyte(y*(stride + 1))
+      line = raw.byteslice(y*(stride + 1) + 1, stride).bytes
+      (0...stride).each {|i|
+        a = (i >= 4) ? line[i - 4] : 0
+        b = prev[i]
+        c = (i >= 4) ? prev[i - 4] : 0
+        pred = case filter
+          when 0 then 0
+          when 1 then a
+          when 2 then b
+          when 3 then (a + b)/2
+          else
+            pa, pb, pc = (b - c).abs, (a - c).abs, (a + b - 2*c).abs
+            (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c)
+        end
+        line[i] = (line[i] + pred) & 0xFF
+      }
+      prev = line
+    }
+    [width, height, rows.map {|line| line.pack("C*")}.join]
+  end
+
+  # Yield the directory of a newly built world, removed afterwards
+  def self.with_world(regions = REGIONS)
+    Dir.mktmpdir("magellan") {|dir| yield(build(dir, regions))}
+  end
+end